@@ -12,6 +12,9 @@
 
 
 #include "PkModelingCLP.h"
+#include "ModuleDescription.h"
+#include "ModuleDescriptionParser.h"
+#include "tclap/CmdLine.h"
 
 #include "itkMetaDataObject.h"
 #include "itkImageFileReader.h"
@@ -20,14 +23,42 @@
 #include "itkMultiThreader.h"
 #include "itkResampleImageFilter.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkRegionOfInterestImageFilter.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 
 #include "itkPluginUtilities.h"
 
 #include "itkSignalIntensityToConcentrationImageFilter.h"
 #include "itkConcentrationToQuantitativeImageFilter.h"
+#include "itkPkModelingEngine.h"
+#include "itkPkChunkedImageIOFactory.h"
+#include "itkPkSparseResultsWriter.h"
+#include "PkTimingReport.h"
+#include "itkMutexLock.h"
+#include "itkConditionVariable.h"
+#include <itksys/SystemTools.hxx>
+#include <itksys/Directory.hxx>
 
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <map>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #define TESTMODE_ERROR_TOLERANCE 0.1
 
@@ -184,58 +215,414 @@ type Get##name(itk::MetaDataDictionary& dictionary)           \
     return false;
   }
 
+  // Compare the voxel grid of an image against a reference image.
+  // Positions are compared to a fraction of a voxel.
+  template <class TImage, class TReferenceImage>
+  bool HasSameGeometry(const TImage* image, const TReferenceImage* reference)
+  {
+    const double tolerance = 1.0e-6;
+    if (image->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion())
+    {
+      return false;
+    }
+    for (unsigned int i = 0; i < TImage::ImageDimension; ++i)
+    {
+      const double spacing = reference->GetSpacing()[i];
+      if (fabs(image->GetSpacing()[i] - spacing) > tolerance * spacing
+        || fabs(image->GetOrigin()[i] - reference->GetOrigin()[i]) > tolerance * spacing)
+      {
+        return false;
+      }
+      for (unsigned int j = 0; j < TImage::ImageDimension; ++j)
+      {
+        if (fabs(image->GetDirection()[i][j] - reference->GetDirection()[i][j]) > tolerance)
+        {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Write the results of the voxels that were fit (diagnostics other
+  // than -1) as a sparse table indexed into the reference grid. Only the
+  // quantifier's outputs are read, so no full size maps are allocated.
+  // The fpv column is 0 unless the 3 parameter model was fit.
+  template <class TQuantifier, class TReferenceImage>
+  void WriteSparseResults(const std::string& fileName, TQuantifier* quantifier,
+    const TReferenceImage* reference)
+  {
+    typedef typename TQuantifier::OutputVolumeType OutputVolumeType;
+    typedef itk::ImageRegionConstIteratorWithIndex<OutputVolumeType> IteratorType;
+
+    std::vector<std::string> columnNames;
+    for (unsigned int i = 0; i < TQuantifier::NumberOfParametricMaps; ++i)
+    {
+      columnNames.push_back(TQuantifier::GetParametricMapName(i));
+    }
+
+    itk::PkSparseResultsWriter::Pointer writer = itk::PkSparseResultsWriter::New();
+    writer->SetFileName(fileName);
+    writer->SetReferenceImage(reference);
+    writer->SetColumnNames(columnNames);
+
+    const typename TReferenceImage::RegionType fullRegion = reference->GetLargestPossibleRegion();
+    const typename OutputVolumeType::RegionType region = quantifier->GetOptimizerDiagnosticsOutput()->GetBufferedRegion();
+    IteratorType diagIter(quantifier->GetOptimizerDiagnosticsOutput(), region);
+    itk::ImageRegionConstIterator<OutputVolumeType> ktransIter(quantifier->GetKTransOutput(), region);
+    itk::ImageRegionConstIterator<OutputVolumeType> veIter(quantifier->GetVEOutput(), region);
+    const OutputVolumeType* fpv = quantifier->GetModelType() == itk::LMCostFunction::TOFTS_3_PARAMETER
+      ? quantifier->GetFPVOutput() : 0;
+    itk::ImageRegionConstIterator<OutputVolumeType> maxSlopeIter(quantifier->GetMaxSlopeOutput(), region);
+    itk::ImageRegionConstIterator<OutputVolumeType> aucIter(quantifier->GetAUCOutput(), region);
+    itk::ImageRegionConstIterator<OutputVolumeType> rsqIter(quantifier->GetRSquaredOutput(), region);
+    itk::ImageRegionConstIterator<OutputVolumeType> batIter(quantifier->GetBATOutput(), region);
+
+    float row[TQuantifier::NumberOfParametricMaps];
+    for (; !diagIter.IsAtEnd(); ++diagIter, ++ktransIter, ++veIter,
+      ++maxSlopeIter, ++aucIter, ++rsqIter, ++batIter)
+    {
+      if (diagIter.Get() == -1)
+      {
+        continue;
+      }
+
+      const typename OutputVolumeType::IndexType index = diagIter.GetIndex();
+      unsigned long long linearIndex = 0;
+      for (int d = OutputVolumeType::ImageDimension - 1; d >= 0; --d)
+      {
+        linearIndex = linearIndex * fullRegion.GetSize()[d] + (index[d] - fullRegion.GetIndex()[d]);
+      }
+
+      row[TQuantifier::KtransMap] = ktransIter.Get();
+      row[TQuantifier::VeMap] = veIter.Get();
+      row[TQuantifier::FpvMap] = fpv ? fpv->GetPixel(index) : 0.0f;
+      row[TQuantifier::MaxSlopeMap] = maxSlopeIter.Get();
+      row[TQuantifier::AUCMap] = aucIter.Get();
+      row[TQuantifier::RSquaredMap] = rsqIter.Get();
+      row[TQuantifier::BATMap] = batIter.Get();
+      row[TQuantifier::DiagnosticsMap] = diagIter.Get();
+      writer->AddRow(linearIndex, row);
+    }
+
+    writer->Write();
+    if (quantifier->GetVerbose())
+    {
+      std::cout << "Sparse results: " << writer->GetNumberOfRows() << " voxels" << std::endl;
+    }
+  }
+
+  // FNV-1a hash of the values of an AIF, in hexadecimal, which the
+  // shards of a study record so that PkShardMerge can check that they
+  // used the same AIF
+  std::string GetAIFChecksum(const std::vector<float>& aif)
+  {
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned char* bytes = aif.empty() ? 0 : reinterpret_cast<const unsigned char *>(&aif[0]);
+    for (size_t i = 0; i < aif.size() * sizeof(float); ++i)
+    {
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    std::ostringstream checksum;
+    checksum << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return checksum.str();
+  }
+
+  // Settings of one run of the module, as parsed from its command line
+  struct StudyParameters
+  {
+    itk::PkModelingParameters Model;
+
+    std::string InputFourDImageFileName;
+    std::string ROIMaskFileName;
+    std::string T1MapFileName;
+    std::string AIFMaskFileName;
+    std::string PrescribedAIFFileName;
+    std::string RegionLabelMapFileName;
+
+    std::string OutputKtransFileName;
+    std::string OutputVeFileName;
+    std::string OutputFpvFileName;
+    std::string OutputMaxSlopeFileName;
+    std::string OutputAUCFileName;
+    std::string OutputRSquaredFileName;
+    std::string OutputBolusArrivalTimeImageFileName;
+    std::string OutputConcentrationsImageFileName;
+    std::string OutputFittedDataImageFileName;
+    std::string OutputOptimizerDiagnosticsImageFileName;
+    std::string OutputParametricMapsFileName;
+    std::string OutputSparseResultsFileName;
+    std::string OutputRegionTableFileName;
+    std::string OutputIterationsFileName;
+    std::string OutputEvaluationsFileName;
+    std::string OutputFitTimeFileName;
+    std::string TimingReportFileName;
+    std::string TraceFileName;
+    std::string OutputAIFFileName;
+
+    // shard i/N, as given on the command line (empty without shards)
+    std::string Shard;
+  };
+
+  // One run of the module. The inputs are read, the maps computed and
+  // the outputs written in separate steps, so that batch mode can
+  // overlap the steps of consecutive studies. Each step returns
+  // EXIT_SUCCESS or EXIT_FAILURE.
+  class StudyBase
+  {
+  public:
+    StudyBase(int argc, char * argv[])
+      : m_Arguments(argv, argv + argc)
+    {
+      for (size_t i = 0; i < m_Arguments.size(); ++i)
+      {
+        m_ArgumentPointers.push_back(&m_Arguments[i][0]);
+      }
+      m_ArgumentPointers.push_back(0);
+    }
+    virtual ~StudyBase() {}
+
+    virtual int Read() = 0;
+    virtual int Compute() = 0;
+    virtual int Write() = 0;
+
+    const std::string& GetInputFileName() const
+    {
+      return m_Parameters.InputFourDImageFileName;
+    }
+
+  protected:
+    int GetArgc() const
+    {
+      return static_cast<int>(m_Arguments.size());
+    }
+    char ** GetArgv()
+    {
+      return &m_ArgumentPointers[0];
+    }
+
+    StudyParameters m_Parameters;
+
+  private:
+    // copies of the command line, which the steps parse again
+    std::vector<std::string> m_Arguments;
+    std::vector<char *> m_ArgumentPointers;
+  };
+
+  // A study read from and written to files; the processing itself is
+  // done by a PkModelingEngine
+  template <class T1, class T2>
+  class Study : public StudyBase
+  {
+  public:
+    typedef itk::PkModelingEngine<T1, T2>                EngineType;
+    typedef typename EngineType::SignalVolumeType        VectorVolumeType;
+    typedef typename EngineType::FloatVectorVolumeType   FloatVectorVolumeType;
+    typedef typename EngineType::MaskVolumeType          MaskVolumeType;
+    typedef typename EngineType::OutputVolumeType        OutputVolumeType;
+    typedef typename EngineType::QuantifierType          QuantifierType;
+    typedef itk::ImageFileReader<VectorVolumeType>       VectorVolumeReaderType;
+    typedef itk::ImageFileWriter<FloatVectorVolumeType>  VectorVolumeWriterType;
+    typedef itk::ImageFileReader<MaskVolumeType>         MaskVolumeReaderType;
+    typedef itk::ImageFileWriter<OutputVolumeType>       OutputVolumeWriterType;
+
+    typedef itk::ResampleImageFilter<MaskVolumeType, MaskVolumeType> ResamplerType;
+    typedef itk::NearestNeighborInterpolateImageFunction<MaskVolumeType> InterpolatorType;
+
+    Study(int argc, char * argv[])
+      : StudyBase(argc, argv), m_ProcessInformation(0)
+    {
+    }
+
+    int Read();
+    int Compute();
+    int Write();
+
+  private:
+    // Read a mask, resampled onto the grid of the input if needed
+    typename MaskVolumeType::Pointer ReadMask(const std::string& fileName, bool resample) const;
+
+    // Write one of the maps of the engine
+    void WriteMap(OutputVolumeType* map, const std::string& fileName, const char* stepName) const;
+
+    // The part of an output that a shard writes: the slab of the shard,
+    // with the shard in its attributes. The whole output without shards.
+    template <class TImage>
+    typename TImage::Pointer GetShardOutput(TImage* image) const;
+
+    ModuleProcessInformation* m_ProcessInformation;
+    itk::PkTimingReport::Pointer m_TimingReport;
+    typename EngineType::Pointer m_Engine;
+  };
+
+  template <class T1, class T2>
+  typename Study<T1, T2>::MaskVolumeType::Pointer
+    Study<T1, T2>::ReadMask(const std::string& fileName, bool resample) const
+  {
+    typename MaskVolumeReaderType::Pointer reader = MaskVolumeReaderType::New();
+    reader->SetFileName(fileName.c_str());
+    reader->Update();
+    typename MaskVolumeType::Pointer mask = reader->GetOutput();
+
+    // masks are usually drawn on the input itself, in which case there
+    // is nothing to resample
+    const VectorVolumeType* input = m_Engine->GetSignal();
+    if (resample && !HasSameGeometry(mask.GetPointer(), input))
+    {
+      typename ResamplerType::Pointer resampler = ResamplerType::New();
+      typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+
+      resampler->SetOutputDirection(input->GetDirection());
+      resampler->SetOutputSpacing(input->GetSpacing());
+      resampler->SetOutputStartIndex(input->GetLargestPossibleRegion().GetIndex());
+      resampler->SetSize(input->GetLargestPossibleRegion().GetSize());
+      resampler->SetOutputOrigin(input->GetOrigin());
+      resampler->SetInput(mask);
+      resampler->SetInterpolator(interpolator);
+      resampler->Update();
+
+      mask = resampler->GetOutput();
+    }
+    return mask;
+  }
+
   template <class T1, class T2>
-  int DoIt(int argc, char * argv[], const T1 &, const T2 &)
+  int Study<T1, T2>::Read()
   {
     //
     // Command line processing
     //
+    int argc = this->GetArgc();
+    char ** argv = this->GetArgv();
     PARSE_ARGS;
 
+    m_ProcessInformation = CLPProcessInformation;
+
+    StudyParameters& p = m_Parameters;
+    p.Model.T1PreBlood = T1PreBloodValue;
+    p.Model.T1PreTissue = T1PreTissueValue;
+    p.Model.Relaxivity = RelaxivityValue;
+    p.Model.S0GradThresh = S0GradValue;
+    p.Model.FTolerance = FTolerance;
+    p.Model.GTolerance = GTolerance;
+    p.Model.XTolerance = XTolerance;
+    p.Model.Epsilon = Epsilon;
+    p.Model.MaxIter = MaxIter;
+    p.Model.Hematocrit = Hematocrit;
+    p.Model.AUCTimeInterval = AUCTimeInterval;
+    p.Model.BoundedFitting = BoundedFitting;
+    p.Model.UseFitCache = UseFitCache;
+    p.Model.ComputeFpv = ComputeFpv;
+    p.Model.UsePopulationAIF = UsePopulationAIF;
+    p.Model.BATCalculationMode = BATCalculationMode;
+    p.Model.ConstantBAT = ConstantBAT;
+    p.Model.PrescreenPeakEnhancement = PrescreenPeakEnhancement;
+    p.Model.PrescreenMaxSlope = PrescreenMaxSlope;
+    p.Model.PrescreenSNR = PrescreenSNR;
+    p.Model.TieredFitting = TieredFitting;
+    p.Model.TieredToleranceScale = TieredToleranceScale;
+    p.Model.TieredMaxIter = TieredMaxIter;
+    p.Model.RefitRSquaredThreshold = RefitRSquaredThreshold;
+    p.Model.NumberOfClusters = NumberOfClusters;
+    p.Model.ClusterRefineIterations = ClusterRefineIterations;
+    p.Model.PyramidFactor = PyramidFactor;
+    p.Model.CheckpointFileName = CheckpointFileName;
+    p.Model.ResumeFromCheckpoint = ResumeFromCheckpoint;
+    p.Model.CheckpointInterval = CheckpointInterval;
+    p.Model.Verbose = Verbose;
+    p.Model.MaskByRSquared = OutputRSquaredFileName.empty();
+    p.Model.ComputeParametricMaps = !OutputParametricMapsFileName.empty();
+    p.Model.ComputeFitCostMaps = !OutputIterationsFileName.empty()
+      || !OutputEvaluationsFileName.empty() || !OutputFitTimeFileName.empty();
+    p.InputFourDImageFileName = InputFourDImageFileName;
+    p.ROIMaskFileName = ROIMaskFileName;
+    p.T1MapFileName = T1MapFileName;
+    p.AIFMaskFileName = AIFMaskFileName;
+    p.PrescribedAIFFileName = PrescribedAIFFileName;
+    p.RegionLabelMapFileName = RegionLabelMapFileName;
+    p.OutputKtransFileName = OutputKtransFileName;
+    p.OutputVeFileName = OutputVeFileName;
+    p.OutputFpvFileName = OutputFpvFileName;
+    p.OutputMaxSlopeFileName = OutputMaxSlopeFileName;
+    p.OutputAUCFileName = OutputAUCFileName;
+    p.OutputRSquaredFileName = OutputRSquaredFileName;
+    p.OutputBolusArrivalTimeImageFileName = OutputBolusArrivalTimeImageFileName;
+    p.OutputConcentrationsImageFileName = OutputConcentrationsImageFileName;
+    p.OutputFittedDataImageFileName = OutputFittedDataImageFileName;
+    p.OutputOptimizerDiagnosticsImageFileName = OutputOptimizerDiagnosticsImageFileName;
+    p.OutputParametricMapsFileName = OutputParametricMapsFileName;
+    p.OutputSparseResultsFileName = OutputSparseResultsFileName;
+    p.OutputRegionTableFileName = OutputRegionTableFileName;
+    p.OutputIterationsFileName = OutputIterationsFileName;
+    p.OutputEvaluationsFileName = OutputEvaluationsFileName;
+    p.OutputFitTimeFileName = OutputFitTimeFileName;
+    p.TimingReportFileName = TimingReportFileName;
+    p.TraceFileName = TraceFileName;
+    p.OutputAIFFileName = OutputAIFFileName;
+    p.Shard = Shard;
+
     // itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
     // threader->SetGlobalMaximumNumberOfThreads(1);
 
-    const   unsigned int VectorVolumeDimension = 3;
-    typedef T1                                                 VectorVolumePixelType;
-    typedef itk::VectorImage<VectorVolumePixelType, VectorVolumeDimension> VectorVolumeType;
-    typedef itk::VectorImage<float, VectorVolumeDimension>     FloatVectorVolumeType;
-    typedef typename VectorVolumeType::RegionType              VectorVolumeRegionType;
-    typedef itk::ImageFileReader<VectorVolumeType>             VectorVolumeReaderType;
-    typedef itk::ImageFileWriter<FloatVectorVolumeType>        VectorVolumeWriterType;
-
-    const   unsigned int MaskVolumeDimension = 3;
-    typedef T2                                                   MaskVolumePixelType;
-    typedef itk::Image<MaskVolumePixelType, MaskVolumeDimension> MaskVolumeType;
-    typedef itk::ImageFileReader<MaskVolumeType>                 MaskVolumeReaderType;
+    m_Engine = EngineType::New();
+    m_Engine->SetParameters(p.Model);
 
-    typedef itk::Image<float, VectorVolumeDimension> OutputVolumeType;
-    typedef itk::ImageFileWriter< OutputVolumeType> OutputVolumeWriterType;
+    if (!Shard.empty())
+    {
+      unsigned int shardNumber = 0, numberOfShards = 0;
+      char extra = 0;
+      if (sscanf(Shard.c_str(), "%u/%u%c", &shardNumber, &numberOfShards, &extra) != 2
+        || shardNumber < 1 || shardNumber > numberOfShards)
+      {
+        std::cerr << "The shard must be given as i/N with i from 1 to N, not " << Shard << std::endl;
+        return EXIT_FAILURE;
+      }
+      if (!OutputSparseResultsFileName.empty() || !OutputRegionTableFileName.empty())
+      {
+        std::cerr << "Sparse results and region tables cannot be written by shards." << std::endl;
+        return EXIT_FAILURE;
+      }
+      m_Engine->SetShard(shardNumber - 1, numberOfShards);
+    }
 
-    typedef itk::ResampleImageFilter<MaskVolumeType, MaskVolumeType> ResamplerType;
-    typedef itk::NearestNeighborInterpolateImageFunction<MaskVolumeType> InterpolatorType;
+    // Optional report of the time spent in each stage, and timeline of
+    // the stages and threads (the trace records through the report)
+    if (!TimingReportFileName.empty() || !TraceFileName.empty())
+    {
+      m_TimingReport = itk::PkTimingReport::New();
+      m_Engine->SetTimingReport(m_TimingReport);
+    }
+    if (!TraceFileName.empty())
+    {
+      m_TimingReport->SetTraceRecorder(itk::PkTraceRecorder::New());
+    }
+    double stageStartTime = itk::PkTimingReport::GetTime();
 
     //Read VectorVolume
     typename VectorVolumeReaderType::Pointer multiVolumeReader
       = VectorVolumeReaderType::New();
     multiVolumeReader->SetFileName(InputFourDImageFileName.c_str());
-    multiVolumeReader->Update();
+    // only the header for now, the voxels are read once the region to
+    // process is known
+    multiVolumeReader->UpdateOutputInformation();
     typename VectorVolumeType::Pointer inputVectorVolume = multiVolumeReader->GetOutput();
+    m_Engine->SetSignal(inputVectorVolume);
 
     //Look for tags representing the acquisition parameters
     //
     //
 
     // Trigger times
-    std::vector<float> Timing;
     try
     {
-      Timing = GetTiming(inputVectorVolume->GetMetaDataDictionary());
+      std::vector<float> timing = GetTiming(inputVectorVolume->GetMetaDataDictionary());
       std::cout << "Timing: ";
-      for (std::vector<float>::size_type i = 0; i < Timing.size(); ++i)
+      for (std::vector<float>::size_type i = 0; i < timing.size(); ++i)
       {
-        std::cout << Timing[i] << ", ";
+        std::cout << timing[i] << ", ";
       }
       std::cout << std::endl;
+      m_Engine->SetTiming(timing);
     }
     catch (itk::ExceptionObject &exc)
     {
@@ -261,10 +648,9 @@ type Get##name(itk::MetaDataDictionary& dictionary)           \
     //   }
 
     // FlipAngle
-    float FAValue = 0.0;
     try
     {
-      FAValue = GetFlipAngle(inputVectorVolume->GetMetaDataDictionary());
+      m_Engine->SetFlipAngle(GetFlipAngle(inputVectorVolume->GetMetaDataDictionary()));
     }
     catch (itk::ExceptionObject &exc)
     {
@@ -275,10 +661,9 @@ type Get##name(itk::MetaDataDictionary& dictionary)           \
     }
 
     // RepetitionTime
-    float TRValue = 0.0;
     try
     {
-      TRValue = GetRepetitionTime(inputVectorVolume->GetMetaDataDictionary());
+      m_Engine->SetRepetitionTime(GetRepetitionTime(inputVectorVolume->GetMetaDataDictionary()));
     }
     catch (itk::ExceptionObject &exc)
     {
@@ -288,60 +673,47 @@ type Get##name(itk::MetaDataDictionary& dictionary)           \
       return EXIT_FAILURE;
     }
 
-    //Read AIF mask
-    typename MaskVolumeReaderType::Pointer aifMaskVolumeReader = MaskVolumeReaderType::New();
-    typename MaskVolumeType::Pointer aifMaskVolume = 0;
-    if (AIFMaskFileName != "")
+    if (m_TimingReport)
     {
-      aifMaskVolumeReader->SetFileName(AIFMaskFileName.c_str());
-      aifMaskVolumeReader->Update();
-      aifMaskVolume = aifMaskVolumeReader->GetOutput();
+      m_TimingReport->AddStep(itk::PkTimingReport::HeaderStage, "input", itk::PkTimingReport::GetTime() - stageStartTime);
     }
+    stageStartTime = itk::PkTimingReport::GetTime();
 
-    //Read T1 Map
-    typename MaskVolumeReaderType::Pointer T1MapVolumeReader = MaskVolumeReaderType::New();
-    typename MaskVolumeType::Pointer T1MapVolume = 0;
+    //Read AIF mask, T1 map, ROI mask and region label map
+    if (AIFMaskFileName != "")
+    {
+      m_Engine->SetAIFMask(this->ReadMask(AIFMaskFileName, false));
+    }
     if (T1MapFileName != "")
     {
-      T1MapVolumeReader->SetFileName(T1MapFileName.c_str());
-      T1MapVolumeReader->Update();
-      T1MapVolume = T1MapVolumeReader->GetOutput();
+      m_Engine->SetT1Map(this->ReadMask(T1MapFileName, false));
     }
-
-    //Read ROI mask
-    typename MaskVolumeReaderType::Pointer roiMaskVolumeReader = MaskVolumeReaderType::New();
-    typename MaskVolumeType::Pointer roiMaskVolume = 0;
     if (ROIMaskFileName != "")
     {
-      roiMaskVolumeReader->SetFileName(ROIMaskFileName.c_str());
-      roiMaskVolumeReader->Update();
-      roiMaskVolume = roiMaskVolumeReader->GetOutput();
-
-      typename ResamplerType::Pointer resampler = ResamplerType::New();
-      typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-
-      resampler->SetOutputDirection(inputVectorVolume->GetDirection());
-      resampler->SetOutputSpacing(inputVectorVolume->GetSpacing());
-      resampler->SetOutputStartIndex(inputVectorVolume->GetBufferedRegion().GetIndex());
-      resampler->SetSize(inputVectorVolume->GetBufferedRegion().GetSize());
-      resampler->SetOutputOrigin(inputVectorVolume->GetOrigin());
-      resampler->SetInput(roiMaskVolume);
-      resampler->SetInterpolator(interpolator);
-      resampler->Update();
+      m_Engine->SetROIMask(this->ReadMask(ROIMaskFileName, true));
+    }
+    if (RegionLabelMapFileName != "")
+    {
+      m_Engine->SetRegionLabelMap(this->ReadMask(RegionLabelMapFileName, true));
+    }
 
-      roiMaskVolume = resampler->GetOutput();
+    if (m_TimingReport)
+    {
+      m_TimingReport->AddStep(itk::PkTimingReport::ReadStage, "masks", itk::PkTimingReport::GetTime() - stageStartTime);
     }
 
     //Read prescribed aif
-    bool usingPrescribedAIF = false;
-    std::vector<float> prescribedAIFTiming;
-    std::vector<float> prescribedAIF;
     if (PrescribedAIFFileName != "")
     {
-      usingPrescribedAIF = GetPrescribedAIF(PrescribedAIFFileName, prescribedAIFTiming, prescribedAIF);
+      std::vector<float> prescribedAIFTiming;
+      std::vector<float> prescribedAIF;
+      if (GetPrescribedAIF(PrescribedAIFFileName, prescribedAIFTiming, prescribedAIF))
+      {
+        m_Engine->SetPrescribedAIF(prescribedAIFTiming, prescribedAIF);
+      }
     }
 
-    if (AIFMaskFileName == "" && !usingPrescribedAIF && !UsePopulationAIF)
+    if (AIFMaskFileName == "" && !m_Engine->GetUsePrescribedAIF() && !UsePopulationAIF)
     {
       std::cerr << "Either a mask localizing the region over which to ";
       std::cerr << "calculate the arterial input function or a prescribed ";
@@ -349,214 +721,290 @@ type Get##name(itk::MetaDataDictionary& dictionary)           \
       return EXIT_FAILURE;
     }
 
-    //Convert to concentration values
-    typedef itk::SignalIntensityToConcentrationImageFilter<VectorVolumeType, MaskVolumeType, FloatVectorVolumeType> ConvertFilterType;
-    typename ConvertFilterType::Pointer converter = ConvertFilterType::New();
-    converter->SetInput(inputVectorVolume);
-
-    if (!usingPrescribedAIF && !UsePopulationAIF)
+    // Only the part of the input that is processed is read (for formats
+    // that support streaming), and the results are pasted back into
+    // full size maps on output.
+    m_Engine->PrepareInputs();
+    if (Verbose && m_Engine->GetNumberOfShards() > 1)
     {
-      converter->SetAIFMask(aifMaskVolume);
+      const typename EngineType::RegionType& shardRegion = m_Engine->GetShardRegion();
+      std::cout << "Shard " << Shard << ": slices " << shardRegion.GetIndex()[2] << " to "
+        << shardRegion.GetIndex()[2] + shardRegion.GetSize()[2] - 1 << std::endl;
     }
-
-    if (ROIMaskFileName != "")
+    if (Verbose && m_Engine->GetProcessingRegion() != inputVectorVolume->GetLargestPossibleRegion())
     {
-      converter->SetROIMask(roiMaskVolume);
+      std::cout << "Processing region: " << m_Engine->GetProcessingRegion().GetIndex()
+        << " " << m_Engine->GetProcessingRegion().GetSize() << std::endl;
     }
 
-    converter->SetT1PreBlood(T1PreBloodValue);
-    converter->SetT1PreTissue(T1PreTissueValue);
-    converter->SetTR(TRValue);
-    converter->SetFA(FAValue);
-    converter->SetBATCalculationMode(BATCalculationMode);
-    converter->SetconstantBAT(ConstantBAT);
-    converter->SetRGD_relaxivity(RelaxivityValue);
-    converter->SetS0GradThresh(S0GradValue);
+    return EXIT_SUCCESS;
+  }
 
-    if (T1MapFileName != "")
+  template <class T1, class T2>
+  int Study<T1, T2>::Compute()
+  {
+    itk::PluginFilterWatcher watchConverter(m_Engine->GetConverter(), "Concentrations", m_ProcessInformation, 1.0 / 20.0, 0.0);
+    itk::PluginFilterWatcher watchQuantifier(m_Engine->GetQuantifier(), "Quantifying", m_ProcessInformation, 19.0 / 20.0, 1.0 / 20.0);
+    m_Engine->Update();
+
+    return EXIT_SUCCESS;
+  }
+
+  template <class T1, class T2>
+  void Study<T1, T2>::WriteMap(OutputVolumeType* map, const std::string& fileName,
+    const char* stepName) const
+  {
+    itk::PkScopedTiming writeTiming(m_TimingReport, itk::PkTimingReport::WriteStage, stepName);
+    typename OutputVolumeWriterType::Pointer writer = OutputVolumeWriterType::New();
+    writer->SetInput(this->GetShardOutput(map));
+    writer->SetFileName(fileName.c_str());
+    writer->SetUseCompression(1);
+    writer->Update();
+  }
+
+  template <class T1, class T2>
+  template <class TImage>
+  typename TImage::Pointer Study<T1, T2>::GetShardOutput(TImage* image) const
+  {
+    if (m_Engine->GetNumberOfShards() <= 1)
     {
-      converter->SetT1Map(T1MapVolume);
+      return image;
     }
 
-    itk::PluginFilterWatcher watchConverter(converter, "Concentrations", CLPProcessInformation, 1.0 / 20.0, 0.0);
-    converter->Update();
+    const typename EngineType::RegionType& studyRegion = m_Engine->GetSignal()->GetLargestPossibleRegion();
+    const typename EngineType::RegionType& shardRegion = m_Engine->GetShardRegion();
+    typedef itk::RegionOfInterestImageFilter<TImage, TImage> CropperType;
+    typename CropperType::Pointer cropper = CropperType::New();
+    cropper->SetInput(image);
+    cropper->SetRegionOfInterest(shardRegion);
+    cropper->Update();
+
+    typename TImage::Pointer slab = cropper->GetOutput();
+    slab->DisconnectPipeline();
+    slab->SetMetaDataDictionary(image->GetMetaDataDictionary());
+
+    // the slices of the slab are counted from the first slice of the study
+    std::ostringstream slices, studySize;
+    slices << shardRegion.GetIndex()[2] - studyRegion.GetIndex()[2] << " "
+      << shardRegion.GetIndex()[2] - studyRegion.GetIndex()[2] + shardRegion.GetSize()[2];
+    studySize << studyRegion.GetSize()[0] << " " << studyRegion.GetSize()[1] << " " << studyRegion.GetSize()[2];
+    itk::MetaDataDictionary& dictionary = slab->GetMetaDataDictionary();
+    itk::EncapsulateMetaData<std::string>(dictionary, "Shard.Number", m_Parameters.Shard);
+    itk::EncapsulateMetaData<std::string>(dictionary, "Shard.Slices", slices.str());
+    itk::EncapsulateMetaData<std::string>(dictionary, "Shard.StudySize", studySize.str());
+    itk::EncapsulateMetaData<std::string>(dictionary, "Shard.AIFChecksum",
+      GetAIFChecksum(m_Engine->GetQuantifier()->GetAIF()));
+    return slab;
+  }
+
+  template <class T1, class T2>
+  int Study<T1, T2>::Write()
+  {
+    const StudyParameters& p = m_Parameters;
+    const VectorVolumeType* inputVectorVolume = m_Engine->GetSignal();
+    QuantifierType* quantifier = m_Engine->GetQuantifier();
 
-    if (OutputConcentrationsImageFileName != "")
+    if (p.OutputConcentrationsImageFileName != "")
     {
       // need to initialize the attributes, otherwise Slicer treats
       //  this as a Vector volume, not MultiVolume
-      FloatVectorVolumeType::Pointer concentrationsVolume = converter->GetOutput();
+      itk::PkScopedTiming writeTiming(m_TimingReport, itk::PkTimingReport::WriteStage, "concentrations");
+      typename FloatVectorVolumeType::Pointer concentrationsVolume = m_Engine->GetConcentrations();
       concentrationsVolume->SetMetaDataDictionary(inputVectorVolume->GetMetaDataDictionary());
 
       typename VectorVolumeWriterType::Pointer multiVolumeWriter
         = VectorVolumeWriterType::New();
-      multiVolumeWriter->SetFileName(OutputConcentrationsImageFileName.c_str());
-      multiVolumeWriter->SetInput(concentrationsVolume);
+      multiVolumeWriter->SetFileName(p.OutputConcentrationsImageFileName.c_str());
+      multiVolumeWriter->SetInput(this->GetShardOutput(concentrationsVolume.GetPointer()));
       multiVolumeWriter->SetUseCompression(1);
       multiVolumeWriter->Update();
     }
 
-    //Calculate parameters
-    typedef itk::ConcentrationToQuantitativeImageFilter<FloatVectorVolumeType, MaskVolumeType, OutputVolumeType> QuantifierType;
-    typename QuantifierType::Pointer quantifier = QuantifierType::New();
-    quantifier->SetInput(converter->GetOutput());
-    if (usingPrescribedAIF)
+    if (m_Engine->GetRegionLabelMap() && !p.OutputRegionTableFileName.empty())
     {
-      quantifier->SetPrescribedAIF(prescribedAIFTiming, prescribedAIF);
-      quantifier->UsePrescribedAIFOn();
+      itk::PkScopedTiming writeTiming(m_TimingReport, itk::PkTimingReport::WriteStage, "regiontable");
+      std::ofstream regionTable(p.OutputRegionTableFileName.c_str());
+      if (!regionTable)
+      {
+        std::cerr << "Could not open region table " << p.OutputRegionTableFileName << std::endl;
+        return EXIT_FAILURE;
+      }
+      regionTable << "Label,NumberOfVoxels,Ktrans,Ve,Fpv,MaxSlope,AUC,RSquared,BAT,Diagnostics" << std::endl;
+      const std::vector<typename QuantifierType::RegionalFit>& fits = quantifier->GetRegionalFits();
+      for (size_t i = 0; i < fits.size(); ++i)
+      {
+        regionTable << fits[i].Label << "," << fits[i].NumberOfVoxels << ","
+          << fits[i].Ktrans << "," << fits[i].Ve << "," << fits[i].Fpv << ","
+          << fits[i].MaxSlope << "," << fits[i].AUC << "," << fits[i].RSquared << ","
+          << fits[i].BAT << "," << fits[i].Diagnostics << std::endl;
+      }
     }
-    else if (UsePopulationAIF)
+
+    //set output
+    if (!p.OutputKtransFileName.empty())
     {
-      quantifier->UsePopulationAIFOn();
-      quantifier->SetAIFMask(aifMaskVolume);
+      this->WriteMap(m_Engine->GetKtrans(), p.OutputKtransFileName, "ktrans");
     }
-    else
+
+    if (!p.OutputVeFileName.empty())
     {
-      quantifier->SetAIFMask(aifMaskVolume);
+      this->WriteMap(m_Engine->GetVe(), p.OutputVeFileName, "ve");
     }
 
-    quantifier->SetAUCTimeInterval(AUCTimeInterval);
-    quantifier->SetTiming(Timing);
-    quantifier->SetfTol(FTolerance);
-    quantifier->SetgTol(GTolerance);
-    quantifier->SetxTol(XTolerance);
-    quantifier->Setepsilon(Epsilon);
-    quantifier->SetmaxIter(MaxIter);
-    quantifier->Sethematocrit(Hematocrit);
-    quantifier->SetconstantBAT(ConstantBAT);
-    quantifier->SetBATCalculationMode(BATCalculationMode);
-    if (ROIMaskFileName != "")
+    if (p.Model.ComputeFpv)
     {
-      quantifier->SetROIMask(roiMaskVolume);
+      if (!p.OutputFpvFileName.empty())
+      {
+        this->WriteMap(m_Engine->GetFpv(), p.OutputFpvFileName, "fpv");
+      }
     }
 
-    if (ComputeFpv)
+    if (!p.OutputMaxSlopeFileName.empty())
     {
-      quantifier->SetModelType(itk::LMCostFunction::TOFTS_3_PARAMETER);
+      this->WriteMap(m_Engine->GetMaxSlope(), p.OutputMaxSlopeFileName, "maxslope");
     }
-    else
+
+    if (!p.OutputAUCFileName.empty())
     {
-      quantifier->SetModelType(itk::LMCostFunction::TOFTS_2_PARAMETER);
+      this->WriteMap(m_Engine->GetAUC(), p.OutputAUCFileName, "auc");
     }
-    quantifier->SetMaskByRSquared(OutputRSquaredFileName.empty());
 
-    itk::PluginFilterWatcher watchQuantifier(quantifier, "Quantifying", CLPProcessInformation, 19.0 / 20.0, 1.0 / 20.0);
-    quantifier->Update();
+    if (!p.OutputRSquaredFileName.empty())
+    {
+      this->WriteMap(m_Engine->GetRSquared(), p.OutputRSquaredFileName, "rsquared");
+    }
 
-    //set output
-    if (!OutputKtransFileName.empty())
+    if (!p.OutputFittedDataImageFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer ktranswriter = OutputVolumeWriterType::New();
-      ktranswriter->SetInput(quantifier->GetKTransOutput());
-      ktranswriter->SetFileName(OutputKtransFileName.c_str());
-      ktranswriter->SetUseCompression(1);
-      ktranswriter->Update();
+      // need to initialize the attributes, otherwise Slicer treats
+      //  this as a Vector volume, not MultiVolume
+      itk::PkScopedTiming writeTiming(m_TimingReport, itk::PkTimingReport::WriteStage, "fitted");
+      typename FloatVectorVolumeType::Pointer fittedVolume = m_Engine->GetFittedData();
+      fittedVolume->SetMetaDataDictionary(inputVectorVolume->GetMetaDataDictionary());
+
+      typename VectorVolumeWriterType::Pointer multiVolumeWriter
+        = VectorVolumeWriterType::New();
+      multiVolumeWriter->SetFileName(p.OutputFittedDataImageFileName.c_str());
+      multiVolumeWriter->SetInput(this->GetShardOutput(fittedVolume.GetPointer()));
+      multiVolumeWriter->SetUseCompression(1);
+      multiVolumeWriter->Update();
     }
 
-    if (!OutputVeFileName.empty())
+    if (!p.OutputBolusArrivalTimeImageFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer vewriter = OutputVolumeWriterType::New();
-      vewriter->SetInput(quantifier->GetVEOutput());
-      vewriter->SetFileName(OutputVeFileName.c_str());
-      vewriter->SetUseCompression(1);
-      vewriter->Update();
+      this->WriteMap(m_Engine->GetBAT(), p.OutputBolusArrivalTimeImageFileName, "bat");
     }
 
-    if (ComputeFpv)
+    if (!p.OutputOptimizerDiagnosticsImageFileName.empty())
     {
-      if (!OutputFpvFileName.empty())
-      {
-        typename OutputVolumeWriterType::Pointer fpvwriter = OutputVolumeWriterType::New();
-        fpvwriter->SetInput(quantifier->GetFPVOutput());
-        fpvwriter->SetFileName(OutputFpvFileName.c_str());
-        fpvwriter->SetUseCompression(1);
-        fpvwriter->Update();
-      }
+      this->WriteMap(m_Engine->GetOptimizerDiagnostics(), p.OutputOptimizerDiagnosticsImageFileName, "diagnostics");
     }
 
-    if (!OutputMaxSlopeFileName.empty())
+    if (!p.OutputIterationsFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer maxSlopewriter = OutputVolumeWriterType::New();
-      maxSlopewriter->SetInput(quantifier->GetMaxSlopeOutput());
-      maxSlopewriter->SetFileName(OutputMaxSlopeFileName.c_str());
-      maxSlopewriter->SetUseCompression(1);
-      maxSlopewriter->Update();
+      this->WriteMap(m_Engine->GetIterations(), p.OutputIterationsFileName, "iterations");
     }
 
-    if (!OutputAUCFileName.empty())
+    if (!p.OutputEvaluationsFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer aucwriter = OutputVolumeWriterType::New();
-      aucwriter->SetInput(quantifier->GetAUCOutput());
-      aucwriter->SetFileName(OutputAUCFileName.c_str());
-      aucwriter->SetUseCompression(1);
-      aucwriter->Update();
+      this->WriteMap(m_Engine->GetEvaluations(), p.OutputEvaluationsFileName, "evaluations");
     }
 
-    if (!OutputRSquaredFileName.empty())
+    if (!p.OutputFitTimeFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer rsqwriter = OutputVolumeWriterType::New();
-      rsqwriter->SetInput(quantifier->GetRSquaredOutput());
-      rsqwriter->SetFileName(OutputRSquaredFileName.c_str());
-      rsqwriter->SetUseCompression(1);
-      rsqwriter->Update();
+      this->WriteMap(m_Engine->GetFitTime(), p.OutputFitTimeFileName, "fittime");
     }
 
-    if (!OutputFittedDataImageFileName.empty())
+    if (!p.OutputParametricMapsFileName.empty())
     {
-      // need to initialize the attributes, otherwise Slicer treats
-      //  this as a Vector volume, not MultiVolume
-      FloatVectorVolumeType::Pointer fittedVolume = quantifier->GetFittedDataOutput();
-      fittedVolume->SetMetaDataDictionary(inputVectorVolume->GetMetaDataDictionary());
+      // name the interleaved components so downstream readers can
+      // find each map without knowing the component order
+      itk::PkScopedTiming writeTiming(m_TimingReport, itk::PkTimingReport::WriteStage, "parametricmaps");
+      std::string componentNames;
+      for (unsigned int i = 0; i < QuantifierType::NumberOfParametricMaps; ++i)
+      {
+        if (i > 0)
+        {
+          componentNames += ",";
+        }
+        componentNames += QuantifierType::GetParametricMapName(i);
+      }
 
-      typename VectorVolumeWriterType::Pointer multiVolumeWriter
+      typename FloatVectorVolumeType::Pointer parametricMapsVolume = m_Engine->GetParametricMaps();
+      itk::MetaDataDictionary& dictionary = parametricMapsVolume->GetMetaDataDictionary();
+      itk::EncapsulateMetaData<std::string>(dictionary, "ParametricMaps.ComponentNames", componentNames);
+      itk::EncapsulateMetaData<std::string>(dictionary, "ParametricMaps.ModelType",
+        p.Model.ComputeFpv ? "Tofts3Parameter" : "Tofts2Parameter");
+
+      typename VectorVolumeWriterType::Pointer mapswriter
         = VectorVolumeWriterType::New();
-      multiVolumeWriter->SetFileName(OutputFittedDataImageFileName.c_str());
-      multiVolumeWriter->SetInput(fittedVolume);
-      multiVolumeWriter->SetUseCompression(1);
-      multiVolumeWriter->Update();
+      mapswriter->SetFileName(p.OutputParametricMapsFileName.c_str());
+      mapswriter->SetInput(this->GetShardOutput(parametricMapsVolume.GetPointer()));
+      mapswriter->SetUseCompression(1);
+      mapswriter->Update();
     }
 
-    if (!OutputBolusArrivalTimeImageFileName.empty())
+    if (!p.OutputAIFFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer batwriter
-        = OutputVolumeWriterType::New();
-      batwriter->SetInput(quantifier->GetBATOutput());
-      batwriter->SetFileName(OutputBolusArrivalTimeImageFileName.c_str());
-      batwriter->SetUseCompression(1);
-      batwriter->Update();
+      // in the format of the prescribed AIF, with enough digits to read
+      // back the same values
+      std::ofstream aifFile(p.OutputAIFFileName.c_str());
+      if (!aifFile)
+      {
+        std::cerr << "Could not open AIF file " << p.OutputAIFFileName << std::endl;
+        return EXIT_FAILURE;
+      }
+      const std::vector<float>& timing = m_Engine->GetTiming();
+      const std::vector<float>& aif = quantifier->GetAIF();
+      aifFile << "Time,Concentration" << std::endl;
+      aifFile << std::setprecision(9);
+      for (size_t i = 0; i < aif.size() && i < timing.size(); ++i)
+      {
+        aifFile << timing[i] << "," << aif[i] << std::endl;
+      }
     }
 
-    if (!OutputOptimizerDiagnosticsImageFileName.empty())
+    if (!p.OutputSparseResultsFileName.empty())
     {
-      typename OutputVolumeWriterType::Pointer diagwriter
-        = OutputVolumeWriterType::New();
-      diagwriter->SetInput(quantifier->GetOptimizerDiagnosticsOutput());
-      diagwriter->SetFileName(OutputOptimizerDiagnosticsImageFileName.c_str());
-      diagwriter->SetUseCompression(1);
-      diagwriter->Update();
+      itk::PkScopedTiming writeTiming(m_TimingReport, itk::PkTimingReport::WriteStage, "sparseresults");
+      WriteSparseResults(p.OutputSparseResultsFileName, quantifier, inputVectorVolume);
     }
 
-    return EXIT_SUCCESS;
-  }
-
-}
-
-int main(int argc, char * argv[])
-{
-
-  PARSE_ARGS;
+    if (!p.TraceFileName.empty())
+    {
+      std::ofstream traceFile(p.TraceFileName.c_str());
+      if (!traceFile)
+      {
+        std::cerr << "Could not open trace file " << p.TraceFileName << std::endl;
+        return EXIT_FAILURE;
+      }
+      m_TimingReport->GetTraceRecorder()->WriteChromeTrace(traceFile);
+    }
 
-  // this line is here to be able to see the full output on the dashboard even
-  // when the test succeeds (to see the reproducibility error measure)
-  std::cout << "ctest needs: CTEST_FULL_OUTPUT" << std::endl;
+    if (!p.TimingReportFileName.empty())
+    {
+      std::ofstream reportFile(p.TimingReportFileName.c_str());
+      if (!reportFile)
+      {
+        std::cerr << "Could not open timing report " << p.TimingReportFileName << std::endl;
+        return EXIT_FAILURE;
+      }
+      m_TimingReport->WriteJSON(reportFile);
+    }
 
-  itk::ImageIOBase::IOPixelType     pixelType;
-  itk::ImageIOBase::IOComponentType componentType;
+    return EXIT_SUCCESS;
+  }
 
-  try
+  // Create the study for a command line, typed by the pixel type of
+  // its input. Returns 0 for an unsupported pixel type. The command line
+  // is parsed again by each step of the study, so it must have been
+  // checked already.
+  StudyBase* NewStudy(const std::string& inputFileName, int argc, char * argv[])
   {
+    itk::ImageIOBase::IOPixelType     pixelType;
+    itk::ImageIOBase::IOComponentType componentType;
 
-    itk::GetImageType(InputFourDImageFileName, pixelType, componentType);
+    itk::GetImageType(inputFileName, pixelType, componentType);
     //std::cout << std::endl << "in try" << std::endl;
     // This filter handles all types
 
@@ -565,30 +1013,873 @@ int main(int argc, char * argv[])
     case itk::ImageIOBase::CHAR:
     case itk::ImageIOBase::UCHAR:
     case itk::ImageIOBase::SHORT:
-      return DoIt(argc, argv, static_cast<short>(0), static_cast<short>(0));
+      return new Study<short, short>(argc, argv);
       break;
     case itk::ImageIOBase::USHORT:
     case itk::ImageIOBase::INT:
-      return DoIt(argc, argv, static_cast<int>(0), static_cast<short>(0));
+      return new Study<int, short>(argc, argv);
       break;
     case itk::ImageIOBase::UINT:
     case itk::ImageIOBase::ULONG:
-      return DoIt(argc, argv, static_cast<unsigned long>(0), static_cast<short>(0));
+      return new Study<unsigned long, short>(argc, argv);
       break;
     case itk::ImageIOBase::LONG:
-      return DoIt(argc, argv, static_cast<long>(0), static_cast<short>(0));
+      return new Study<long, short>(argc, argv);
       break;
     case itk::ImageIOBase::FLOAT:
-      return DoIt(argc, argv, static_cast<float>(0), static_cast<short>(0));
+      return new Study<float, short>(argc, argv);
       break;
     case itk::ImageIOBase::DOUBLE:
-      return DoIt(argc, argv, static_cast<float>(0), static_cast<short>(0));
+      return new Study<float, short>(argc, argv);
       break;
     case itk::ImageIOBase::UNKNOWNCOMPONENTTYPE:
     default:
       std::cout << "unknown component type" << std::endl;
       break;
     }
+    return 0;
+  }
+
+  // Split a manifest line into arguments at white space. Double quotes
+  // group an argument that contains spaces.
+  std::vector<std::string> SplitCommandLine(const std::string& line)
+  {
+    std::vector<std::string> arguments;
+    std::string argument;
+    bool inArgument = false;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+      const char c = line[i];
+      if (c == '"')
+      {
+        quoted = !quoted;
+        inArgument = true;
+      }
+      else if (!quoted && isspace(static_cast<unsigned char>(c)))
+      {
+        if (inArgument)
+        {
+          arguments.push_back(argument);
+          argument.clear();
+          inArgument = false;
+        }
+      }
+      else
+      {
+        argument += c;
+        inArgument = true;
+      }
+    }
+    if (inArgument)
+    {
+      arguments.push_back(argument);
+    }
+    return arguments;
+  }
+
+  // Owner of the arguments of a command line parser built by
+  // CheckCommandLine()
+  struct CommandLineArguments
+  {
+    std::vector<TCLAP::Arg *> Arguments;
+    std::vector<TCLAP::Constraint<std::string> *> Constraints;
+
+    ~CommandLineArguments()
+    {
+      for (size_t i = 0; i < Arguments.size(); ++i)
+      {
+        delete Arguments[i];
+      }
+      for (size_t i = 0; i < Constraints.size(); ++i)
+      {
+        delete Constraints[i];
+      }
+    }
+  };
+
+  std::string StripFlag(std::string flag)
+  {
+    return flag.erase(0, flag.find_first_not_of('-'));
+  }
+
+  // Parse a command line (with the program name) against the parameters
+  // of the module's XML description, as PARSE_ARGS does, but without
+  // exiting the process on an error or on --help. The command lines of
+  // a batch manifest or of service jobs are checked with it before the
+  // steps of their study parse them with PARSE_ARGS. Returns false,
+  // with the error on std::cerr, if the command line does not parse;
+  // otherwise inputFileName receives the input volume.
+  bool CheckCommandLine(const std::vector<std::string>& commandLine, const std::string& name,
+    std::string& inputFileName)
+  {
+    ModuleDescription module;
+    ModuleDescriptionParser parser;
+    if (parser.Parse(GetXMLModuleDescription(), module) != 0)
+    {
+      std::cerr << name << ": cannot parse the module description" << std::endl;
+      return false;
+    }
+
+    TCLAP::CmdLine commandLineParser(module.GetDescription(), ' ', module.GetVersion());
+    commandLineParser.setExceptionHandling(false);
+    CommandLineArguments arguments;
+
+    // the arguments every module takes
+    arguments.Arguments.push_back(new TCLAP::SwitchArg("", "xml", "", commandLineParser, false));
+    arguments.Arguments.push_back(new TCLAP::SwitchArg("", "echo", "", commandLineParser, false));
+    arguments.Arguments.push_back(new TCLAP::ValueArg<std::string>("", "processinformationaddress", "",
+      false, "", "std::string", commandLineParser));
+    arguments.Arguments.push_back(new TCLAP::ValueArg<std::string>("", "returnparameterfile", "",
+      false, "", "std::string", commandLineParser));
+
+    // flagged parameters, then the parameters given by position in the
+    // order of their index
+    std::map<int, ModuleParameter> indexed;
+    const std::vector<ModuleParameterGroup>& groups = module.GetParameterGroups();
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+      const std::vector<ModuleParameter>& parameters = groups[g].GetParameters();
+      for (size_t i = 0; i < parameters.size(); ++i)
+      {
+        const ModuleParameter& parameter = parameters[i];
+        if (!parameter.GetIndex().empty())
+        {
+          indexed[atoi(parameter.GetIndex().c_str())] = parameter;
+          continue;
+        }
+        const std::string flag = StripFlag(parameter.GetFlag());
+        const std::string longFlag = StripFlag(parameter.GetLongFlag());
+        if (flag.empty() && longFlag.empty())
+        {
+          // a return parameter, not on the command line
+          continue;
+        }
+        const std::string argumentName = longFlag.empty() ? parameter.GetName() : longFlag;
+        const std::string& tag = parameter.GetTag();
+
+        TCLAP::Arg* argument = 0;
+        if (tag == "boolean")
+        {
+          argument = new TCLAP::SwitchArg(flag, argumentName, "", commandLineParser, false);
+        }
+        else if (parameter.GetMultiple() == "true")
+        {
+          argument = new TCLAP::MultiArg<std::string>(flag, argumentName, "", false, "std::string", commandLineParser);
+        }
+        else if (tag == "integer")
+        {
+          argument = new TCLAP::ValueArg<int>(flag, argumentName, "", false, 0, "int", commandLineParser);
+        }
+        else if (tag == "float")
+        {
+          argument = new TCLAP::ValueArg<float>(flag, argumentName, "", false, 0.0f, "float", commandLineParser);
+        }
+        else if (tag == "double")
+        {
+          argument = new TCLAP::ValueArg<double>(flag, argumentName, "", false, 0.0, "double", commandLineParser);
+        }
+        else if (tag.find("-enumeration") != std::string::npos)
+        {
+          std::vector<std::string> elements = parameter.GetElements();
+          TCLAP::ValuesConstraint<std::string>* constraint = new TCLAP::ValuesConstraint<std::string>(elements);
+          arguments.Constraints.push_back(constraint);
+          argument = new TCLAP::ValueArg<std::string>(flag, argumentName, "", false, "", constraint, commandLineParser);
+        }
+        else
+        {
+          argument = new TCLAP::ValueArg<std::string>(flag, argumentName, "", false, "", "std::string", commandLineParser);
+        }
+        arguments.Arguments.push_back(argument);
+      }
+    }
+    TCLAP::UnlabeledValueArg<std::string>* input = 0;
+    for (std::map<int, ModuleParameter>::const_iterator it = indexed.begin(); it != indexed.end(); ++it)
+    {
+      TCLAP::UnlabeledValueArg<std::string>* argument = new TCLAP::UnlabeledValueArg<std::string>(
+        it->second.GetName(), "", true, "", "std::string", commandLineParser);
+      arguments.Arguments.push_back(argument);
+      if (it->second.GetName() == "InputFourDImageFileName")
+      {
+        input = argument;
+      }
+    }
+
+    std::vector<std::string> argv(commandLine);
+    try
+    {
+      commandLineParser.parse(argv);
+    }
+    catch (TCLAP::ArgException& e)
+    {
+      std::cerr << name << ": " << e.error() << " for argument " << e.argId() << std::endl;
+      return false;
+    }
+    catch (TCLAP::ExitException&)
+    {
+      std::cerr << name << ": the command line asks for help or the version, not a study" << std::endl;
+      return false;
+    }
+    if (!input)
+    {
+      std::cerr << name << ": the module description has no input volume" << std::endl;
+      return false;
+    }
+    inputFileName = input->getValue();
+    return true;
+  }
+
+  // Create the study for a command line given as arguments, reporting
+  // failures with the name of the study. Returns 0 on failure, including
+  // a command line that does not parse.
+  StudyBase* CreateStudy(std::vector<std::string> commandLine, const std::string& name)
+  {
+    std::string inputFileName;
+    if (!CheckCommandLine(commandLine, name, inputFileName))
+    {
+      return 0;
+    }
+
+    std::vector<char *> argv;
+    for (size_t i = 0; i < commandLine.size(); ++i)
+    {
+      argv.push_back(&commandLine[i][0]);
+    }
+    argv.push_back(0);
+
+    try
+    {
+      return NewStudy(inputFileName, static_cast<int>(commandLine.size()), &argv[0]);
+    }
+    catch (itk::ExceptionObject & excep)
+    {
+      std::cerr << name << ": exception caught !" << std::endl;
+      std::cerr << excep << std::endl;
+    }
+    return 0;
+  }
+
+  // Run one step (0 read, 1 compute, 2 write) of a study, reporting
+  // failures and exceptions by status
+  int RunStudyStep(StudyBase* study, const std::string& name, int step, double& seconds)
+  {
+    const double start = itk::PkTimingReport::GetTime();
+    int status = EXIT_FAILURE;
+    try
+    {
+      switch (step)
+      {
+      case 0:
+        status = study->Read();
+        break;
+      case 1:
+        status = study->Compute();
+        break;
+      default:
+        status = study->Write();
+        break;
+      }
+    }
+    catch (itk::ExceptionObject & excep)
+    {
+      std::cerr << name << ": exception caught !" << std::endl;
+      std::cerr << excep << std::endl;
+    }
+    catch (std::exception & excep)
+    {
+      std::cerr << name << ": " << excep.what() << std::endl;
+    }
+    seconds = itk::PkTimingReport::GetTime() - start;
+    return status;
+  }
+
+  // Studies of a batch and the step of the pipeline each stage works on
+  struct BatchPipelineStruct
+  {
+    std::string Program;
+    std::vector< std::vector<std::string> > CommandLines;
+    std::vector<StudyBase*> Studies;
+    std::vector<int> Status;
+    std::vector<double> StepSeconds[3];
+    int ReadIndex;
+    int ComputeIndex;
+    int WriteIndex;
+  };
+
+  std::string GetBatchStudyName(int index)
+  {
+    std::ostringstream name;
+    name << "Study " << index + 1;
+    return name.str();
+  }
+
+  ITK_THREAD_RETURN_TYPE BatchReadCallback(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+    BatchPipelineStruct* str = static_cast<BatchPipelineStruct *>(info->UserData);
+    const int index = str->ReadIndex;
+    if (index < 0)
+    {
+      return ITK_THREAD_RETURN_VALUE;
+    }
+
+    str->Studies[index] = CreateStudy(str->CommandLines[index], GetBatchStudyName(index));
+    if (!str->Studies[index])
+    {
+      str->Status[index] = EXIT_FAILURE;
+      return ITK_THREAD_RETURN_VALUE;
+    }
+    str->Status[index] = RunStudyStep(str->Studies[index], GetBatchStudyName(index), 0, str->StepSeconds[0][index]);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  ITK_THREAD_RETURN_TYPE BatchComputeCallback(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+    BatchPipelineStruct* str = static_cast<BatchPipelineStruct *>(info->UserData);
+    const int index = str->ComputeIndex;
+    if (index >= 0 && str->Status[index] == EXIT_SUCCESS)
+    {
+      str->Status[index] = RunStudyStep(str->Studies[index], GetBatchStudyName(index), 1, str->StepSeconds[1][index]);
+    }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  ITK_THREAD_RETURN_TYPE BatchWriteCallback(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+    BatchPipelineStruct* str = static_cast<BatchPipelineStruct *>(info->UserData);
+    const int index = str->WriteIndex;
+    if (index < 0)
+    {
+      return ITK_THREAD_RETURN_VALUE;
+    }
+    if (str->Status[index] == EXIT_SUCCESS)
+    {
+      str->Status[index] = RunStudyStep(str->Studies[index], GetBatchStudyName(index), 2, str->StepSeconds[2][index]);
+    }
+    // the study is done, release its images
+    delete str->Studies[index];
+    str->Studies[index] = 0;
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  // Run the studies of a manifest, one command line (without the
+  // program name) per line. Studies go through a three stage pipeline:
+  // while study n is computed, study n+1 is read and study n-1 written.
+  // The compute stage uses the threads of the module as in a single
+  // run. A failed study is reported and the others still run.
+  int RunBatch(const char* program, const std::string& manifestFileName)
+  {
+    std::ifstream manifest(manifestFileName.c_str());
+    if (!manifest)
+    {
+      std::cerr << "Cannot open batch manifest " << manifestFileName << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    BatchPipelineStruct str;
+    str.Program = program;
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+      std::vector<std::string> arguments = SplitCommandLine(line);
+      if (arguments.empty() || arguments[0][0] == '#')
+      {
+        continue;
+      }
+      arguments.insert(arguments.begin(), str.Program);
+      str.CommandLines.push_back(arguments);
+    }
+
+    const int numberOfStudies = static_cast<int>(str.CommandLines.size());
+    str.Studies.resize(numberOfStudies, 0);
+    str.Status.resize(numberOfStudies, EXIT_SUCCESS);
+    for (unsigned int step = 0; step < 3; ++step)
+    {
+      str.StepSeconds[step].resize(numberOfStudies, 0.0);
+    }
+    std::cout << "Batch of " << numberOfStudies << " studies" << std::endl;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(3);
+    threader->SetMultipleMethod(0, BatchReadCallback, &str);
+    threader->SetMultipleMethod(1, BatchComputeCallback, &str);
+    threader->SetMultipleMethod(2, BatchWriteCallback, &str);
+
+    const double start = itk::PkTimingReport::GetTime();
+    for (int step = 0; step < numberOfStudies + 2; ++step)
+    {
+      str.ReadIndex = step < numberOfStudies ? step : -1;
+      str.ComputeIndex = step >= 1 && step - 1 < numberOfStudies ? step - 1 : -1;
+      str.WriteIndex = step >= 2 ? step - 2 : -1;
+      threader->MultipleMethodExecute();
+    }
+    const double seconds = itk::PkTimingReport::GetTime() - start;
+
+    int failures = 0;
+    for (int i = 0; i < numberOfStudies; ++i)
+    {
+      std::cout << "Study " << i + 1 << ": " << (str.Status[i] == EXIT_SUCCESS ? "done" : "FAILED")
+        << ", read " << str.StepSeconds[0][i] << " s, compute " << str.StepSeconds[1][i]
+        << " s, write " << str.StepSeconds[2][i] << " s" << std::endl;
+      if (str.Status[i] != EXIT_SUCCESS)
+      {
+        ++failures;
+      }
+    }
+    std::cout << "Batch: " << numberOfStudies - failures << " of " << numberOfStudies
+      << " studies in " << seconds << " s" << std::endl;
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  // A job of the service: the command line of one study, and where its
+  // result goes
+  struct ServiceJob
+  {
+    int Id;
+    std::string Name;
+    std::vector<std::string> CommandLine;
+    // connection to answer on, or -1
+    int Connection;
+    // claimed job file of the spool directory, or empty
+    std::string SpoolFileName;
+    double SubmitTime;
+  };
+
+  // Queue of the service, shared by the thread taking the jobs and the
+  // workers running them
+  struct ServiceStruct
+  {
+    std::string Program;
+    std::deque<ServiceJob*> Queue;
+    itk::SimpleMutexLock Lock;
+    itk::ConditionVariable::Pointer JobsAvailable;
+    bool Stopping;
+    int NumberOfJobs;
+  };
+
+  void SubmitServiceJob(ServiceStruct* str, const std::vector<std::string>& arguments,
+    int connection, const std::string& spoolFileName)
+  {
+    ServiceJob* job = new ServiceJob;
+    job->CommandLine = arguments;
+    job->CommandLine.insert(job->CommandLine.begin(), str->Program);
+    job->Connection = connection;
+    job->SpoolFileName = spoolFileName;
+    job->SubmitTime = itk::PkTimingReport::GetTime();
+
+    str->Lock.Lock();
+    job->Id = ++str->NumberOfJobs;
+    std::ostringstream name;
+    name << "Job " << job->Id;
+    job->Name = name.str();
+    str->Queue.push_back(job);
+    str->Lock.Unlock();
+    str->JobsAvailable->Signal();
+  }
+
+  // Run a job and answer with one line of JSON with its status and the
+  // time it waited in the queue and spent in each step
+  void RunServiceJob(ServiceJob* job)
+  {
+    const double queueSeconds = itk::PkTimingReport::GetTime() - job->SubmitTime;
+    double stepSeconds[3] = { 0.0, 0.0, 0.0 };
+    int status = EXIT_FAILURE;
+    StudyBase* study = CreateStudy(job->CommandLine, job->Name);
+    if (study)
+    {
+      status = EXIT_SUCCESS;
+      for (int step = 0; step < 3 && status == EXIT_SUCCESS; ++step)
+      {
+        status = RunStudyStep(study, job->Name, step, stepSeconds[step]);
+      }
+      delete study;
+    }
+
+    std::ostringstream result;
+    result << "{\"job\": " << job->Id
+      << ", \"status\": \"" << (status == EXIT_SUCCESS ? "done" : "failed") << "\""
+      << ", \"queueSeconds\": " << queueSeconds
+      << ", \"readSeconds\": " << stepSeconds[0]
+      << ", \"computeSeconds\": " << stepSeconds[1]
+      << ", \"writeSeconds\": " << stepSeconds[2] << "}";
+    std::cout << result.str() << std::endl;
+    result << "\n";
+
+#ifndef _WIN32
+    if (job->Connection >= 0)
+    {
+      const std::string answer = result.str();
+      if (send(job->Connection, answer.c_str(), answer.size(), 0) < 0)
+      {
+        std::cerr << job->Name << ": could not answer the client" << std::endl;
+      }
+      close(job->Connection);
+    }
+#endif
+
+    if (!job->SpoolFileName.empty())
+    {
+      const std::string base = itksys::SystemTools::GetFilenameWithoutLastExtension(job->SpoolFileName);
+      const std::string path = itksys::SystemTools::GetFilenamePath(job->SpoolFileName) + "/" + base;
+      std::ofstream resultFile((path + ".result").c_str());
+      resultFile << result.str();
+      resultFile.close();
+      itksys::SystemTools::RenameFile(job->SpoolFileName.c_str(),
+        (path + (status == EXIT_SUCCESS ? ".done" : ".failed")).c_str());
+    }
+  }
+
+  ITK_THREAD_RETURN_TYPE ServiceWorkerCallback(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+    ServiceStruct* str = static_cast<ServiceStruct *>(info->UserData);
+    while (true)
+    {
+      str->Lock.Lock();
+      while (str->Queue.empty() && !str->Stopping)
+      {
+        str->JobsAvailable->Wait(&str->Lock);
+      }
+      if (str->Queue.empty())
+      {
+        // stopping, and all jobs taken
+        str->Lock.Unlock();
+        break;
+      }
+      ServiceJob* job = str->Queue.front();
+      str->Queue.pop_front();
+      str->Lock.Unlock();
+
+      RunServiceJob(job);
+      delete job;
+    }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+#ifndef _WIN32
+  // Remove the socket left by an earlier service at a path. Returns
+  // false if the path is something other than a socket, which is kept.
+  bool RemoveStaleSocket(const std::string& socketPath)
+  {
+    struct stat status;
+    if (lstat(socketPath.c_str(), &status) != 0)
+    {
+      return true;
+    }
+    if (!S_ISSOCK(status.st_mode))
+    {
+      return false;
+    }
+    unlink(socketPath.c_str());
+    return true;
+  }
+
+  // Read the line a client sends, giving up on a client that sends
+  // nothing for ServiceReceiveTimeout seconds so that it cannot hold up
+  // the other clients
+  const int ServiceReceiveTimeout = 10;
+
+  std::string ReceiveLine(int connection)
+  {
+    timeval timeout;
+    timeout.tv_sec = ServiceReceiveTimeout;
+    timeout.tv_usec = 0;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string line;
+    char buffer[4096];
+    while (line.size() < 65536)
+    {
+      const ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+      if (received <= 0)
+      {
+        break;
+      }
+      line.append(buffer, received);
+      const size_t end = line.find('\n');
+      if (end != std::string::npos)
+      {
+        line.erase(end);
+        break;
+      }
+    }
+    return line;
+  }
+
+  // Take jobs from the clients of a Unix domain socket. A client sends
+  // the command line of a study on one line and receives the result of
+  // the job; the line "shutdown" stops the service. The socket is only
+  // accessible to the user running the service.
+  int ServeSocket(ServiceStruct* str, const std::string& socketPath)
+  {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+      std::cerr << "Socket path too long: " << socketPath << std::endl;
+      return EXIT_FAILURE;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    if (!RemoveStaleSocket(socketPath))
+    {
+      std::cerr << socketPath << " exists and is not a socket" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    // created with owner permissions only, then made sure of
+    const mode_t mask = umask(0077);
+    const bool bound = server >= 0
+      && bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    umask(mask);
+    if (!bound
+      || chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) < 0
+      || listen(server, 16) < 0)
+    {
+      std::cerr << "Cannot listen on socket " << socketPath << std::endl;
+      if (server >= 0)
+      {
+        close(server);
+      }
+      return EXIT_FAILURE;
+    }
+    // a client that went away must not end the service
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "Listening on " << socketPath << std::endl;
+
+    while (true)
+    {
+      const int connection = accept(server, 0, 0);
+      if (connection < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        std::cerr << "Cannot accept on socket " << socketPath << std::endl;
+        break;
+      }
+
+      const std::vector<std::string> arguments = SplitCommandLine(ReceiveLine(connection));
+      if (arguments.empty())
+      {
+        close(connection);
+        continue;
+      }
+      if (arguments[0] == "shutdown")
+      {
+        const std::string answer = "{\"status\": \"stopping\"}\n";
+        send(connection, answer.c_str(), answer.size(), 0);
+        close(connection);
+        break;
+      }
+      SubmitServiceJob(str, arguments, connection, "");
+    }
+
+    close(server);
+    RemoveStaleSocket(socketPath);
+    return EXIT_SUCCESS;
+  }
+#endif
+
+  // Take jobs from the files with extension .job of a directory, each
+  // with the command line of a study. A job file must be complete when
+  // it gets its .job name: clients write it under another name and
+  // rename it. A job file is claimed by renaming it to .running before
+  // it is read, and renamed to .done or .failed when finished, next to
+  // a .result file with the result of the job. A file named "shutdown"
+  // stops the service.
+  int ServeSpoolDirectory(ServiceStruct* str, const std::string& spoolDirectory)
+  {
+    if (!itksys::SystemTools::FileIsDirectory(spoolDirectory.c_str()))
+    {
+      std::cerr << "Spool directory " << spoolDirectory << " does not exist" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::cout << "Watching " << spoolDirectory << std::endl;
+
+    const std::string shutdownFileName = spoolDirectory + "/shutdown";
+    while (!itksys::SystemTools::FileExists(shutdownFileName.c_str()))
+    {
+      itksys::Directory directory;
+      directory.Load(spoolDirectory.c_str());
+      std::vector<std::string> jobFileNames;
+      for (unsigned long i = 0; i < directory.GetNumberOfFiles(); ++i)
+      {
+        const std::string fileName = directory.GetFile(i);
+        if (itksys::SystemTools::GetFilenameLastExtension(fileName) == ".job")
+        {
+          jobFileNames.push_back(fileName);
+        }
+      }
+      // jobs named in submission order are run in that order
+      std::sort(jobFileNames.begin(), jobFileNames.end());
+
+      for (size_t i = 0; i < jobFileNames.size(); ++i)
+      {
+        const std::string jobFileName = spoolDirectory + "/" + jobFileNames[i];
+        const std::string runningFileName = spoolDirectory + "/"
+          + itksys::SystemTools::GetFilenameWithoutLastExtension(jobFileNames[i]) + ".running";
+        // another service may have taken the job
+        if (!itksys::SystemTools::RenameFile(jobFileName.c_str(), runningFileName.c_str()))
+        {
+          continue;
+        }
+
+        std::ifstream jobFile(runningFileName.c_str());
+        std::vector<std::string> arguments;
+        std::string line;
+        while (arguments.empty() && std::getline(jobFile, line))
+        {
+          arguments = SplitCommandLine(line);
+          if (!arguments.empty() && arguments[0][0] == '#')
+          {
+            arguments.clear();
+          }
+        }
+        jobFile.close();
+        SubmitServiceJob(str, arguments, -1, runningFileName);
+      }
+
+      itksys::SystemTools::Delay(500);
+    }
+
+    itksys::SystemTools::RemoveFile(shutdownFileName.c_str());
+    return EXIT_SUCCESS;
+  }
+
+  // Run as a resident service taking jobs from a Unix domain socket or a
+  // spool directory, until told to stop. Up to maxJobs jobs run at a
+  // time, and the threads of the module are shared among them, so the
+  // service as a whole never uses more threads than a single run. The
+  // IO factories, worker threads and population AIFs stay in place
+  // between jobs.
+  int RunService(const char* program, const std::string& socketPath,
+    const std::string& spoolDirectory, int maxJobs)
+  {
+    if (socketPath.empty() == spoolDirectory.empty())
+    {
+      std::cerr << "Give either a socket or a spool directory to serve" << std::endl;
+      return EXIT_FAILURE;
+    }
+#ifdef _WIN32
+    if (!socketPath.empty())
+    {
+      std::cerr << "Serving on a socket is not supported on this platform" << std::endl;
+      return EXIT_FAILURE;
+    }
+#endif
+    maxJobs = std::max(maxJobs, 1);
+    const itk::ThreadIdType threadsPerJob
+      = itk::MultiThreader::GetGlobalDefaultNumberOfThreads() / static_cast<itk::ThreadIdType>(maxJobs);
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(std::max(threadsPerJob, itk::ThreadIdType(1)));
+
+    ServiceStruct str;
+    str.Program = program;
+    str.JobsAvailable = itk::ConditionVariable::New();
+    str.Stopping = false;
+    str.NumberOfJobs = 0;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    std::vector<itk::ThreadIdType> workers;
+    for (int i = 0; i < maxJobs; ++i)
+    {
+      workers.push_back(threader->SpawnThread(ServiceWorkerCallback, &str));
+    }
+
+    int status = EXIT_SUCCESS;
+#ifndef _WIN32
+    if (!socketPath.empty())
+    {
+      status = ServeSocket(&str, socketPath);
+    }
+#endif
+    if (!spoolDirectory.empty())
+    {
+      status = ServeSpoolDirectory(&str, spoolDirectory);
+    }
+
+    // finish the jobs taken so far
+    str.Lock.Lock();
+    str.Stopping = true;
+    str.Lock.Unlock();
+    str.JobsAvailable->Broadcast();
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+      threader->TerminateThread(workers[i]);
+    }
+    std::cout << "Service stopped after " << str.NumberOfJobs << " jobs" << std::endl;
+    return status;
+  }
+
+  // Value of a flag selecting one of the modes that do not take the
+  // arguments of a single run, or an empty string
+  std::string GetModeArgument(int argc, char * argv[], const std::string& flag)
+  {
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+      if (flag == argv[i])
+      {
+        return argv[i + 1];
+      }
+    }
+    return "";
+  }
+
+}
+
+int main(int argc, char * argv[])
+{
+  // Batch and service modes take the studies from a manifest or from
+  // jobs, so none of the arguments of a single run are required
+  const std::string batchManifestFileName = GetModeArgument(argc, argv, "--batch");
+  const std::string serviceSocket = GetModeArgument(argc, argv, "--serveSocket");
+  const std::string serviceSpoolDirectory = GetModeArgument(argc, argv, "--serveSpool");
+  if (!batchManifestFileName.empty())
+  {
+    itk::PkChunkedImageIOFactory::RegisterOneFactory();
+    return RunBatch(argv[0], batchManifestFileName);
+  }
+  if (!serviceSocket.empty() || !serviceSpoolDirectory.empty())
+  {
+    const std::string maxJobs = GetModeArgument(argc, argv, "--serviceJobs");
+    itk::PkChunkedImageIOFactory::RegisterOneFactory();
+    return RunService(argv[0], serviceSocket, serviceSpoolDirectory,
+      maxJobs.empty() ? 1 : atoi(maxJobs.c_str()));
+  }
+
+  PARSE_ARGS;
+
+  // this line is here to be able to see the full output on the dashboard even
+  // when the test succeeds (to see the reproducibility error measure)
+  std::cout << "ctest needs: CTEST_FULL_OUTPUT" << std::endl;
+
+  // Inputs and outputs may also use the chunked voxel-major container
+  itk::PkChunkedImageIOFactory::RegisterOneFactory();
+
+  try
+  {
+    StudyBase* study = NewStudy(InputFourDImageFileName, argc, argv);
+    if (!study)
+    {
+      return EXIT_SUCCESS;
+    }
+    int status = study->Read();
+    if (status == EXIT_SUCCESS)
+    {
+      status = study->Compute();
+    }
+    if (status == EXIT_SUCCESS)
+    {
+      status = study->Write();
+    }
+    delete study;
+    return status;
   }
   catch (itk::ExceptionObject & excep)
   {
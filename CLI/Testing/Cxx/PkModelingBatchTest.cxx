@@ -0,0 +1,104 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Batch mode with a manifest that has one bad line between two good
+// ones. The bad line must fail its study only: the batch reports the
+// failure, and the studies before and after it are still written.
+//
+// Usage: PkModelingBatchTest PkModelingTest PkPhantomGenerator temporaryDirectory
+
+#include <itksys/SystemTools.hxx>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace
+{
+  std::string Quote(const std::string& s)
+  {
+    return "\"" + s + "\"";
+  }
+
+  // a study of the phantom writing its Ktrans map
+  std::string StudyLine(const std::string& prefix, const std::string& ktransFileName)
+  {
+    return "--aifMask " + Quote(prefix + "-aif.nrrd") + " --outputKtrans " + Quote(ktransFileName)
+      + " " + Quote(prefix + ".nrrd");
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 4)
+  {
+    std::cerr << "Usage: " << argv[0] << " PkModelingTest PkPhantomGenerator temporaryDirectory" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string module = argv[1];
+  const std::string generator = argv[2];
+  const std::string directory = argv[3];
+  itksys::SystemTools::MakeDirectory(directory.c_str());
+
+  const std::string prefix = directory + "/PkModelingBatchTest-phantom";
+  const std::string generate = Quote(generator) + " --size 8 8 2 --frames 30"
+    + " --aifMask " + Quote(prefix + "-aif.nrrd") + " " + Quote(prefix + ".nrrd");
+  if (system(generate.c_str()) != 0)
+  {
+    std::cerr << "Cannot generate the phantom" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const std::string ktransFileNames[3] =
+  {
+    directory + "/PkModelingBatchTest-1-ktrans.nrrd",
+    directory + "/PkModelingBatchTest-2-ktrans.nrrd",
+    directory + "/PkModelingBatchTest-3-ktrans.nrrd"
+  };
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    itksys::SystemTools::RemoveFile(ktransFileNames[i].c_str());
+  }
+
+  // the second line has a value that is not a number, which PARSE_ARGS
+  // would end the whole process on
+  const std::string manifestFileName = directory + "/PkModelingBatchTest-manifest.txt";
+  {
+    std::ofstream manifest(manifestFileName.c_str());
+    manifest << "# two good studies around a bad one" << std::endl;
+    manifest << StudyLine(prefix, ktransFileNames[0]) << std::endl;
+    manifest << "--maxIter many " << StudyLine(prefix, ktransFileNames[1]) << std::endl;
+    manifest << StudyLine(prefix, ktransFileNames[2]) << std::endl;
+  }
+
+  const std::string batch = Quote(module) + " ModuleEntryPoint --batch " + Quote(manifestFileName);
+  std::cout << batch << std::endl;
+  const int status = system(batch.c_str());
+
+  bool ok = true;
+  if (status == 0)
+  {
+    std::cerr << "The batch did not report the bad study" << std::endl;
+    ok = false;
+  }
+  if (!itksys::SystemTools::FileExists(ktransFileNames[0].c_str())
+    || !itksys::SystemTools::FileExists(ktransFileNames[2].c_str()))
+  {
+    std::cerr << "The good studies were not written" << std::endl;
+    ok = false;
+  }
+  if (itksys::SystemTools::FileExists(ktransFileNames[1].c_str()))
+  {
+    std::cerr << "The bad study was written" << std::endl;
+    ok = false;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,498 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// End-to-end throughput of the PkModeling module.
+//
+// Synthetic phantoms of each size are made with PkPhantomGenerator, and
+// the module entry point (through PkModelingTest, in a process of its
+// own so the peak memory is that of the run) is timed for every
+// combination of ROI fraction, model and number of threads. The time of
+// each stage, the fitted voxels per second, the parallel efficiency
+// relative to the run with the fewest threads and the peak resident set
+// size are taken from the module's --timingReport and written as CSV.
+//
+// With --baseline, the voxels per second of every run are compared with
+// those of the same configuration in a CSV written earlier, and the
+// harness fails if any run is slower than the baseline by more than the
+// tolerance.
+
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIterator.h"
+#include "PkTimingReport.h"
+
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  struct RunResult
+  {
+    std::string Size;
+    unsigned long NumberOfVoxels;
+    double ROIFraction;
+    int Model;
+    unsigned int NumberOfThreads;
+    double WallSeconds;
+    double StageSeconds[itk::PkTimingReport::NumberOfStages];
+    unsigned long FittedVoxels;
+    double VoxelsPerSecond;
+    double ParallelEfficiency;
+    double PeakRSSBytes;
+  };
+
+  void Usage(const char* program)
+  {
+    std::cerr << "Usage: " << program << " --module PkModelingTest --generator PkPhantomGenerator [options]" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --workDir dir          phantoms and reports (default .)" << std::endl;
+    std::cerr << "  --sizes list           volume sizes, e.g. 32x32x8,64x64x16" << std::endl;
+    std::cerr << "  --frames n             frames of the phantoms (default 40)" << std::endl;
+    std::cerr << "  --roiFractions list    fractions of each slice in the ROI (default 1)" << std::endl;
+    std::cerr << "  --models list          2 and/or 3 parameter Tofts model (default 2)" << std::endl;
+    std::cerr << "  --threads list         numbers of threads (default 1)" << std::endl;
+    std::cerr << "  --output file          write the results as CSV" << std::endl;
+    std::cerr << "  --baseline file        compare the voxels per second with an earlier output" << std::endl;
+    std::cerr << "  --tolerance t          allowed relative slowdown (default 0.2)" << std::endl;
+  }
+
+  std::vector<std::string> SplitList(const std::string& list)
+  {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+      if (!item.empty())
+      {
+        items.push_back(item);
+      }
+    }
+    return items;
+  }
+
+  std::string Quote(const std::string& s)
+  {
+    return "\"" + s + "\"";
+  }
+
+  // Run a command with the given number of ITK threads (0 keeps the
+  // environment as it is), returns its exit status
+  int RunCommand(const std::string& command, unsigned int numberOfThreads)
+  {
+    if (numberOfThreads > 0)
+    {
+      std::ostringstream env;
+      env << "ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS=" << numberOfThreads;
+      itksys::SystemTools::PutEnv(env.str().c_str());
+    }
+    std::cout << command << std::endl;
+    return system(command.c_str());
+  }
+
+  // ROI covering the given fraction of each slice, from the corner of
+  // the slices where the phantom's AIF vessel is, so that the AIF is
+  // inside the bounding box of the ROI that the module processes
+  void WriteROIMask(const unsigned int size[3], double fraction, const std::string& fileName)
+  {
+    typedef itk::Image<unsigned char, 3> MaskImageType;
+    MaskImageType::Pointer mask = MaskImageType::New();
+    MaskImageType::RegionType region;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      region.SetSize(i, size[i]);
+    }
+    mask->SetRegions(region);
+    mask->Allocate();
+    mask->FillBuffer(0);
+
+    const double side = sqrt(fraction);
+    MaskImageType::RegionType roi;
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+      const unsigned int roiSize = std::max(1u, static_cast<unsigned int>(size[i] * side + 0.5));
+      roi.SetIndex(i, 0);
+      roi.SetSize(i, std::min(roiSize, size[i]));
+    }
+    roi.SetIndex(2, 0);
+    roi.SetSize(2, size[2]);
+    for (itk::ImageRegionIterator<MaskImageType> it(mask, roi); !it.IsAtEnd(); ++it)
+    {
+      it.Set(1);
+    }
+
+    typedef itk::ImageFileWriter<MaskImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(mask);
+    writer->SetFileName(fileName.c_str());
+    writer->SetUseCompression(1);
+    writer->Update();
+  }
+
+  // Read the numbers of interest from a --timingReport file. The report
+  // is written one stage or section per line, which is all this relies on.
+  bool ReadTimingReport(const std::string& fileName, RunResult& result)
+  {
+    std::ifstream file(fileName.c_str());
+    if (!file)
+    {
+      return false;
+    }
+    for (unsigned int stage = 0; stage < itk::PkTimingReport::NumberOfStages; ++stage)
+    {
+      result.StageSeconds[stage] = 0.0;
+    }
+    result.PeakRSSBytes = 0.0;
+    result.FittedVoxels = 0;
+    result.VoxelsPerSecond = 0.0;
+
+    // the fitted voxels are counted by the quantifier, the quantification
+    // section gives the time they took
+    double quantificationSeconds = 0.0;
+    std::string line;
+    while (std::getline(file, line))
+    {
+      double value = 0.0;
+      size_t pos = line.find("\"peakRSSBytes\": ");
+      if (pos != std::string::npos && sscanf(line.c_str() + pos + 16, "%lf", &value) == 1)
+      {
+        result.PeakRSSBytes = value;
+        continue;
+      }
+      pos = line.find("\"fittedVoxels\": ");
+      if (pos != std::string::npos && sscanf(line.c_str() + pos + 16, "%lf", &value) == 1)
+      {
+        result.FittedVoxels = static_cast<unsigned long>(value);
+      }
+      if (line.find("\"counters\": ") != std::string::npos)
+      {
+        continue;
+      }
+      pos = line.find("{\"name\": \"");
+      if (pos == std::string::npos)
+      {
+        continue;
+      }
+      const size_t nameStart = pos + 10;
+      const size_t nameEnd = line.find('"', nameStart);
+      const std::string name = line.substr(nameStart, nameEnd - nameStart);
+      if (name == "quantification")
+      {
+        size_t wallPos = line.find("\"wallSeconds\": ");
+        if (wallPos != std::string::npos)
+        {
+          sscanf(line.c_str() + wallPos + 15, "%lf", &quantificationSeconds);
+        }
+        continue;
+      }
+      size_t secondsPos = line.find("\"seconds\": ", nameEnd);
+      if (secondsPos == std::string::npos || sscanf(line.c_str() + secondsPos + 11, "%lf", &value) != 1)
+      {
+        continue;
+      }
+      for (unsigned int stage = 0; stage < itk::PkTimingReport::NumberOfStages; ++stage)
+      {
+        if (name == itk::PkTimingReport::GetStageName(stage))
+        {
+          result.StageSeconds[stage] = value;
+        }
+      }
+    }
+    if (quantificationSeconds > 0.0)
+    {
+      result.VoxelsPerSecond = result.FittedVoxels / quantificationSeconds;
+    }
+    return true;
+  }
+
+  std::string ConfigurationKey(const std::string& size, double roiFraction, int model, unsigned int threads)
+  {
+    std::ostringstream key;
+    key << size << "," << roiFraction << "," << model << "," << threads;
+    return key.str();
+  }
+
+  void WriteResults(std::ostream& os, const std::vector<RunResult>& results)
+  {
+    os << "size,voxels,roiFraction,model,threads,wallSeconds";
+    for (unsigned int stage = 0; stage < itk::PkTimingReport::NumberOfStages; ++stage)
+    {
+      os << "," << itk::PkTimingReport::GetStageName(stage) << "Seconds";
+    }
+    os << ",fittedVoxels,voxelsPerSecond,parallelEfficiency,peakRSSBytes" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      const RunResult& r = results[i];
+      os << r.Size << "," << r.NumberOfVoxels << "," << r.ROIFraction << "," << r.Model << ","
+        << r.NumberOfThreads << "," << r.WallSeconds;
+      for (unsigned int stage = 0; stage < itk::PkTimingReport::NumberOfStages; ++stage)
+      {
+        os << "," << r.StageSeconds[stage];
+      }
+      os << "," << r.FittedVoxels << "," << r.VoxelsPerSecond << "," << r.ParallelEfficiency
+        << "," << r.PeakRSSBytes << std::endl;
+    }
+  }
+
+  // voxels per second of each configuration of an earlier output
+  bool ReadBaseline(const std::string& fileName, std::map<std::string, double>& baseline)
+  {
+    std::ifstream file(fileName.c_str());
+    std::string line;
+    if (!file || !std::getline(file, line))
+    {
+      return false;
+    }
+    std::vector<std::string> columns = SplitList(line);
+    int size = -1, roi = -1, model = -1, threads = -1, rate = -1;
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+      if (columns[i] == "size") size = i;
+      else if (columns[i] == "roiFraction") roi = i;
+      else if (columns[i] == "model") model = i;
+      else if (columns[i] == "threads") threads = i;
+      else if (columns[i] == "voxelsPerSecond") rate = i;
+    }
+    if (size < 0 || roi < 0 || model < 0 || threads < 0 || rate < 0)
+    {
+      return false;
+    }
+    while (std::getline(file, line))
+    {
+      std::vector<std::string> values = SplitList(line);
+      if (values.size() != columns.size())
+      {
+        continue;
+      }
+      baseline[ConfigurationKey(values[size], atof(values[roi].c_str()),
+        atoi(values[model].c_str()), atoi(values[threads].c_str()))] = atof(values[rate].c_str());
+    }
+    return true;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  std::string module, generator, workDir = ".", outputFileName, baselineFileName;
+  std::vector<std::string> sizes;
+  std::vector<std::string> roiFractions(1, "1");
+  std::vector<std::string> models(1, "2");
+  std::vector<std::string> threads(1, "1");
+  unsigned int numberOfFrames = 40;
+  double tolerance = 0.2;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--module" && i + 1 < argc)
+    {
+      module = argv[++i];
+    }
+    else if (arg == "--generator" && i + 1 < argc)
+    {
+      generator = argv[++i];
+    }
+    else if (arg == "--workDir" && i + 1 < argc)
+    {
+      workDir = argv[++i];
+    }
+    else if (arg == "--sizes" && i + 1 < argc)
+    {
+      sizes = SplitList(argv[++i]);
+    }
+    else if (arg == "--frames" && i + 1 < argc)
+    {
+      numberOfFrames = atoi(argv[++i]);
+    }
+    else if (arg == "--roiFractions" && i + 1 < argc)
+    {
+      roiFractions = SplitList(argv[++i]);
+    }
+    else if (arg == "--models" && i + 1 < argc)
+    {
+      models = SplitList(argv[++i]);
+    }
+    else if (arg == "--threads" && i + 1 < argc)
+    {
+      threads = SplitList(argv[++i]);
+    }
+    else if (arg == "--output" && i + 1 < argc)
+    {
+      outputFileName = argv[++i];
+    }
+    else if (arg == "--baseline" && i + 1 < argc)
+    {
+      baselineFileName = argv[++i];
+    }
+    else if (arg == "--tolerance" && i + 1 < argc)
+    {
+      tolerance = atof(argv[++i]);
+    }
+    else
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (module.empty() || generator.empty() || sizes.empty())
+  {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  itksys::SystemTools::MakeDirectory(workDir.c_str());
+
+  std::vector<RunResult> results;
+  try
+  {
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+      unsigned int size[3];
+      if (sscanf(sizes[s].c_str(), "%ux%ux%u", &size[0], &size[1], &size[2]) != 3)
+      {
+        std::cerr << "Bad size " << sizes[s] << ", expected e.g. 64x64x16" << std::endl;
+        return EXIT_FAILURE;
+      }
+      const std::string prefix = workDir + "/phantom-" + sizes[s];
+      std::ostringstream generate;
+      generate << Quote(generator) << " --size " << size[0] << " " << size[1] << " " << size[2]
+        << " --frames " << numberOfFrames << " --noise 5"
+        << " --aifMask " << Quote(prefix + "-aif.nrrd") << " " << Quote(prefix + ".nrrd");
+      if (RunCommand(generate.str(), 0) != 0)
+      {
+        std::cerr << "Cannot generate the phantom of size " << sizes[s] << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      for (size_t f = 0; f < roiFractions.size(); ++f)
+      {
+        const double roiFraction = atof(roiFractions[f].c_str());
+        const std::string roiFileName = prefix + "-roi" + roiFractions[f] + ".nrrd";
+        WriteROIMask(size, roiFraction, roiFileName);
+
+        for (size_t m = 0; m < models.size(); ++m)
+        {
+          const int model = atoi(models[m].c_str());
+          const size_t firstResult = results.size();
+          for (size_t t = 0; t < threads.size(); ++t)
+          {
+            RunResult result;
+            result.Size = sizes[s];
+            result.NumberOfVoxels = (unsigned long)size[0] * size[1] * size[2];
+            result.ROIFraction = roiFraction;
+            result.Model = model;
+            result.NumberOfThreads = atoi(threads[t].c_str());
+
+            const std::string configuration = ConfigurationKey(sizes[s], roiFraction, model, result.NumberOfThreads);
+            std::string runName = prefix + "-run-" + roiFractions[f] + "-" + models[m] + "-" + threads[t];
+            std::ostringstream run;
+            run << Quote(module) << " ModuleEntryPoint"
+              << " --timingReport " << Quote(runName + "-timing.json")
+              << " --roiMask " << Quote(roiFileName)
+              << " --aifMask " << Quote(prefix + "-aif.nrrd")
+              << (model == 3 ? " --computeFpv" : "")
+              << " --outputKtrans " << Quote(runName + "-ktrans.nrrd")
+              << " " << Quote(prefix + ".nrrd");
+
+            const double start = itk::PkTimingReport::GetTime();
+            if (RunCommand(run.str(), result.NumberOfThreads) != 0)
+            {
+              std::cerr << "PkModeling failed for " << configuration << std::endl;
+              return EXIT_FAILURE;
+            }
+            result.WallSeconds = itk::PkTimingReport::GetTime() - start;
+            if (!ReadTimingReport(runName + "-timing.json", result))
+            {
+              std::cerr << "Cannot read the timing report of " << configuration << std::endl;
+              return EXIT_FAILURE;
+            }
+            result.ParallelEfficiency = 0.0;
+            results.push_back(result);
+          }
+
+          // efficiency relative to the run with the fewest threads
+          size_t reference = firstResult;
+          for (size_t i = firstResult; i < results.size(); ++i)
+          {
+            if (results[i].NumberOfThreads < results[reference].NumberOfThreads)
+            {
+              reference = i;
+            }
+          }
+          for (size_t i = firstResult; i < results.size(); ++i)
+          {
+            const RunResult& r = results[reference];
+            if (r.VoxelsPerSecond > 0)
+            {
+              results[i].ParallelEfficiency = (results[i].VoxelsPerSecond / r.VoxelsPerSecond)
+                * r.NumberOfThreads / results[i].NumberOfThreads;
+            }
+          }
+        }
+      }
+    }
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  WriteResults(std::cout, results);
+  if (!outputFileName.empty())
+  {
+    std::ofstream output(outputFileName.c_str());
+    WriteResults(output, results);
+  }
+
+  if (!baselineFileName.empty())
+  {
+    std::map<std::string, double> baseline;
+    if (!ReadBaseline(baselineFileName, baseline))
+    {
+      std::cerr << "Cannot read the baseline " << baselineFileName << std::endl;
+      return EXIT_FAILURE;
+    }
+    bool regression = false;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      const RunResult& r = results[i];
+      const std::string key = ConfigurationKey(r.Size, r.ROIFraction, r.Model, r.NumberOfThreads);
+      std::map<std::string, double>::const_iterator it = baseline.find(key);
+      if (it == baseline.end())
+      {
+        std::cout << "No baseline for " << key << std::endl;
+        continue;
+      }
+      if (r.VoxelsPerSecond < it->second * (1.0 - tolerance))
+      {
+        std::cerr << "Throughput regression for " << key << ": " << r.VoxelsPerSecond
+          << " voxels/s, baseline " << it->second << std::endl;
+        regression = true;
+      }
+    }
+    if (regression)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// The sparse results of a phantom, read back, must hold one row for each
+// fitted voxel of the parametric maps, with the same values.
+//
+// Usage: PkModelingSparseResultsTest PkModelingTest PkPhantomGenerator temporaryDirectory
+
+#include "itkImage.h"
+#include "itkVectorImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkByteSwapper.h"
+#include <itksys/SystemTools.hxx>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  typedef itk::VectorImage<float, 3> MapsType;
+
+  // the columns of the sparse results and the components of the
+  // parametric maps, in the same order
+  const unsigned int NumberOfColumns = 8;
+  const unsigned int DiagnosticsColumn = 7;
+
+  std::string Quote(const std::string& s)
+  {
+    return "\"" + s + "\"";
+  }
+
+  struct SparseResults
+  {
+    unsigned long size[3];
+    std::vector<std::string> columnNames;
+    std::vector<unsigned long long> indices;
+    std::vector<std::vector<float> > columns;
+  };
+
+  // Read the header up to the line "end", then the index column and the
+  // value columns
+  bool ReadSparseResults(const std::string& fileName, SparseResults& results)
+  {
+    std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!file)
+    {
+      std::cerr << "Cannot open " << fileName << std::endl;
+      return false;
+    }
+
+    size_t rows = 0;
+    bool hasRows = false;
+    bool hasSizes = false;
+    std::string byteOrder;
+    std::string line;
+    while (std::getline(file, line) && line != "end")
+    {
+      std::istringstream fields(line);
+      std::string key;
+      fields >> key;
+      if (key == "sizes:")
+      {
+        hasSizes = static_cast<bool>(fields >> results.size[0] >> results.size[1] >> results.size[2]);
+      }
+      else if (key == "rows:")
+      {
+        hasRows = static_cast<bool>(fields >> rows);
+      }
+      else if (key == "columns:")
+      {
+        std::string name;
+        while (fields >> name)
+        {
+          results.columnNames.push_back(name);
+        }
+      }
+      else if (key == "byteorder:")
+      {
+        fields >> byteOrder;
+      }
+    }
+    if (line != "end" || !hasSizes || !hasRows)
+    {
+      std::cerr << fileName << ": incomplete header" << std::endl;
+      return false;
+    }
+    if (byteOrder != (itk::ByteSwapper<int>::SystemIsBigEndian() ? "big" : "little"))
+    {
+      std::cerr << fileName << ": unexpected byte order " << byteOrder << std::endl;
+      return false;
+    }
+
+    results.indices.resize(rows);
+    results.columns.assign(results.columnNames.size(), std::vector<float>(rows));
+    if (rows > 0)
+    {
+      file.read(reinterpret_cast<char *>(&results.indices[0]), rows * sizeof(unsigned long long));
+      for (size_t c = 0; c < results.columns.size(); ++c)
+      {
+        file.read(reinterpret_cast<char *>(&results.columns[c][0]), rows * sizeof(float));
+      }
+    }
+    if (!file)
+    {
+      std::cerr << fileName << ": truncated" << std::endl;
+      return false;
+    }
+    file.peek();
+    if (!file.eof())
+    {
+      std::cerr << fileName << ": trailing data" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool CompareWithMaps(const SparseResults& results, const MapsType* maps)
+  {
+    const MapsType::RegionType region = maps->GetLargestPossibleRegion();
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+      if (results.size[d] != region.GetSize()[d])
+      {
+        std::cerr << "The size of the sparse results differs from the maps" << std::endl;
+        return false;
+      }
+    }
+    if (results.columnNames.size() != NumberOfColumns
+      || maps->GetNumberOfComponentsPerPixel() != NumberOfColumns)
+    {
+      std::cerr << "Expected " << NumberOfColumns << " columns, found " << results.columnNames.size()
+        << " and " << maps->GetNumberOfComponentsPerPixel() << " components" << std::endl;
+      return false;
+    }
+
+    std::map<unsigned long long, size_t> rowOfIndex;
+    for (size_t r = 0; r < results.indices.size(); ++r)
+    {
+      if (r > 0 && results.indices[r] <= results.indices[r - 1])
+      {
+        std::cerr << "The indices are not increasing at row " << r << std::endl;
+        return false;
+      }
+      rowOfIndex[results.indices[r]] = r;
+    }
+
+    // every fitted voxel has its row, with the values of the maps, and
+    // no row is left over
+    size_t fitted = 0;
+    itk::ImageRegionConstIteratorWithIndex<MapsType> it(maps, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+      const MapsType::PixelType values = it.Get();
+      if (values[DiagnosticsColumn] == -1)
+      {
+        continue;
+      }
+      ++fitted;
+
+      const MapsType::IndexType index = it.GetIndex();
+      const unsigned long long linearIndex = index[0] - region.GetIndex()[0]
+        + region.GetSize()[0] * (index[1] - region.GetIndex()[1]
+        + region.GetSize()[1] * static_cast<unsigned long long>(index[2] - region.GetIndex()[2]));
+      std::map<unsigned long long, size_t>::const_iterator row = rowOfIndex.find(linearIndex);
+      if (row == rowOfIndex.end())
+      {
+        std::cerr << "Voxel " << index << " is missing from the sparse results" << std::endl;
+        return false;
+      }
+      for (unsigned int c = 0; c < NumberOfColumns; ++c)
+      {
+        if (results.columns[c][row->second] != values[c])
+        {
+          std::cerr << results.columnNames[c] << " at voxel " << index << " is "
+            << results.columns[c][row->second] << " instead of " << values[c] << std::endl;
+          return false;
+        }
+      }
+    }
+    if (fitted == 0 || fitted != results.indices.size())
+    {
+      std::cerr << results.indices.size() << " rows for " << fitted << " fitted voxels" << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 4)
+  {
+    std::cerr << "Usage: " << argv[0] << " PkModelingTest PkPhantomGenerator temporaryDirectory" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string module = argv[1];
+  const std::string generator = argv[2];
+  const std::string directory = argv[3];
+  itksys::SystemTools::MakeDirectory(directory.c_str());
+
+  const std::string phantom = directory + "/PkModelingSparseResultsTest-phantom";
+  const std::string generate = Quote(generator) + " --size 6 5 3 --frames 30 --noise 2"
+    + " --aifMask " + Quote(phantom + "-aif.nrrd") + " --roiMask " + Quote(phantom + "-roi.nrrd")
+    + " " + Quote(phantom + ".nrrd");
+  if (system(generate.c_str()) != 0)
+  {
+    std::cerr << "Cannot generate the phantom" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // fit the 3 parameter model so that the fpv column is not all 0
+  const std::string sparse = directory + "/PkModelingSparseResultsTest.pks";
+  const std::string maps = directory + "/PkModelingSparseResultsTest-maps.nrrd";
+  const std::string process = Quote(module) + " ModuleEntryPoint --computeFpv"
+    + " --outputSparseResults " + Quote(sparse) + " --outputParametricMaps " + Quote(maps)
+    + " --aifMask " + Quote(phantom + "-aif.nrrd") + " --roiMask " + Quote(phantom + "-roi.nrrd")
+    + " " + Quote(phantom + ".nrrd");
+  std::cout << process << std::endl;
+  if (system(process.c_str()) != 0)
+  {
+    std::cerr << "Cannot process the phantom" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  bool ok = true;
+  try
+  {
+    itk::ImageFileReader<MapsType>::Pointer reader = itk::ImageFileReader<MapsType>::New();
+    reader->SetFileName(maps);
+    reader->Update();
+
+    SparseResults results;
+    ok = ReadSparseResults(sparse, results) && CompareWithMaps(results, reader->GetOutput());
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
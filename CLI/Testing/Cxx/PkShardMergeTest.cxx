@@ -0,0 +1,175 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// A phantom processed in shards and merged with PkShardMerge must give
+// the same maps as the phantom processed as a whole.
+//
+// Usage: PkShardMergeTest PkModelingTest PkPhantomGenerator PkShardMerge temporaryDirectory
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include <itksys/SystemTools.hxx>
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+  typedef itk::Image<float, 3> MapType;
+
+  const unsigned int NumberOfShards = 3;
+  const char* const MapNames[] = { "ktrans", "ve" };
+  const char* const MapFlags[] = { "--outputKtrans", "--outputVe" };
+  const unsigned int NumberOfMaps = 2;
+
+  std::string Quote(const std::string& s)
+  {
+    return "\"" + s + "\"";
+  }
+
+  std::string MapFileName(const std::string& prefix, const std::string& name)
+  {
+    return prefix + "-" + name + ".nrrd";
+  }
+
+  // Process the phantom, or one shard of it, writing its maps with the
+  // given prefix
+  bool Process(const std::string& module, const std::string& phantom, const std::string& shard,
+    const std::string& prefix)
+  {
+    std::string command = Quote(module) + " ModuleEntryPoint";
+    if (!shard.empty())
+    {
+      command += " --shard " + shard;
+    }
+    for (unsigned int m = 0; m < NumberOfMaps; ++m)
+    {
+      command += std::string(" ") + MapFlags[m] + " " + Quote(MapFileName(prefix, MapNames[m]));
+    }
+    command += " --aifMask " + Quote(phantom + "-aif.nrrd") + " --roiMask " + Quote(phantom + "-roi.nrrd")
+      + " " + Quote(phantom + ".nrrd");
+    std::cout << command << std::endl;
+    return system(command.c_str()) == 0;
+  }
+
+  MapType::Pointer ReadMap(const std::string& fileName)
+  {
+    itk::ImageFileReader<MapType>::Pointer reader = itk::ImageFileReader<MapType>::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+    return reader->GetOutput();
+  }
+
+  bool CompareMaps(const std::string& fileName, const std::string& referenceFileName)
+  {
+    MapType::Pointer map = ReadMap(fileName);
+    MapType::Pointer reference = ReadMap(referenceFileName);
+    if (map->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion()
+      || map->GetSpacing() != reference->GetSpacing()
+      || map->GetOrigin() != reference->GetOrigin())
+    {
+      std::cerr << fileName << ": the geometry differs from " << referenceFileName << std::endl;
+      return false;
+    }
+    itk::ImageRegionConstIteratorWithIndex<MapType> it(map, map->GetLargestPossibleRegion());
+    itk::ImageRegionConstIterator<MapType> referenceIt(reference, reference->GetLargestPossibleRegion());
+    for (; !it.IsAtEnd(); ++it, ++referenceIt)
+    {
+      if (it.Get() != referenceIt.Get())
+      {
+        std::cerr << fileName << ": voxel " << it.GetIndex() << " is " << it.Get()
+          << " instead of " << referenceIt.Get() << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 5)
+  {
+    std::cerr << "Usage: " << argv[0] << " PkModelingTest PkPhantomGenerator PkShardMerge temporaryDirectory" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string module = argv[1];
+  const std::string generator = argv[2];
+  const std::string merger = argv[3];
+  const std::string directory = argv[4];
+  itksys::SystemTools::MakeDirectory(directory.c_str());
+
+  // more slices than shards, and noise so that the voxels differ
+  const std::string phantom = directory + "/PkShardMergeTest-phantom";
+  const std::string generate = Quote(generator) + " --size 8 8 7 --frames 30 --noise 2"
+    + " --aifMask " + Quote(phantom + "-aif.nrrd") + " --roiMask " + Quote(phantom + "-roi.nrrd")
+    + " " + Quote(phantom + ".nrrd");
+  if (system(generate.c_str()) != 0)
+  {
+    std::cerr << "Cannot generate the phantom" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const std::string whole = directory + "/PkShardMergeTest-whole";
+  if (!Process(module, phantom, "", whole))
+  {
+    std::cerr << "Cannot process the phantom" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::string shardPrefixes[NumberOfShards];
+  for (unsigned int i = 0; i < NumberOfShards; ++i)
+  {
+    std::ostringstream shard, prefix;
+    shard << i + 1 << "/" << NumberOfShards;
+    prefix << directory << "/PkShardMergeTest-shard" << i + 1;
+    shardPrefixes[i] = prefix.str();
+    if (!Process(module, phantom, shard.str(), shardPrefixes[i]))
+    {
+      std::cerr << "Cannot process shard " << shard.str() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  bool ok = true;
+  try
+  {
+    for (unsigned int m = 0; m < NumberOfMaps; ++m)
+    {
+      // the shards are given out of order, the merge sorts them
+      const std::string merged = MapFileName(directory + "/PkShardMergeTest-merged", MapNames[m]);
+      std::string merge = Quote(merger) + " " + Quote(merged);
+      for (unsigned int i = NumberOfShards; i > 0; --i)
+      {
+        merge += " " + Quote(MapFileName(shardPrefixes[i - 1], MapNames[m]));
+      }
+      std::cout << merge << std::endl;
+      if (system(merge.c_str()) != 0)
+      {
+        std::cerr << "Cannot merge the " << MapNames[m] << " maps" << std::endl;
+        ok = false;
+        continue;
+      }
+      ok = CompareMaps(merged, MapFileName(whole, MapNames[m])) && ok;
+    }
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
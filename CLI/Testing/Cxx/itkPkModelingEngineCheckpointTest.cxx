@@ -0,0 +1,204 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// A fit that writes a checkpoint, whose checkpoint is then cut short as
+// if the process had been stopped in the middle of a record, must be
+// resumed from the complete records and give the same maps as a fit
+// without a checkpoint.
+//
+// Usage: itkPkModelingEngineCheckpointTest temporaryDirectory
+
+#include "itkPkModelingEngine.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "PkSolver.h"
+#include <itksys/SystemTools.hxx>
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  typedef itk::PkModelingEngine<float, short> EngineType;
+
+  const unsigned int NumberOfFrames = 30;
+  const float FrameSeconds = 5.0f;
+
+  // Enough ROI voxels for several chunks of checkpoint records
+  const unsigned int Size[3] = { 24, 24, 8 };
+
+  // A baseline, then an enhancement that grows with x and y, in the
+  // voxels inside a border of one voxel
+  void MakeStudy(EngineType::SignalVolumeType::Pointer& signal, EngineType::MaskVolumeType::Pointer& roi)
+  {
+    EngineType::SizeType size;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      size[i] = Size[i];
+    }
+    const EngineType::RegionType region(size);
+
+    signal = EngineType::SignalVolumeType::New();
+    signal->SetRegions(region);
+    signal->SetNumberOfComponentsPerPixel(NumberOfFrames);
+    signal->Allocate();
+    roi = EngineType::MaskVolumeType::New();
+    roi->SetRegions(region);
+    roi->Allocate();
+
+    EngineType::SignalVolumeType::PixelType pixel(NumberOfFrames);
+    itk::ImageRegionIteratorWithIndex<EngineType::SignalVolumeType> it(signal, region);
+    itk::ImageRegionIteratorWithIndex<EngineType::MaskVolumeType> roiIt(roi, region);
+    for (; !it.IsAtEnd(); ++it, ++roiIt)
+    {
+      const EngineType::SignalVolumeType::IndexType index = it.GetIndex();
+      const float rate = 0.005f * (1 + index[0]) + 0.003f * (1 + index[1]) + 0.002f * index[2];
+      for (unsigned int t = 0; t < NumberOfFrames; ++t)
+      {
+        const float enhancement = t < 5 ? 0.0f : 1.0f - exp(-rate * (t - 5));
+        pixel[t] = 100.0f * (1.0f + enhancement);
+      }
+      it.Set(pixel);
+      bool inside = true;
+      for (unsigned int i = 0; i < 2; ++i)
+      {
+        inside = inside && index[i] > 0 && index[i] + 1 < static_cast<long>(size[i]);
+      }
+      roiIt.Set(inside ? 1 : 0);
+    }
+  }
+
+  EngineType::Pointer Fit(EngineType::SignalVolumeType* signal, EngineType::MaskVolumeType* roi,
+    const std::string& checkpointFileName, bool resume)
+  {
+    std::vector<float> timing(NumberOfFrames);
+    for (unsigned int t = 0; t < NumberOfFrames; ++t)
+    {
+      timing[t] = t * FrameSeconds;
+    }
+    itk::PkModelingParameters parameters;
+    parameters.CheckpointFileName = checkpointFileName;
+    parameters.ResumeFromCheckpoint = resume;
+    // every chunk is flushed as soon as it is written
+    parameters.CheckpointInterval = 0.0f;
+
+    EngineType::Pointer engine = EngineType::New();
+    engine->SetParameters(parameters);
+    engine->SetSignal(signal);
+    engine->SetROIMask(roi);
+    engine->SetTiming(timing);
+    engine->SetFlipAngle(15.0f);
+    engine->SetRepetitionTime(5.0f);
+    engine->SetPrescribedAIF(timing, itk::compute_population_aif(timing, 0.1f));
+    engine->Update();
+    return engine;
+  }
+
+  bool CompareMaps(const EngineType::OutputVolumeType* map, const EngineType::OutputVolumeType* reference,
+    const std::string& name)
+  {
+    if (map->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion())
+    {
+      std::cerr << name << ": the map has region " << map->GetLargestPossibleRegion()
+        << " instead of " << reference->GetLargestPossibleRegion() << std::endl;
+      return false;
+    }
+    itk::ImageRegionConstIterator<EngineType::OutputVolumeType> it(map, map->GetLargestPossibleRegion());
+    itk::ImageRegionConstIterator<EngineType::OutputVolumeType> referenceIt(reference, reference->GetLargestPossibleRegion());
+    for (; !it.IsAtEnd(); ++it, ++referenceIt)
+    {
+      if (it.Get() != referenceIt.Get())
+      {
+        std::cerr << name << ": " << it.Get() << " instead of " << referenceIt.Get() << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Keep the first length bytes of a file
+  bool Truncate(const std::string& fileName, unsigned long length)
+  {
+    std::vector<char> data(length);
+    {
+      std::ifstream file(fileName.c_str(), std::ios::binary);
+      if (!file.read(&data[0], length))
+      {
+        return false;
+      }
+    }
+    std::ofstream file(fileName.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(&data[0], length);
+    return !file.fail();
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " temporaryDirectory" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string directory = argv[1];
+  itksys::SystemTools::MakeDirectory(directory.c_str());
+  const std::string checkpointFileName = directory + "/itkPkModelingEngineCheckpointTest.pkcp";
+  itksys::SystemTools::RemoveFile(checkpointFileName.c_str());
+
+  bool ok = true;
+  try
+  {
+    EngineType::SignalVolumeType::Pointer signal;
+    EngineType::MaskVolumeType::Pointer roi;
+    MakeStudy(signal, roi);
+
+    EngineType::Pointer reference = Fit(signal, roi, "", false);
+    Fit(signal, roi, checkpointFileName, false);
+    if (itksys::SystemTools::FileExists((checkpointFileName + ".tmp").c_str()))
+    {
+      std::cerr << "The temporary checkpoint was left behind" << std::endl;
+      ok = false;
+    }
+
+    // stopped in the middle of a record, past about half of them
+    const unsigned long length = itksys::SystemTools::FileLength(checkpointFileName.c_str());
+    if (!Truncate(checkpointFileName, length / 2 + 3))
+    {
+      std::cerr << "Cannot truncate " << checkpointFileName << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    EngineType::Pointer resumed = Fit(signal, roi, checkpointFileName, true);
+    const itk::SizeValueType restored = resumed->GetQuantifier()->GetNumberOfRestoredVoxels();
+    const itk::SizeValueType fitted = resumed->GetQuantifier()->GetNumberOfFittedVoxels();
+    std::cout << restored << " voxels restored, " << fitted << " fitted" << std::endl;
+    if (restored == 0 || fitted == 0)
+    {
+      std::cerr << "The resumed fit should restore some voxels and fit the others" << std::endl;
+      ok = false;
+    }
+
+    ok = CompareMaps(resumed->GetKtrans(), reference->GetKtrans(), "Ktrans") && ok;
+    ok = CompareMaps(resumed->GetVe(), reference->GetVe(), "Ve") && ok;
+    ok = CompareMaps(resumed->GetOptimizerDiagnostics(), reference->GetOptimizerDiagnostics(), "Diagnostics") && ok;
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
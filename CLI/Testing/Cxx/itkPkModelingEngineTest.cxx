@@ -0,0 +1,185 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// One engine processing studies of different sizes, ROIs and AIFs in
+// turn must give each study the same maps as an engine that only
+// processes that study. The last study has no ROI and measures its AIF
+// from a mask, so nothing of the earlier studies may be left over.
+//
+// Usage: itkPkModelingEngineTest
+
+#include "itkPkModelingEngine.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "PkSolver.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  typedef itk::PkModelingEngine<float, short> EngineType;
+
+  const unsigned int NumberOfFrames = 30;
+  const float FrameSeconds = 5.0f;
+
+  struct StudyType
+  {
+    EngineType::SignalVolumeType::Pointer Signal;
+    EngineType::MaskVolumeType::Pointer ROIMask;
+    EngineType::MaskVolumeType::Pointer AIFMask; // null for a prescribed AIF
+  };
+
+  // A baseline, then an enhancement that grows with x and y, in the
+  // voxels of a box in the middle of the volume, or, with
+  // measuredAIF, with no ROI and the AIF in the column at x = y = 0
+  StudyType MakeStudy(unsigned int sx, unsigned int sy, unsigned int sz, bool measuredAIF = false)
+  {
+    EngineType::SizeType size;
+    size[0] = sx;
+    size[1] = sy;
+    size[2] = sz;
+    const EngineType::RegionType region(size);
+
+    StudyType study;
+    study.Signal = EngineType::SignalVolumeType::New();
+    study.Signal->SetRegions(region);
+    study.Signal->SetNumberOfComponentsPerPixel(NumberOfFrames);
+    study.Signal->Allocate();
+    study.ROIMask = EngineType::MaskVolumeType::New();
+    study.ROIMask->SetRegions(region);
+    study.ROIMask->Allocate();
+    study.AIFMask = EngineType::MaskVolumeType::New();
+    study.AIFMask->SetRegions(region);
+    study.AIFMask->Allocate();
+
+    EngineType::SignalVolumeType::PixelType pixel(NumberOfFrames);
+    itk::ImageRegionIteratorWithIndex<EngineType::SignalVolumeType> it(study.Signal, region);
+    itk::ImageRegionIteratorWithIndex<EngineType::MaskVolumeType> roiIt(study.ROIMask, region);
+    itk::ImageRegionIteratorWithIndex<EngineType::MaskVolumeType> aifIt(study.AIFMask, region);
+    for (; !it.IsAtEnd(); ++it, ++roiIt, ++aifIt)
+    {
+      const EngineType::SignalVolumeType::IndexType index = it.GetIndex();
+      const float rate = 0.02f * (1 + index[0]) + 0.01f * (1 + index[1]);
+      for (unsigned int t = 0; t < NumberOfFrames; ++t)
+      {
+        const float enhancement = t < 5 ? 0.0f : 1.0f - exp(-rate * (t - 5));
+        pixel[t] = 100.0f * (1.0f + enhancement);
+      }
+      it.Set(pixel);
+      bool inside = true;
+      for (unsigned int i = 0; i < 2; ++i)
+      {
+        inside = inside && index[i] > 0 && index[i] + 1 < static_cast<long>(size[i]);
+      }
+      roiIt.Set(inside ? 1 : 0);
+      aifIt.Set(index[0] == 0 && index[1] == 0 ? 1 : 0);
+    }
+    if (measuredAIF)
+    {
+      study.ROIMask = 0;
+    }
+    else
+    {
+      study.AIFMask = 0;
+    }
+    return study;
+  }
+
+  void SetStudy(EngineType* engine, const StudyType& study)
+  {
+    std::vector<float> timing(NumberOfFrames);
+    for (unsigned int t = 0; t < NumberOfFrames; ++t)
+    {
+      timing[t] = t * FrameSeconds;
+    }
+    engine->SetSignal(study.Signal);
+    engine->SetROIMask(study.ROIMask);
+    engine->SetAIFMask(study.AIFMask);
+    engine->SetTiming(timing);
+    engine->SetFlipAngle(15.0f);
+    engine->SetRepetitionTime(5.0f);
+    engine->SetPrescribedAIF(timing, study.AIFMask ? std::vector<float>() : itk::compute_population_aif(timing, 0.1f));
+  }
+
+  // Process a study with an engine that has processed others, and with
+  // a fresh one
+  bool CompareWithFreshEngine(EngineType* engine, const StudyType& study, const std::string& name)
+  {
+    SetStudy(engine, study);
+    engine->Update();
+
+    EngineType::Pointer reference = EngineType::New();
+    SetStudy(reference, study);
+    reference->Update();
+
+    bool ok = true;
+    if (engine->GetProcessingRegion() != reference->GetProcessingRegion())
+    {
+      std::cerr << name << " was processed over " << engine->GetProcessingRegion()
+        << " instead of " << reference->GetProcessingRegion() << std::endl;
+      ok = false;
+    }
+    ok = CompareMaps(engine->GetKtrans(), reference->GetKtrans(), name + " Ktrans") && ok;
+    ok = CompareMaps(engine->GetVe(), reference->GetVe(), name + " Ve") && ok;
+    ok = CompareMaps(engine->GetOptimizerDiagnostics(), reference->GetOptimizerDiagnostics(), name + " Diagnostics") && ok;
+    return ok;
+  }
+
+  bool CompareMaps(const EngineType::OutputVolumeType* map, const EngineType::OutputVolumeType* reference,
+    const std::string& name)
+  {
+    if (map->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion())
+    {
+      std::cerr << name << ": the map has region " << map->GetLargestPossibleRegion()
+        << " instead of " << reference->GetLargestPossibleRegion() << std::endl;
+      return false;
+    }
+    itk::ImageRegionConstIterator<EngineType::OutputVolumeType> it(map, map->GetLargestPossibleRegion());
+    itk::ImageRegionConstIterator<EngineType::OutputVolumeType> referenceIt(reference, reference->GetLargestPossibleRegion());
+    for (; !it.IsAtEnd(); ++it, ++referenceIt)
+    {
+      if (it.Get() != referenceIt.Get())
+      {
+        std::cerr << name << ": " << it.Get() << " instead of " << referenceIt.Get() << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+int main(int, char * argv[])
+{
+  bool ok = true;
+  try
+  {
+    const StudyType first = MakeStudy(8, 8, 2);
+    const StudyType second = MakeStudy(6, 10, 3);
+    const StudyType third = MakeStudy(7, 9, 2, true);
+
+    EngineType::Pointer engine = EngineType::New();
+    SetStudy(engine, first);
+    engine->Update();
+    ok = CompareWithFreshEngine(engine, second, "Second study") && ok;
+    ok = CompareWithFreshEngine(engine, third, "Third study") && ok;
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -16,7 +16,11 @@
 #include "itkImageRegionIterator.h"
 #include "itkCastImageFilter.h"
 #include "PkSolver.h"
+#include "PkCheckpoint.h"
+#include "PkFitCache.h"
+#include "PkTimingReport.h"
 #include <string>
+#include <map>
 
 namespace itk
 {
@@ -103,6 +107,44 @@ namespace itk
     itkStaticConstMacro(OutputVolumeDimension, unsigned int,
       OutputVolumeType::ImageDimension);
 
+    /** Components of the multi-component parametric map output, in the
+     * order they are interleaved at each voxel. */
+    enum ParametricMapComponent
+    {
+      KtransMap = 0,
+      VeMap,
+      FpvMap,
+      MaxSlopeMap,
+      AUCMap,
+      RSquaredMap,
+      BATMap,
+      DiagnosticsMap,
+      NumberOfParametricMaps
+    };
+
+    /** Values saved per voxel in a checkpoint: the parametric map
+     * components, then the fit cost and whether a curve was fit. */
+    enum CheckpointValue
+    {
+      IterationsValue = NumberOfParametricMaps,
+      EvaluationsValue,
+      FitTimeValue,
+      FittedCurveValue,
+      NumberOfCheckpointValues
+    };
+
+    /** Name of a parametric map component, suitable for image metadata. */
+    static const char* GetParametricMapName(unsigned int component);
+
+    /** Tests of the voxel pre-screen, in the order they are applied. */
+    enum PrescreenTest
+    {
+      PrescreenPeakEnhancementTest = 0,
+      PrescreenMaxSlopeTest,
+      PrescreenSNRTest,
+      NumberOfPrescreenTests
+    };
+
     /** Set and get the parameters to control the calculation of
     quantified valued */
     itkGetMacro(T1Pre, float);
@@ -167,6 +209,38 @@ namespace itk
     /// Get the mask that specifies from where the model fit is calculated
     const TMaskImage* GetROIMask() const;
 
+    /// Set a label map to fit regions instead of voxels. The curves of
+    /// each nonzero label (within the ROI mask, if any) are averaged and
+    /// only the mean curve of each label is fit. The results are
+    /// available from GetRegionalFits() and are painted over the label's
+    /// voxels in the output images.
+    void SetRegionLabelMap(const MaskVolumeType* volume);
+
+    /// Get the label map of the regions to fit
+    const TMaskImage* GetRegionLabelMap() const;
+
+    /// Result of fitting the mean curve of a region
+    struct RegionalFit
+    {
+      long          Label;
+      SizeValueType NumberOfVoxels;
+      float         Ktrans;
+      float         Ve;
+      float         Fpv;
+      float         MaxSlope;
+      float         AUC;
+      float         RSquared;
+      float         BAT;
+      float         Diagnostics;
+    };
+
+    /// Fits of the regions of the label map during the last update,
+    /// ordered by label
+    const std::vector<RegionalFit>& GetRegionalFits() const
+    {
+      return m_RegionalFits;
+    }
+
 
     /// Set the AIF as a vector of timing and concentration
     /// values. Timing specified in seconds.
@@ -185,12 +259,182 @@ namespace itk
       return m_PrescribedAIFTiming;
     }
 
+    /// Get the AIF used by the last update, at the frame times
+    const std::vector<float>& GetAIF() const
+    {
+      return m_AIF;
+    }
+
     /// Control whether the output volumes are masked by a threshold on
     /// the R-squared goodness of fit
     itkSetMacro(MaskByRSquared, bool);
     itkGetMacro(MaskByRSquared, bool);
     itkBooleanMacro(MaskByRSquared);
 
+    /// Control whether the multi-component parametric map output is
+    /// generated. When on, each voxel's Ktrans, Ve, fpv, MaxSlope, AUC,
+    /// R-squared, BAT and diagnostics are stored interleaved in a single
+    /// vector image. Default is off, in which case the output is not
+    /// allocated.
+    itkSetMacro(ComputeParametricMaps, bool);
+    itkGetMacro(ComputeParametricMaps, bool);
+    itkBooleanMacro(ComputeParametricMaps);
+
+    /// Thresholds of the pre-screen that skips the model fit at voxels
+    /// that do not enhance. The statistics are measured on the
+    /// concentration curve before the BAT detection, which is skipped as
+    /// well: the peak enhancement above the mean of the baseline (the
+    /// samples before the BAT of the AIF), the largest increase between
+    /// consecutive samples, and the ratio of the peak enhancement to the
+    /// standard deviation of the baseline. The tissue BAT is not known
+    /// yet, so a voxel whose bolus arrives before the AIF's may pass the
+    /// pre-screen; it is then flagged BAT_BEFORE_AIF_BAT (0x40) after
+    /// BAT detection and not fit. Voxels failing a test get the
+    /// corresponding PRESCREEN_* diagnostics code. A threshold of zero,
+    /// the default, disables the test.
+    itkSetMacro(PrescreenPeakEnhancement, float);
+    itkGetMacro(PrescreenPeakEnhancement, float);
+    itkSetMacro(PrescreenMaxSlope, float);
+    itkGetMacro(PrescreenMaxSlope, float);
+    itkSetMacro(PrescreenSNR, float);
+    itkGetMacro(PrescreenSNR, float);
+
+    /// Number of voxels rejected by a pre-screen test during the last update
+    SizeValueType GetNumberOfPrescreenedVoxels(unsigned int test) const;
+
+    /// Control two-tier fitting. When on, every voxel is first fit with
+    /// the tolerances multiplied by TieredToleranceScale and at most
+    /// TieredMaxIter function evaluations. Voxels where that fit ran out
+    /// of iterations, clamped Ktrans or Ve, or has an R-squared (the
+    /// value of the R-squared map) below RefitRSquaredThreshold are fit
+    /// again with the regular tolerances
+    /// and maxIter, from the first estimate and from alternative starting
+    /// points, keeping the fit with the smallest residual. Default is
+    /// off.
+    itkSetMacro(TieredFitting, bool);
+    itkGetMacro(TieredFitting, bool);
+    itkBooleanMacro(TieredFitting);
+    itkSetMacro(TieredToleranceScale, float);
+    itkGetMacro(TieredToleranceScale, float);
+    itkSetMacro(TieredMaxIter, int);
+    itkGetMacro(TieredMaxIter, int);
+    itkSetMacro(RefitRSquaredThreshold, float);
+    itkGetMacro(RefitRSquaredThreshold, float);
+
+    /// Number of voxels fit, and refit by the second tier, during the
+    /// last update
+    itkGetConstMacro(NumberOfFittedVoxels, SizeValueType);
+    itkGetConstMacro(NumberOfRefitVoxels, SizeValueType);
+
+    /// Control whether Ktrans, Ve and fpv are constrained to their
+    /// physiological ranges during the optimization, rather than only
+    /// clamped afterwards (see LMCostFunction::SetUseBounds()). Active
+    /// bounds are reported with the KTRANS_CLAMPED, VE_CLAMPED and
+    /// FPV_CLAMPED diagnostics flags. Default is off.
+    itkSetMacro(BoundedFitting, bool);
+    itkGetMacro(BoundedFitting, bool);
+    itkBooleanMacro(BoundedFitting);
+
+    /// Total number of optimizer iterations during the last update. The
+    /// vnl lmdif optimizer counts its iterations as evaluations of the
+    /// residuals, so this equals NumberOfEvaluations.
+    itkGetConstMacro(NumberOfIterations, SizeValueType);
+
+    /// Total number of cost function evaluations during the last update
+    itkGetConstMacro(NumberOfEvaluations, SizeValueType);
+
+    /// Control whether the fit cost outputs are generated: the number of
+    /// optimizer iterations, the number of cost function evaluations and
+    /// the wall time of the fit in microseconds at each voxel, summed
+    /// over all the fits of the voxel. Voxels taken from the fit cache or
+    /// from a cluster cost nothing. Default is off, in which case the
+    /// outputs are not allocated.
+    itkSetMacro(ComputeFitCostMaps, bool);
+    itkGetMacro(ComputeFitCostMaps, bool);
+    itkBooleanMacro(ComputeFitCostMaps);
+
+    /// Control whether a summary of the fit (voxels skipped, refit,
+    /// reused or restored, and the optimizer cost) is printed at the end
+    /// of each update. Default is off.
+    itkSetMacro(Verbose, bool);
+    itkGetMacro(Verbose, bool);
+    itkBooleanMacro(Verbose);
+
+    /// Report to record the time of the AIF, BAT, fit, R-squared and AUC
+    /// stages per thread, and the utilization of the threads. Optional.
+    /// If the report has a trace recorder, each thread also records its
+    /// share of the volume and every chunk of TraceChunkSize voxels.
+    itkSetObjectMacro(TimingReport, PkTimingReport);
+    itkGetObjectMacro(TimingReport, PkTimingReport);
+
+    /// Control whether fits are cached and reused for voxels whose
+    /// aligned concentration curve, BAT shift and starting point (in
+    /// pyramid mode) are bit-identical to a curve already fit, as in
+    /// zero-filled backgrounds or synthetic phantoms. The cache is
+    /// shared by all threads and cleared at each update. Default is off.
+    itkSetMacro(UseFitCache, bool);
+    itkGetMacro(UseFitCache, bool);
+    itkBooleanMacro(UseFitCache);
+
+    /// Maximum number of curves held by the fit cache, beyond which new
+    /// curves are fit without being stored. Default is 100000.
+    itkSetMacro(MaximumFitCacheEntries, SizeValueType);
+    itkGetMacro(MaximumFitCacheEntries, SizeValueType);
+
+    /// Fit cache hits and misses during the last update
+    itkGetConstMacro(NumberOfFitCacheHits, SizeValueType);
+    itkGetConstMacro(NumberOfFitCacheMisses, SizeValueType);
+
+    /// Approximate fitting by clustering. When NumberOfClusters is not
+    /// zero, the aligned concentration curves of the ROI are downsampled
+    /// and grouped by mini-batch k-means, and the mean curve of each
+    /// cluster is fit once. Each voxel then takes the parameters of the
+    /// nearest cluster or, when ClusterRefineIterations is not zero,
+    /// starts its own fit from them with that many iterations at most.
+    /// More clusters are slower and closer to a full fit. The BAT found
+    /// for each voxel while clustering is reused by its fit. Default is
+    /// 0 (every voxel is fit independently).
+    itkSetMacro(NumberOfClusters, unsigned int);
+    itkGetMacro(NumberOfClusters, unsigned int);
+    itkSetMacro(ClusterRefineIterations, int);
+    itkGetMacro(ClusterRefineIterations, int);
+
+    /// Coarse-to-fine fitting. When PyramidFactor is larger than 1, the
+    /// concentration curves of the ROI are averaged over blocks of
+    /// PyramidFactor^3 voxels and the block means are fit first. Each
+    /// voxel's fit then starts from the parameters of its block.
+    /// Voxels in blocks whose mean curve does not enhance (or fails the
+    /// pre-screen) are not fit and get the PYRAMID_BACKGROUND
+    /// diagnostics code. Default is 1 (off).
+    itkSetMacro(PyramidFactor, unsigned int);
+    itkGetMacro(PyramidFactor, unsigned int);
+
+    /// Number of voxels excluded by background blocks during the last update
+    itkGetConstMacro(NumberOfPyramidExcludedVoxels, SizeValueType);
+
+    /// Checkpointing of long fits. When CheckpointFileName is set, the
+    /// results of the voxels are appended to that file as threads
+    /// complete chunks of CheckpointChunkSize voxels, and the file is
+    /// flushed every CheckpointInterval seconds at most. With
+    /// ResumeFromCheckpoint, the voxels found in the file are restored
+    /// instead of fitted; their fitted curves are recomputed from the
+    /// parameters. The file is keyed by a hash of the input, the masks,
+    /// the AIF and the settings, so a file written for other inputs or
+    /// settings is started over. Does not apply to regional fitting.
+    itkSetMacro(CheckpointFileName, std::string);
+    itkGetConstReferenceMacro(CheckpointFileName, std::string);
+    itkSetMacro(ResumeFromCheckpoint, bool);
+    itkGetMacro(ResumeFromCheckpoint, bool);
+    itkBooleanMacro(ResumeFromCheckpoint);
+    itkSetMacro(CheckpointInterval, double);
+    itkGetMacro(CheckpointInterval, double);
+
+    /// Number of voxels restored from the checkpoint during the last update
+    SizeValueType GetNumberOfRestoredVoxels() const
+    {
+      return m_NumberOfRestoredVoxels;
+    }
+
     /// Get the quantitative output images
     TOutputImage* GetKTransOutput();
     TOutputImage* GetVEOutput();
@@ -204,13 +448,31 @@ namespace itk
 
     TOutputImage* GetOptimizerDiagnosticsOutput();
 
+    /// Get the multi-component parametric map output. Only valid when
+    /// ComputeParametricMaps is on.
+    VectorVolumeType* GetParametricMapsOutput();
+
+    /// Get the fit cost outputs. Only valid when ComputeFitCostMaps is on.
+    TOutputImage* GetIterationsOutput();
+    TOutputImage* GetEvaluationsOutput();
+    TOutputImage* GetFitTimeOutput();
+
+    /// Number of voxels per traced chunk
+    itkStaticConstMacro(TraceChunkSize, unsigned int, 256);
+
+    /// Number of voxels per chunk appended to the checkpoint
+    itkStaticConstMacro(CheckpointChunkSize, unsigned int, 1024);
+
   protected:
     ConcentrationToQuantitativeImageFilter();
     ~ConcentrationToQuantitativeImageFilter(){
     }
     void PrintSelf(std::ostream& os, Indent indent) const;
 
+    void GenerateOutputInformation();
+    void AllocateOutputs();
     void BeforeThreadedGenerateData();
+    void AfterThreadedGenerateData();
 
 #if ITK_VERSION_MAJOR < 4
     void ThreadedGenerateData( const OutputVolumeRegionType& outputRegionForThread, int threadId );
@@ -226,6 +488,75 @@ namespace itk
     std::vector<float> CalculateAverageAIF(const VectorVolumeType* inputVectorVolume, const MaskVolumeType* maskVolume);
     std::vector<float> ResampleAIF(std::vector<float> t1, std::vector<float> y1, std::vector<float> t2);
 
+    /// Apply the pre-screen to a concentration curve. Returns the first
+    /// test that failed, or NumberOfPrescreenTests if the voxel passed.
+    unsigned int PrescreenCurve(const VectorVoxelType& curve) const;
+
+    /// Fit the model to a curve aligned with the AIF, using tiered
+    /// fitting when enabled. Returns the diagnostics code of the fit
+    /// that was kept, and its RMS residual in rms. shift is the shift
+    /// that aligned the curve (the AIF BAT minus the voxel's BAT).
+    unsigned int FitCurve(const std::vector<float>& timeMinute, const VectorVoxelType& curve,
+      float& Ktrans, float& Ve, float& Fpv, double& rms,
+      LevenbergMarquardtOptimizer* optimizer, LMCostFunction* costFunction,
+      unsigned int threadId, const float* initialParameters = 0, int shift = 0);
+
+    /// R-squared of a fit with the given RMS residual, from the fitted
+    /// curve
+    double ComputeRSquared(const VectorVoxelType& fittedCurve, double rms) const;
+
+    /// R-squared of the model with the given parameters as written to
+    /// the R-squared map: from the fitted curve moved back by shift to
+    /// the voxel's BAT. costFunction holds the timing of the fit.
+    double ComputeFitRSquared(float Ktrans, float Ve, float Fpv, int shift, double rms,
+      LMCostFunction* costFunction) const;
+
+    /// RMS residual of the model with the given parameters to a curve
+    double ComputeFitRMS(const std::vector<float>& timeMinute, const VectorVoxelType& curve,
+      float Ktrans, float Ve, float Fpv, LMCostFunction* costFunction) const;
+
+    /// Shift a curve to align its bolus arrival with the AIF's. Returns
+    /// false if the BAT cannot be found or precedes the AIF BAT.
+    bool AlignCurveToAIF(const VectorVoxelType& curve, VectorVoxelType& aligned,
+      int& BATIndex, float& maxSlope) const;
+
+    /// Cluster the aligned curves of the ROI and fit the cluster means
+    void ComputeClusters();
+    static ITK_THREAD_RETURN_TYPE ClusterThreaderCallback(void* arg);
+    void ComputeClusterFeatures(const VectorVoxelType& curve, float* features) const;
+    unsigned int FindNearestCluster(const float* features, unsigned int numberOfClusters) const;
+
+    /// Average the ROI curves over the blocks of the coarse grid and fit
+    /// the block means
+    void ComputeCoarseFits();
+    static ITK_THREAD_RETURN_TYPE CoarseFitThreaderCallback(void* arg);
+
+    /// Key of the checkpoint: a hash of the input, the masks, the AIF,
+    /// the timing, the settings and the output region
+    unsigned long long ComputeCheckpointKey() const;
+
+    /// Fit of one block of the coarse grid
+    struct CoarseFit
+    {
+      enum StatusType { Empty = 0, Background, Failed, Fitted };
+      int Status;
+      float Ktrans;
+      float Ve;
+      float Fpv;
+    };
+
+    /// Coarse fit of the block containing a voxel
+    const CoarseFit& GetCoarseFit(const OutputVolumeIndexType& index) const;
+
+    /// Print a histogram of a fit cost output over the fitted voxels,
+    /// with power of two bins
+    void PrintFitCostHistogram(const char* name, TOutputImage* image) const;
+
+    /// Regional fitting: sum the curves of each label over a thread's
+    /// region, then fit the regional means and paint the outputs
+    void AccumulateRegionCurves(const OutputVolumeRegionType& region, unsigned int threadId);
+    void FitRegions();
+
   private:
     ConcentrationToQuantitativeImageFilter(const Self &); // purposely not implemented
     void operator=(const Self &); // purposely not implemented
@@ -245,6 +576,22 @@ namespace itk
     int    m_AIFBATIndex;
     int    m_ModelType;
     bool   m_MaskByRSquared;
+    bool   m_ComputeParametricMaps;
+    bool   m_ComputeFitCostMaps;
+    bool   m_Verbose;
+    float  m_PrescreenPeakEnhancement;
+    float  m_PrescreenMaxSlope;
+    float  m_PrescreenSNR;
+    bool   m_TieredFitting;
+    float  m_TieredToleranceScale;
+    int    m_TieredMaxIter;
+    float  m_RefitRSquaredThreshold;
+    bool   m_BoundedFitting;
+    bool   m_UseFitCache;
+    SizeValueType m_MaximumFitCacheEntries;
+    unsigned int m_NumberOfClusters;
+    int    m_ClusterRefineIterations;
+    unsigned int m_PyramidFactor;
     int m_constantBAT;
     std::string m_BATCalculationMode;
 
@@ -258,6 +605,84 @@ namespace itk
     // variables to cache information to share between threads
     std::vector<float> m_AIF;
     float  m_aifAUC;
+
+    // pre-screen rejections, counted per thread and summed after the update
+    std::vector<std::vector<SizeValueType> > m_PrescreenCounts;
+    std::vector<SizeValueType> m_NumberOfPrescreenedVoxels;
+
+    // fits and second tier refits, counted per thread
+    std::vector<SizeValueType> m_FitCounts;
+    std::vector<SizeValueType> m_RefitCounts;
+    SizeValueType m_NumberOfFittedVoxels;
+    SizeValueType m_NumberOfRefitVoxels;
+    std::vector<SizeValueType> m_IterationCounts;
+    SizeValueType m_NumberOfIterations;
+    std::vector<SizeValueType> m_EvaluationCounts;
+    SizeValueType m_NumberOfEvaluations;
+
+    // fits shared between threads, with hits and misses counted per thread
+    PkFitCache::Pointer m_FitCache;
+
+    // results of the voxels completed so far, and of an earlier update
+    std::string m_CheckpointFileName;
+    bool m_ResumeFromCheckpoint;
+    double m_CheckpointInterval;
+    PkCheckpoint::Pointer m_Checkpoint;
+    SizeValueType m_NumberOfRestoredVoxels;
+
+    PkTimingReport::Pointer m_TimingReport;
+    double m_ThreadedStartTime;
+    std::vector<double> m_ThreadBusySeconds;
+    std::vector<SizeValueType> m_FitCacheHits;
+    std::vector<SizeValueType> m_FitCacheMisses;
+    SizeValueType m_NumberOfFitCacheHits;
+    SizeValueType m_NumberOfFitCacheMisses;
+
+    // cluster centroids (downsampled curves) and the fit of each cluster mean
+    struct ClusterFit
+    {
+      float Ktrans;
+      float Ve;
+      float Fpv;
+      unsigned int Code;
+    };
+    unsigned int m_ClusterFeatureSize;
+    std::vector<float> m_ClusterCentroids;
+    std::vector<ClusterFit> m_ClusterFits;
+
+    // BAT (-1 where it was not found) and max slope of the voxels that
+    // passed the pre-screen, by offset in the outputs, found while
+    // clustering and reused by the fit
+    std::vector<int> m_ClusterBATs;
+    std::vector<float> m_ClusterMaxSlopes;
+
+    // threaded passes of the clustering over the ROI: the features of
+    // the aligned curves, then the sums of the curves of each cluster,
+    // per thread
+    enum ClusterPassType { ClusterFeaturePass, ClusterSumPass };
+    ClusterPassType m_ClusterPass;
+    unsigned int m_NumberOfClusterCentroids;
+    std::vector<std::vector<float> > m_ClusterThreadFeatures;
+    std::vector<std::vector<double> > m_ClusterThreadSums;
+    std::vector<std::vector<SizeValueType> > m_ClusterThreadMembers;
+
+    // coarse grid of the pyramid mode, x fastest
+    OutputVolumeIndexType m_CoarseGridIndex;
+    SizeValueType m_CoarseGridSize[OutputVolumeDimension];
+    std::vector<CoarseFit> m_CoarseFits;
+    std::vector<std::vector<float> > m_CoarseCurves;
+    std::vector<SizeValueType> m_PyramidExcludedCounts;
+    SizeValueType m_NumberOfPyramidExcludedVoxels;
+
+    // regional fitting: per-thread sums of the curves of each label
+    struct RegionAccumulator
+    {
+      std::vector<double> Sum;
+      SizeValueType NumberOfVoxels;
+    };
+    typedef std::map<long, RegionAccumulator> RegionAccumulatorMapType;
+    std::vector<RegionAccumulatorMapType> m_RegionAccumulators;
+    std::vector<RegionalFit> m_RegionalFits;
   };
 
 }; // end namespace itk
@@ -7,6 +7,10 @@
 #include "itkProgressReporter.h"
 #include "itkLevenbergMarquardtOptimizer.h"
 #include "vnl/vnl_math.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreader.h"
+#include "itksys/SystemTools.hxx"
+#include <algorithm>
 
 // work around compile error on Windows
 #define M_PI 3.1415926535897932384626433832795
@@ -36,6 +40,37 @@ namespace itk
     m_UsePopulationAIF = false;
     m_UsePrescribedAIF = false;
     m_MaskByRSquared = true;
+    m_ComputeParametricMaps = false;
+    m_PrescreenPeakEnhancement = 0.0f;
+    m_PrescreenMaxSlope = 0.0f;
+    m_PrescreenSNR = 0.0f;
+    m_NumberOfPrescreenedVoxels.assign(NumberOfPrescreenTests, 0);
+    m_TieredFitting = false;
+    m_TieredToleranceScale = 100.0f;
+    m_TieredMaxIter = 30;
+    m_RefitRSquaredThreshold = 0.5f;
+    m_BoundedFitting = false;
+    m_UseFitCache = false;
+    m_MaximumFitCacheEntries = 100000;
+    m_NumberOfClusters = 0;
+    m_ClusterRefineIterations = 0;
+    m_ClusterFeatureSize = 0;
+    m_ClusterPass = ClusterFeaturePass;
+    m_NumberOfClusterCentroids = 0;
+    m_PyramidFactor = 1;
+    m_NumberOfPyramidExcludedVoxels = 0;
+    m_NumberOfFitCacheHits = 0;
+    m_NumberOfFitCacheMisses = 0;
+    m_NumberOfIterations = 0;
+    m_NumberOfEvaluations = 0;
+    m_ComputeFitCostMaps = false;
+    m_Verbose = false;
+    m_ThreadedStartTime = 0.0;
+    m_NumberOfFittedVoxels = 0;
+    m_NumberOfRefitVoxels = 0;
+    m_ResumeFromCheckpoint = false;
+    m_CheckpointInterval = 60.0;
+    m_NumberOfRestoredVoxels = 0;
     m_ModelType = itk::LMCostFunction::TOFTS_2_PARAMETER;
     m_constantBAT = 0;
     m_BATCalculationMode = "PeakGradient";
@@ -48,6 +83,10 @@ namespace itk
     this->Superclass::SetNthOutput(6, static_cast<TOutputImage*>(this->MakeOutput(6).GetPointer()));  // BAT
     this->Superclass::SetNthOutput(7, static_cast<VectorVolumeType*>(this->MakeOutput(7).GetPointer())); // fitted
     this->Superclass::SetNthOutput(8, static_cast<TOutputImage*>(this->MakeOutput(8).GetPointer())); // fitted
+    this->Superclass::SetNthOutput(9, static_cast<VectorVolumeType*>(this->MakeOutput(9).GetPointer())); // parametric maps
+    this->Superclass::SetNthOutput(10, static_cast<TOutputImage*>(this->MakeOutput(10).GetPointer())); // iterations
+    this->Superclass::SetNthOutput(11, static_cast<TOutputImage*>(this->MakeOutput(11).GetPointer())); // evaluations
+    this->Superclass::SetNthOutput(12, static_cast<TOutputImage*>(this->MakeOutput(12).GetPointer())); // fit time
   }
 
   template< class TInputImage, class TMaskImage, class TOutputImage >
@@ -55,7 +94,7 @@ namespace itk
     ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
     ::MakeOutput(DataObjectPointerArraySizeType idx)
   {
-    if (idx == 7)
+    if (idx == 7 || idx == 9)
     {
       return VectorVolumeType::New().GetPointer();
     }
@@ -119,6 +158,22 @@ namespace itk
     return dynamic_cast<const TMaskImage *>(this->ProcessObject::GetInput(2));
   }
 
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  void
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::SetRegionLabelMap(const TMaskImage* volume)
+  {
+    this->SetNthInput(3, const_cast<TMaskImage*>(volume));
+  }
+
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  const TMaskImage*
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::GetRegionLabelMap() const
+  {
+    return dynamic_cast<const TMaskImage *>(this->ProcessObject::GetInput(3));
+  }
+
   template< class TInputImage, class TMaskImage, class TOutputImage >
   TOutputImage*
     ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
@@ -191,6 +246,95 @@ namespace itk
     return dynamic_cast<TOutputImage *>(this->ProcessObject::GetOutput(8));
   }
 
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  TInputImage*
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::GetParametricMapsOutput()
+  {
+    return dynamic_cast<TInputImage *>(this->ProcessObject::GetOutput(9));
+  }
+
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  TOutputImage*
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::GetIterationsOutput()
+  {
+    return dynamic_cast<TOutputImage *>(this->ProcessObject::GetOutput(10));
+  }
+
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  TOutputImage*
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::GetEvaluationsOutput()
+  {
+    return dynamic_cast<TOutputImage *>(this->ProcessObject::GetOutput(11));
+  }
+
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  TOutputImage*
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::GetFitTimeOutput()
+  {
+    return dynamic_cast<TOutputImage *>(this->ProcessObject::GetOutput(12));
+  }
+
+  template< class TInputImage, class TMaskImage, class TOutputImage >
+  const char*
+    ConcentrationToQuantitativeImageFilter< TInputImage, TMaskImage, TOutputImage >
+    ::GetParametricMapName(unsigned int component)
+  {
+    static const char* names[NumberOfParametricMaps] =
+    {
+      "Ktrans", "Ve", "fpv", "MaxSlope", "AUC", "RSquared", "BAT", "Diagnostics"
+    };
+    if (component >= NumberOfParametricMaps)
+    {
+      return "";
+    }
+    return names[component];
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::GenerateOutputInformation()
+  {
+    Superclass::GenerateOutputInformation();
+
+    // The vector outputs inherit the number of time points from the
+    // input; the parametric maps have a fixed number of components.
+    this->GetParametricMapsOutput()->SetNumberOfComponentsPerPixel(NumberOfParametricMaps);
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::AllocateOutputs()
+  {
+    typedef ImageBase<OutputVolumeDimension> ImageBaseType;
+
+    // Same as the superclass, except that optional outputs which were
+    // not requested are left unallocated.
+    for (unsigned int i = 0; i < this->GetNumberOfOutputs(); ++i)
+    {
+      if (i == 9 && !m_ComputeParametricMaps)
+      {
+        continue;
+      }
+      if (i >= 10 && i <= 12 && !m_ComputeFitCostMaps)
+      {
+        continue;
+      }
+
+      ImageBaseType* output = dynamic_cast<ImageBaseType *>(this->ProcessObject::GetOutput(i));
+      if (output)
+      {
+        output->SetBufferedRegion(output->GetRequestedRegion());
+        output->Allocate();
+      }
+    }
+  }
+
   template <class TInputImage, class TMaskImage, class TOutputImage>
   void
     ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
@@ -205,6 +349,7 @@ namespace itk
 
     int   aif_FirstPeakIndex = 0;
     float aif_MaxSlope = 0.0f;
+    const double aifStartTime = PkTimingReport::GetTime();
 
     // Some of the outputs are optional and may not be calculated.
     // Let's initialize those to all zeros
@@ -224,72 +369,1383 @@ namespace itk
       std::vector<float>::iterator pait = m_PrescribedAIF.begin();
       std::vector<float>::iterator ptit = m_PrescribedAIFTiming.begin();
 
-      std::vector<float>::iterator paitnext = pait;
-      paitnext++;
-      std::vector<float>::iterator ptitnext = ptit;
-      ptitnext++;
+      std::vector<float>::iterator paitnext = pait;
+      paitnext++;
+      std::vector<float>::iterator ptitnext = ptit;
+      ptitnext++;
+
+      for (; tit != m_Timing.end(); ++tit, ++ait)
+      {
+        // Three cases
+        // (1) extrapolate the aif on the low end of the range of prescribed timings
+        // (2) interpolate the aif
+        // (3) extrapolate the aif on the high end of the range of prescribed timings
+        //
+        // Case (1) is handled implictly by the initialization and conditionals.
+        if (*ptit <= *tit)
+        {
+          // Case (2) from above)
+          // find the prescribed times that straddle the current time to interpolate
+          while (*ptitnext < *tit && ptitnext != m_PrescribedAIFTiming.end())
+          {
+            ++ptit;
+            ++ptitnext;
+            ++pait;
+            ++paitnext;
+          }
+        }
+        if (ptitnext == m_PrescribedAIFTiming.end())
+        {
+          // we'll need to extrapolate (Case (3) from above)
+          ptitnext = ptit;
+          --ptit;
+          paitnext = pait;
+          --pait;
+        }
+
+        // interpolate aif;
+        float a;
+        a = *pait + ((*tit - *ptit) / (*ptitnext - *ptit)) * (*paitnext - *pait);
+        *ait = a;
+      }
+    }
+    else if (maskVolume && !m_UsePopulationAIF)
+    {
+      // calculate the AIF from the image using the data under the
+      // specified mask
+      m_AIF = this->CalculateAverageAIF(inputVectorVolume, maskVolume);
+    }
+    else if (m_UsePopulationAIF)
+    {
+      m_AIF = this->CalculatePopulationAIF(m_Timing, 0.1);
+    }
+    else
+    {
+      itkExceptionMacro("A mask image over which to establish the AIF or a prescribed AIF must be assigned. If prescribing an AIF, then UsePrescribedAIF must be set to true.");
+    }
+    // Compute the bolus arrival time
+    if (m_BATCalculationMode == "UseConstantBAT")
+    {
+      m_AIFBATIndex = m_constantBAT;
+    }
+    else if (m_BATCalculationMode == "PeakGradient")
+    {
+      compute_bolus_arrival_time(m_AIF.size(), &m_AIF[0], m_AIFBATIndex, aif_FirstPeakIndex, aif_MaxSlope);
+    }
+
+    // Compute the area under the curve for the AIF
+    m_aifAUC = area_under_curve(timeSize, &m_Timing[0], &m_AIF[0], m_AIFBATIndex, m_AUCTimeInterval);
+    if (m_TimingReport)
+    {
+      m_TimingReport->AddStep(PkTimingReport::AIFStage, "aif", PkTimingReport::GetTime() - aifStartTime);
+    }
+
+    m_PrescreenCounts.assign(this->GetNumberOfThreads(),
+      std::vector<SizeValueType>(NumberOfPrescreenTests, 0));
+    m_FitCounts.assign(this->GetNumberOfThreads(), 0);
+    m_RefitCounts.assign(this->GetNumberOfThreads(), 0);
+    m_IterationCounts.assign(this->GetNumberOfThreads(), 0);
+    m_EvaluationCounts.assign(this->GetNumberOfThreads(), 0);
+    m_FitCacheHits.assign(this->GetNumberOfThreads(), 0);
+    m_FitCacheMisses.assign(this->GetNumberOfThreads(), 0);
+
+    m_FitCache = 0;
+    if (m_UseFitCache)
+    {
+      m_FitCache = PkFitCache::New();
+      m_FitCache->SetMaximumNumberOfEntries(m_MaximumFitCacheEntries);
+    }
+
+    m_PyramidExcludedCounts.assign(this->GetNumberOfThreads(), 0);
+
+    m_RegionAccumulators.assign(this->GetNumberOfThreads(), RegionAccumulatorMapType());
+    m_RegionalFits.clear();
+
+    m_Checkpoint = 0;
+    m_NumberOfRestoredVoxels = 0;
+    if (!m_CheckpointFileName.empty())
+    {
+      if (this->GetRegionLabelMap())
+      {
+        itkWarningMacro("Checkpoints do not apply to regional fitting, " << m_CheckpointFileName << " is not used");
+      }
+      else
+      {
+        m_Checkpoint = PkCheckpoint::New();
+        m_Checkpoint->SetInterval(m_CheckpointInterval);
+        const bool resumed = m_Checkpoint->Open(m_CheckpointFileName, this->ComputeCheckpointKey(),
+          NumberOfCheckpointValues, m_ResumeFromCheckpoint);
+        if (m_Verbose && m_ResumeFromCheckpoint && !resumed)
+        {
+          std::cout << "Checkpoint: " << m_CheckpointFileName
+            << " is missing or was written for other inputs or settings, starting over" << std::endl;
+        }
+      }
+    }
+
+    // the voxelwise accelerations do not apply to regional fitting
+    if (!this->GetRegionLabelMap())
+    {
+      {
+        PkScopedTiming timing(m_TimingReport, PkTimingReport::FitStage, "clusters");
+        this->ComputeClusters();
+      }
+      {
+        PkScopedTiming timing(m_TimingReport, PkTimingReport::FitStage, "pyramid");
+        this->ComputeCoarseFits();
+      }
+    }
+
+    if (m_TimingReport)
+    {
+      m_TimingReport->SetNumberOfThreads(this->GetNumberOfThreads());
+      if (m_TimingReport->GetTraceRecorder())
+      {
+        m_TimingReport->GetTraceRecorder()->SetNumberOfThreads(this->GetNumberOfThreads());
+      }
+      m_ThreadBusySeconds.assign(this->GetNumberOfThreads(), 0.0);
+      m_ThreadedStartTime = PkTimingReport::GetTime();
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::AfterThreadedGenerateData()
+  {
+    const double threadedWallSeconds = PkTimingReport::GetTime() - m_ThreadedStartTime;
+
+    if (this->GetRegionLabelMap())
+    {
+      PkScopedTiming timing(m_TimingReport, PkTimingReport::FitStage, "regions");
+      this->FitRegions();
+    }
+
+    m_NumberOfPrescreenedVoxels.assign(NumberOfPrescreenTests, 0);
+    for (unsigned int t = 0; t < m_PrescreenCounts.size(); ++t)
+    {
+      for (unsigned int i = 0; i < NumberOfPrescreenTests; ++i)
+      {
+        m_NumberOfPrescreenedVoxels[i] += m_PrescreenCounts[t][i];
+      }
+    }
+
+    if (m_Verbose && (m_PrescreenPeakEnhancement > 0 || m_PrescreenMaxSlope > 0 || m_PrescreenSNR > 0))
+    {
+      std::cout << "Pre-screen rejected voxels: "
+        << m_NumberOfPrescreenedVoxels[PrescreenPeakEnhancementTest] << " peak enhancement, "
+        << m_NumberOfPrescreenedVoxels[PrescreenMaxSlopeTest] << " max slope, "
+        << m_NumberOfPrescreenedVoxels[PrescreenSNRTest] << " SNR" << std::endl;
+    }
+
+    m_NumberOfFittedVoxels = 0;
+    m_NumberOfRefitVoxels = 0;
+    m_NumberOfIterations = 0;
+    m_NumberOfEvaluations = 0;
+    m_NumberOfFitCacheHits = 0;
+    m_NumberOfFitCacheMisses = 0;
+    m_NumberOfPyramidExcludedVoxels = 0;
+    for (unsigned int t = 0; t < m_FitCounts.size(); ++t)
+    {
+      m_NumberOfFittedVoxels += m_FitCounts[t];
+      m_NumberOfRefitVoxels += m_RefitCounts[t];
+      m_NumberOfIterations += m_IterationCounts[t];
+      m_NumberOfEvaluations += m_EvaluationCounts[t];
+      m_NumberOfFitCacheHits += m_FitCacheHits[t];
+      m_NumberOfFitCacheMisses += m_FitCacheMisses[t];
+      m_NumberOfPyramidExcludedVoxels += m_PyramidExcludedCounts[t];
+    }
+
+    if (m_Verbose && m_TieredFitting)
+    {
+      std::cout << "Tiered fitting: " << m_NumberOfRefitVoxels << " of "
+        << m_NumberOfFittedVoxels << " fitted voxels were refit" << std::endl;
+    }
+    if (m_Verbose && m_NumberOfFittedVoxels > 0)
+    {
+      std::cout << "Mean optimizer iterations per fitted voxel: "
+        << (double)m_NumberOfIterations / m_NumberOfFittedVoxels << std::endl;
+      std::cout << "Mean cost function evaluations per fitted voxel: "
+        << (double)m_NumberOfEvaluations / m_NumberOfFittedVoxels << std::endl;
+    }
+    if (m_Verbose && m_ComputeFitCostMaps)
+    {
+      this->PrintFitCostHistogram("optimizer iterations", this->GetIterationsOutput());
+      this->PrintFitCostHistogram("cost function evaluations", this->GetEvaluationsOutput());
+      this->PrintFitCostHistogram("fit time (us)", this->GetFitTimeOutput());
+    }
+    if (m_FitCache)
+    {
+      if (m_Verbose)
+      {
+        std::cout << "Fit cache: " << m_NumberOfFitCacheHits << " hits, "
+          << m_NumberOfFitCacheMisses << " misses, "
+          << m_FitCache->GetNumberOfEntries() << " distinct curves" << std::endl;
+      }
+      if (m_TimingReport)
+      {
+        m_TimingReport->SetCounter("fitCacheHits", m_NumberOfFitCacheHits);
+        m_TimingReport->SetCounter("fitCacheMisses", m_NumberOfFitCacheMisses);
+      }
+      // the entries are only valid for this update
+      m_FitCache = 0;
+    }
+    if (m_Checkpoint)
+    {
+      m_NumberOfRestoredVoxels = m_Checkpoint->GetNumberOfRestoredVoxels();
+      if (m_Verbose && m_ResumeFromCheckpoint)
+      {
+        std::cout << "Checkpoint: " << m_NumberOfRestoredVoxels << " voxels restored from "
+          << m_CheckpointFileName << std::endl;
+      }
+      m_Checkpoint->Close();
+      m_Checkpoint = 0;
+    }
+    m_ClusterBATs.clear();
+    m_ClusterMaxSlopes.clear();
+    if (!m_CoarseFits.empty())
+    {
+      if (m_Verbose)
+      {
+        std::cout << "Pyramid: " << m_NumberOfPyramidExcludedVoxels
+          << " voxels excluded by background blocks" << std::endl;
+      }
+      if (m_TimingReport)
+      {
+        m_TimingReport->SetCounter("pyramidExcludedVoxels", m_NumberOfPyramidExcludedVoxels);
+      }
+      m_CoarseFits.clear();
+    }
+
+    if (m_TimingReport)
+    {
+      m_TimingReport->AddSection("quantification", threadedWallSeconds, m_ThreadBusySeconds,
+        m_NumberOfFittedVoxels);
+      m_TimingReport->SetCounter("fittedVoxels", m_NumberOfFittedVoxels);
+      m_TimingReport->SetCounter("optimizerIterations", m_NumberOfIterations);
+      m_TimingReport->SetCounter("costFunctionEvaluations", m_NumberOfEvaluations);
+      if (m_PrescreenPeakEnhancement > 0 || m_PrescreenMaxSlope > 0 || m_PrescreenSNR > 0)
+      {
+        m_TimingReport->SetCounter("prescreenLowEnhancementVoxels",
+          m_NumberOfPrescreenedVoxels[PrescreenPeakEnhancementTest]);
+        m_TimingReport->SetCounter("prescreenLowSlopeVoxels", m_NumberOfPrescreenedVoxels[PrescreenMaxSlopeTest]);
+        m_TimingReport->SetCounter("prescreenLowSNRVoxels", m_NumberOfPrescreenedVoxels[PrescreenSNRTest]);
+      }
+      if (m_TieredFitting)
+      {
+        m_TimingReport->SetCounter("refitVoxels", m_NumberOfRefitVoxels);
+      }
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  unsigned long long
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeCheckpointKey() const
+  {
+    const VectorVolumeType* input = this->GetInput();
+    unsigned long long key = PkCheckpoint::Hash(input->GetBufferPointer(),
+      input->GetPixelContainer()->Size() * sizeof(typename VectorVolumeType::InternalPixelType));
+    if (this->GetROIMask())
+    {
+      const MaskVolumeType* roi = this->GetROIMask();
+      key = PkCheckpoint::Hash(roi->GetBufferPointer(),
+        roi->GetPixelContainer()->Size() * sizeof(MaskVolumePixelType), key);
+    }
+    key = PkCheckpoint::Hash(&m_AIF[0], m_AIF.size() * sizeof(float), key);
+    key = PkCheckpoint::Hash(&m_Timing[0], m_Timing.size() * sizeof(float), key);
+
+    // the voxels are identified by their offset in the output buffer
+    const OutputVolumeRegionType region = const_cast<Self *>(this)->GetKTransOutput()->GetBufferedRegion();
+    for (unsigned int d = 0; d < OutputVolumeDimension; ++d)
+    {
+      const double extent[2] = { static_cast<double>(region.GetIndex()[d]), static_cast<double>(region.GetSize()[d]) };
+      key = PkCheckpoint::Hash(extent, sizeof(extent), key);
+    }
+
+    const double settings[] =
+    {
+      m_fTol, m_gTol, m_xTol, m_epsilon, static_cast<double>(m_maxIter), m_hematocrit,
+      m_AUCTimeInterval, static_cast<double>(m_ModelType), static_cast<double>(m_MaskByRSquared),
+      m_PrescreenPeakEnhancement, m_PrescreenMaxSlope, m_PrescreenSNR,
+      static_cast<double>(m_TieredFitting), m_TieredToleranceScale, static_cast<double>(m_TieredMaxIter),
+      m_RefitRSquaredThreshold, static_cast<double>(m_BoundedFitting),
+      static_cast<double>(m_NumberOfClusters), static_cast<double>(m_ClusterRefineIterations),
+      static_cast<double>(m_PyramidFactor), static_cast<double>(m_constantBAT),
+      static_cast<double>(m_UseFitCache), static_cast<double>(NumberOfCheckpointValues)
+    };
+    key = PkCheckpoint::Hash(settings, sizeof(settings), key);
+    return PkCheckpoint::Hash(m_BATCalculationMode.c_str(), m_BATCalculationMode.size(), key);
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::PrintFitCostHistogram(const char* name, TOutputImage* image) const
+  {
+    // bin 0 holds zero, bin b > 0 holds [2^(b-1), 2^b)
+    std::vector<SizeValueType> bins;
+    OutputVolumeConstIterType costIter(image, image->GetRequestedRegion());
+    OutputVolumeConstIterType diagIter(const_cast<Self *>(this)->GetOptimizerDiagnosticsOutput(),
+      image->GetRequestedRegion());
+    for (; !costIter.IsAtEnd(); ++costIter, ++diagIter)
+    {
+      if (diagIter.Get() == -1)
+      {
+        continue;
+      }
+      unsigned long value = static_cast<unsigned long>(std::max<OutputVolumePixelType>(costIter.Get(), 0));
+      unsigned int bin = 0;
+      while (value)
+      {
+        value >>= 1;
+        ++bin;
+      }
+      if (bin >= bins.size())
+      {
+        bins.resize(bin + 1, 0);
+      }
+      ++bins[bin];
+    }
+
+    std::cout << "Histogram of " << name << " per voxel:" << std::endl;
+    for (unsigned int b = 0; b < bins.size(); ++b)
+    {
+      if (b == 0)
+      {
+        std::cout << "  0: ";
+      }
+      else
+      {
+        std::cout << "  " << (1UL << (b - 1)) << "-" << (1UL << b) - 1 << ": ";
+      }
+      std::cout << bins[b] << std::endl;
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  unsigned int
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::FitCurve(const std::vector<float>& timeMinute, const VectorVoxelType& curve,
+    float& Ktrans, float& Ve, float& Fpv, double& rms,
+    LevenbergMarquardtOptimizer* optimizer, LMCostFunction* costFunction,
+    unsigned int threadId, const float* initialParameters, int shift)
+  {
+    const int timeSize = (int)curve.GetSize();
+    const float* curveData = curve.GetDataPointer();
+    ++m_FitCounts[threadId];
+    unsigned iterations = 0, evaluations = 0;
+
+    if (!m_ClusterFits.empty())
+    {
+      std::vector<float> features(m_ClusterFeatureSize);
+      this->ComputeClusterFeatures(curve, &features[0]);
+      const ClusterFit& clusterFit = m_ClusterFits[this->FindNearestCluster(&features[0], m_ClusterFits.size())];
+
+      if (m_ClusterRefineIterations > 0)
+      {
+        // warm start from the cluster's parameters
+        const float start[3] = { clusterFit.Ktrans, std::max(clusterFit.Ve, 0.01f), clusterFit.Fpv };
+        unsigned int code = pk_solver(timeSize, &timeMinute[0], curveData, &m_AIF[0],
+          Ktrans, Ve, Fpv,
+          m_fTol, m_gTol, m_xTol,
+          m_epsilon, m_ClusterRefineIterations, m_hematocrit,
+          optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode,
+          start, m_BoundedFitting, &iterations, &evaluations);
+        rms = optimizer->GetOptimizer()->get_end_error();
+        m_IterationCounts[threadId] += iterations;
+        m_EvaluationCounts[threadId] += evaluations;
+        return code;
+      }
+
+      Ktrans = clusterFit.Ktrans;
+      Ve = clusterFit.Ve;
+      Fpv = clusterFit.Fpv;
+      rms = this->ComputeFitRMS(timeMinute, curve, Ktrans, Ve, Fpv, costFunction);
+      return clusterFit.Code;
+    }
+
+    if (!m_TieredFitting)
+    {
+      unsigned int code = pk_solver(timeSize, &timeMinute[0], curveData, &m_AIF[0],
+        Ktrans, Ve, Fpv,
+        m_fTol, m_gTol, m_xTol,
+        m_epsilon, m_maxIter, m_hematocrit,
+        optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode,
+        initialParameters, m_BoundedFitting, &iterations, &evaluations);
+      rms = optimizer->GetOptimizer()->get_end_error();
+      m_IterationCounts[threadId] += iterations;
+      m_EvaluationCounts[threadId] += evaluations;
+      return code;
+    }
+
+    // First tier: loose tolerances and few iterations
+    unsigned int code = pk_solver(timeSize, &timeMinute[0], curveData, &m_AIF[0],
+      Ktrans, Ve, Fpv,
+      m_fTol * m_TieredToleranceScale, m_gTol * m_TieredToleranceScale, m_xTol * m_TieredToleranceScale,
+      m_epsilon, m_TieredMaxIter, m_hematocrit,
+      optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode,
+      initialParameters, m_BoundedFitting, &iterations, &evaluations);
+    rms = optimizer->GetOptimizer()->get_end_error();
+    m_IterationCounts[threadId] += iterations;
+    m_EvaluationCounts[threadId] += evaluations;
+
+    if ((code & 0x0F) != TOO_MANY_ITERATIONS
+      && !(code & (KTRANS_CLAMPED | VE_CLAMPED))
+      && this->ComputeFitRSquared(Ktrans, Ve, Fpv, shift, rms, costFunction) >= m_RefitRSquaredThreshold)
+    {
+      return code;
+    }
+
+    // Second tier: regular tolerances, starting from the first estimate
+    // (kept away from Ve = 0 where the model is singular) and from a few
+    // alternative points spread over the physiological range
+    ++m_RefitCounts[threadId];
+    const unsigned int numberOfStarts = 4;
+    float starts[numberOfStarts][3] =
+    {
+      { Ktrans, std::max(Ve, 0.01f), Fpv },
+      { 0.02f, 0.2f, 0.02f },
+      { 0.5f, 0.8f, 0.05f },
+      { 1.5f, 0.4f, 0.1f }
+    };
+    for (unsigned int s = 0; s < numberOfStarts; ++s)
+    {
+      float refitKtrans = 0.0f, refitVe = 0.0f, refitFpv = 0.0f;
+      unsigned int refitCode = pk_solver(timeSize, &timeMinute[0], curveData, &m_AIF[0],
+        refitKtrans, refitVe, refitFpv,
+        m_fTol, m_gTol, m_xTol,
+        m_epsilon, m_maxIter, m_hematocrit,
+        optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode,
+        starts[s], m_BoundedFitting, &iterations, &evaluations);
+      double refitRMS = optimizer->GetOptimizer()->get_end_error();
+      m_IterationCounts[threadId] += iterations;
+      m_EvaluationCounts[threadId] += evaluations;
+      if (refitRMS < rms)
+      {
+        Ktrans = refitKtrans;
+        Ve = refitVe;
+        Fpv = refitFpv;
+        rms = refitRMS;
+        code = refitCode;
+      }
+    }
+    return code;
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  double
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeFitRMS(const std::vector<float>& timeMinute, const VectorVoxelType& curve,
+    float Ktrans, float Ve, float Fpv, LMCostFunction* costFunction) const
+  {
+    const int timeSize = (int)curve.GetSize();
+    costFunction->SetNumberOfValues(timeSize);
+    costFunction->SetCb(&m_AIF[0], timeSize);
+    costFunction->SetCv(curve.GetDataPointer(), timeSize);
+    costFunction->SetTime(&timeMinute[0], timeSize);
+    costFunction->SetHematocrit(m_hematocrit);
+    costFunction->SetModelType(m_ModelType);
+    costFunction->SetUseBounds(false);
+
+    LMCostFunction::ParametersType param(costFunction->GetNumberOfParameters());
+    param[0] = Ktrans;
+    param[1] = Ve;
+    if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+    {
+      param[2] = Fpv;
+    }
+    LMCostFunction::MeasureType residuals = costFunction->GetValue(param);
+
+    double sumSquared = 0.0;
+    for (unsigned int i = 0; i < residuals.size(); ++i)
+    {
+      sumSquared += residuals[i] * residuals[i];
+    }
+    return sqrt(sumSquared / residuals.size());
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  bool
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::AlignCurveToAIF(const VectorVoxelType& curve, VectorVoxelType& aligned,
+    int& BATIndex, float& maxSlope) const
+  {
+    int FirstPeakIndex = 0;
+    BATIndex = 0;
+    maxSlope = 0.0f;
+    if (m_BATCalculationMode == "UseConstantBAT")
+    {
+      BATIndex = m_constantBAT;
+    }
+    else if (!compute_bolus_arrival_time(curve.GetSize(), curve.GetDataPointer(), BATIndex, FirstPeakIndex, maxSlope))
+    {
+      return false;
+    }
+
+    const int shift = m_AIFBATIndex - BATIndex;
+    if (shift > 0)
+    {
+      return false;
+    }
+
+    aligned.SetSize(curve.GetSize());
+    aligned.Fill(0.0);
+    for (int i = 0; i < (int)curve.GetSize() + shift; ++i)
+    {
+      aligned[i] = curve[i - shift];
+    }
+    return true;
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeClusterFeatures(const VectorVoxelType& curve, float* features) const
+  {
+    // average the curve over equal bins of time points
+    const unsigned int size = curve.GetSize();
+    for (unsigned int f = 0; f < m_ClusterFeatureSize; ++f)
+    {
+      const unsigned int begin = f * size / m_ClusterFeatureSize;
+      const unsigned int end = (f + 1) * size / m_ClusterFeatureSize;
+      float sum = 0.0f;
+      for (unsigned int i = begin; i < end; ++i)
+      {
+        sum += curve[i];
+      }
+      features[f] = sum / (end - begin);
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  unsigned int
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::FindNearestCluster(const float* features, unsigned int numberOfClusters) const
+  {
+    unsigned int nearest = 0;
+    float nearestDistance = NumericTraits<float>::max();
+    for (unsigned int c = 0; c < numberOfClusters; ++c)
+    {
+      const float* centroid = &m_ClusterCentroids[c * m_ClusterFeatureSize];
+      float distance = 0.0f;
+      for (unsigned int f = 0; f < m_ClusterFeatureSize; ++f)
+      {
+        distance += (features[f] - centroid[f]) * (features[f] - centroid[f]);
+      }
+      if (distance < nearestDistance)
+      {
+        nearestDistance = distance;
+        nearest = c;
+      }
+    }
+    return nearest;
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeClusters()
+  {
+    m_ClusterCentroids.clear();
+    m_ClusterFits.clear();
+    m_ClusterBATs.clear();
+    m_ClusterMaxSlopes.clear();
+    if (m_NumberOfClusters == 0)
+    {
+      return;
+    }
+
+    const unsigned int timeSize = this->GetInput()->GetNumberOfComponentsPerPixel();
+    m_ClusterFeatureSize = std::min(16u, timeSize);
+    const unsigned int featureSize = m_ClusterFeatureSize;
+
+    // Find the BAT and the features of the aligned curve of the voxels
+    // that would be fit, in parallel over slabs of the volume. The slabs
+    // are in raster order, so the features are in the same order for
+    // any number of threads.
+    const SizeValueType numberOfVoxels = this->GetKTransOutput()->GetBufferedRegion().GetNumberOfPixels();
+    m_ClusterBATs.assign(numberOfVoxels, -1);
+    m_ClusterMaxSlopes.assign(numberOfVoxels, 0.0f);
+    m_ClusterThreadFeatures.assign(this->GetNumberOfThreads(), std::vector<float>());
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads(this->GetNumberOfThreads());
+    threader->SetSingleMethod(Self::ClusterThreaderCallback, this);
+    m_ClusterPass = ClusterFeaturePass;
+    threader->SingleMethodExecute();
+
+    std::vector<float> features;
+    for (unsigned int t = 0; t < m_ClusterThreadFeatures.size(); ++t)
+    {
+      features.insert(features.end(), m_ClusterThreadFeatures[t].begin(), m_ClusterThreadFeatures[t].end());
+    }
+    m_ClusterThreadFeatures.clear();
+
+    const unsigned int numberOfCurves = features.size() / featureSize;
+    if (numberOfCurves == 0)
+    {
+      return;
+    }
+    const unsigned int numberOfClusters = std::min(m_NumberOfClusters, numberOfCurves);
+
+    // Mini-batch k-means, seeded with evenly spaced curves. A fixed
+    // seed keeps the clustering, and the results, reproducible.
+    m_ClusterCentroids.resize(numberOfClusters * featureSize);
+    for (unsigned int c = 0; c < numberOfClusters; ++c)
+    {
+      const unsigned int seed = (unsigned int)(((unsigned long long)c * numberOfCurves) / numberOfClusters);
+      std::copy(&features[seed * featureSize], &features[seed * featureSize] + featureSize,
+        &m_ClusterCentroids[c * featureSize]);
+    }
+
+    typedef Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+    GeneratorType::Pointer generator = GeneratorType::New();
+    generator->Initialize(1);
+
+    const unsigned int numberOfIterations = 50;
+    const unsigned int batchSize = std::min(numberOfCurves, std::max(1024u, 4 * numberOfClusters));
+    std::vector<unsigned int> batch(batchSize);
+    std::vector<unsigned int> labels(batchSize);
+    std::vector<SizeValueType> updates(numberOfClusters, 0);
+    for (unsigned int iteration = 0; iteration < numberOfIterations; ++iteration)
+    {
+      for (unsigned int b = 0; b < batchSize; ++b)
+      {
+        batch[b] = generator->GetIntegerVariate(numberOfCurves - 1);
+        labels[b] = this->FindNearestCluster(&features[batch[b] * featureSize], numberOfClusters);
+      }
+      for (unsigned int b = 0; b < batchSize; ++b)
+      {
+        // per-centroid learning rate decreasing with its number of updates
+        const unsigned int c = labels[b];
+        const float rate = 1.0f / ++updates[c];
+        const float* x = &features[batch[b] * featureSize];
+        float* centroid = &m_ClusterCentroids[c * featureSize];
+        for (unsigned int f = 0; f < featureSize; ++f)
+        {
+          centroid[f] += rate * (x[f] - centroid[f]);
+        }
+      }
+    }
+
+    // Mean full resolution curve of each cluster, summed in parallel
+    // from the input and the BATs of the first pass
+    m_NumberOfClusterCentroids = numberOfClusters;
+    m_ClusterThreadSums.assign(this->GetNumberOfThreads(), std::vector<double>(numberOfClusters * timeSize, 0.0));
+    m_ClusterThreadMembers.assign(this->GetNumberOfThreads(), std::vector<SizeValueType>(numberOfClusters, 0));
+    m_ClusterPass = ClusterSumPass;
+    threader->SingleMethodExecute();
+
+    std::vector<double> sums(numberOfClusters * timeSize, 0.0);
+    std::vector<SizeValueType> members(numberOfClusters, 0);
+    for (unsigned int t = 0; t < m_ClusterThreadSums.size(); ++t)
+    {
+      for (unsigned int c = 0; c < numberOfClusters; ++c)
+      {
+        members[c] += m_ClusterThreadMembers[t][c];
+        for (unsigned int i = 0; i < timeSize; ++i)
+        {
+          sums[c * timeSize + i] += m_ClusterThreadSums[t][c * timeSize + i];
+        }
+      }
+    }
+    m_ClusterThreadSums.clear();
+    m_ClusterThreadMembers.clear();
+
+    // Fit each non-empty cluster's mean curve
+    std::vector<float> timeMinute(m_Timing.size());
+    for (unsigned int i = 0; i < timeMinute.size(); i++)
+    {
+      timeMinute[i] = m_Timing[i] / 60.0;
+    }
+    itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
+    LMCostFunction::Pointer costFunction = LMCostFunction::New();
+
+    std::vector<float> centroids;
+    std::vector<float> meanCurve(timeSize);
+    for (unsigned int c = 0; c < numberOfClusters; ++c)
+    {
+      if (members[c] == 0)
+      {
+        continue;
+      }
+      for (unsigned int i = 0; i < timeSize; ++i)
+      {
+        meanCurve[i] = sums[c * timeSize + i] / members[c];
+      }
+
+      ClusterFit fit;
+      fit.Ktrans = fit.Ve = fit.Fpv = 0.0f;
+      fit.Code = pk_solver(timeSize, &timeMinute[0], &meanCurve[0], &m_AIF[0],
+        fit.Ktrans, fit.Ve, fit.Fpv,
+        m_fTol, m_gTol, m_xTol,
+        m_epsilon, m_maxIter, m_hematocrit,
+        optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode,
+        0, m_BoundedFitting);
+      m_ClusterFits.push_back(fit);
+      centroids.insert(centroids.end(), &m_ClusterCentroids[c * featureSize],
+        &m_ClusterCentroids[c * featureSize] + featureSize);
+    }
+    m_ClusterCentroids.swap(centroids);
+
+    if (m_Verbose)
+    {
+      std::cout << "Clustered fitting: " << numberOfCurves << " curves in "
+        << m_ClusterFits.size() << " clusters" << std::endl;
+    }
+    if (m_TimingReport)
+    {
+      m_TimingReport->SetCounter("clusters", m_ClusterFits.size());
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  ITK_THREAD_RETURN_TYPE
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ClusterThreaderCallback(void* arg)
+  {
+    MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+    Self* filter = static_cast<Self *>(info->UserData);
+    const ThreadIdType threadId = info->ThreadID;
+
+    OutputVolumeRegionType region;
+    if (threadId >= filter->SplitRequestedRegion(threadId, info->NumberOfThreads, region))
+    {
+      return ITK_THREAD_RETURN_VALUE;
+    }
+
+    const VectorVolumeType* inputVectorVolume = filter->GetInput();
+    const MaskVolumeType* roiMaskVolume = filter->GetROIMask();
+    const OutputVolumeType* ktransVolume = filter->GetKTransOutput();
+    const unsigned int timeSize = inputVectorVolume->GetNumberOfComponentsPerPixel();
+
+    std::vector<float> features(filter->m_ClusterFeatureSize);
+    VectorVoxelType aligned(timeSize);
+    VectorVolumeConstIterType inputVectorVolumeIter(inputVectorVolume, region);
+    MaskVolumeConstIterType roiMaskVolumeIter;
+    if (roiMaskVolume)
+    {
+      roiMaskVolumeIter = MaskVolumeConstIterType(roiMaskVolume, region);
+    }
+    for (; !inputVectorVolumeIter.IsAtEnd(); ++inputVectorVolumeIter)
+    {
+      const bool inROI = !roiMaskVolume || roiMaskVolumeIter.Get();
+      if (roiMaskVolume)
+      {
+        ++roiMaskVolumeIter;
+      }
+      if (!inROI)
+      {
+        continue;
+      }
+
+      const SizeValueType offset = ktransVolume->ComputeOffset(inputVectorVolumeIter.GetIndex());
+      const VectorVoxelType vectorVoxel = inputVectorVolumeIter.Get();
+      if (filter->m_ClusterPass == ClusterFeaturePass)
+      {
+        if (filter->PrescreenCurve(vectorVoxel) != NumberOfPrescreenTests)
+        {
+          continue;
+        }
+        int BATIndex = 0, FirstPeakIndex = 0;
+        float maxSlope = 0.0f;
+        if (filter->m_BATCalculationMode == "UseConstantBAT")
+        {
+          BATIndex = filter->m_constantBAT;
+        }
+        else if (!compute_bolus_arrival_time(timeSize, vectorVoxel.GetDataPointer(), BATIndex, FirstPeakIndex, maxSlope))
+        {
+          BATIndex = -1;
+        }
+        filter->m_ClusterBATs[offset] = BATIndex;
+        filter->m_ClusterMaxSlopes[offset] = maxSlope;
+      }
+
+      // the voxels that are fit: BAT found, and not before the AIF's
+      const int shift = filter->m_AIFBATIndex - filter->m_ClusterBATs[offset];
+      if (filter->m_ClusterBATs[offset] < 0 || shift > 0)
+      {
+        continue;
+      }
+      aligned.Fill(0.0);
+      for (int i = 0; i < (int)timeSize + shift; ++i)
+      {
+        aligned[i] = vectorVoxel[i - shift];
+      }
+
+      filter->ComputeClusterFeatures(aligned, &features[0]);
+      if (filter->m_ClusterPass == ClusterFeaturePass)
+      {
+        filter->m_ClusterThreadFeatures[threadId].insert(filter->m_ClusterThreadFeatures[threadId].end(),
+          features.begin(), features.end());
+      }
+      else
+      {
+        const unsigned int c = filter->FindNearestCluster(&features[0], filter->m_NumberOfClusterCentroids);
+        ++filter->m_ClusterThreadMembers[threadId][c];
+        double* sum = &filter->m_ClusterThreadSums[threadId][c * timeSize];
+        for (unsigned int i = 0; i < timeSize; ++i)
+        {
+          sum[i] += aligned[i];
+        }
+      }
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeCoarseFits()
+  {
+    m_CoarseFits.clear();
+    m_CoarseCurves.clear();
+    if (m_PyramidFactor <= 1)
+    {
+      return;
+    }
+
+    const VectorVolumeType* inputVectorVolume = this->GetInput();
+    const MaskVolumeType* roiMaskVolume = this->GetROIMask();
+    const OutputVolumeRegionType region = this->GetOutput()->GetRequestedRegion();
+    const unsigned int timeSize = inputVectorVolume->GetNumberOfComponentsPerPixel();
+
+    m_CoarseGridIndex = region.GetIndex();
+    SizeValueType numberOfBlocks = 1;
+    for (unsigned int d = 0; d < OutputVolumeDimension; ++d)
+    {
+      m_CoarseGridSize[d] = (region.GetSize()[d] + m_PyramidFactor - 1) / m_PyramidFactor;
+      numberOfBlocks *= m_CoarseGridSize[d];
+    }
+
+    // Sum the ROI curves of each block
+    std::vector<SizeValueType> members(numberOfBlocks, 0);
+    m_CoarseCurves.assign(numberOfBlocks, std::vector<float>());
+    VectorVolumeConstIterType inputVectorVolumeIter(inputVectorVolume, region);
+    MaskVolumeConstIterType roiMaskVolumeIter;
+    if (roiMaskVolume)
+    {
+      roiMaskVolumeIter = MaskVolumeConstIterType(roiMaskVolume, region);
+    }
+    for (; !inputVectorVolumeIter.IsAtEnd(); ++inputVectorVolumeIter)
+    {
+      const bool inROI = !roiMaskVolume || roiMaskVolumeIter.Get();
+      if (roiMaskVolume)
+      {
+        ++roiMaskVolumeIter;
+      }
+      if (!inROI)
+      {
+        continue;
+      }
+
+      const OutputVolumeIndexType index = inputVectorVolumeIter.GetIndex();
+      SizeValueType block = 0;
+      for (int d = OutputVolumeDimension - 1; d >= 0; --d)
+      {
+        block = block * m_CoarseGridSize[d] + (index[d] - m_CoarseGridIndex[d]) / m_PyramidFactor;
+      }
+
+      std::vector<float>& sum = m_CoarseCurves[block];
+      if (sum.empty())
+      {
+        sum.assign(timeSize, 0.0f);
+      }
+      const VectorVoxelType curve = inputVectorVolumeIter.Get();
+      for (unsigned int i = 0; i < timeSize; ++i)
+      {
+        sum[i] += curve[i];
+      }
+      ++members[block];
+    }
+
+    for (SizeValueType block = 0; block < numberOfBlocks; ++block)
+    {
+      for (unsigned int i = 0; i < m_CoarseCurves[block].size(); ++i)
+      {
+        m_CoarseCurves[block][i] /= members[block];
+      }
+    }
+
+    // Fit the block means in parallel
+    CoarseFit empty;
+    empty.Status = CoarseFit::Empty;
+    empty.Ktrans = empty.Ve = empty.Fpv = 0.0f;
+    m_CoarseFits.assign(numberOfBlocks, empty);
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads(this->GetNumberOfThreads());
+    threader->SetSingleMethod(Self::CoarseFitThreaderCallback, this);
+    threader->SingleMethodExecute();
+
+    // the mean curves are not needed once fit
+    m_CoarseCurves.clear();
+
+    SizeValueType counts[4] = { 0, 0, 0, 0 };
+    for (SizeValueType block = 0; block < numberOfBlocks; ++block)
+    {
+      ++counts[m_CoarseFits[block].Status];
+    }
+    if (m_Verbose)
+    {
+      std::cout << "Pyramid: " << counts[CoarseFit::Fitted] << " blocks fit, "
+        << counts[CoarseFit::Background] << " background, "
+        << counts[CoarseFit::Failed] << " failed, on a coarse grid of "
+        << m_CoarseGridSize[0] << "x" << m_CoarseGridSize[1] << "x" << m_CoarseGridSize[2]
+        << std::endl;
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  ITK_THREAD_RETURN_TYPE
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::CoarseFitThreaderCallback(void* arg)
+  {
+    MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+    Self* filter = static_cast<Self *>(info->UserData);
+
+    itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
+    LMCostFunction::Pointer costFunction = LMCostFunction::New();
+
+    std::vector<float> timeMinute(filter->m_Timing.size());
+    for (unsigned int i = 0; i < timeMinute.size(); i++)
+    {
+      timeMinute[i] = filter->m_Timing[i] / 60.0;
+    }
+
+    // blocks are interleaved between the threads to balance the load
+    // of the ROI, which is usually in the middle of the volume
+    VectorVoxelType curve, aligned;
+    for (SizeValueType block = info->ThreadID; block < filter->m_CoarseFits.size(); block += info->NumberOfThreads)
+    {
+      const std::vector<float>& mean = filter->m_CoarseCurves[block];
+      if (mean.empty())
+      {
+        continue;
+      }
+      CoarseFit& fit = filter->m_CoarseFits[block];
+
+      curve.SetSize(mean.size());
+      for (unsigned int i = 0; i < mean.size(); ++i)
+      {
+        curve[i] = mean[i];
+      }
+
+      int BATIndex = 0;
+      float maxSlope = 0.0f;
+      if (!filter->AlignCurveToAIF(curve, aligned, BATIndex, maxSlope))
+      {
+        fit.Status = CoarseFit::Failed;
+        continue;
+      }
+
+      // a block is background if its mean curve does not rise above its
+      // baseline, or fails the pre-screen
+      float baseline = 0.0f, peak = -NumericTraits<float>::max();
+      for (int i = 0; i < (int)curve.GetSize(); ++i)
+      {
+        if (i < std::max(BATIndex, 1))
+        {
+          baseline += curve[i] / std::max(BATIndex, 1);
+        }
+        else
+        {
+          peak = std::max(peak, curve[i]);
+        }
+      }
+      if (peak <= baseline
+        || filter->PrescreenCurve(curve) != NumberOfPrescreenTests)
+      {
+        fit.Status = CoarseFit::Background;
+        continue;
+      }
+
+      pk_solver(aligned.GetSize(), &timeMinute[0], aligned.GetDataPointer(), &filter->m_AIF[0],
+        fit.Ktrans, fit.Ve, fit.Fpv,
+        filter->m_fTol, filter->m_gTol, filter->m_xTol,
+        filter->m_epsilon, filter->m_maxIter, filter->m_hematocrit,
+        optimizer, costFunction, filter->m_ModelType, filter->m_constantBAT, filter->m_BATCalculationMode,
+        0, filter->m_BoundedFitting);
+      fit.Status = CoarseFit::Fitted;
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  const typename ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>::CoarseFit&
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::GetCoarseFit(const OutputVolumeIndexType& index) const
+  {
+    SizeValueType block = 0;
+    for (int d = OutputVolumeDimension - 1; d >= 0; --d)
+    {
+      block = block * m_CoarseGridSize[d] + (index[d] - m_CoarseGridIndex[d]) / m_PyramidFactor;
+    }
+    return m_CoarseFits[block];
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::AccumulateRegionCurves(const OutputVolumeRegionType& region, unsigned int threadId)
+  {
+    const VectorVolumeType* inputVectorVolume = this->GetInput();
+    const unsigned int timeSize = inputVectorVolume->GetNumberOfComponentsPerPixel();
+    RegionAccumulatorMapType& accumulators = m_RegionAccumulators[threadId];
+
+    VectorVolumeConstIterType inputVectorVolumeIter(inputVectorVolume, region);
+    MaskVolumeConstIterType labelIter(this->GetRegionLabelMap(), region);
+    MaskVolumeConstIterType roiMaskVolumeIter;
+    if (this->GetROIMask())
+    {
+      roiMaskVolumeIter = MaskVolumeConstIterType(this->GetROIMask(), region);
+    }
+
+    ProgressReporter progress(this, threadId, region.GetNumberOfPixels());
+
+    // the previous voxel's label is usually the same, avoid the lookup
+    long currentLabel = 0;
+    RegionAccumulator* accumulator = 0;
+    for (; !inputVectorVolumeIter.IsAtEnd(); ++inputVectorVolumeIter, ++labelIter)
+    {
+      const long label = static_cast<long>(labelIter.Get());
+      const bool inROI = !this->GetROIMask() || roiMaskVolumeIter.Get();
+      if (this->GetROIMask())
+      {
+        ++roiMaskVolumeIter;
+      }
+      progress.CompletedPixel();
+      if (label == 0 || !inROI)
+      {
+        continue;
+      }
+
+      if (!accumulator || label != currentLabel)
+      {
+        accumulator = &accumulators[label];
+        if (accumulator->Sum.empty())
+        {
+          accumulator->Sum.assign(timeSize, 0.0);
+          accumulator->NumberOfVoxels = 0;
+        }
+        currentLabel = label;
+      }
+
+      const VectorVoxelType curve = inputVectorVolumeIter.Get();
+      for (unsigned int i = 0; i < timeSize; ++i)
+      {
+        accumulator->Sum[i] += curve[i];
+      }
+      ++accumulator->NumberOfVoxels;
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  void
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::FitRegions()
+  {
+    const unsigned int timeSize = this->GetInput()->GetNumberOfComponentsPerPixel();
+
+    // Sum the threads' accumulators
+    RegionAccumulatorMapType regions;
+    for (unsigned int t = 0; t < m_RegionAccumulators.size(); ++t)
+    {
+      for (typename RegionAccumulatorMapType::const_iterator it = m_RegionAccumulators[t].begin();
+        it != m_RegionAccumulators[t].end(); ++it)
+      {
+        RegionAccumulator& region = regions[it->first];
+        if (region.Sum.empty())
+        {
+          region.Sum.assign(timeSize, 0.0);
+          region.NumberOfVoxels = 0;
+        }
+        for (unsigned int i = 0; i < timeSize; ++i)
+        {
+          region.Sum[i] += it->second.Sum[i];
+        }
+        region.NumberOfVoxels += it->second.NumberOfVoxels;
+      }
+    }
+    m_RegionAccumulators.clear();
+
+    std::vector<float> timeMinute(m_Timing.size());
+    for (unsigned int i = 0; i < timeMinute.size(); i++)
+    {
+      timeMinute[i] = m_Timing[i] / 60.0;
+    }
+    itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
+    LMCostFunction::Pointer costFunction = LMCostFunction::New();
+
+    // Fit the mean curve of each region, keeping the fitted curves
+    // (realigned with the region's BAT) to paint the fitted output
+    std::map<long, unsigned int> fitIndex;
+    std::vector<VectorVoxelType> fittedCurves;
+    VectorVoxelType curve(timeSize), aligned(timeSize);
+    for (typename RegionAccumulatorMapType::const_iterator it = regions.begin(); it != regions.end(); ++it)
+    {
+      for (unsigned int i = 0; i < timeSize; ++i)
+      {
+        curve[i] = it->second.Sum[i] / it->second.NumberOfVoxels;
+      }
+
+      RegionalFit fit;
+      fit.Label = it->first;
+      fit.NumberOfVoxels = it->second.NumberOfVoxels;
+      fit.Ktrans = fit.Ve = fit.Fpv = fit.MaxSlope = fit.AUC = fit.RSquared = fit.BAT = 0.0f;
+      VectorVoxelType fitted(timeSize);
+      fitted.Fill(0.0);
+
+      int BATIndex = 0;
+      if (!this->AlignCurveToAIF(curve, aligned, BATIndex, fit.MaxSlope))
+      {
+        fit.Diagnostics = BAT_DETECTION_FAILED;
+      }
+      else
+      {
+        fit.BAT = BATIndex;
+        fit.Diagnostics = pk_solver(timeSize, &timeMinute[0], aligned.GetDataPointer(), &m_AIF[0],
+          fit.Ktrans, fit.Ve, fit.Fpv,
+          m_fTol, m_gTol, m_xTol,
+          m_epsilon, m_maxIter, m_hematocrit,
+          optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode,
+          0, m_BoundedFitting);
+        const double rms = optimizer->GetOptimizer()->get_end_error();
+        if (m_ModelType != itk::LMCostFunction::TOFTS_3_PARAMETER)
+        {
+          fit.Fpv = 0.0f;
+        }
+
+        itk::LMCostFunction::ParametersType param(costFunction->GetNumberOfParameters());
+        param[0] = fit.Ktrans;
+        param[1] = fit.Ve;
+        if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+        {
+          param[2] = fit.Fpv;
+        }
+        itk::LMCostFunction::MeasureType measure = costFunction->GetFittedFunction(param);
+        const int shift = m_AIFBATIndex - BATIndex;
+        for (int i = -shift; i < (int)timeSize; ++i)
+        {
+          fitted[i] = measure[i + shift];
+        }
+        fit.RSquared = this->ComputeRSquared(fitted, rms);
+        fit.AUC = area_under_curve(timeSize, &m_Timing[0], fitted.GetDataPointer(), BATIndex, m_AUCTimeInterval) / m_aifAUC;
+      }
+
+      fitIndex[fit.Label] = m_RegionalFits.size();
+      m_RegionalFits.push_back(fit);
+      fittedCurves.push_back(fitted);
+    }
+
+    // Paint the regional results over the voxels of each label
+    const OutputVolumeRegionType outputRegion = this->GetKTransOutput()->GetRequestedRegion();
+    OutputVolumeIterType ktransVolumeIter(this->GetKTransOutput(), outputRegion);
+    OutputVolumeIterType veVolumeIter(this->GetVEOutput(), outputRegion);
+    OutputVolumeIterType fpvVolumeIter(this->GetFPVOutput(), outputRegion);
+    OutputVolumeIterType maxSlopeVolumeIter(this->GetMaxSlopeOutput(), outputRegion);
+    OutputVolumeIterType aucVolumeIter(this->GetAUCOutput(), outputRegion);
+    OutputVolumeIterType rsqVolumeIter(this->GetRSquaredOutput(), outputRegion);
+    OutputVolumeIterType batVolumeIter(this->GetBATOutput(), outputRegion);
+    OutputVolumeIterType diagVolumeIter(this->GetOptimizerDiagnosticsOutput(), outputRegion);
+    VectorVolumeIterType fittedVolumeIter(this->GetFittedDataOutput(), outputRegion);
+    MaskVolumeConstIterType labelIter(this->GetRegionLabelMap(), outputRegion);
+    MaskVolumeConstIterType roiMaskVolumeIter;
+    if (this->GetROIMask())
+    {
+      roiMaskVolumeIter = MaskVolumeConstIterType(this->GetROIMask(), outputRegion);
+    }
+    VectorVolumeIterType parametricMapsVolumeIter;
+    VectorVoxelType parametricMapsVoxel(NumberOfParametricMaps);
+    if (m_ComputeParametricMaps)
+    {
+      parametricMapsVolumeIter = VectorVolumeIterType(this->GetParametricMapsOutput(), outputRegion);
+    }
+    VectorVoxelType zeroVectorVoxel(timeSize);
+    zeroVectorVoxel.Fill(0.0);
+
+    RegionalFit outside;
+    outside.Ktrans = outside.Ve = outside.Fpv = outside.MaxSlope = outside.AUC = outside.RSquared = outside.BAT = 0.0f;
+    outside.Diagnostics = -1.0f;
+
+    for (; !ktransVolumeIter.IsAtEnd(); ++labelIter)
+    {
+      const bool inROI = !this->GetROIMask() || roiMaskVolumeIter.Get();
+      std::map<long, unsigned int>::const_iterator found = fitIndex.find(static_cast<long>(labelIter.Get()));
+      const bool inRegion = inROI && found != fitIndex.end();
+      const RegionalFit& fit = inRegion ? m_RegionalFits[found->second] : outside;
+
+      ktransVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.Ktrans));
+      veVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.Ve));
+      fpvVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.Fpv));
+      maxSlopeVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.MaxSlope));
+      aucVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.AUC));
+      rsqVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.RSquared));
+      batVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.BAT));
+      diagVolumeIter.Set(static_cast<OutputVolumePixelType>(fit.Diagnostics));
+      fittedVolumeIter.Set(inRegion ? fittedCurves[found->second] : zeroVectorVoxel);
+
+      if (m_ComputeParametricMaps)
+      {
+        parametricMapsVoxel[KtransMap] = fit.Ktrans;
+        parametricMapsVoxel[VeMap] = fit.Ve;
+        parametricMapsVoxel[FpvMap] = fit.Fpv;
+        parametricMapsVoxel[MaxSlopeMap] = fit.MaxSlope;
+        parametricMapsVoxel[AUCMap] = fit.AUC;
+        parametricMapsVoxel[RSquaredMap] = fit.RSquared;
+        parametricMapsVoxel[BATMap] = fit.BAT;
+        parametricMapsVoxel[DiagnosticsMap] = fit.Diagnostics;
+        parametricMapsVolumeIter.Set(parametricMapsVoxel);
+        ++parametricMapsVolumeIter;
+      }
+
+      if (this->GetROIMask())
+      {
+        ++roiMaskVolumeIter;
+      }
+      ++ktransVolumeIter;
+      ++veVolumeIter;
+      ++fpvVolumeIter;
+      ++maxSlopeVolumeIter;
+      ++aucVolumeIter;
+      ++rsqVolumeIter;
+      ++batVolumeIter;
+      ++diagVolumeIter;
+      ++fittedVolumeIter;
+    }
+
+    // the regional fits are not attributable to voxels
+    if (m_ComputeFitCostMaps)
+    {
+      this->GetIterationsOutput()->FillBuffer(0);
+      this->GetEvaluationsOutput()->FillBuffer(0);
+      this->GetFitTimeOutput()->FillBuffer(0);
+    }
+
+    if (m_Verbose)
+    {
+      std::cout << "Regional fitting: " << m_RegionalFits.size() << " labels" << std::endl;
+    }
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  double
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeRSquared(const VectorVoxelType& fittedCurve, double rms) const
+  {
+    // Check R-squared:
+    //   R2 = 1 - SSerr / SStot
+    // where
+    //   SSerr = \sum (y_i - f_i)^2
+    //   SStot = \sum (f_i - \bar{f})^2, over the fitted curve f
+    //
+    // Note: R-squared is not a good metric for nonlinear function
+    // fitting. R-squared values are not bound between [0,1] when
+    // fitting nonlinear functions.
+
+    // SSerr we get from the optimizer's rms, SStot is computed from the
+    // fitted curve. The computation is shared with pk_solver_batch.
+    return compute_rsquared(fittedCurve.GetSize(), fittedCurve.GetDataPointer(), rms);
+  }
 
-      for (; tit != m_Timing.end(); ++tit, ++ait)
-      {
-        // Three cases
-        // (1) extrapolate the aif on the low end of the range of prescribed timings
-        // (2) interpolate the aif
-        // (3) extrapolate the aif on the high end of the range of prescribed timings
-        //
-        // Case (1) is handled implictly by the initialization and conditionals.
-        if (*ptit <= *tit)
-        {
-          // Case (2) from above)
-          // find the prescribed times that straddle the current time to interpolate
-          while (*ptitnext < *tit && ptitnext != m_PrescribedAIFTiming.end())
-          {
-            ++ptit;
-            ++ptitnext;
-            ++pait;
-            ++paitnext;
-          }
-        }
-        if (ptitnext == m_PrescribedAIFTiming.end())
-        {
-          // we'll need to extrapolate (Case (3) from above)
-          ptitnext = ptit;
-          --ptit;
-          paitnext = pait;
-          --pait;
-        }
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  double
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::ComputeFitRSquared(float Ktrans, float Ve, float Fpv, int shift, double rms,
+    LMCostFunction* costFunction) const
+  {
+    LMCostFunction::ParametersType param(costFunction->GetNumberOfParameters());
+    param[0] = Ktrans;
+    param[1] = Ve;
+    if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+    {
+      param[2] = Fpv;
+    }
+    const LMCostFunction::MeasureType measure = costFunction->GetFittedFunction(param);
 
-        // interpolate aif;
-        float a;
-        a = *pait + ((*tit - *ptit) / (*ptitnext - *ptit)) * (*paitnext - *pait);
-        *ait = a;
-      }
+    // as the fitted curve of ThreadedGenerateData
+    const int timeSize = (int)measure.size();
+    VectorVoxelType fitted(timeSize);
+    fitted.Fill(0.0);
+    for (int i = std::max(-shift, 0); i < timeSize && i + shift < timeSize; ++i)
+    {
+      fitted[i] = measure[i + shift];
     }
-    else if (maskVolume && !m_UsePopulationAIF)
+    return this->ComputeRSquared(fitted, rms);
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  SizeValueType
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::GetNumberOfPrescreenedVoxels(unsigned int test) const
+  {
+    if (test >= NumberOfPrescreenTests)
     {
-      // calculate the AIF from the image using the data under the
-      // specified mask
-      m_AIF = this->CalculateAverageAIF(inputVectorVolume, maskVolume);
+      return 0;
     }
-    else if (m_UsePopulationAIF)
+    return m_NumberOfPrescreenedVoxels[test];
+  }
+
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  unsigned int
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::PrescreenCurve(const VectorVoxelType& curve) const
+  {
+    const int size = (int)curve.GetSize();
+    const int baselineEnd = std::max(1, std::min(m_AIFBATIndex, size));
+
+    // baseline statistics over the samples before the bolus
+    double sum = 0.0, sumSquared = 0.0;
+    for (int i = 0; i < baselineEnd; ++i)
     {
-      m_AIF = this->CalculatePopulationAIF(m_Timing, 0.1);
+      sum += curve[i];
+      sumSquared += curve[i] * curve[i];
     }
-    else
+    const double baseline = sum / baselineEnd;
+
+    double peak = curve[baselineEnd - 1];
+    for (int i = baselineEnd; i < size; ++i)
     {
-      itkExceptionMacro("A mask image over which to establish the AIF or a prescribed AIF must be assigned. If prescribing an AIF, then UsePrescribedAIF must be set to true.");
+      peak = std::max(peak, (double)curve[i]);
     }
-    // Compute the bolus arrival time
-    if (m_BATCalculationMode == "UseConstantBAT")
+    const double enhancement = peak - baseline;
+
+    if (m_PrescreenPeakEnhancement > 0 && enhancement < m_PrescreenPeakEnhancement)
     {
-      m_AIFBATIndex = m_constantBAT;
+      return PrescreenPeakEnhancementTest;
     }
-    else if (m_BATCalculationMode == "PeakGradient")
+
+    if (m_PrescreenMaxSlope > 0)
     {
-      compute_bolus_arrival_time(m_AIF.size(), &m_AIF[0], m_AIFBATIndex, aif_FirstPeakIndex, aif_MaxSlope);
+      float maxSlope = 0.0f;
+      for (int i = 1; i < size; ++i)
+      {
+        maxSlope = std::max(maxSlope, curve[i] - curve[i - 1]);
+      }
+      if (maxSlope < m_PrescreenMaxSlope)
+      {
+        return PrescreenMaxSlopeTest;
+      }
     }
 
-    // Compute the area under the curve for the AIF
-    m_aifAUC = area_under_curve(timeSize, &m_Timing[0], &m_AIF[0], m_AIFBATIndex, m_AUCTimeInterval);
+    if (m_PrescreenSNR > 0)
+    {
+      // the noise cannot be estimated from a single baseline sample
+      if (baselineEnd > 1)
+      {
+        const double variance = (sumSquared - sum * sum / baselineEnd) / (baselineEnd - 1);
+        const double noise = sqrt(std::max(variance, 0.0));
+        if (enhancement <= 0 || (noise > 0 && enhancement < m_PrescreenSNR * noise))
+        {
+          return PrescreenSNRTest;
+        }
+      }
+    }
+
+    return NumberOfPrescreenTests;
   }
 
   template <class TInputImage, class TMaskImage, class TOutputImage>
@@ -301,7 +1757,21 @@ namespace itk
     ::ThreadedGenerateData(const OutputVolumeRegionType& outputRegionForThread, ThreadIdType threadId)
 #endif
   {
+    const double threadStartTime = PkTimingReport::GetTime();
+    PkTraceRecorder* trace = m_TimingReport ? m_TimingReport->GetTraceRecorder() : 0;
+    if (this->GetRegionLabelMap())
+    {
+      PkTraceScope traceScope(trace, threadId, "accumulate regions");
+      this->AccumulateRegionCurves(outputRegionForThread, threadId);
+      if (m_TimingReport)
+      {
+        m_ThreadBusySeconds[threadId] = PkTimingReport::GetTime() - threadStartTime;
+      }
+      return;
+    }
+
     VectorVoxelType vectorVoxel, fittedVectorVoxel;
+    PkStageTimer stageTimer(m_TimingReport, threadId);
 
     float tempFpv = 0.0f;
     float tempKtrans = 0.0f;
@@ -336,6 +1806,21 @@ namespace itk
     OutputVolumeIterType rsqVolumeIter(this->GetRSquaredOutput(), outputRegionForThread);
     OutputVolumeIterType batVolumeIter(this->GetBATOutput(), outputRegionForThread);
 
+    VectorVolumeIterType parametricMapsVolumeIter;
+    VectorVoxelType parametricMapsVoxel(NumberOfParametricMaps);
+    if (m_ComputeParametricMaps)
+    {
+      parametricMapsVolumeIter = VectorVolumeIterType(this->GetParametricMapsOutput(), outputRegionForThread);
+    }
+
+    OutputVolumeIterType iterationsVolumeIter, evaluationsVolumeIter, fitTimeVolumeIter;
+    if (m_ComputeFitCostMaps)
+    {
+      iterationsVolumeIter = OutputVolumeIterType(this->GetIterationsOutput(), outputRegionForThread);
+      evaluationsVolumeIter = OutputVolumeIterType(this->GetEvaluationsOutput(), outputRegionForThread);
+      fitTimeVolumeIter = OutputVolumeIterType(this->GetFitTimeOutput(), outputRegionForThread);
+    }
+
     //set up optimizer and cost function
     itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
     LMCostFunction::Pointer                   costFunction = LMCostFunction::New();
@@ -364,29 +1849,145 @@ namespace itk
 
 
     VectorVoxelType shiftedVectorVoxel(timeSize);
+    VectorVoxelType zeroVectorVoxel(timeSize);
+    zeroVectorVoxel.Fill(0.0);
     int shift;
     unsigned int shiftStart = 0, shiftEnd = 0;
+    PkFitCache::Result cachedFit;
     bool success = true;
+
+    // results of the voxels completed since the last chunk appended to
+    // the checkpoint
+    std::vector<unsigned long long> checkpointOffsets;
+    std::vector<float> checkpointValues;
+    float restoredValues[NumberOfCheckpointValues];
+
+    // traced chunks of voxels, with the number of fits in each
+    const double traceStart = trace ? trace->GetTime() : 0.0;
+    double chunkStart = traceStart;
+    unsigned int chunkVoxels = 0;
+    SizeValueType chunkFits = m_FitCounts[threadId];
+
     while (!ktransVolumeIter.IsAtEnd())
     {
       success = true;
       float optimizerErrorCode = -1;
       tempKtrans = tempVe = tempFpv = tempMaxSlope = tempAUC = 0.0;
       BATIndex = FirstPeakIndex = 0;
+      float tempBAT = 0.0f;
+      double rSquared = 0.0;
+      bool haveFittedCurve = false;
+      const SizeValueType iterationsBefore = m_IterationCounts[threadId];
+      const SizeValueType evaluationsBefore = m_EvaluationCounts[threadId];
+      double fitTime = 0.0;
+      const bool inROI = !this->GetROIMask() || roiMaskVolumeIter.Get();
+
+      bool restored = false;
+      unsigned long long voxelOffset = 0;
+      if (m_Checkpoint && inROI)
+      {
+        voxelOffset = static_cast<unsigned long long>(this->GetKTransOutput()->ComputeOffset(ktransVolumeIter.GetIndex()));
+        restored = m_Checkpoint->Find(voxelOffset, restoredValues);
+      }
+
+      if (restored)
+      {
+        tempKtrans = restoredValues[KtransMap];
+        tempVe = restoredValues[VeMap];
+        tempFpv = restoredValues[FpvMap];
+        tempMaxSlope = restoredValues[MaxSlopeMap];
+        tempAUC = restoredValues[AUCMap];
+        rSquared = restoredValues[RSquaredMap];
+        tempBAT = restoredValues[BATMap];
+        optimizerErrorCode = restoredValues[DiagnosticsMap];
+        fitTime = restoredValues[FitTimeValue];
+
+        // the fitted curve is not saved, it is the model at the restored
+        // parameters shifted back to the BAT of the voxel
+        if (restoredValues[FittedCurveValue] != 0.0f)
+        {
+          costFunction->SetNumberOfValues(timeSize);
+          costFunction->SetCb(&m_AIF[0], timeSize);
+          costFunction->SetTime(&timeMinute[0], timeSize);
+          costFunction->SetHematocrit(m_hematocrit);
+          costFunction->SetModelType(m_ModelType);
+          costFunction->SetUseBounds(m_BoundedFitting);
 
-      if (!this->GetROIMask() || (this->GetROIMask() && roiMaskVolumeIter.Get()))
+          itk::LMCostFunction::ParametersType param(3);
+          param[0] = tempKtrans; param[1] = tempVe; param[2] = tempFpv;
+          itk::LMCostFunction::MeasureType measure =
+            costFunction->GetFittedFunction(param);
+
+          shift = m_AIFBATIndex - static_cast<int>(tempBAT);
+          shiftedVectorVoxel.Fill(0.0);
+          for (int i = -shift; i < timeSize; ++i)
+          {
+            shiftedVectorVoxel[i] = measure[i + shift];
+          }
+          fittedVolumeIter.Set(shiftedVectorVoxel);
+          haveFittedCurve = true;
+        }
+      }
+      else if (inROI)
       {
         vectorVoxel = inputVectorVolumeIter.Get();
         fittedVectorVoxel = inputVectorVolumeIter.Get();
         // dump a specific voxel
         // std::cout << "VectorVoxel = " << vectorVoxel;
 
+        // In pyramid mode, skip the voxels of background blocks and start
+        // the others from the fit of their block
+        const float* initialParameters = 0;
+        float coarseParameters[3];
+        if (!m_CoarseFits.empty())
+        {
+          const CoarseFit& coarseFit = this->GetCoarseFit(ktransVolumeIter.GetIndex());
+          if (coarseFit.Status == CoarseFit::Background)
+          {
+            success = false;
+            optimizerErrorCode = PYRAMID_BACKGROUND;
+            ++m_PyramidExcludedCounts[threadId];
+          }
+          else if (coarseFit.Status == CoarseFit::Fitted)
+          {
+            coarseParameters[0] = coarseFit.Ktrans;
+            coarseParameters[1] = std::max(coarseFit.Ve, 0.01f);
+            coarseParameters[2] = coarseFit.Fpv;
+            initialParameters = coarseParameters;
+          }
+        }
+
+        // Skip the fit, and the BAT detection, at voxels that do not enhance
+        stageTimer.Start();
+        if (success)
+        {
+          const unsigned int failedTest = this->PrescreenCurve(vectorVoxel);
+          if (failedTest != NumberOfPrescreenTests)
+          {
+            static const int prescreenCodes[NumberOfPrescreenTests] =
+            {
+              PRESCREEN_LOW_ENHANCEMENT, PRESCREEN_LOW_SLOPE, PRESCREEN_LOW_SNR
+            };
+            success = false;
+            optimizerErrorCode = prescreenCodes[failedTest];
+            ++m_PrescreenCounts[threadId][failedTest];
+          }
+        }
+
         // Compute the bolus arrival time and the max slope parameter
         if (success)
         {
           int status;
           // Compute the bolus arrival time
-          if (m_BATCalculationMode == "UseConstantBAT")
+          if (!m_ClusterBATs.empty())
+          {
+            // found by the clustering
+            const SizeValueType offset = this->GetKTransOutput()->ComputeOffset(ktransVolumeIter.GetIndex());
+            BATIndex = m_ClusterBATs[offset];
+            tempMaxSlope = m_ClusterMaxSlopes[offset];
+            status = BATIndex >= 0;
+          }
+          else if (m_BATCalculationMode == "UseConstantBAT")
           {
             BATIndex = m_constantBAT;
             status = 1;
@@ -402,13 +2003,14 @@ namespace itk
             optimizerErrorCode = BAT_DETECTION_FAILED;
           }
         }
+        stageTimer.Stop(PkTimingReport::BATStage);
 
 
         // Shift the current time course to align with the BAT of the AIF
         // (note the sense of the shift)
         if (success)
         {
-          batVolumeIter.Set(BATIndex);
+          tempBAT = BATIndex;
           shift = m_AIFBATIndex - BATIndex;
           shiftedVectorVoxel.Fill(0.0);
           if (shift <= 0)
@@ -432,28 +2034,60 @@ namespace itk
         }
 
         // Calculate parameter ktrans, ve, and fpv
-        double rSquared = 0.0;
         if (success)
         {
-          optimizerErrorCode = pk_solver(timeSize, &timeMinute[0],
-            const_cast<float *>(shiftedVectorVoxel.GetDataPointer()),
-            &m_AIF[0],
-            tempKtrans, tempVe, tempFpv,
-            m_fTol, m_gTol, m_xTol,
-            m_epsilon, m_maxIter, m_hematocrit,
-            optimizer, costFunction, m_ModelType, m_constantBAT, m_BATCalculationMode);
-
-          itk::LMCostFunction::ParametersType param(3);
-          param[0] = tempKtrans; param[1] = tempVe;
-          if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+          double rms = 0.0;
+          const double fitStart = m_ComputeFitCostMaps ? itksys::SystemTools::GetTime() : 0.0;
+          if (m_FitCache && m_FitCache->Find(shiftedVectorVoxel.GetDataPointer(), timeSize, shift,
+            initialParameters, cachedFit))
           {
-            param[2] = tempFpv;
+            ++m_FitCacheHits[threadId];
+            tempKtrans = cachedFit.Ktrans;
+            tempVe = cachedFit.Ve;
+            tempFpv = cachedFit.Fpv;
+            optimizerErrorCode = cachedFit.Code;
+            rms = cachedFit.RMS;
+            for (size_t i = 0; i < fittedVectorVoxel.GetSize(); i++)
+            {
+              fittedVectorVoxel[i] = cachedFit.Fitted[i];
+            }
           }
-          itk::LMCostFunction::MeasureType measure =
-            costFunction->GetFittedFunction(param);
-          for (size_t i = 0; i < fittedVectorVoxel.GetSize(); i++)
+          else
+          {
+            optimizerErrorCode = this->FitCurve(timeMinute, shiftedVectorVoxel,
+              tempKtrans, tempVe, tempFpv, rms, optimizer, costFunction, threadId,
+              initialParameters, shift);
+
+            itk::LMCostFunction::ParametersType param(3);
+            param[0] = tempKtrans; param[1] = tempVe;
+            if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+            {
+              param[2] = tempFpv;
+            }
+            itk::LMCostFunction::MeasureType measure =
+              costFunction->GetFittedFunction(param);
+            for (size_t i = 0; i < fittedVectorVoxel.GetSize(); i++)
+            {
+              fittedVectorVoxel[i] = measure[i];
+            }
+
+            if (m_FitCache)
+            {
+              ++m_FitCacheMisses[threadId];
+              cachedFit.Ktrans = tempKtrans;
+              cachedFit.Ve = tempVe;
+              cachedFit.Fpv = tempFpv;
+              cachedFit.Code = (unsigned int)optimizerErrorCode;
+              cachedFit.RMS = rms;
+              cachedFit.Fitted.assign(fittedVectorVoxel.GetDataPointer(),
+                fittedVectorVoxel.GetDataPointer() + fittedVectorVoxel.GetSize());
+              m_FitCache->Insert(shiftedVectorVoxel.GetDataPointer(), timeSize, shift,
+                initialParameters, cachedFit);
+            }
+          }
+          if (m_ComputeFitCostMaps)
           {
-            fittedVectorVoxel[i] = measure[i];
+            fitTime = (itksys::SystemTools::GetTime() - fitStart) * 1e6;
           }
 
           // Shift the current time course to align with the BAT of the AIF
@@ -471,41 +2105,12 @@ namespace itk
           }
 
           fittedVolumeIter.Set(shiftedVectorVoxel);
+          haveFittedCurve = true;
+          stageTimer.Stop(PkTimingReport::FitStage);
 
           // Only keep the estimated values if the optimization produced a good answer
-          // Check R-squared:
-          //   R2 = 1 - SSerr / SStot
-          // where
-          //   SSerr = \sum (y_i - f_i)^2
-          //   SStot = \sum (y_i - \bar{y})^2
-          //
-          // Note: R-squared is not a good metric for nonlinear function
-          // fitting. R-squared values are not bound between [0,1] when
-          // fitting nonlinear functions.
-
-          // SSerr we can get easily from the optimizer
-          double rms = optimizer->GetOptimizer()->get_end_error();
-          double SSerr = rms*rms*shiftedVectorVoxel.GetSize();
-
-          // if we couldn't get rms from the optimizer, we would calculate SSerr ourselves
-          // LMCostFunction::MeasureType residuals = costFunction->GetValue(optimizer->GetCurrentPosition());
-          // double SSerr = 0.0;
-          // for (unsigned int i=0; i < residuals.size(); ++i)
-          //   {
-          //   SSerr += (residuals[i]*residuals[i]);
-          //   }
-
-          // SStot we need to calculate
-          double sumSquared = 0.0;
-          double sum = 0.0;
-          for (unsigned int i = 0; i < shiftedVectorVoxel.GetSize(); ++i)
-          {
-            sum += shiftedVectorVoxel[i];
-            sumSquared += (shiftedVectorVoxel[i] * shiftedVectorVoxel[i]);
-          }
-          double SStot = sumSquared - sum*sum / (double)shiftedVectorVoxel.GetSize();
-
-          rSquared = 1.0 - (SSerr / SStot);
+          rSquared = this->ComputeRSquared(shiftedVectorVoxel, rms);
+          stageTimer.Stop(PkTimingReport::RSquaredStage);
 
           /*
           double rSquaredThreshold = 0.15;
@@ -520,53 +2125,88 @@ namespace itk
         {
           tempAUC =
             (area_under_curve(timeSize, &m_Timing[0], const_cast<float *>(shiftedVectorVoxel.GetDataPointer()), BATIndex, m_AUCTimeInterval)) / m_aifAUC;
+          stageTimer.Stop(PkTimingReport::AUCStage);
         }
 
-        // Do we mask the output volumes by the R-squared value?
-        if (m_MaskByRSquared)
+        // Do we mask the output volumes by the R-squared value?  If
+        // so, unsuccessful fits default to zero.
+        if (m_MaskByRSquared && !success)
         {
-          // If we were successful, save the estimated values, otherwise
-          // default to zero
-          if (success)
-          {
-            ktransVolumeIter.Set(static_cast<OutputVolumePixelType>(tempKtrans));
-            veVolumeIter.Set(static_cast<OutputVolumePixelType>(tempVe));
-            maxSlopeVolumeIter.Set(static_cast<OutputVolumePixelType>(tempMaxSlope));
-            aucVolumeIter.Set(static_cast<OutputVolumePixelType>(tempAUC));
-            if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
-            {
-              fpvVolumeIter.Set(static_cast<OutputVolumePixelType>(tempFpv));
-            }
-          }
-          else
-          {
-            ktransVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-            veVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-            maxSlopeVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-            aucVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-          }
+          tempKtrans = tempVe = tempFpv = tempMaxSlope = tempAUC = 0.0;
         }
-        else
+      }
+
+      if (!haveFittedCurve)
+      {
+        fittedVolumeIter.Set(zeroVectorVoxel);
+      }
+
+      if (m_ModelType != itk::LMCostFunction::TOFTS_3_PARAMETER)
+      {
+        tempFpv = 0.0;
+      }
+
+      float iterations = static_cast<float>(m_IterationCounts[threadId] - iterationsBefore);
+      float evaluations = static_cast<float>(m_EvaluationCounts[threadId] - evaluationsBefore);
+      if (restored)
+      {
+        iterations = restoredValues[IterationsValue];
+        evaluations = restoredValues[EvaluationsValue];
+      }
+      else if (m_Checkpoint && inROI)
+      {
+        const float values[NumberOfCheckpointValues] =
         {
-          ktransVolumeIter.Set(static_cast<OutputVolumePixelType>(tempKtrans));
-          veVolumeIter.Set(static_cast<OutputVolumePixelType>(tempVe));
-          maxSlopeVolumeIter.Set(static_cast<OutputVolumePixelType>(tempMaxSlope));
-          aucVolumeIter.Set(static_cast<OutputVolumePixelType>(tempAUC));
-          if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
-          {
-            fpvVolumeIter.Set(static_cast<OutputVolumePixelType>(tempFpv));
-          }
+          tempKtrans, tempVe, tempFpv, tempMaxSlope, tempAUC, static_cast<float>(rSquared),
+          tempBAT, optimizerErrorCode, iterations, evaluations, static_cast<float>(fitTime),
+          haveFittedCurve ? 1.0f : 0.0f
+        };
+        checkpointOffsets.push_back(voxelOffset);
+        checkpointValues.insert(checkpointValues.end(), values, values + NumberOfCheckpointValues);
+        if (checkpointOffsets.size() == CheckpointChunkSize)
+        {
+          m_Checkpoint->Append(checkpointOffsets, checkpointValues);
+          checkpointOffsets.clear();
+          checkpointValues.clear();
         }
+      }
+
+      ktransVolumeIter.Set(static_cast<OutputVolumePixelType>(tempKtrans));
+      veVolumeIter.Set(static_cast<OutputVolumePixelType>(tempVe));
+      maxSlopeVolumeIter.Set(static_cast<OutputVolumePixelType>(tempMaxSlope));
+      aucVolumeIter.Set(static_cast<OutputVolumePixelType>(tempAUC));
+      rsqVolumeIter.Set(static_cast<OutputVolumePixelType>(rSquared));
+      batVolumeIter.Set(static_cast<OutputVolumePixelType>(tempBAT));
+      diagVolumeIter.Set(static_cast<OutputVolumePixelType>(optimizerErrorCode));
+      if (m_ModelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+      {
+        fpvVolumeIter.Set(static_cast<OutputVolumePixelType>(tempFpv));
+      }
 
-        // RSquared output volume is always written
-        rsqVolumeIter.Set(rSquared);
+      // All of the voxel's results go to the interleaved output in a
+      // single store
+      if (m_ComputeParametricMaps)
+      {
+        parametricMapsVoxel[KtransMap] = tempKtrans;
+        parametricMapsVoxel[VeMap] = tempVe;
+        parametricMapsVoxel[FpvMap] = tempFpv;
+        parametricMapsVoxel[MaxSlopeMap] = tempMaxSlope;
+        parametricMapsVoxel[AUCMap] = tempAUC;
+        parametricMapsVoxel[RSquaredMap] = rSquared;
+        parametricMapsVoxel[BATMap] = tempBAT;
+        parametricMapsVoxel[DiagnosticsMap] = optimizerErrorCode;
+        parametricMapsVolumeIter.Set(parametricMapsVoxel);
+        ++parametricMapsVolumeIter;
       }
-      else
+
+      if (m_ComputeFitCostMaps)
       {
-        ktransVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-        veVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-        maxSlopeVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
-        aucVolumeIter.Set(static_cast<OutputVolumePixelType>(0));
+        iterationsVolumeIter.Set(static_cast<OutputVolumePixelType>(iterations));
+        evaluationsVolumeIter.Set(static_cast<OutputVolumePixelType>(evaluations));
+        fitTimeVolumeIter.Set(static_cast<OutputVolumePixelType>(fitTime));
+        ++iterationsVolumeIter;
+        ++evaluationsVolumeIter;
+        ++fitTimeVolumeIter;
       }
 
       ++ktransVolumeIter;
@@ -575,6 +2215,7 @@ namespace itk
       ++aucVolumeIter;
       ++rsqVolumeIter;
       ++batVolumeIter;
+      ++diagVolumeIter;
       ++inputVectorVolumeIter;
       ++fittedVolumeIter;
 
@@ -588,217 +2229,54 @@ namespace itk
         ++fpvVolumeIter;
       }
 
-      diagVolumeIter.Set(static_cast<OutputVolumePixelType>(optimizerErrorCode));
-      ++diagVolumeIter;
-
       progress.CompletedPixel();
-    }
-  }
-
-  // Calculate a population AIF.
-  //
-  // See "Experimentally-Derived Functional Form for a Population-Averaged High-
-  // Temporal-Resolution Arterial Input Function for Dynamic Contrast-Enhanced
-  // MRI" - Parker, Robers, Macdonald, Buonaccorsi, Cheung, Buckley, Jackson,
-  // Watson, Davies, Jayson.  Magnetic Resonance in Medicine 56:993-1000 (2006)
-  template <class TInputImage, class TMaskImage, class TOutputImage>
-  std::vector<float>
-    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
-    ::CalculatePopulationAIF(std::vector<float> signalTime, const float bolusArrivalTimeFraction)
-  {
-
-    // Inputs
-    // ------
-    // signalTime : sequence time, presumed in units of seconds.
-    // bolusArrivalTimeFraction : fractional point between 0 and 1 when the bolus is
-    //     desired to arrive.  Choose 0.0 to have it at the very beginning,
-    //     1.0 to have it at the end.
-    //
-    // Outputs
-    // -------
-    // AIF : arterial input function as a function of time
-    std::vector<float> AIF;
-
-    // Make a high resolution timing vector as input to the AIF construction.
-    std::vector<float> aif_time(signalTime.size() * 10);
-    float final_time_point = signalTime[signalTime.size() - 1];
-    float resolution = final_time_point / (aif_time.size() - 1);
-    for (size_t j = 0; j < aif_time.size(); ++j)
-    {
-      aif_time[j] = resolution * j;
-    }
-
-    size_t bolus_arrival_time_idx = (float)aif_time.size() * bolusArrivalTimeFraction;
-
-    size_t n = aif_time.size();
-    AIF.resize(n);
-
-    size_t numTimePoints = n - bolus_arrival_time_idx;
-    std::vector<float> timeSinceBolus(numTimePoints);
-
-
-    // t=FR*[0:numTimePoints-1]/60;
-    // These time points "start" when the bolus arrives.
-    for (size_t j = 0; j < numTimePoints; ++j)
-    {
-      //timeSinceBolus[j] = FR * j / 60.0;
-      timeSinceBolus[j] = aif_time[bolus_arrival_time_idx + j] - aif_time[bolus_arrival_time_idx];
-    }
-
-    // Parker
-    // defining parameters
-    double a1(0.809);
-    double a2(0.330);
-    double T1(0.17406);
-    double T2(0.365);
-    double sigma1(0.0563);
-    double sigma2(0.132);
-    double alpha(1.050);
-    double beta(0.1685);
-    double s(38.078);
-    double tau(0.483);
-
-
-    // term0=alpha*exp(-beta*t)./(1+exp(-s*(t-tau)));
-    // Here the assumption is that time is in minutes, so must scale accordingly.
-    // see Parker.
-    std::vector<double> term0(numTimePoints);
-    for (size_t j = 0; j < numTimePoints; ++j)
-    {
-      term0[j] = alpha * exp(-beta*timeSinceBolus[j] / 60.0)
-        / (1 + exp(-s * (timeSinceBolus[j] / 60.0 - tau)));
-    }
-
-
-    // term1=[];
-    // term2=[];
-    double A1 = a1 / (sigma1 * pow((2 * M_PI), 0.5));
-
-    // B1=exp(-(t-T1).^2./(2.*sigma1^2));
-    double numerator, denominator;
-    std::vector<double> B1(numTimePoints);
-    denominator = 2.0 * pow(sigma1, 2.0);
-    for (size_t j = 0; j < numTimePoints; ++j)
-    {
-      numerator = -1 * pow(-(timeSinceBolus[j] / 60.0 - T1), 2.0);
-      B1[j] = exp(numerator / denominator);
-    }
-
-    // term1=A1.*B1;
-    std::vector<double> term1(numTimePoints);
-    for (size_t j = 0; j < numTimePoints; ++j)
-    {
-      term1[j] = A1 * B1[j];
-    }
-
-
-    // A2=a2/(sigma2*((2*pi)^0.5));
-    double A2 = a2 / (sigma2 * pow(2 * M_PI, 0.5));
 
-    //B2=exp(-(t-T2).^2./(2.*sigma2^2));
-    std::vector<double> B2(numTimePoints);
-    denominator = 2.0 * pow(sigma2, 2.0);
-    for (size_t j = 0; j < numTimePoints; ++j)
-    {
-      numerator = -1 * pow(-(timeSinceBolus[j] / 60.0 - T2), 2.0);
-      B2[j] = exp(numerator / denominator);
-    }
-
-    // term2=A2.*B2;
-    std::vector<double> term2(numTimePoints);
-    for (size_t j = 0; j < numTimePoints; ++j)
-    {
-      term2[j] = A2 * B2[j];
+      if (trace && ++chunkVoxels == TraceChunkSize)
+      {
+        trace->AddEvent(threadId, "chunk", chunkStart, "fits", m_FitCounts[threadId] - chunkFits);
+        chunkStart = trace->GetTime();
+        chunkVoxels = 0;
+        chunkFits = m_FitCounts[threadId];
+      }
     }
 
-    // aifPost=term0+term1+term2;
-    std::vector<double> aifPost(numTimePoints);
-    for (size_t j = 0; j < numTimePoints; ++j)
+    if (m_Checkpoint)
     {
-      aifPost[j] = term0[j] + term1[j] + term2[j];
+      m_Checkpoint->Append(checkpointOffsets, checkpointValues);
     }
 
-    // Initialize values before bolus arrival.
-    for (size_t j = 0; j < bolus_arrival_time_idx; ++j)
+    if (trace)
     {
-      AIF[j] = 0;
+      if (chunkVoxels > 0)
+      {
+        trace->AddEvent(threadId, "chunk", chunkStart, "fits", m_FitCounts[threadId] - chunkFits);
+      }
+      trace->AddEvent(threadId, "quantify", traceStart, "voxels", outputRegionForThread.GetNumberOfPixels());
     }
 
-    // Shift the data to take into account the bolus arrival time.
-    // sp=timeOfBolus+1;
-    // AIF(sp:end)=aifPost;
-    for (size_t j = bolus_arrival_time_idx; j < AIF.size(); ++j)
+    if (m_TimingReport)
     {
-      AIF[j] = aifPost[j - bolus_arrival_time_idx];
+      m_ThreadBusySeconds[threadId] = PkTimingReport::GetTime() - threadStartTime;
     }
-
-    // Resample back to signal (sequence) time.
-    std::vector<float> rAIF = this->ResampleAIF(aif_time, AIF, signalTime);
-
-    return rAIF;
-
   }
 
+  // Calculate a population AIF (Parker), see compute_population_aif()
+  template <class TInputImage, class TMaskImage, class TOutputImage>
+  std::vector<float>
+    ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
+    ::CalculatePopulationAIF(std::vector<float> signalTime, const float bolusArrivalTimeFraction)
+  {
+    return get_population_aif(signalTime, bolusArrivalTimeFraction);
+  }
 
   template <class TInputImage, class TMaskImage, class TOutputImage>
   std::vector<float>
     ConcentrationToQuantitativeImageFilter<TInputImage, TMaskImage, TOutputImage>
     ::ResampleAIF(std::vector<float> t1, std::vector<float> y1, std::vector<float> t2)
   {
-    // Resample time1, y1 to time2
-    size_t timeSize = t2.size();
-    std::vector<float> y2(timeSize);
-
-    std::vector<float>::iterator y2it = y2.begin();
-    std::vector<float>::iterator t2it = t2.begin();
-
-    std::vector<float>::iterator y1it = y1.begin();
-    std::vector<float>::iterator t1it = t1.begin();
-
-    std::vector<float>::iterator y1itnext = y1it;
-    y1itnext++;
-    std::vector<float>::iterator t1itnext = t1it;
-    t1itnext++;
-
-    for (; t2it != t2.end(); ++t2it, ++y2it)
-    {
-      // Three cases
-      // (1) extrapolate the aif on the low end of the range of prescribed timings
-      // (2) interpolate the aif
-      // (3) extrapolate the aif on the high end of the range of prescribed timings
-      //
-      // Case (1) is handled implictly by the initialization and conditionals.
-      if (*t1it <= *t2it)
-      {
-        // Case (2) from above)
-        // find the prescribed times that straddle the current time to interpolate
-        while (*t1itnext < *t2it && t1itnext != t1.end())
-        {
-          ++t1it;
-          ++t1itnext;
-          ++y1it;
-          ++y1itnext;
-        }
-      }
-      if (t1itnext == t1.end())
-      {
-        // we'll need to extrapolate (Case (3) from above)
-        t1itnext = t1it;
-        --t1it;
-        y1itnext = y1it;
-        --y1it;
-      }
-
-      // interpolate aif;
-      float a;
-      a = *y1it + ((*t2it - *t1it) / (*t1itnext - *t1it)) * (*y1itnext - *y1it);
-      *y2it = a;
-    }
-
-    return y2;
+    return resample_curve(t1, y1, t2);
   }
 
-
   // Calculate average AIF according to the AIF mask
   template <class TInputImage, class TMaskImage, class TOutputImage>
   std::vector<float>
@@ -868,6 +2346,25 @@ namespace itk
     os << indent << "Epsilon: " << m_epsilon << std::endl;
     os << indent << "Maximum number of iterations: " << m_maxIter << std::endl;
     os << indent << "Hematocrit: " << m_hematocrit << std::endl;
+    os << indent << "Compute parametric maps: " << m_ComputeParametricMaps << std::endl;
+    os << indent << "Compute fit cost maps: " << m_ComputeFitCostMaps << std::endl;
+    os << indent << "Verbose: " << m_Verbose << std::endl;
+    os << indent << "Pre-screen peak enhancement: " << m_PrescreenPeakEnhancement << std::endl;
+    os << indent << "Pre-screen max slope: " << m_PrescreenMaxSlope << std::endl;
+    os << indent << "Pre-screen SNR: " << m_PrescreenSNR << std::endl;
+    os << indent << "Tiered fitting: " << m_TieredFitting << std::endl;
+    os << indent << "Tiered tolerance scale: " << m_TieredToleranceScale << std::endl;
+    os << indent << "Tiered maximum number of iterations: " << m_TieredMaxIter << std::endl;
+    os << indent << "Refit R-squared threshold: " << m_RefitRSquaredThreshold << std::endl;
+    os << indent << "Bounded fitting: " << m_BoundedFitting << std::endl;
+    os << indent << "Use fit cache: " << m_UseFitCache << std::endl;
+    os << indent << "Maximum fit cache entries: " << m_MaximumFitCacheEntries << std::endl;
+    os << indent << "Number of clusters: " << m_NumberOfClusters << std::endl;
+    os << indent << "Cluster refine iterations: " << m_ClusterRefineIterations << std::endl;
+    os << indent << "Pyramid factor: " << m_PyramidFactor << std::endl;
+    os << indent << "Checkpoint file name: " << m_CheckpointFileName << std::endl;
+    os << indent << "Resume from checkpoint: " << m_ResumeFromCheckpoint << std::endl;
+    os << indent << "Checkpoint interval: " << m_CheckpointInterval << std::endl;
   }
 
 } // end namespace itk
@@ -0,0 +1,316 @@
+/*=========================================================================
+  Program:   Insight Segmentation & Registration Toolkit
+  Module:    $RCSfile: itkPkModelingEngine.h,v $
+  Language:  C++
+  =========================================================================*/
+#ifndef __itkPkModelingEngine_h
+#define __itkPkModelingEngine_h
+
+#include "itkObject.h"
+#include "itkImage.h"
+#include "itkVectorImage.h"
+#include "itkSignalIntensityToConcentrationImageFilter.h"
+#include "itkConcentrationToQuantitativeImageFilter.h"
+#include "PkTimingReport.h"
+#include <string>
+#include <vector>
+
+namespace itk
+{
+  /** Settings of the conversion to concentrations and of the model fit.
+   * The defaults are those of the PkModeling module. */
+  struct PkModelingParameters
+  {
+    PkModelingParameters()
+      : T1PreBlood(1600.0f), T1PreTissue(1597.0f), Relaxivity(0.0039f),
+      S0GradThresh(15.0f), FTolerance(1e-4f), GTolerance(1e-4f),
+      XTolerance(1e-5f), Epsilon(1e-9f), MaxIter(200.0f), Hematocrit(0.4f),
+      AUCTimeInterval(90.0f), BoundedFitting(false), UseFitCache(false),
+      ComputeFpv(false), UsePopulationAIF(false),
+      BATCalculationMode("PeakGradient"), ConstantBAT(1),
+      PrescreenPeakEnhancement(0.0f), PrescreenMaxSlope(0.0f), PrescreenSNR(0.0f),
+      TieredFitting(false), TieredToleranceScale(100.0f), TieredMaxIter(30),
+      RefitRSquaredThreshold(0.5f), NumberOfClusters(0),
+      ClusterRefineIterations(0), PyramidFactor(1), MaskByRSquared(true),
+      ComputeParametricMaps(false), ComputeFitCostMaps(false), Verbose(false),
+      ResumeFromCheckpoint(false), CheckpointInterval(60.0f)
+    {
+    }
+
+    float T1PreBlood;
+    float T1PreTissue;
+    float Relaxivity;
+    float S0GradThresh;
+    float FTolerance;
+    float GTolerance;
+    float XTolerance;
+    float Epsilon;
+    float MaxIter;
+    float Hematocrit;
+    float AUCTimeInterval;
+    bool BoundedFitting;
+    bool UseFitCache;
+    bool ComputeFpv;
+    bool UsePopulationAIF;
+    std::string BATCalculationMode;
+    int ConstantBAT;
+    float PrescreenPeakEnhancement;
+    float PrescreenMaxSlope;
+    float PrescreenSNR;
+    bool TieredFitting;
+    float TieredToleranceScale;
+    int TieredMaxIter;
+    float RefitRSquaredThreshold;
+    int NumberOfClusters;
+    int ClusterRefineIterations;
+    int PyramidFactor;
+
+    // Zero the maps where the fit is poor (the R-squared map is not
+    // kept), and compute the optional outputs
+    bool MaskByRSquared;
+    bool ComputeParametricMaps;
+    bool ComputeFitCostMaps;
+
+    // Print a summary of the fit to the log
+    bool Verbose;
+
+    // Save the results of the fitted voxels to a side file as the fit
+    // goes, and restore them from that file (see
+    // ConcentrationToQuantitativeImageFilter::SetCheckpointFileName())
+    std::string CheckpointFileName;
+    bool ResumeFromCheckpoint;
+    float CheckpointInterval;
+  };
+
+  /** \class PkModelingEngine
+   * \brief Quantifies a DCE MRI study held in memory.
+   *
+   * This is the processing of the PkModeling module without its file
+   * input and output: the signal, acquisition parameters, masks and
+   * settings are given as images (or buffers wrapped without copying)
+   * and the maps are returned as images at the size of the signal.
+   *
+   * The processing is restricted to the bounding box of the ROI mask
+   * (or of the region labels), extended to the AIF mask when the AIF is
+   * measured from the image. Masks must be on the grid of the signal.
+   * A study can be divided into shards processed separately (see
+   * SetShard()).
+   */
+  template <class TInputPixel, class TMaskPixel = short>
+  class ITK_EXPORT PkModelingEngine : public Object
+  {
+  public:
+    typedef PkModelingEngine         Self;
+    typedef Object                   Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(PkModelingEngine, Object);
+
+    itkStaticConstMacro(ImageDimension, unsigned int, 3);
+
+    typedef VectorImage<TInputPixel, ImageDimension> SignalVolumeType;
+    typedef typename SignalVolumeType::RegionType    RegionType;
+    typedef typename SignalVolumeType::SizeType      SizeType;
+    typedef typename SignalVolumeType::SpacingType   SpacingType;
+    typedef typename SignalVolumeType::PointType     PointType;
+    typedef Image<TMaskPixel, ImageDimension>        MaskVolumeType;
+    typedef VectorImage<float, ImageDimension>       FloatVectorVolumeType;
+    typedef Image<float, ImageDimension>             OutputVolumeType;
+
+    typedef SignalIntensityToConcentrationImageFilter<SignalVolumeType, MaskVolumeType, FloatVectorVolumeType> ConverterType;
+    typedef ConcentrationToQuantitativeImageFilter<FloatVectorVolumeType, MaskVolumeType, OutputVolumeType> QuantifierType;
+
+    void SetParameters(const PkModelingParameters& parameters)
+    {
+      m_Parameters = parameters;
+      this->Modified();
+    }
+    const PkModelingParameters& GetParameters() const
+    {
+      return m_Parameters;
+    }
+
+    /** Signal of the study. It may be the output of a reader that has
+     * only read the header; only the processed region is then read. */
+    itkSetObjectMacro(Signal, SignalVolumeType);
+    itkGetObjectMacro(Signal, SignalVolumeType);
+
+    /** Wrap a signal buffer without copying it: numberOfFrames values
+     * per voxel, voxels in x fastest order. The buffer must outlive the
+     * engine's use of it. */
+    void SetSignalBuffer(TInputPixel* buffer, const SizeType& size, unsigned int numberOfFrames,
+      const SpacingType& spacing, const PointType& origin);
+
+    /** Wrap a mask buffer on the grid of the signal without copying it */
+    typename MaskVolumeType::Pointer ImportMask(TMaskPixel* buffer) const;
+
+    /** Acquisition: frame times in seconds from the first frame, flip
+     * angle in degrees and repetition time in milliseconds */
+    void SetTiming(const std::vector<float>& timing)
+    {
+      m_Timing = timing;
+      this->Modified();
+    }
+    const std::vector<float>& GetTiming() const
+    {
+      return m_Timing;
+    }
+    itkSetMacro(FlipAngle, float);
+    itkGetMacro(FlipAngle, float);
+    itkSetMacro(RepetitionTime, float);
+    itkGetMacro(RepetitionTime, float);
+
+    itkSetObjectMacro(AIFMask, MaskVolumeType);
+    itkGetObjectMacro(AIFMask, MaskVolumeType);
+    itkSetObjectMacro(ROIMask, MaskVolumeType);
+    itkGetObjectMacro(ROIMask, MaskVolumeType);
+    itkSetObjectMacro(T1Map, MaskVolumeType);
+    itkGetObjectMacro(T1Map, MaskVolumeType);
+    itkSetObjectMacro(RegionLabelMap, MaskVolumeType);
+    itkGetObjectMacro(RegionLabelMap, MaskVolumeType);
+
+    /** AIF given as concentrations at its own times, used instead of
+     * the AIF mask */
+    void SetPrescribedAIF(const std::vector<float>& timing, const std::vector<float>& aif);
+    itkGetMacro(UsePrescribedAIF, bool);
+
+    itkSetObjectMacro(TimingReport, PkTimingReport);
+
+    /** Filters doing the work, e.g. to watch their progress */
+    itkGetObjectMacro(Converter, ConverterType);
+    itkGetObjectMacro(Quantifier, QuantifierType);
+
+    /** Restrict the inputs to the region to process, reading the signal
+     * of that region. Called by Update() if not done since the engine,
+     * its settings or its input images were last modified, so that one
+     * engine can process one study after another. */
+    void PrepareInputs();
+
+    /** Region of the signal that is processed */
+    const RegionType& GetProcessingRegion() const
+    {
+      return m_ProcessingRegion;
+    }
+
+    /** Process only shard index (0 to count - 1) of count shards. The
+     * slices of the signal are divided into count slabs holding about
+     * the same number of ROI voxels (or of voxels, without an ROI), and
+     * the fit is restricted to the ROI voxels of the slab of the shard.
+     * The processing region and the AIF mask are not restricted, so
+     * every shard converts the same concentrations and measures the
+     * same AIF as the whole study. Region
+     * labels, clustering and pyramid fitting combine voxels across the
+     * ROI and cannot be sharded. */
+    void SetShard(unsigned int index, unsigned int count)
+    {
+      m_ShardIndex = index;
+      m_NumberOfShards = count;
+      this->Modified();
+    }
+    itkGetMacro(ShardIndex, unsigned int);
+    itkGetMacro(NumberOfShards, unsigned int);
+
+    /** Slab of the signal of the shard (the whole signal without
+     * shards), known after PrepareInputs() */
+    const RegionType& GetShardRegion() const
+    {
+      return m_ShardRegion;
+    }
+
+    /** Convert the signal to concentrations and fit the model */
+    void Update();
+
+    /** Results at the size of the signal. Maps are zero outside the
+     * processed region, except the diagnostics which are -1. */
+    typename OutputVolumeType::Pointer GetKtrans() const;
+    typename OutputVolumeType::Pointer GetVe() const;
+    typename OutputVolumeType::Pointer GetFpv() const;
+    typename OutputVolumeType::Pointer GetMaxSlope() const;
+    typename OutputVolumeType::Pointer GetAUC() const;
+    typename OutputVolumeType::Pointer GetRSquared() const;
+    typename OutputVolumeType::Pointer GetBAT() const;
+    typename OutputVolumeType::Pointer GetOptimizerDiagnostics() const;
+    typename OutputVolumeType::Pointer GetIterations() const;
+    typename OutputVolumeType::Pointer GetEvaluations() const;
+    typename OutputVolumeType::Pointer GetFitTime() const;
+    typename FloatVectorVolumeType::Pointer GetConcentrations() const;
+    typename FloatVectorVolumeType::Pointer GetFittedData() const;
+    typename FloatVectorVolumeType::Pointer GetParametricMaps() const;
+
+    /** Bounding box of the nonzero voxels of a mask. Returns false if
+     * the mask is empty. */
+    static bool GetMaskBoundingRegion(const MaskVolumeType* mask, RegionType& region);
+
+  protected:
+    PkModelingEngine();
+    virtual ~PkModelingEngine() {}
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+    // Extract a region of an image. The data is only read (for a reader
+    // that streams) and copied when the region is smaller than the image.
+    template <class TImage>
+    static typename TImage::Pointer CropToRegion(TImage* image, const RegionType& region);
+
+    // Place an image computed over the processed region into an image
+    // covering the whole signal grid, filling the rest with fillValue.
+    template <class TImage>
+    typename TImage::Pointer UncropImage(TImage* image, const typename TImage::PixelType& fillValue) const;
+
+    typename MaskVolumeType::Pointer CropMask(MaskVolumeType* mask) const;
+
+    // Slab of the signal of the shard
+    RegionType ComputeShardRegion() const;
+
+  private:
+    PkModelingEngine(const Self &); //purposely not implemented
+    void operator=(const Self &);   //purposely not implemented
+
+    PkModelingParameters m_Parameters;
+
+    typename SignalVolumeType::Pointer m_Signal;
+    std::vector<float> m_Timing;
+    float m_FlipAngle;
+    float m_RepetitionTime;
+
+    typename MaskVolumeType::Pointer m_AIFMask;
+    typename MaskVolumeType::Pointer m_ROIMask;
+    typename MaskVolumeType::Pointer m_T1Map;
+    typename MaskVolumeType::Pointer m_RegionLabelMap;
+
+    bool m_UsePrescribedAIF;
+    std::vector<float> m_PrescribedAIFTiming;
+    std::vector<float> m_PrescribedAIF;
+
+    PkTimingReport::Pointer m_TimingReport;
+
+    unsigned int m_ShardIndex;
+    unsigned int m_NumberOfShards;
+    RegionType m_ShardRegion;
+    typename MaskVolumeType::Pointer m_ShardROIMask; // the ROI within the slab
+
+    // Latest modification time of the engine and its input images
+    ModifiedTimeType GetInputsMTime() const;
+
+    // inputs restricted to the processed region, and when they were
+    TimeStamp m_InputsPreparedTime;
+    RegionType m_ProcessingRegion;
+    typename SignalVolumeType::Pointer m_ProcessingSignal;
+    typename MaskVolumeType::Pointer m_ProcessingAIFMask;
+    typename MaskVolumeType::Pointer m_ProcessingROIMask;
+    typename MaskVolumeType::Pointer m_ProcessingFitROIMask; // the ROI of the shard
+    typename MaskVolumeType::Pointer m_ProcessingT1Map;
+    typename MaskVolumeType::Pointer m_ProcessingRegionLabelMap;
+
+    typename ConverterType::Pointer m_Converter;
+    typename QuantifierType::Pointer m_Quantifier;
+  };
+
+}; // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkPkModelingEngine.hxx"
+#endif
+
+#endif
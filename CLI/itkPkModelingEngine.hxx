@@ -0,0 +1,553 @@
+#ifndef _itkPkModelingEngine_hxx
+#define _itkPkModelingEngine_hxx
+
+#include "itkPkModelingEngine.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkRegionOfInterestImageFilter.h"
+#include <algorithm>
+
+namespace itk
+{
+
+  template <class TInputPixel, class TMaskPixel>
+  PkModelingEngine<TInputPixel, TMaskPixel>::PkModelingEngine()
+  {
+    m_FlipAngle = 0.0f;
+    m_RepetitionTime = 0.0f;
+    m_UsePrescribedAIF = false;
+    m_ShardIndex = 0;
+    m_NumberOfShards = 1;
+    m_Converter = ConverterType::New();
+    m_Quantifier = QuantifierType::New();
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  void PkModelingEngine<TInputPixel, TMaskPixel>
+    ::SetSignalBuffer(TInputPixel* buffer, const SizeType& size, unsigned int numberOfFrames,
+    const SpacingType& spacing, const PointType& origin)
+  {
+    typename SignalVolumeType::Pointer signal = SignalVolumeType::New();
+    signal->SetRegions(RegionType(size));
+    signal->SetNumberOfComponentsPerPixel(numberOfFrames);
+    signal->SetSpacing(spacing);
+    signal->SetOrigin(origin);
+
+    typename SignalVolumeType::PixelContainer::Pointer container = SignalVolumeType::PixelContainer::New();
+    container->SetImportPointer(buffer, size[0] * size[1] * size[2] * numberOfFrames, false);
+    signal->SetPixelContainer(container);
+
+    this->SetSignal(signal);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::MaskVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::ImportMask(TMaskPixel* buffer) const
+  {
+    if (!m_Signal)
+    {
+      itkExceptionMacro("The signal must be set before importing a mask.");
+    }
+    typename MaskVolumeType::Pointer mask = MaskVolumeType::New();
+    mask->CopyInformation(m_Signal);
+    mask->SetRegions(m_Signal->GetLargestPossibleRegion());
+
+    const SizeType size = m_Signal->GetLargestPossibleRegion().GetSize();
+    typename MaskVolumeType::PixelContainer::Pointer container = MaskVolumeType::PixelContainer::New();
+    container->SetImportPointer(buffer, size[0] * size[1] * size[2], false);
+    mask->SetPixelContainer(container);
+    return mask;
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  void PkModelingEngine<TInputPixel, TMaskPixel>
+    ::SetPrescribedAIF(const std::vector<float>& timing, const std::vector<float>& aif)
+  {
+    m_PrescribedAIFTiming = timing;
+    m_PrescribedAIF = aif;
+    m_UsePrescribedAIF = !aif.empty();
+    this->Modified();
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  bool PkModelingEngine<TInputPixel, TMaskPixel>
+    ::GetMaskBoundingRegion(const MaskVolumeType* mask, RegionType& region)
+  {
+    typedef typename MaskVolumeType::IndexType IndexType;
+    IndexType lower = mask->GetBufferedRegion().GetIndex();
+    IndexType upper = lower;
+    bool found = false;
+
+    ImageRegionConstIteratorWithIndex<MaskVolumeType> it(mask, mask->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+    {
+      if (!it.Get())
+      {
+        continue;
+      }
+      const IndexType index = it.GetIndex();
+      for (unsigned int i = 0; i < ImageDimension; ++i)
+      {
+        if (!found || index[i] < lower[i])
+        {
+          lower[i] = index[i];
+        }
+        if (!found || index[i] > upper[i])
+        {
+          upper[i] = index[i];
+        }
+      }
+      found = true;
+    }
+
+    if (found)
+    {
+      SizeType size;
+      for (unsigned int i = 0; i < ImageDimension; ++i)
+      {
+        size[i] = upper[i] - lower[i] + 1;
+      }
+      region.SetIndex(lower);
+      region.SetSize(size);
+    }
+    return found;
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  template <class TImage>
+  typename TImage::Pointer PkModelingEngine<TInputPixel, TMaskPixel>
+    ::CropToRegion(TImage* image, const RegionType& region)
+  {
+    if (region == image->GetLargestPossibleRegion())
+    {
+      image->Update();
+      return image;
+    }
+
+    typedef RegionOfInterestImageFilter<TImage, TImage> CropperType;
+    typename CropperType::Pointer cropper = CropperType::New();
+    cropper->SetInput(image);
+    cropper->SetRegionOfInterest(region);
+    cropper->Update();
+
+    typename TImage::Pointer cropped = cropper->GetOutput();
+    cropped->DisconnectPipeline();
+    cropped->SetMetaDataDictionary(image->GetMetaDataDictionary());
+    return cropped;
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  template <class TImage>
+  typename TImage::Pointer PkModelingEngine<TInputPixel, TMaskPixel>
+    ::UncropImage(TImage* image, const typename TImage::PixelType& fillValue) const
+  {
+    if (m_ProcessingRegion == m_Signal->GetLargestPossibleRegion())
+    {
+      return image;
+    }
+
+    typename TImage::Pointer full = TImage::New();
+    full->CopyInformation(m_Signal);
+    full->SetNumberOfComponentsPerPixel(image->GetNumberOfComponentsPerPixel());
+    full->SetRegions(m_Signal->GetLargestPossibleRegion());
+    full->Allocate();
+    full->FillBuffer(fillValue);
+    full->SetMetaDataDictionary(image->GetMetaDataDictionary());
+
+    ImageRegionConstIterator<TImage> inIt(image, image->GetBufferedRegion());
+    ImageRegionIterator<TImage> outIt(full, m_ProcessingRegion);
+    for (; !inIt.IsAtEnd(); ++inIt, ++outIt)
+    {
+      outIt.Set(inIt.Get());
+    }
+    return full;
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::MaskVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::CropMask(MaskVolumeType* mask) const
+  {
+    if (!mask)
+    {
+      return 0;
+    }
+    if (mask->GetLargestPossibleRegion() != m_Signal->GetLargestPossibleRegion())
+    {
+      itkExceptionMacro("Masks must be on the grid of the signal.");
+    }
+    return CropToRegion(mask, m_ProcessingRegion);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::RegionType
+    PkModelingEngine<TInputPixel, TMaskPixel>::ComputeShardRegion() const
+  {
+    const RegionType fullRegion = m_Signal->GetLargestPossibleRegion();
+    const SizeValueType numberOfSlices = fullRegion.GetSize()[2];
+    if (m_NumberOfShards > numberOfSlices)
+    {
+      itkExceptionMacro("Cannot divide " << numberOfSlices << " slices into " << m_NumberOfShards << " shards.");
+    }
+
+    // weight of each slice: its number of ROI voxels, or 1 for all
+    // slices when there are none
+    std::vector<unsigned long long> weight(numberOfSlices, 0);
+    if (m_ROIMask)
+    {
+      ImageRegionConstIteratorWithIndex<MaskVolumeType> it(m_ROIMask, fullRegion);
+      for (; !it.IsAtEnd(); ++it)
+      {
+        if (it.Get())
+        {
+          ++weight[it.GetIndex()[2] - fullRegion.GetIndex()[2]];
+        }
+      }
+    }
+    unsigned long long total = 0;
+    for (SizeValueType z = 0; z < numberOfSlices; ++z)
+    {
+      total += weight[z];
+    }
+    if (total == 0)
+    {
+      std::fill(weight.begin(), weight.end(), 1);
+      total = numberOfSlices;
+    }
+
+    // shard k starts at the first slice with at least k / count of the
+    // weight before it, keeping at least one slice per shard. Integer
+    // arithmetic, so that every shard computes the same boundaries.
+    std::vector<SizeValueType> start(m_NumberOfShards + 1);
+    start[0] = 0;
+    start[m_NumberOfShards] = numberOfSlices;
+    unsigned long long before = 0;
+    SizeValueType z = 0;
+    for (unsigned int k = 1; k < m_NumberOfShards; ++k)
+    {
+      while (z < numberOfSlices && before * m_NumberOfShards < total * k)
+      {
+        before += weight[z];
+        ++z;
+      }
+      start[k] = std::min(std::max(z, start[k - 1] + 1), numberOfSlices - (m_NumberOfShards - k));
+    }
+
+    RegionType shardRegion = fullRegion;
+    shardRegion.SetIndex(2, fullRegion.GetIndex()[2] + start[m_ShardIndex]);
+    shardRegion.SetSize(2, start[m_ShardIndex + 1] - start[m_ShardIndex]);
+    return shardRegion;
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  void PkModelingEngine<TInputPixel, TMaskPixel>::PrepareInputs()
+  {
+    if (!m_Signal)
+    {
+      itkExceptionMacro("A signal must be set.");
+    }
+    const bool measuredAIF = !m_UsePrescribedAIF && !m_Parameters.UsePopulationAIF;
+    if (measuredAIF && !m_AIFMask)
+    {
+      itkExceptionMacro("Either a mask localizing the region over which to calculate the arterial input function or a prescribed arterial input function must be specified.");
+    }
+
+    // a shard fits the ROI voxels of its slab
+    m_ShardRegion = m_Signal->GetLargestPossibleRegion();
+    m_ShardROIMask = m_ROIMask;
+    if (m_NumberOfShards > 1)
+    {
+      if (m_ShardIndex >= m_NumberOfShards)
+      {
+        itkExceptionMacro("Shard " << m_ShardIndex << " of " << m_NumberOfShards << " does not exist.");
+      }
+      if (m_RegionLabelMap || m_Parameters.NumberOfClusters > 0 || m_Parameters.PyramidFactor > 1)
+      {
+        itkExceptionMacro("Region labels, clustering and pyramid fitting cannot be sharded.");
+      }
+      if (m_ROIMask && m_ROIMask->GetLargestPossibleRegion() != m_Signal->GetLargestPossibleRegion())
+      {
+        itkExceptionMacro("Masks must be on the grid of the signal.");
+      }
+      m_ShardRegion = this->ComputeShardRegion();
+
+      m_ShardROIMask = MaskVolumeType::New();
+      m_ShardROIMask->CopyInformation(m_Signal);
+      m_ShardROIMask->SetRegions(m_Signal->GetLargestPossibleRegion());
+      m_ShardROIMask->Allocate();
+      m_ShardROIMask->FillBuffer(0);
+      ImageRegionIterator<MaskVolumeType> shardIt(m_ShardROIMask, m_ShardRegion);
+      if (m_ROIMask)
+      {
+        ImageRegionConstIterator<MaskVolumeType> roiIt(m_ROIMask, m_ShardRegion);
+        for (; !shardIt.IsAtEnd(); ++shardIt, ++roiIt)
+        {
+          shardIt.Set(roiIt.Get());
+        }
+      }
+      else
+      {
+        for (; !shardIt.IsAtEnd(); ++shardIt)
+        {
+          shardIt.Set(1);
+        }
+      }
+    }
+
+    // without an ROI, the labels bound the voxels that are used. A shard
+    // is processed over the region of the whole study, so that it
+    // computes the same concentrations and AIF; only its fit is
+    // restricted to the ROI voxels of its slab.
+    m_ProcessingRegion = m_Signal->GetLargestPossibleRegion();
+    MaskVolumeType* boundingMask = m_ROIMask ? m_ROIMask.GetPointer() : m_RegionLabelMap.GetPointer();
+    const bool bounded = boundingMask && GetMaskBoundingRegion(boundingMask, m_ProcessingRegion);
+    if (bounded)
+    {
+      RegionType aifRegion;
+      if (measuredAIF && GetMaskBoundingRegion(m_AIFMask, aifRegion))
+      {
+        // smallest region containing both
+        typename RegionType::IndexType lower;
+        SizeType size;
+        for (unsigned int i = 0; i < ImageDimension; ++i)
+        {
+          lower[i] = std::min(m_ProcessingRegion.GetIndex()[i], aifRegion.GetIndex()[i]);
+          const typename RegionType::IndexValueType upper = std::max(
+            m_ProcessingRegion.GetIndex()[i] + static_cast<typename RegionType::IndexValueType>(m_ProcessingRegion.GetSize()[i]),
+            aifRegion.GetIndex()[i] + static_cast<typename RegionType::IndexValueType>(aifRegion.GetSize()[i]));
+          size[i] = upper - lower[i];
+        }
+        m_ProcessingRegion = RegionType(lower, size);
+      }
+    }
+
+    const double startTime = PkTimingReport::GetTime();
+    m_ProcessingSignal = CropToRegion(m_Signal.GetPointer(), m_ProcessingRegion);
+    if (m_TimingReport)
+    {
+      m_TimingReport->AddStep(PkTimingReport::ReadStage, "input", PkTimingReport::GetTime() - startTime);
+    }
+    m_ProcessingAIFMask = this->CropMask(m_AIFMask);
+    m_ProcessingROIMask = this->CropMask(m_ROIMask);
+    m_ProcessingFitROIMask = m_ShardROIMask == m_ROIMask ? m_ProcessingROIMask : this->CropMask(m_ShardROIMask);
+    m_ProcessingT1Map = this->CropMask(m_T1Map);
+    m_ProcessingRegionLabelMap = this->CropMask(m_RegionLabelMap);
+    m_InputsPreparedTime.Modified();
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  ModifiedTimeType PkModelingEngine<TInputPixel, TMaskPixel>::GetInputsMTime() const
+  {
+    ModifiedTimeType mtime = this->GetMTime();
+    const DataObject* inputs[] = { m_Signal, m_AIFMask, m_ROIMask, m_T1Map, m_RegionLabelMap };
+    for (unsigned int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i)
+    {
+      if (inputs[i])
+      {
+        mtime = std::max(mtime, inputs[i]->GetMTime());
+      }
+    }
+    return mtime;
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  void PkModelingEngine<TInputPixel, TMaskPixel>::Update()
+  {
+    if (m_InputsPreparedTime.GetMTime() < this->GetInputsMTime())
+    {
+      this->PrepareInputs();
+    }
+    const PkModelingParameters& p = m_Parameters;
+
+    // every input is set, null included, so that nothing is left over
+    // from an earlier study processed by this engine
+    const bool measuredAIF = !m_UsePrescribedAIF && !p.UsePopulationAIF;
+
+    //Convert to concentration values
+    m_Converter->SetInput(m_ProcessingSignal);
+    m_Converter->SetAIFMask(measuredAIF ? m_ProcessingAIFMask.GetPointer() : 0);
+    m_Converter->SetROIMask(m_ProcessingROIMask);
+    m_Converter->SetT1Map(m_ProcessingT1Map);
+    m_Converter->SetT1PreBlood(p.T1PreBlood);
+    m_Converter->SetT1PreTissue(p.T1PreTissue);
+    m_Converter->SetTR(m_RepetitionTime);
+    m_Converter->SetFA(m_FlipAngle);
+    m_Converter->SetBATCalculationMode(p.BATCalculationMode);
+    m_Converter->SetconstantBAT(p.ConstantBAT);
+    m_Converter->SetRGD_relaxivity(p.Relaxivity);
+    m_Converter->SetS0GradThresh(p.S0GradThresh);
+    m_Converter->SetTimingReport(m_TimingReport);
+    m_Converter->Update();
+
+    //Calculate parameters
+    m_Quantifier->SetInput(m_Converter->GetOutput());
+    if (m_UsePrescribedAIF)
+    {
+      m_Quantifier->SetPrescribedAIF(m_PrescribedAIFTiming, m_PrescribedAIF);
+    }
+    m_Quantifier->SetUsePrescribedAIF(m_UsePrescribedAIF);
+    m_Quantifier->SetUsePopulationAIF(!m_UsePrescribedAIF && p.UsePopulationAIF);
+    m_Quantifier->SetAIFMask(m_UsePrescribedAIF ? 0 : m_ProcessingAIFMask.GetPointer());
+    m_Quantifier->SetROIMask(m_ProcessingFitROIMask);
+    m_Quantifier->SetRegionLabelMap(m_ProcessingRegionLabelMap);
+
+    m_Quantifier->SetAUCTimeInterval(p.AUCTimeInterval);
+    m_Quantifier->SetTiming(m_Timing);
+    m_Quantifier->SetfTol(p.FTolerance);
+    m_Quantifier->SetgTol(p.GTolerance);
+    m_Quantifier->SetxTol(p.XTolerance);
+    m_Quantifier->Setepsilon(p.Epsilon);
+    m_Quantifier->SetmaxIter(p.MaxIter);
+    m_Quantifier->Sethematocrit(p.Hematocrit);
+    m_Quantifier->SetconstantBAT(p.ConstantBAT);
+    m_Quantifier->SetBATCalculationMode(p.BATCalculationMode);
+    if (p.ComputeFpv)
+    {
+      m_Quantifier->SetModelType(LMCostFunction::TOFTS_3_PARAMETER);
+    }
+    else
+    {
+      m_Quantifier->SetModelType(LMCostFunction::TOFTS_2_PARAMETER);
+    }
+    m_Quantifier->SetMaskByRSquared(p.MaskByRSquared);
+    m_Quantifier->SetComputeParametricMaps(p.ComputeParametricMaps);
+    m_Quantifier->SetComputeFitCostMaps(p.ComputeFitCostMaps);
+    m_Quantifier->SetVerbose(p.Verbose);
+    m_Quantifier->SetPrescreenPeakEnhancement(p.PrescreenPeakEnhancement);
+    m_Quantifier->SetPrescreenMaxSlope(p.PrescreenMaxSlope);
+    m_Quantifier->SetPrescreenSNR(p.PrescreenSNR);
+    m_Quantifier->SetTieredFitting(p.TieredFitting);
+    m_Quantifier->SetTieredToleranceScale(p.TieredToleranceScale);
+    m_Quantifier->SetTieredMaxIter(p.TieredMaxIter);
+    m_Quantifier->SetRefitRSquaredThreshold(p.RefitRSquaredThreshold);
+    m_Quantifier->SetBoundedFitting(p.BoundedFitting);
+    m_Quantifier->SetUseFitCache(p.UseFitCache);
+    m_Quantifier->SetNumberOfClusters(std::max(p.NumberOfClusters, 0));
+    m_Quantifier->SetClusterRefineIterations(p.ClusterRefineIterations);
+    m_Quantifier->SetPyramidFactor(p.PyramidFactor);
+    m_Quantifier->SetCheckpointFileName(p.CheckpointFileName);
+    m_Quantifier->SetResumeFromCheckpoint(p.ResumeFromCheckpoint);
+    m_Quantifier->SetCheckpointInterval(p.CheckpointInterval);
+    m_Quantifier->SetTimingReport(m_TimingReport);
+    m_Quantifier->Update();
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetKtrans() const
+  {
+    return this->UncropImage(m_Quantifier->GetKTransOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetVe() const
+  {
+    return this->UncropImage(m_Quantifier->GetVEOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetFpv() const
+  {
+    return this->UncropImage(m_Quantifier->GetFPVOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetMaxSlope() const
+  {
+    return this->UncropImage(m_Quantifier->GetMaxSlopeOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetAUC() const
+  {
+    return this->UncropImage(m_Quantifier->GetAUCOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetRSquared() const
+  {
+    return this->UncropImage(m_Quantifier->GetRSquaredOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetBAT() const
+  {
+    return this->UncropImage(m_Quantifier->GetBATOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetOptimizerDiagnostics() const
+  {
+    return this->UncropImage(m_Quantifier->GetOptimizerDiagnosticsOutput(), -1.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetIterations() const
+  {
+    return this->UncropImage(m_Quantifier->GetIterationsOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetEvaluations() const
+  {
+    return this->UncropImage(m_Quantifier->GetEvaluationsOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::OutputVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetFitTime() const
+  {
+    return this->UncropImage(m_Quantifier->GetFitTimeOutput(), 0.0f);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::FloatVectorVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetConcentrations() const
+  {
+    typename FloatVectorVolumeType::PixelType zeroCurve(m_Signal->GetNumberOfComponentsPerPixel());
+    zeroCurve.Fill(0.0f);
+    return this->UncropImage(m_Converter->GetOutput(), zeroCurve);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::FloatVectorVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetFittedData() const
+  {
+    typename FloatVectorVolumeType::PixelType zeroCurve(m_Signal->GetNumberOfComponentsPerPixel());
+    zeroCurve.Fill(0.0f);
+    return this->UncropImage(m_Quantifier->GetFittedDataOutput(), zeroCurve);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  typename PkModelingEngine<TInputPixel, TMaskPixel>::FloatVectorVolumeType::Pointer
+    PkModelingEngine<TInputPixel, TMaskPixel>::GetParametricMaps() const
+  {
+    typename FloatVectorVolumeType::PixelType outsideMaps(QuantifierType::NumberOfParametricMaps);
+    outsideMaps.Fill(0.0f);
+    outsideMaps[QuantifierType::DiagnosticsMap] = -1.0f;
+    return this->UncropImage(m_Quantifier->GetParametricMapsOutput(), outsideMaps);
+  }
+
+  template <class TInputPixel, class TMaskPixel>
+  void PkModelingEngine<TInputPixel, TMaskPixel>::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "FlipAngle: " << m_FlipAngle << std::endl;
+    os << indent << "RepetitionTime: " << m_RepetitionTime << std::endl;
+    os << indent << "NumberOfFrames: " << m_Timing.size() << std::endl;
+    os << indent << "UsePrescribedAIF: " << m_UsePrescribedAIF << std::endl;
+    os << indent << "Shard: " << m_ShardIndex << " of " << m_NumberOfShards << std::endl;
+    os << indent << "ProcessingRegion: " << m_ProcessingRegion << std::endl;
+  }
+
+} // end namespace itk
+
+#endif
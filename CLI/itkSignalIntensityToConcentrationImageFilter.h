@@ -19,6 +19,7 @@
 #include "itkImageFileWriter.h"
 
 #include "PkSolver.h"
+#include "PkTimingReport.h"
 
 namespace itk
 {
@@ -108,6 +109,10 @@ namespace itk
     itkGetMacro(constantBAT, int);
     itkSetMacro(constantBAT, int);
 
+    // Optional report to record the time of the S0 and concentration stages
+    itkSetObjectMacro(TimingReport, PkTimingReport);
+    itkGetObjectMacro(TimingReport, PkTimingReport);
+
     // Set a mask image for specifying the location of the arterial
     // input function. This is interpretted as a binary image with
     // nonzero values only at the arterial input function locations.
@@ -174,6 +179,7 @@ namespace itk
     float m_S0GradThresh;
     std::string m_BATCalculationMode;
     int m_constantBAT;
+    PkTimingReport::Pointer m_TimingReport;
   };
 
 }; // end namespace itk
@@ -27,6 +27,7 @@ void SignalIntensityToConcentrationImageFilter<TInputImage, TMaskImage, TOutputI
   OutputImageType* outputVolume = this->GetOutput();
   outputVolume->SetBufferedRegion(inputVectorVolume->GetBufferedRegion());
   outputVolume->Allocate();
+  const double startTime = PkTimingReport::GetTime();
   // Get S0 Volume
   typedef SignalIntensityToS0ImageFilter<TInputImage, InternalVolumeType> S0VolumeFilterType;
   typename S0VolumeFilterType::Pointer S0VolumeFilter = S0VolumeFilterType::New();
@@ -36,6 +37,13 @@ void SignalIntensityToConcentrationImageFilter<TInputImage, TMaskImage, TOutputI
   S0VolumeFilter->SetconstantBAT(m_constantBAT);
   S0VolumeFilter->Update();
   InternalVolumePointerType S0Volume = S0VolumeFilter->GetOutput();
+  const double s0Time = PkTimingReport::GetTime();
+  // each step is recorded when it ends, so that its trace event starts
+  // at the right time
+  if (m_TimingReport)
+    {
+    m_TimingReport->AddStep(PkTimingReport::S0Stage, "s0", s0Time - startTime);
+    }
   
   InternalVolumeIterType S0VolumeIter(S0Volume, S0Volume->GetRequestedRegion() );
   InputImageConstIterType inputVectorVolumeIter(inputVectorVolume, 
@@ -176,6 +184,16 @@ void SignalIntensityToConcentrationImageFilter<TInputImage, TMaskImage, TOutputI
     }
 
   delete [] concentrationVectorVoxelTemp;
+
+  // the conversion runs on a single thread
+  if (m_TimingReport)
+    {
+    const double endTime = PkTimingReport::GetTime();
+    const double wallSeconds = endTime - startTime;
+    m_TimingReport->AddStep(PkTimingReport::ConcentrationStage, "concentration", endTime - s0Time);
+    m_TimingReport->AddSection("concentration", wallSeconds, std::vector<double>(1, wallSeconds),
+                               outputVolume->GetRequestedRegion().GetNumberOfPixels());
+    }
 }
 
 
@@ -0,0 +1,295 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Round trip of a multi-component volume through the chunked container:
+// whole and partial reads of files written with compressed and raw
+// tiles, and, when the path of PkChunkedConvert is given, a conversion
+// from NRRD to .pkc and back.
+//
+// Usage: itkPkChunkedImageIOTest temporaryDirectory [PkChunkedConvert]
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMetaDataObject.h"
+#include "itkNrrdImageIO.h"
+#include "itkNrrdImageIOFactory.h"
+#include "itkPkChunkedImageIO.h"
+#include "itkPkChunkedImageIOFactory.h"
+#include "itkVectorImage.h"
+#include "itksys/SystemTools.hxx"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace
+{
+  typedef itk::VectorImage<short, 3> ImageType;
+
+  const unsigned int NumberOfComponents = 7;
+
+  // A value that differs for every voxel and component
+  short GetValue(const ImageType::IndexType& index, unsigned int component)
+  {
+    return static_cast<short>((((index[2] * 31 + index[1]) * 37 + index[0]) * 11 + component) % 60000 - 30000);
+  }
+
+  ImageType::Pointer MakeImage()
+  {
+    // sizes that are not multiples of the tile size, so that the tiles
+    // at the far edges are partial
+    ImageType::SizeType size;
+    size[0] = 37;
+    size[1] = 23;
+    size[2] = 9;
+    ImageType::IndexType start;
+    start.Fill(0);
+    ImageType::RegionType region(start, size);
+
+    ImageType::Pointer image = ImageType::New();
+    image->SetRegions(region);
+    image->SetNumberOfComponentsPerPixel(NumberOfComponents);
+    ImageType::SpacingType spacing;
+    spacing[0] = 0.5;
+    spacing[1] = 0.75;
+    spacing[2] = 3.0;
+    image->SetSpacing(spacing);
+    ImageType::PointType origin;
+    origin[0] = -10.0;
+    origin[1] = 20.0;
+    origin[2] = 5.5;
+    image->SetOrigin(origin);
+    image->Allocate();
+
+    ImageType::PixelType pixel(NumberOfComponents);
+    for (itk::ImageRegionIteratorWithIndex<ImageType> it(image, region); !it.IsAtEnd(); ++it)
+    {
+      for (unsigned int c = 0; c < NumberOfComponents; ++c)
+      {
+        pixel[c] = GetValue(it.GetIndex(), c);
+      }
+      it.Set(pixel);
+    }
+
+    itk::MetaDataDictionary& dictionary = image->GetMetaDataDictionary();
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.FrameLabels", "0,1000,2000,3000,4000,5000,6000");
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.DICOM.FlipAngle", "15");
+    return image;
+  }
+
+  // Compare the pixels of an image read back over its buffered region
+  // with the values they were written with
+  bool CheckPixels(const ImageType* image, const ImageType::RegionType& region, const std::string& name)
+  {
+    if (!image->GetBufferedRegion().IsInside(region))
+    {
+      std::cerr << name << ": region " << region << " was not read" << std::endl;
+      return false;
+    }
+    if (image->GetNumberOfComponentsPerPixel() != NumberOfComponents)
+    {
+      std::cerr << name << ": " << image->GetNumberOfComponentsPerPixel() << " components" << std::endl;
+      return false;
+    }
+    for (itk::ImageRegionConstIteratorWithIndex<ImageType> it(image, region); !it.IsAtEnd(); ++it)
+    {
+      const ImageType::PixelType pixel = it.Get();
+      for (unsigned int c = 0; c < NumberOfComponents; ++c)
+      {
+        if (pixel[c] != GetValue(it.GetIndex(), c))
+        {
+          std::cerr << name << ": voxel " << it.GetIndex() << " component " << c << " is "
+            << pixel[c] << " instead of " << GetValue(it.GetIndex(), c) << std::endl;
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  bool CheckInformation(const ImageType* image, const ImageType* reference, const std::string& name)
+  {
+    if (image->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion()
+      || image->GetSpacing() != reference->GetSpacing()
+      || image->GetOrigin() != reference->GetOrigin())
+    {
+      std::cerr << name << ": the geometry differs" << std::endl;
+      return false;
+    }
+    std::string labels;
+    if (!itk::ExposeMetaData<std::string>(image->GetMetaDataDictionary(), "MultiVolume.FrameLabels", labels)
+      || labels != "0,1000,2000,3000,4000,5000,6000")
+    {
+      std::cerr << name << ": the attributes were not preserved" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  ImageType::RegionType MakeRegion(long x, long y, long z, unsigned long sx, unsigned long sy, unsigned long sz)
+  {
+    ImageType::IndexType index;
+    index[0] = x;
+    index[1] = y;
+    index[2] = z;
+    ImageType::SizeType size;
+    size[0] = sx;
+    size[1] = sy;
+    size[2] = sz;
+    return ImageType::RegionType(index, size);
+  }
+
+  bool TestFile(const ImageType* reference, const std::string& fileName, bool compress)
+  {
+    itk::PkChunkedImageIO::Pointer io = itk::PkChunkedImageIO::New();
+    io->SetTileSize(16, 8, 4);
+    itk::ImageFileWriter<ImageType>::Pointer writer = itk::ImageFileWriter<ImageType>::New();
+    writer->SetImageIO(io);
+    writer->SetFileName(fileName);
+    writer->SetInput(reference);
+    writer->SetUseCompression(compress);
+    writer->Update();
+
+    bool ok = true;
+    {
+      itk::ImageFileReader<ImageType>::Pointer reader = itk::ImageFileReader<ImageType>::New();
+      reader->SetFileName(fileName);
+      reader->Update();
+      ok = CheckInformation(reader->GetOutput(), reference, fileName)
+        && CheckPixels(reader->GetOutput(), reference->GetLargestPossibleRegion(), fileName) && ok;
+    }
+
+    // a region inside one tile, regions across tile boundaries, a
+    // single voxel and a region at the partial tiles of the far edges
+    const ImageType::RegionType regions[] =
+    {
+      MakeRegion(1, 1, 1, 3, 2, 2),
+      MakeRegion(10, 5, 2, 20, 10, 5),
+      MakeRegion(17, 9, 5, 1, 1, 1),
+      MakeRegion(30, 20, 6, 7, 3, 3)
+    };
+    for (unsigned int r = 0; r < sizeof(regions) / sizeof(regions[0]); ++r)
+    {
+      itk::ImageFileReader<ImageType>::Pointer reader = itk::ImageFileReader<ImageType>::New();
+      reader->SetFileName(fileName);
+      reader->UpdateOutputInformation();
+      reader->GetOutput()->SetRequestedRegion(regions[r]);
+      reader->Update();
+      ok = CheckPixels(reader->GetOutput(), regions[r], fileName) && ok;
+    }
+    return ok;
+  }
+
+  // One IO reading files of different tile sizes in turn must not keep
+  // the tile index of the previous file
+  bool TestReuse(const ImageType* reference, const std::string& directory)
+  {
+    const std::string fileNames[] =
+    {
+      directory + "/itkPkChunkedImageIOTest-reuse-a.pkc",
+      directory + "/itkPkChunkedImageIOTest-reuse-b.pkc"
+    };
+    const unsigned int tileSizes[][3] = { { 16, 8, 4 }, { 5, 3, 2 } };
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+      itk::PkChunkedImageIO::Pointer io = itk::PkChunkedImageIO::New();
+      io->SetTileSize(tileSizes[i][0], tileSizes[i][1], tileSizes[i][2]);
+      itk::ImageFileWriter<ImageType>::Pointer writer = itk::ImageFileWriter<ImageType>::New();
+      writer->SetImageIO(io);
+      writer->SetFileName(fileNames[i]);
+      writer->SetInput(reference);
+      writer->SetUseCompression(i == 0);
+      writer->Update();
+    }
+
+    bool ok = true;
+    itk::PkChunkedImageIO::Pointer io = itk::PkChunkedImageIO::New();
+    const unsigned int order[] = { 0, 1, 0 };
+    for (unsigned int i = 0; i < sizeof(order) / sizeof(order[0]); ++i)
+    {
+      itk::ImageFileReader<ImageType>::Pointer reader = itk::ImageFileReader<ImageType>::New();
+      reader->SetImageIO(io);
+      reader->SetFileName(fileNames[order[i]]);
+      reader->Update();
+      ok = CheckPixels(reader->GetOutput(), reference->GetLargestPossibleRegion(), fileNames[order[i]]) && ok;
+    }
+    return ok;
+  }
+
+  bool TestConverter(const ImageType* reference, const std::string& directory, const std::string& converter)
+  {
+    const std::string nrrdFileName = directory + "/itkPkChunkedImageIOTest-input.nrrd";
+    const std::string chunkedFileName = directory + "/itkPkChunkedImageIOTest-converted.pkc";
+    const std::string backFileName = directory + "/itkPkChunkedImageIOTest-converted.nrrd";
+
+    itk::ImageFileWriter<ImageType>::Pointer writer = itk::ImageFileWriter<ImageType>::New();
+    writer->SetImageIO(itk::NrrdImageIO::New());
+    writer->SetFileName(nrrdFileName);
+    writer->SetInput(reference);
+    writer->Update();
+
+    const std::string toChunked = "\"" + converter + "\" --tileSize 8 8 2 \"" + nrrdFileName + "\" \"" + chunkedFileName + "\"";
+    const std::string toNrrd = "\"" + converter + "\" \"" + chunkedFileName + "\" \"" + backFileName + "\"";
+    if (system(toChunked.c_str()) != 0 || system(toNrrd.c_str()) != 0)
+    {
+      std::cerr << "PkChunkedConvert failed" << std::endl;
+      return false;
+    }
+
+    bool ok = true;
+    const std::string fileNames[] = { chunkedFileName, backFileName };
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+      itk::ImageFileReader<ImageType>::Pointer reader = itk::ImageFileReader<ImageType>::New();
+      reader->SetFileName(fileNames[i]);
+      reader->Update();
+      ok = CheckInformation(reader->GetOutput(), reference, fileNames[i])
+        && CheckPixels(reader->GetOutput(), reference->GetLargestPossibleRegion(), fileNames[i]) && ok;
+    }
+    return ok;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " temporaryDirectory [PkChunkedConvert]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string directory = argv[1];
+  itksys::SystemTools::MakeDirectory(directory.c_str());
+
+  itk::NrrdImageIOFactory::RegisterOneFactory();
+  itk::PkChunkedImageIOFactory::RegisterOneFactory();
+
+  bool ok = true;
+  try
+  {
+    ImageType::Pointer reference = MakeImage();
+    ok = TestFile(reference, directory + "/itkPkChunkedImageIOTest-zlib.pkc", true) && ok;
+    ok = TestFile(reference, directory + "/itkPkChunkedImageIOTest-raw.pkc", false) && ok;
+    ok = TestReuse(reference, directory) && ok;
+    if (argc > 2)
+    {
+      ok = TestConverter(reference, directory, argv[2]) && ok;
+    }
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
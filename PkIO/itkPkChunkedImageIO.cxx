@@ -0,0 +1,646 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+#include "itkPkChunkedImageIO.h"
+#include "itkByteSwapper.h"
+#include "itkMetaDataObject.h"
+#include "itk_zlib.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+namespace
+{
+  const char* const PkChunkedMagic = "PKCHUNK0001";
+
+  // Reverse the bytes of each component in place
+  void SwapComponents(char* data, size_t numberOfBytes, unsigned int componentSize)
+  {
+    if (componentSize < 2)
+    {
+      return;
+    }
+    for (size_t i = 0; i + componentSize <= numberOfBytes; i += componentSize)
+    {
+      std::reverse(data + i, data + i + componentSize);
+    }
+  }
+
+  // Copy the overlap of two boxes between two voxel-major buffers
+  void CopyOverlap(const char* source, const unsigned long sourceStart[3], const unsigned long sourceSize[3],
+    char* destination, const unsigned long destinationStart[3], const unsigned long destinationSize[3],
+    unsigned int pixelSize)
+  {
+    unsigned long lower[3], upper[3];
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      lower[i] = std::max(sourceStart[i], destinationStart[i]);
+      upper[i] = std::min(sourceStart[i] + sourceSize[i], destinationStart[i] + destinationSize[i]);
+      if (lower[i] >= upper[i])
+      {
+        return;
+      }
+    }
+
+    const size_t rowBytes = (upper[0] - lower[0]) * pixelSize;
+    for (unsigned long z = lower[2]; z < upper[2]; ++z)
+    {
+      for (unsigned long y = lower[1]; y < upper[1]; ++y)
+      {
+        size_t sourceOffset = ((z - sourceStart[2]) * sourceSize[1] + (y - sourceStart[1])) * sourceSize[0]
+          + (lower[0] - sourceStart[0]);
+        size_t destinationOffset = ((z - destinationStart[2]) * destinationSize[1] + (y - destinationStart[1])) * destinationSize[0]
+          + (lower[0] - destinationStart[0]);
+        memcpy(destination + destinationOffset * pixelSize, source + sourceOffset * pixelSize, rowBytes);
+      }
+    }
+  }
+}
+
+namespace itk
+{
+
+  struct PkChunkedImageIO::TileThreadStruct
+  {
+    const PkChunkedImageIO* IO;
+    std::vector<unsigned long> Tiles;
+    unsigned long RegionStart[3];
+    unsigned long RegionSize[3];
+    char* Destination;                            // Read
+    const char* Source;                           // Write
+    std::vector< std::vector<char> >* Encoded;    // Write
+    std::vector<std::string> Errors;              // one per thread
+  };
+
+  PkChunkedImageIO::PkChunkedImageIO()
+  {
+    this->SetNumberOfDimensions(3);
+    m_TileSize[0] = 16;
+    m_TileSize[1] = 16;
+    m_TileSize[2] = 4;
+    m_NumberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+    m_Codec = ZLIB;
+    m_SwapBytes = false;
+
+    if (ByteSwapper<int>::SystemIsBigEndian())
+    {
+      m_ByteOrder = BigEndian;
+    }
+    else
+    {
+      m_ByteOrder = LittleEndian;
+    }
+
+    this->AddSupportedReadExtension(".pkc");
+    this->AddSupportedWriteExtension(".pkc");
+  }
+
+  void PkChunkedImageIO::SetTileSize(unsigned int x, unsigned int y, unsigned int z)
+  {
+    m_TileSize[0] = std::max(x, 1u);
+    m_TileSize[1] = std::max(y, 1u);
+    m_TileSize[2] = std::max(z, 1u);
+    this->Modified();
+  }
+
+  unsigned int PkChunkedImageIO::GetNumberOfTiles(unsigned int axis) const
+  {
+    return (m_Dimensions[axis] + m_TileSize[axis] - 1) / m_TileSize[axis];
+  }
+
+  void PkChunkedImageIO::GetTileRegion(unsigned long tile, unsigned long start[3], unsigned long size[3]) const
+  {
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      unsigned long numberOfTiles = this->GetNumberOfTiles(i);
+      start[i] = (tile % numberOfTiles) * m_TileSize[i];
+      size[i] = std::min<unsigned long>(m_TileSize[i], m_Dimensions[i] - start[i]);
+      tile /= numberOfTiles;
+    }
+  }
+
+  bool PkChunkedImageIO::CanReadFile(const char* fileName)
+  {
+    std::string extension = itksys::SystemTools::GetFilenameLastExtension(fileName);
+    if (extension != ".pkc")
+    {
+      return false;
+    }
+
+    std::ifstream file(fileName, std::ios::in | std::ios::binary);
+    if (!file)
+    {
+      return false;
+    }
+    std::string magic;
+    std::getline(file, magic);
+    return magic == PkChunkedMagic;
+  }
+
+  bool PkChunkedImageIO::CanWriteFile(const char* fileName)
+  {
+    std::string extension = itksys::SystemTools::GetFilenameLastExtension(fileName);
+    return extension == ".pkc";
+  }
+
+  void PkChunkedImageIO::ReadImageInformation()
+  {
+    // an IO reused for another file must not keep the tile index, the
+    // component type or the tile size of the previous one
+    m_TileOffsets.clear();
+    m_TileByteCounts.clear();
+    m_ComponentType = UNKNOWNCOMPONENTTYPE;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      m_TileSize[i] = 0;
+    }
+
+    std::ifstream file(m_FileName.c_str(), std::ios::in | std::ios::binary);
+    if (!file)
+    {
+      itkExceptionMacro("Cannot open " << m_FileName << " for reading.");
+    }
+
+    std::string line;
+    std::getline(file, line);
+    if (line != PkChunkedMagic)
+    {
+      itkExceptionMacro(<< m_FileName << " is not a PkModeling chunked image.");
+    }
+
+    MetaDataDictionary dictionary;
+    unsigned int numberOfComponents = 1;
+    bool sawEnd = false;
+    while (std::getline(file, line))
+    {
+      if (line == "end")
+      {
+        sawEnd = true;
+        break;
+      }
+
+      std::string::size_type separator = line.find(": ");
+      if (separator == std::string::npos)
+      {
+        continue;
+      }
+      std::string key = line.substr(0, separator);
+      std::string value = line.substr(separator + 2);
+      std::istringstream valueStream(value);
+
+      if (key == "sizes")
+      {
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+          valueStream >> m_Dimensions[i];
+        }
+      }
+      else if (key == "spacing")
+      {
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+          valueStream >> m_Spacing[i];
+        }
+      }
+      else if (key == "origin")
+      {
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+          valueStream >> m_Origin[i];
+        }
+      }
+      else if (key.compare(0, 10, "direction[") == 0)
+      {
+        unsigned int axis = atoi(key.substr(10).c_str());
+        std::vector<double> direction(3);
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+          valueStream >> direction[i];
+        }
+        if (axis < 3)
+        {
+          this->SetDirection(axis, direction);
+        }
+      }
+      else if (key == "components")
+      {
+        valueStream >> numberOfComponents;
+      }
+      else if (key == "componenttype")
+      {
+        m_ComponentType = UNKNOWNCOMPONENTTYPE;
+        for (int type = UCHAR; type <= DOUBLE; ++type)
+        {
+          if (value == GetComponentTypeAsString(static_cast<IOComponentType>(type)))
+          {
+            m_ComponentType = static_cast<IOComponentType>(type);
+          }
+        }
+      }
+      else if (key == "byteorder")
+      {
+        m_ByteOrder = (value == "big") ? BigEndian : LittleEndian;
+      }
+      else if (key == "tilesize")
+      {
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+          valueStream >> m_TileSize[i];
+        }
+      }
+      else if (key == "codec")
+      {
+        m_Codec = (value == "zlib") ? ZLIB : RAW;
+      }
+      else if (key == "meta")
+      {
+        std::string::size_type assign = value.find(":=");
+        if (assign != std::string::npos)
+        {
+          EncapsulateMetaData<std::string>(dictionary, value.substr(0, assign), value.substr(assign + 2));
+        }
+      }
+    }
+
+    if (!sawEnd || m_ComponentType == UNKNOWNCOMPONENTTYPE)
+    {
+      itkExceptionMacro("Malformed header in " << m_FileName);
+    }
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      if (m_TileSize[i] == 0)
+      {
+        itkExceptionMacro("Malformed tile size in " << m_FileName);
+      }
+    }
+
+    this->SetNumberOfComponents(numberOfComponents);
+    this->SetPixelType(numberOfComponents > 1 ? VECTOR : SCALAR);
+    this->SetMetaDataDictionary(dictionary);
+
+    m_SwapBytes = (m_ByteOrder == BigEndian) != ByteSwapper<int>::SystemIsBigEndian();
+
+    // tile index: offset and byte count of each tile
+    unsigned long numberOfTiles = this->GetNumberOfTiles(0) * this->GetNumberOfTiles(1) * this->GetNumberOfTiles(2);
+    std::vector<unsigned long long> index(2 * numberOfTiles);
+    if (numberOfTiles > 0)
+    {
+      file.read(reinterpret_cast<char *>(&index[0]), index.size() * sizeof(unsigned long long));
+      if (!file)
+      {
+        itkExceptionMacro("Truncated tile index in " << m_FileName);
+      }
+      if (m_SwapBytes)
+      {
+        SwapComponents(reinterpret_cast<char *>(&index[0]), index.size() * sizeof(unsigned long long),
+          sizeof(unsigned long long));
+      }
+    }
+
+    m_TileOffsets.resize(numberOfTiles);
+    m_TileByteCounts.resize(numberOfTiles);
+    for (unsigned long i = 0; i < numberOfTiles; ++i)
+    {
+      m_TileOffsets[i] = index[2 * i];
+      m_TileByteCounts[i] = index[2 * i + 1];
+    }
+  }
+
+  ImageIORegion PkChunkedImageIO::GenerateStreamableReadRegionFromRequestedRegion(
+    const ImageIORegion& requested) const
+  {
+    // Tiles are decoded individually, so exactly the requested region
+    // can be produced.
+    ImageIORegion streamableRegion(m_NumberOfDimensions);
+    for (unsigned int i = 0; i < m_NumberOfDimensions; ++i)
+    {
+      if (i < requested.GetImageDimension())
+      {
+        streamableRegion.SetIndex(i, requested.GetIndex(i));
+        streamableRegion.SetSize(i, requested.GetSize(i));
+      }
+      else
+      {
+        streamableRegion.SetIndex(i, 0);
+        streamableRegion.SetSize(i, 1);
+      }
+    }
+    return streamableRegion;
+  }
+
+  bool PkChunkedImageIO::DecodeTile(std::ifstream& file, unsigned long tile,
+    std::vector<char>& compressed, std::vector<char>& decoded) const
+  {
+    unsigned long start[3], size[3];
+    this->GetTileRegion(tile, start, size);
+    const size_t decodedSize = size[0] * size[1] * size[2] * this->GetPixelSize();
+    const size_t byteCount = static_cast<size_t>(m_TileByteCounts[tile]);
+
+    decoded.resize(decodedSize);
+    compressed.resize(byteCount);
+
+    file.seekg(static_cast<std::streamoff>(m_TileOffsets[tile]), std::ios::beg);
+    if (byteCount > 0)
+    {
+      file.read(&compressed[0], byteCount);
+    }
+    if (!file)
+    {
+      return false;
+    }
+
+    if (m_Codec == ZLIB)
+    {
+      uLongf length = static_cast<uLongf>(decodedSize);
+      if (uncompress(reinterpret_cast<Bytef *>(&decoded[0]), &length,
+        reinterpret_cast<const Bytef *>(&compressed[0]), static_cast<uLong>(byteCount)) != Z_OK
+        || length != decodedSize)
+      {
+        return false;
+      }
+    }
+    else
+    {
+      if (byteCount != decodedSize)
+      {
+        return false;
+      }
+      decoded.swap(compressed);
+    }
+
+    if (m_SwapBytes)
+    {
+      SwapComponents(&decoded[0], decodedSize, this->GetComponentSize());
+    }
+    return true;
+  }
+
+  ITK_THREAD_RETURN_TYPE PkChunkedImageIO::ReadTilesThreaderCallback(void* arg)
+  {
+    MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+    TileThreadStruct* str = static_cast<TileThreadStruct *>(info->UserData);
+    const PkChunkedImageIO* io = str->IO;
+
+    // each thread has its own file handle so tiles are read concurrently
+    std::ifstream file(io->GetFileName(), std::ios::in | std::ios::binary);
+    if (!file)
+    {
+      str->Errors[info->ThreadID] = "cannot open file";
+      return ITK_THREAD_RETURN_VALUE;
+    }
+
+    std::vector<char> compressed, decoded;
+    for (size_t t = info->ThreadID; t < str->Tiles.size(); t += info->NumberOfThreads)
+    {
+      unsigned long tile = str->Tiles[t];
+      if (!io->DecodeTile(file, tile, compressed, decoded))
+      {
+        std::ostringstream msg;
+        msg << "tile " << tile << " is corrupt";
+        str->Errors[info->ThreadID] = msg.str();
+        break;
+      }
+
+      unsigned long start[3], size[3];
+      io->GetTileRegion(tile, start, size);
+      CopyOverlap(&decoded[0], start, size,
+        str->Destination, str->RegionStart, str->RegionSize, io->GetPixelSize());
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void PkChunkedImageIO::Read(void* buffer)
+  {
+    if (m_TileOffsets.empty())
+    {
+      this->ReadImageInformation();
+    }
+
+    TileThreadStruct str;
+    str.IO = this;
+    str.Destination = static_cast<char *>(buffer);
+    str.Source = 0;
+    str.Encoded = 0;
+
+    // the IORegion can have fewer dimensions than the file
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      if (i < m_IORegion.GetImageDimension())
+      {
+        str.RegionStart[i] = m_IORegion.GetIndex(i);
+        str.RegionSize[i] = m_IORegion.GetSize(i);
+      }
+      else
+      {
+        str.RegionStart[i] = 0;
+        str.RegionSize[i] = 1;
+      }
+      if (str.RegionSize[i] == 0)
+      {
+        return;
+      }
+    }
+
+    // only the tiles overlapping the requested region are decoded
+    unsigned long firstTile[3], lastTile[3];
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      firstTile[i] = str.RegionStart[i] / m_TileSize[i];
+      lastTile[i] = (str.RegionStart[i] + str.RegionSize[i] - 1) / m_TileSize[i];
+    }
+    for (unsigned long z = firstTile[2]; z <= lastTile[2]; ++z)
+    {
+      for (unsigned long y = firstTile[1]; y <= lastTile[1]; ++y)
+      {
+        for (unsigned long x = firstTile[0]; x <= lastTile[0]; ++x)
+        {
+          str.Tiles.push_back((z * this->GetNumberOfTiles(1) + y) * this->GetNumberOfTiles(0) + x);
+        }
+      }
+    }
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads(std::max<unsigned int>(1,
+      std::min<size_t>(m_NumberOfThreads, str.Tiles.size())));
+    str.Errors.resize(threader->GetNumberOfThreads());
+    threader->SetSingleMethod(ReadTilesThreaderCallback, &str);
+    threader->SingleMethodExecute();
+
+    for (size_t i = 0; i < str.Errors.size(); ++i)
+    {
+      if (!str.Errors[i].empty())
+      {
+        itkExceptionMacro("Error reading " << m_FileName << ": " << str.Errors[i]);
+      }
+    }
+  }
+
+  ITK_THREAD_RETURN_TYPE PkChunkedImageIO::WriteTilesThreaderCallback(void* arg)
+  {
+    MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+    TileThreadStruct* str = static_cast<TileThreadStruct *>(info->UserData);
+    const PkChunkedImageIO* io = str->IO;
+    const unsigned int pixelSize = io->GetPixelSize();
+
+    std::vector<char> raw;
+    for (size_t t = info->ThreadID; t < str->Tiles.size(); t += info->NumberOfThreads)
+    {
+      unsigned long tile = str->Tiles[t];
+      unsigned long start[3], size[3];
+      io->GetTileRegion(tile, start, size);
+
+      // gather the tile out of the image buffer
+      raw.resize(size[0] * size[1] * size[2] * pixelSize);
+      CopyOverlap(str->Source, str->RegionStart, str->RegionSize,
+        &raw[0], start, size, pixelSize);
+
+      std::vector<char>& encoded = (*str->Encoded)[tile];
+      if (io->m_Codec == ZLIB)
+      {
+        uLongf length = compressBound(static_cast<uLong>(raw.size()));
+        encoded.resize(length);
+        if (compress2(reinterpret_cast<Bytef *>(&encoded[0]), &length,
+          reinterpret_cast<const Bytef *>(&raw[0]), static_cast<uLong>(raw.size()), Z_BEST_SPEED) != Z_OK)
+        {
+          str->Errors[info->ThreadID] = "compression failed";
+          break;
+        }
+        encoded.resize(length);
+      }
+      else
+      {
+        encoded.swap(raw);
+      }
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void PkChunkedImageIO::Write(const void* buffer)
+  {
+    if (m_NumberOfDimensions != 3)
+    {
+      itkExceptionMacro("PkChunkedImageIO only writes 3D images.");
+    }
+
+    m_Codec = m_UseCompression ? ZLIB : RAW;
+
+    const unsigned long numberOfTiles = this->GetNumberOfTiles(0) * this->GetNumberOfTiles(1) * this->GetNumberOfTiles(2);
+    std::vector< std::vector<char> > encoded(numberOfTiles);
+
+    TileThreadStruct str;
+    str.IO = this;
+    str.Destination = 0;
+    str.Source = static_cast<const char *>(buffer);
+    str.Encoded = &encoded;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      str.RegionStart[i] = 0;
+      str.RegionSize[i] = m_Dimensions[i];
+    }
+    for (unsigned long tile = 0; tile < numberOfTiles; ++tile)
+    {
+      str.Tiles.push_back(tile);
+    }
+
+    // tiles are independent, so they are compressed in parallel
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads(std::max<unsigned int>(1,
+      std::min<unsigned long>(m_NumberOfThreads, numberOfTiles)));
+    str.Errors.resize(threader->GetNumberOfThreads());
+    threader->SetSingleMethod(WriteTilesThreaderCallback, &str);
+    threader->SingleMethodExecute();
+
+    for (size_t i = 0; i < str.Errors.size(); ++i)
+    {
+      if (!str.Errors[i].empty())
+      {
+        itkExceptionMacro("Error writing " << m_FileName << ": " << str.Errors[i]);
+      }
+    }
+
+    // header
+    std::ostringstream header;
+    header.precision(17);
+    header << PkChunkedMagic << "\n";
+    header << "sizes: " << m_Dimensions[0] << " " << m_Dimensions[1] << " " << m_Dimensions[2] << "\n";
+    header << "spacing: " << m_Spacing[0] << " " << m_Spacing[1] << " " << m_Spacing[2] << "\n";
+    header << "origin: " << m_Origin[0] << " " << m_Origin[1] << " " << m_Origin[2] << "\n";
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      header << "direction[" << i << "]: " << m_Direction[i][0] << " " << m_Direction[i][1] << " " << m_Direction[i][2] << "\n";
+    }
+    header << "components: " << this->GetNumberOfComponents() << "\n";
+    header << "componenttype: " << GetComponentTypeAsString(m_ComponentType) << "\n";
+    header << "byteorder: " << (ByteSwapper<int>::SystemIsBigEndian() ? "big" : "little") << "\n";
+    header << "tilesize: " << m_TileSize[0] << " " << m_TileSize[1] << " " << m_TileSize[2] << "\n";
+    header << "codec: " << (m_Codec == ZLIB ? "zlib" : "raw") << "\n";
+
+    // string attributes (e.g. the MultiVolume tags) are preserved
+    const MetaDataDictionary& dictionary = this->GetMetaDataDictionary();
+    for (MetaDataDictionary::ConstIterator it = dictionary.Begin(); it != dictionary.End(); ++it)
+    {
+      std::string value;
+      if (ExposeMetaData<std::string>(dictionary, it->first, value)
+        && value.find('\n') == std::string::npos
+        && it->first.find(":=") == std::string::npos)
+      {
+        header << "meta: " << it->first << ":=" << value << "\n";
+      }
+    }
+    header << "end\n";
+
+    // tile index
+    const std::string headerString = header.str();
+    std::vector<unsigned long long> index(2 * numberOfTiles);
+    unsigned long long offset = headerString.size() + index.size() * sizeof(unsigned long long);
+    for (unsigned long tile = 0; tile < numberOfTiles; ++tile)
+    {
+      index[2 * tile] = offset;
+      index[2 * tile + 1] = encoded[tile].size();
+      offset += encoded[tile].size();
+    }
+
+    std::ofstream file(m_FileName.c_str(), std::ios::out | std::ios::binary);
+    if (!file)
+    {
+      itkExceptionMacro("Cannot open " << m_FileName << " for writing.");
+    }
+    file.write(headerString.c_str(), headerString.size());
+    if (!index.empty())
+    {
+      file.write(reinterpret_cast<const char *>(&index[0]), index.size() * sizeof(unsigned long long));
+    }
+    for (unsigned long tile = 0; tile < numberOfTiles; ++tile)
+    {
+      if (!encoded[tile].empty())
+      {
+        file.write(&encoded[tile][0], encoded[tile].size());
+      }
+    }
+    if (!file)
+    {
+      itkExceptionMacro("Error writing " << m_FileName);
+    }
+  }
+
+  void PkChunkedImageIO::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "TileSize: " << m_TileSize[0] << " " << m_TileSize[1] << " " << m_TileSize[2] << std::endl;
+    os << indent << "Codec: " << (m_Codec == ZLIB ? "zlib" : "raw") << std::endl;
+    os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+  }
+
+} // end namespace itk
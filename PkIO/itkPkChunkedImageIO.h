@@ -0,0 +1,140 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef __itkPkChunkedImageIO_h
+#define __itkPkChunkedImageIO_h
+
+#include "itkImageIOBase.h"
+#include "itkMultiThreader.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+  /** \class PkChunkedImageIO
+   * \brief Chunked, compressed container for multi-component volumes.
+   *
+   * The volume is split into spatial tiles. Each tile is stored
+   * voxel-major (all components of a voxel are contiguous, voxels in
+   * x-fastest order within the tile) and compressed independently, and
+   * the file carries an index of tile offsets. This matches the layout
+   * of an itk::VectorImage, so a time curve is read without any
+   * transposition, and it lets tiles be decoded by several threads and
+   * lets a requested region be read without touching the rest of the
+   * file.
+   *
+   * Files use the extension ".pkc". The header is plain text (like a
+   * NRRD header) followed by a binary tile index and the tile
+   * payloads. String metadata in the image dictionary is preserved, so
+   * the MultiVolume attributes survive a round trip.
+   */
+  class PkChunkedImageIO : public ImageIOBase
+  {
+  public:
+    /** Standard class typedefs. */
+    typedef PkChunkedImageIO         Self;
+    typedef ImageIOBase              Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+
+    /** Run-time type information (and related methods). */
+    itkTypeMacro(PkChunkedImageIO, ImageIOBase);
+
+    /** Tile codecs */
+    enum CodecType { RAW = 0, ZLIB };
+
+    /** Tile size in voxels along each dimension used when writing. */
+    void SetTileSize(unsigned int x, unsigned int y, unsigned int z);
+    unsigned int GetTileSize(unsigned int axis) const
+    {
+      return m_TileSize[axis];
+    }
+
+    /** Number of threads used to encode or decode tiles. Defaults to
+     * the global default number of threads. */
+    itkSetMacro(NumberOfThreads, unsigned int);
+    itkGetConstMacro(NumberOfThreads, unsigned int);
+
+    virtual bool SupportsDimension(unsigned long dim)
+    {
+      return dim == 3;
+    }
+
+    /** Determine if the file can be read with this ImageIO implementation. */
+    virtual bool CanReadFile(const char*);
+
+    /** Set the spacing, dimensions, components and tile index. */
+    virtual void ReadImageInformation();
+
+    /** Reads the tiles overlapping the IORegion into the buffer. */
+    virtual void Read(void* buffer);
+
+    /** Any region can be read; only the tiles overlapping it are decoded. */
+    virtual bool CanStreamRead()
+    {
+      return true;
+    }
+
+    virtual ImageIORegion GenerateStreamableReadRegionFromRequestedRegion(
+      const ImageIORegion& requested) const;
+
+    /** Determine if the file can be written with this ImageIO implementation. */
+    virtual bool CanWriteFile(const char*);
+
+    /** The header is written along with the data in Write(). */
+    virtual void WriteImageInformation()
+    {
+    }
+
+    /** Writes the whole image. Tiles are compressed with zlib when
+     * UseCompression is on and stored raw otherwise. */
+    virtual void Write(const void* buffer);
+
+  protected:
+    PkChunkedImageIO();
+    ~PkChunkedImageIO()
+    {
+    }
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+  private:
+    PkChunkedImageIO(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+
+    /** Per-thread work for encoding and decoding tiles */
+    struct TileThreadStruct;
+    static ITK_THREAD_RETURN_TYPE ReadTilesThreaderCallback(void* arg);
+    static ITK_THREAD_RETURN_TYPE WriteTilesThreaderCallback(void* arg);
+
+    /** Number of tiles along an axis */
+    unsigned int GetNumberOfTiles(unsigned int axis) const;
+
+    /** Region (in voxels) covered by a tile */
+    void GetTileRegion(unsigned long tile, unsigned long start[3], unsigned long size[3]) const;
+
+    /** Decode one tile into the caller's scratch buffer */
+    bool DecodeTile(std::ifstream& file, unsigned long tile,
+      std::vector<char>& compressed, std::vector<char>& decoded) const;
+
+    unsigned int m_TileSize[3];
+    unsigned int m_NumberOfThreads;
+    int m_Codec;
+    bool m_SwapBytes;
+
+    std::vector<unsigned long long> m_TileOffsets;
+    std::vector<unsigned long long> m_TileByteCounts;
+  };
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,48 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+#include "itkPkChunkedImageIOFactory.h"
+#include "itkPkChunkedImageIO.h"
+#include "itkCreateObjectFunction.h"
+#include "itkVersion.h"
+
+namespace itk
+{
+
+  PkChunkedImageIOFactory::PkChunkedImageIOFactory()
+  {
+    this->RegisterOverride("itkImageIOBase",
+      "itkPkChunkedImageIO",
+      "PkModeling chunked image IO",
+      1,
+      CreateObjectFunction<PkChunkedImageIO>::New());
+  }
+
+  const char* PkChunkedImageIOFactory::GetITKSourceVersion() const
+  {
+    return ITK_SOURCE_VERSION;
+  }
+
+  const char* PkChunkedImageIOFactory::GetDescription() const
+  {
+    return "PkModeling chunked image IO factory, reads and writes .pkc files.";
+  }
+
+  void PkChunkedImageIOFactory::RegisterOneFactory()
+  {
+    static bool registered = false;
+    if (!registered)
+    {
+      ObjectFactoryBase::RegisterFactory(PkChunkedImageIOFactory::New());
+      registered = true;
+    }
+  }
+
+} // end namespace itk
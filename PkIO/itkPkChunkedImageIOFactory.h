@@ -0,0 +1,56 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef __itkPkChunkedImageIOFactory_h
+#define __itkPkChunkedImageIOFactory_h
+
+#include "itkObjectFactoryBase.h"
+#include "itkImageIOBase.h"
+
+namespace itk
+{
+  /** \class PkChunkedImageIOFactory
+   * \brief Create instances of PkChunkedImageIO objects using an object factory.
+   */
+  class PkChunkedImageIOFactory : public ObjectFactoryBase
+  {
+  public:
+    /** Standard class typedefs. */
+    typedef PkChunkedImageIOFactory  Self;
+    typedef ObjectFactoryBase        Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    /** Class methods used to interface with the registered factories. */
+    virtual const char* GetITKSourceVersion() const;
+    virtual const char* GetDescription() const;
+
+    /** Method for class instantiation. */
+    itkFactorylessNewMacro(Self);
+
+    /** Run-time type information (and related methods). */
+    itkTypeMacro(PkChunkedImageIOFactory, ObjectFactoryBase);
+
+    /** Register one factory of this type. Repeated calls are ignored. */
+    static void RegisterOneFactory();
+
+  protected:
+    PkChunkedImageIOFactory();
+    ~PkChunkedImageIOFactory()
+    {
+    }
+
+  private:
+    PkChunkedImageIOFactory(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+  };
+
+} // end namespace itk
+
+#endif
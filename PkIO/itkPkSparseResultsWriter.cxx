@@ -0,0 +1,118 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+#include "itkPkSparseResultsWriter.h"
+#include "itkByteSwapper.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+  const char* const PkSparseMagic = "PKSPARSE0001";
+}
+
+namespace itk
+{
+
+  void PkSparseResultsWriter::SetColumnNames(const std::vector<std::string>& names)
+  {
+    m_ColumnNames = names;
+    m_Indices.clear();
+    m_Columns.assign(names.size(), std::vector<float>());
+    this->Modified();
+  }
+
+  void PkSparseResultsWriter::Reserve(size_t numberOfRows)
+  {
+    m_Indices.reserve(numberOfRows);
+    for (size_t c = 0; c < m_Columns.size(); ++c)
+    {
+      m_Columns[c].reserve(numberOfRows);
+    }
+  }
+
+  void PkSparseResultsWriter::AddRow(unsigned long long index, const float* values)
+  {
+    m_Indices.push_back(index);
+    for (size_t c = 0; c < m_Columns.size(); ++c)
+    {
+      m_Columns[c].push_back(values[c]);
+    }
+  }
+
+  void PkSparseResultsWriter::Write()
+  {
+    if (m_FileName.empty())
+    {
+      itkExceptionMacro("No file name specified.");
+    }
+    if (!m_ReferenceImage)
+    {
+      itkExceptionMacro("No reference image specified.");
+    }
+
+    const ReferenceImageType::SizeType size = m_ReferenceImage->GetLargestPossibleRegion().GetSize();
+    const ReferenceImageType::SpacingType spacing = m_ReferenceImage->GetSpacing();
+    const ReferenceImageType::PointType origin = m_ReferenceImage->GetOrigin();
+    const ReferenceImageType::DirectionType direction = m_ReferenceImage->GetDirection();
+
+    std::ostringstream header;
+    header.precision(17);
+    header << PkSparseMagic << "\n";
+    header << "sizes: " << size[0] << " " << size[1] << " " << size[2] << "\n";
+    header << "spacing: " << spacing[0] << " " << spacing[1] << " " << spacing[2] << "\n";
+    header << "origin: " << origin[0] << " " << origin[1] << " " << origin[2] << "\n";
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      header << "direction[" << i << "]: " << direction[i][0] << " " << direction[i][1] << " " << direction[i][2] << "\n";
+    }
+    header << "rows: " << m_Indices.size() << "\n";
+    header << "columns:";
+    for (size_t c = 0; c < m_ColumnNames.size(); ++c)
+    {
+      header << " " << m_ColumnNames[c];
+    }
+    header << "\n";
+    header << "indextype: uint64\n";
+    header << "valuetype: float\n";
+    header << "byteorder: " << (ByteSwapper<int>::SystemIsBigEndian() ? "big" : "little") << "\n";
+    header << "end\n";
+
+    std::ofstream file(m_FileName.c_str(), std::ios::out | std::ios::binary);
+    if (!file)
+    {
+      itkExceptionMacro("Cannot open " << m_FileName << " for writing.");
+    }
+    const std::string headerString = header.str();
+    file.write(headerString.c_str(), headerString.size());
+    if (!m_Indices.empty())
+    {
+      file.write(reinterpret_cast<const char *>(&m_Indices[0]), m_Indices.size() * sizeof(unsigned long long));
+      for (size_t c = 0; c < m_Columns.size(); ++c)
+      {
+        file.write(reinterpret_cast<const char *>(&m_Columns[c][0]), m_Columns[c].size() * sizeof(float));
+      }
+    }
+    if (!file)
+    {
+      itkExceptionMacro("Error writing " << m_FileName);
+    }
+  }
+
+  void PkSparseResultsWriter::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "FileName: " << m_FileName << std::endl;
+    os << indent << "NumberOfColumns: " << m_ColumnNames.size() << std::endl;
+    os << indent << "NumberOfRows: " << m_Indices.size() << std::endl;
+  }
+
+} // end namespace itk
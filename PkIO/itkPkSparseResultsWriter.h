@@ -0,0 +1,102 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef __itkPkSparseResultsWriter_h
+#define __itkPkSparseResultsWriter_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImageBase.h"
+#include <string>
+#include <vector>
+
+namespace itk
+{
+  /** \class PkSparseResultsWriter
+   * \brief Writes per-voxel results for a subset of voxels as a
+   * columnar binary table.
+   *
+   * Each row is one voxel: its linear index in the reference image
+   * (x fastest) and one float per column. The file starts with a plain
+   * text header (geometry of the reference image, number of rows, column
+   * names, byte order) terminated by "end\n", followed by the index
+   * column as uint64 and then each value column as float32, so a reader
+   * can load any single column with one contiguous read.
+   *
+   * Files use the extension ".pks".
+   */
+  class PkSparseResultsWriter : public Object
+  {
+  public:
+    /** Standard class typedefs. */
+    typedef PkSparseResultsWriter    Self;
+    typedef Object                   Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    typedef ImageBase<3> ReferenceImageType;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+
+    /** Run-time type information (and related methods). */
+    itkTypeMacro(PkSparseResultsWriter, Object);
+
+    itkSetStringMacro(FileName);
+    itkGetStringMacro(FileName);
+
+    /** Image whose geometry the linear indices refer to */
+    itkSetConstObjectMacro(ReferenceImage, ReferenceImageType);
+    itkGetConstObjectMacro(ReferenceImage, ReferenceImageType);
+
+    /** Names of the value columns. Setting them clears the rows. */
+    void SetColumnNames(const std::vector<std::string>& names);
+    const std::vector<std::string>& GetColumnNames() const
+    {
+      return m_ColumnNames;
+    }
+
+    /** Reserve space for a number of rows */
+    void Reserve(size_t numberOfRows);
+
+    /** Append a row; values holds one value per column */
+    void AddRow(unsigned long long index, const float* values);
+
+    size_t GetNumberOfRows() const
+    {
+      return m_Indices.size();
+    }
+
+    /** Write the table. Throws an ExceptionObject on error. */
+    void Write();
+
+  protected:
+    PkSparseResultsWriter()
+    {
+    }
+    ~PkSparseResultsWriter()
+    {
+    }
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+  private:
+    PkSparseResultsWriter(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+
+    std::string m_FileName;
+    ReferenceImageType::ConstPointer m_ReferenceImage;
+
+    std::vector<std::string> m_ColumnNames;
+    std::vector<unsigned long long> m_Indices;
+    std::vector< std::vector<float> > m_Columns;
+  };
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,226 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#include "PkCheckpoint.h"
+#include "PkTimingReport.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace itk
+{
+  namespace
+  {
+    const char CheckpointMagic[8] = { 'P', 'K', 'C', 'K', 'P', 'T', '0', '1' };
+
+    // Sorts record indices by voxel offset
+    struct OffsetLess
+    {
+      const std::vector<unsigned long long>* Offsets;
+      bool operator()(size_t a, size_t b) const
+      {
+        return (*Offsets)[a] < (*Offsets)[b];
+      }
+    };
+  }
+
+  PkCheckpoint::PkCheckpoint()
+  {
+    m_Interval = 60.0;
+    m_NumberOfValues = 0;
+    m_LastFlushTime = 0.0;
+  }
+
+  PkCheckpoint::~PkCheckpoint()
+  {
+    this->Close();
+  }
+
+  unsigned long long PkCheckpoint::Hash(const void* data, size_t size, unsigned long long hash)
+  {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  bool PkCheckpoint::Load(const std::string& fileName, unsigned long long key)
+  {
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    if (!file)
+    {
+      return false;
+    }
+
+    char magic[sizeof(CheckpointMagic)];
+    unsigned long long fileKey = 0;
+    unsigned int numberOfValues = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey));
+    file.read(reinterpret_cast<char*>(&numberOfValues), sizeof(numberOfValues));
+    if (!file || memcmp(magic, CheckpointMagic, sizeof(magic)) != 0
+      || fileKey != key || numberOfValues != m_NumberOfValues)
+    {
+      return false;
+    }
+
+    // records until the end, or until one cut short
+    std::vector<unsigned long long> offsets;
+    std::vector<float> values;
+    unsigned long long offset = 0;
+    std::vector<float> record(m_NumberOfValues);
+    while (file.read(reinterpret_cast<char*>(&offset), sizeof(offset))
+      && file.read(reinterpret_cast<char*>(&record[0]), m_NumberOfValues * sizeof(float)))
+    {
+      offsets.push_back(offset);
+      values.insert(values.end(), record.begin(), record.end());
+    }
+
+    // sorted for lookups; a voxel written twice keeps its first results
+    std::vector<size_t> order(offsets.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+      order[i] = i;
+    }
+    OffsetLess less;
+    less.Offsets = &offsets;
+    std::stable_sort(order.begin(), order.end(), less);
+
+    m_RestoredOffsets.clear();
+    m_RestoredValues.clear();
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+      if (!m_RestoredOffsets.empty() && m_RestoredOffsets.back() == offsets[order[i]])
+      {
+        continue;
+      }
+      m_RestoredOffsets.push_back(offsets[order[i]]);
+      m_RestoredValues.insert(m_RestoredValues.end(),
+        values.begin() + order[i] * m_NumberOfValues, values.begin() + (order[i] + 1) * m_NumberOfValues);
+    }
+    return true;
+  }
+
+  void PkCheckpoint::WriteHeader(unsigned long long key)
+  {
+    m_File.write(CheckpointMagic, sizeof(CheckpointMagic));
+    m_File.write(reinterpret_cast<const char*>(&key), sizeof(key));
+    m_File.write(reinterpret_cast<const char*>(&m_NumberOfValues), sizeof(m_NumberOfValues));
+  }
+
+  void PkCheckpoint::WriteRecords(const unsigned long long* offsets, const float* values, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      m_File.write(reinterpret_cast<const char*>(&offsets[i]), sizeof(offsets[i]));
+      m_File.write(reinterpret_cast<const char*>(values + i * m_NumberOfValues), m_NumberOfValues * sizeof(float));
+    }
+  }
+
+  bool PkCheckpoint::Open(const std::string& fileName, unsigned long long key,
+    unsigned int numberOfValues, bool resume)
+  {
+    this->Close();
+    m_NumberOfValues = numberOfValues;
+    m_RestoredOffsets.clear();
+    m_RestoredValues.clear();
+    const bool loaded = resume && this->Load(fileName, key);
+
+    // the loaded results are written back, without a chunk that may have
+    // been cut short, so that new chunks follow complete ones. They go to
+    // a temporary file that replaces the checkpoint only once complete,
+    // so that a process stopped here does not lose the checkpoint.
+    const std::string temporaryFileName = fileName + ".tmp";
+    m_File.open(temporaryFileName.c_str(), std::ios::binary | std::ios::trunc);
+    if (!m_File)
+    {
+      itkExceptionMacro("Cannot write checkpoint " << temporaryFileName);
+    }
+    this->WriteHeader(key);
+    if (!m_RestoredOffsets.empty())
+    {
+      this->WriteRecords(&m_RestoredOffsets[0], &m_RestoredValues[0], m_RestoredOffsets.size());
+    }
+    m_File.close();
+    if (m_File.fail())
+    {
+      std::remove(temporaryFileName.c_str());
+      itkExceptionMacro("Cannot write checkpoint " << temporaryFileName);
+    }
+    // rename() does not replace an existing file on Windows
+    if (std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0
+      && (std::remove(fileName.c_str()) != 0 || std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0))
+    {
+      itkExceptionMacro("Cannot replace checkpoint " << fileName << " by " << temporaryFileName);
+    }
+
+    m_File.clear();
+    m_File.open(fileName.c_str(), std::ios::binary | std::ios::app);
+    if (!m_File)
+    {
+      itkExceptionMacro("Cannot write checkpoint " << fileName);
+    }
+    m_LastFlushTime = PkTimingReport::GetTime();
+    return loaded;
+  }
+
+  void PkCheckpoint::Close()
+  {
+    if (m_File.is_open())
+    {
+      m_File.close();
+    }
+  }
+
+  bool PkCheckpoint::Find(unsigned long long offset, float* values) const
+  {
+    std::vector<unsigned long long>::const_iterator it =
+      std::lower_bound(m_RestoredOffsets.begin(), m_RestoredOffsets.end(), offset);
+    if (it == m_RestoredOffsets.end() || *it != offset)
+    {
+      return false;
+    }
+    const size_t index = it - m_RestoredOffsets.begin();
+    std::copy(m_RestoredValues.begin() + index * m_NumberOfValues,
+      m_RestoredValues.begin() + (index + 1) * m_NumberOfValues, values);
+    return true;
+  }
+
+  void PkCheckpoint::Append(const std::vector<unsigned long long>& offsets, const std::vector<float>& values)
+  {
+    if (offsets.empty())
+    {
+      return;
+    }
+    m_Lock.Lock();
+    if (m_File.is_open())
+    {
+      this->WriteRecords(&offsets[0], &values[0], offsets.size());
+      const double now = PkTimingReport::GetTime();
+      if (now - m_LastFlushTime >= m_Interval)
+      {
+        m_File.flush();
+        m_LastFlushTime = now;
+      }
+    }
+    m_Lock.Unlock();
+  }
+
+  void PkCheckpoint::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "Interval: " << m_Interval << std::endl;
+    os << indent << "NumberOfValues: " << m_NumberOfValues << std::endl;
+    os << indent << "NumberOfRestoredVoxels: " << m_RestoredOffsets.size() << std::endl;
+  }
+
+} // end namespace itk
@@ -0,0 +1,112 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef PkCheckpoint_h_
+#define PkCheckpoint_h_
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleFastMutexLock.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+  /** \class PkCheckpoint
+   * \brief Side file of the results of the voxels fitted so far.
+   *
+   * Threads append the results of chunks of voxels (a voxel offset and
+   * a fixed number of values per voxel) as they complete them, and the
+   * file is flushed at most every Interval seconds, so that a process
+   * that is stopped loses little work. A later process can resume from
+   * the file: the voxels found in it are restored instead of fitted.
+   *
+   * The file starts with a key, a hash of everything the results depend
+   * on (the input, the masks, the AIF and the settings). A file with a
+   * different key, or written for a different number of values, is
+   * discarded. A chunk cut short by the end of the process is ignored.
+   * The file is in the byte order of the machine that wrote it.
+   */
+  class PkCheckpoint : public Object
+  {
+  public:
+    typedef PkCheckpoint             Self;
+    typedef Object                   Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(PkCheckpoint, Object);
+
+    /** Seconds between flushes of the file. Default is 60. */
+    itkSetMacro(Interval, double);
+    itkGetConstMacro(Interval, double);
+
+    /** 64 bit FNV-1a hash of a buffer, continuing from hash, to build
+     * the key of a checkpoint */
+    static unsigned long long Hash(const void* data, size_t size,
+      unsigned long long hash = 14695981039346656037ULL);
+
+    /** Open a checkpoint file for results of numberOfValues values per
+     * voxel. With resume, the results of a file with the same key are
+     * loaded first and kept in the file; otherwise the file is started
+     * over. The file is rewritten to fileName.tmp, then renamed over
+     * fileName. Returns true if results were loaded, throws if the file
+     * cannot be written. */
+    bool Open(const std::string& fileName, unsigned long long key,
+      unsigned int numberOfValues, bool resume);
+
+    /** Flush and close the file */
+    void Close();
+
+    /** Look up the loaded results of a voxel. Returns false if the voxel
+     * is not in the checkpoint. */
+    bool Find(unsigned long long offset, float* values) const;
+
+    /** Number of voxels loaded by Open() */
+    SizeValueType GetNumberOfRestoredVoxels() const
+    {
+      return m_RestoredOffsets.size();
+    }
+
+    /** Append the results of a chunk of voxels, numberOfValues values
+     * per offset. Thread safe. */
+    void Append(const std::vector<unsigned long long>& offsets, const std::vector<float>& values);
+
+  protected:
+    PkCheckpoint();
+    ~PkCheckpoint();
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+  private:
+    PkCheckpoint(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+
+    // Load the results of a file, returns false if it does not match
+    bool Load(const std::string& fileName, unsigned long long key);
+
+    void WriteHeader(unsigned long long key);
+    void WriteRecords(const unsigned long long* offsets, const float* values, size_t count);
+
+    double m_Interval;
+    unsigned int m_NumberOfValues;
+
+    // loaded results, sorted by offset
+    std::vector<unsigned long long> m_RestoredOffsets;
+    std::vector<float> m_RestoredValues;
+
+    SimpleFastMutexLock m_Lock;
+    std::ofstream m_File;
+    double m_LastFlushTime;
+  };
+
+} // end namespace itk
+
+#endif
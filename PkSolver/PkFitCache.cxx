@@ -0,0 +1,162 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#include "PkFitCache.h"
+
+#include <cstring>
+
+namespace itk
+{
+  unsigned long PkFitCache::Hash(const float* curve, unsigned int size, int shift,
+    const float* initialParameters)
+  {
+    // 32 bit FNV-1a over the bytes of the curve, the shift and the start
+    unsigned long hash = 2166136261UL;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(curve);
+    for (size_t i = 0; i < size * sizeof(float); ++i)
+    {
+      hash = ((hash ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    bytes = reinterpret_cast<const unsigned char*>(&shift);
+    for (size_t i = 0; i < sizeof(int); ++i)
+    {
+      hash = ((hash ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    if (initialParameters)
+    {
+      bytes = reinterpret_cast<const unsigned char*>(initialParameters);
+      for (size_t i = 0; i < 3 * sizeof(float); ++i)
+      {
+        hash = ((hash ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+      }
+    }
+    return hash;
+  }
+
+  bool PkFitCache::Matches(const Entry& entry, const float* curve, unsigned int size, int shift,
+    const float* initialParameters)
+  {
+    return entry.Shift == shift
+      && entry.HasStart == (initialParameters != 0)
+      && (!initialParameters || memcmp(entry.Start, initialParameters, sizeof(entry.Start)) == 0)
+      && entry.Curve.size() == size
+      && memcmp(&entry.Curve[0], curve, size * sizeof(float)) == 0;
+  }
+
+  bool PkFitCache::Find(const float* curve, unsigned int size, int shift,
+    const float* initialParameters, Result& result) const
+  {
+    if (size == 0)
+    {
+      return false;
+    }
+
+    const unsigned long hash = Hash(curve, size, shift, initialParameters);
+    const Shard& shard = m_Shards[hash % NumberOfShards];
+
+    bool found = false;
+    shard.Lock.Lock();
+    TableType::const_iterator it = shard.Table.find(hash);
+    if (it != shard.Table.end())
+    {
+      for (size_t i = 0; i < it->second.size(); ++i)
+      {
+        if (Matches(it->second[i], curve, size, shift, initialParameters))
+        {
+          result = it->second[i].Value;
+          found = true;
+          break;
+        }
+      }
+    }
+    shard.Lock.Unlock();
+    return found;
+  }
+
+  void PkFitCache::Insert(const float* curve, unsigned int size, int shift,
+    const float* initialParameters, const Result& result)
+  {
+    if (size == 0)
+    {
+      return;
+    }
+
+    const unsigned long hash = Hash(curve, size, shift, initialParameters);
+    Shard& shard = m_Shards[hash % NumberOfShards];
+
+    // the cap is split evenly between the shards, so that a full cache
+    // is detected without locking all of them
+    const SizeValueType maximumShardEntries =
+      (m_MaximumNumberOfEntries + NumberOfShards - 1) / NumberOfShards;
+
+    shard.Lock.Lock();
+    if (shard.NumberOfEntries >= maximumShardEntries)
+    {
+      shard.Lock.Unlock();
+      return;
+    }
+    std::vector<Entry>& bucket = shard.Table[hash];
+    bool present = false;
+    for (size_t i = 0; i < bucket.size(); ++i)
+    {
+      // another thread may have fit the same curve in the meantime
+      if (Matches(bucket[i], curve, size, shift, initialParameters))
+      {
+        present = true;
+        break;
+      }
+    }
+    if (!present)
+    {
+      bucket.push_back(Entry());
+      Entry& entry = bucket.back();
+      entry.Curve.assign(curve, curve + size);
+      entry.Shift = shift;
+      entry.HasStart = initialParameters != 0;
+      for (unsigned int i = 0; i < 3; ++i)
+      {
+        entry.Start[i] = initialParameters ? initialParameters[i] : 0.0f;
+      }
+      entry.Value = result;
+      ++shard.NumberOfEntries;
+    }
+    shard.Lock.Unlock();
+  }
+
+  void PkFitCache::Clear()
+  {
+    for (unsigned int s = 0; s < NumberOfShards; ++s)
+    {
+      m_Shards[s].Lock.Lock();
+      m_Shards[s].Table.clear();
+      m_Shards[s].NumberOfEntries = 0;
+      m_Shards[s].Lock.Unlock();
+    }
+  }
+
+  SizeValueType PkFitCache::GetNumberOfEntries() const
+  {
+    SizeValueType entries = 0;
+    for (unsigned int s = 0; s < NumberOfShards; ++s)
+    {
+      m_Shards[s].Lock.Lock();
+      entries += m_Shards[s].NumberOfEntries;
+      m_Shards[s].Lock.Unlock();
+    }
+    return entries;
+  }
+
+  void PkFitCache::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "Maximum number of entries: " << m_MaximumNumberOfEntries << std::endl;
+    os << indent << "Number of entries: " << this->GetNumberOfEntries() << std::endl;
+  }
+
+} // end namespace itk
@@ -0,0 +1,130 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef PkFitCache_h_
+#define PkFitCache_h_
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkSimpleFastMutexLock.h"
+#include <itksys/hash_map.hxx>
+#include <vector>
+
+namespace itk
+{
+  /** \class PkFitCache
+   * \brief Thread safe cache of model fits keyed on the fitted curve.
+   *
+   * Stores the result of fitting a concentration curve (after alignment
+   * with the AIF) so that voxels with bit-identical curves, the same
+   * BAT shift and the same starting point of the optimizer are only fit
+   * once. The table is split into shards, each guarded by its own lock,
+   * so threads looking up different curves rarely contend. Keys are
+   * compared exactly, a hash collision never returns the result of a
+   * different curve.
+   *
+   * The number of entries is capped by MaximumNumberOfEntries; once a
+   * shard holds its share of them, further curves of that shard are not
+   * stored.
+   */
+  class PkFitCache : public Object
+  {
+  public:
+    typedef PkFitCache               Self;
+    typedef Object                   Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(PkFitCache, Object);
+
+    /** Maximum number of curves stored. Default is 100000. */
+    itkSetMacro(MaximumNumberOfEntries, SizeValueType);
+    itkGetConstMacro(MaximumNumberOfEntries, SizeValueType);
+
+    /** Result of fitting one curve */
+    struct Result
+    {
+      float Ktrans;
+      float Ve;
+      float Fpv;
+      unsigned int Code;
+      double RMS;
+      std::vector<float> Fitted;  // model curve, aligned with the AIF
+    };
+
+    /** Look up a curve fit from initialParameters (Ktrans, Ve and fpv),
+     * or from the default starting point if it is null. Returns false if
+     * it has not been fit yet. */
+    bool Find(const float* curve, unsigned int size, int shift,
+      const float* initialParameters, Result& result) const;
+
+    /** Store the result of fitting a curve from initialParameters. Does
+     * nothing if the cache is full. */
+    void Insert(const float* curve, unsigned int size, int shift,
+      const float* initialParameters, const Result& result);
+
+    /** Remove all the entries */
+    void Clear();
+
+    /** Number of distinct curves stored */
+    SizeValueType GetNumberOfEntries() const;
+
+  protected:
+    PkFitCache()
+    {
+      m_MaximumNumberOfEntries = 100000;
+    }
+    ~PkFitCache()
+    {
+    }
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+  private:
+    PkFitCache(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+
+    // the starting point of the fit is part of the key, with a default
+    // start marked by HasStart
+    struct Entry
+    {
+      std::vector<float> Curve;
+      int Shift;
+      bool HasStart;
+      float Start[3];
+      Result Value;
+    };
+
+    typedef itksys::hash_map<unsigned long, std::vector<Entry> > TableType;
+
+    struct Shard
+    {
+      Shard() : NumberOfEntries(0)
+      {
+      }
+      mutable SimpleFastMutexLock Lock;
+      TableType Table;
+      SizeValueType NumberOfEntries;
+    };
+
+    enum { NumberOfShards = 64 };
+
+    static unsigned long Hash(const float* curve, unsigned int size, int shift,
+      const float* initialParameters);
+
+    static bool Matches(const Entry& entry, const float* curve, unsigned int size, int shift,
+      const float* initialParameters);
+
+    SizeValueType m_MaximumNumberOfEntries;
+    Shard m_Shards[NumberOfShards];
+  };
+
+} // end namespace itk
+
+#endif
@@ -18,7 +18,11 @@
 #include <itkLevenbergMarquardtOptimizer.h>
 #include "PkSolver.h"
 #include "itkTimeProbesCollectorBase.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMultiThreader.h"
+#include <algorithm>
 #include <string>
+#include <cmath>
 
 namespace itk
 {
@@ -139,12 +143,13 @@ namespace itk
       Fpv = finalPosition[2];
     }
 
-    std::cout << optimizer->GetStopConditionDescription() << std::endl;
-
     return true;
   }
 
-  unsigned pk_solver(int signalSize, const float* timeAxis,
+  // The fit of pk_solver, without setting the BAT mode used by
+  // convert_signal_to_concentration, so that pk_solver_batch can call it
+  // from several threads
+  static unsigned fit_curve(int signalSize, const float* timeAxis,
     const float* PixelConcentrationCurve,
     const float* BloodConcentrationCurve,
     float& Ktrans, float& Ve, float& Fpv,
@@ -154,8 +159,10 @@ namespace itk
     itk::LevenbergMarquardtOptimizer* optimizer,
     LMCostFunction* costFunction,
     int modelType,
-    int constantBAT,
-    const std::string BATCalculationMode
+    const float* initialParameters,
+    bool useBounds,
+    unsigned* numberOfIterations,
+    unsigned* numberOfEvaluations
     )
   {
     //std::cout << "in pk solver" << std::endl;
@@ -168,9 +175,6 @@ namespace itk
     // maxIter   =   200;  // Maximum number of iterations
     //std::cerr << "In pkSolver!" << std::endl;
 
-    m_BATCalculationMode = BATCalculationMode;
-    m_ConstantBAT = constantBAT;
-
     // Levenberg Marquardt optimizer
 
     //////////////
@@ -186,6 +190,13 @@ namespace itk
     }
     initialValue[0] = 0.1;     //Ktrans //...
     initialValue[1] = 0.5;     //ve //...
+    if (initialParameters)
+    {
+      for (unsigned int i = 0; i < initialValue.size(); ++i)
+      {
+        initialValue[i] = initialParameters[i];
+      }
+    }
 
     costFunction->SetNumberOfValues(signalSize);
 
@@ -196,6 +207,7 @@ namespace itk
     costFunction->SetHematocrit(hematocrit);
     costFunction->GetValue(initialValue); //...
     costFunction->SetModelType(modelType);
+    costFunction->SetUseBounds(useBounds);
 
     optimizer->UseCostFunctionGradientOff();
 
@@ -221,7 +233,7 @@ namespace itk
 
     // We start not so far from the solution
 
-    optimizer->SetInitialPosition(initialValue); //...
+    optimizer->SetInitialPosition(costFunction->GetOptimizerParameters(initialValue)); //...
 
     try
     {
@@ -239,10 +251,35 @@ namespace itk
     }
     //vnlOptimizer->diagnose_outcome();
     //std::cerr << "after optimizer!" << std::endl;
+    if (numberOfIterations)
+    {
+      *numberOfIterations = vnlOptimizer->get_num_iterations();
+    }
+    if (numberOfEvaluations)
+    {
+      *numberOfEvaluations = vnlOptimizer->get_num_evaluations();
+    }
     itk::LevenbergMarquardtOptimizer::ParametersType finalPosition;
     finalPosition = optimizer->GetCurrentPosition();
     //std::cerr << finalPosition[0] << ", " << finalPosition[1] << ", " << finalPosition[2] << std::endl;
 
+    // With bounds, the optimizer's position maps to the solution inside
+    // the box. A parameter that converged onto a bound marks that bound
+    // as active.
+    unsigned activeBounds = 0;
+    if (useBounds)
+    {
+      finalPosition = costFunction->GetModelParameters(finalPosition);
+      const unsigned boundFlags[3] = { KTRANS_CLAMPED, VE_CLAMPED, FPV_CLAMPED };
+      for (unsigned int i = 0; i < finalPosition.size() && i < 3; ++i)
+      {
+        if (costFunction->IsAtBound(finalPosition, i))
+        {
+          activeBounds |= boundFlags[i];
+        }
+      }
+    }
+
 
     //Solution: remove the scale of 100
     Ktrans = finalPosition[0];
@@ -260,6 +297,7 @@ namespace itk
       if (diagnosticsCode.find(OptimizerDiagnosticStrings[errorCode]) != std::string::npos)
         break;
     }
+    errorCode |= activeBounds;
 
     // "Project" back onto the feasible set.  Should really be done as a
     // constraint in the optimization.
@@ -289,6 +327,191 @@ namespace itk
     return errorCode;
   }
 
+  unsigned pk_solver(int signalSize, const float* timeAxis,
+    const float* PixelConcentrationCurve,
+    const float* BloodConcentrationCurve,
+    float& Ktrans, float& Ve, float& Fpv,
+    float fTol, float gTol, float xTol,
+    float epsilon, int maxIter,
+    float hematocrit,
+    itk::LevenbergMarquardtOptimizer* optimizer,
+    LMCostFunction* costFunction,
+    int modelType,
+    int constantBAT,
+    const std::string BATCalculationMode,
+    const float* initialParameters,
+    bool useBounds,
+    unsigned* numberOfIterations,
+    unsigned* numberOfEvaluations
+    )
+  {
+    m_BATCalculationMode = BATCalculationMode;
+    m_ConstantBAT = constantBAT;
+
+    return fit_curve(signalSize, timeAxis, PixelConcentrationCurve, BloodConcentrationCurve,
+      Ktrans, Ve, Fpv, fTol, gTol, xTol, epsilon, maxIter, hematocrit,
+      optimizer, costFunction, modelType, initialParameters, useBounds,
+      numberOfIterations, numberOfEvaluations);
+  }
+
+  //
+  // pk_solver_batch: the curves are handed out to the threads in chunks
+  // from a shared counter, and each thread fits its chunks with one
+  // optimizer and cost function
+  //
+  struct PkSolverBatchStruct
+  {
+    int SignalSize;
+    const float* TimeAxis;
+    const float* BloodConcentrationCurve;
+    long long NumberOfCurves;
+    const float* Curves;
+    long long CurveStride;
+    long long FrameStride;
+    float* Parameters;
+    unsigned* Diagnostics;
+    float* RSquared;
+    float* FittedCurves;
+    float FTol;
+    float GTol;
+    float XTol;
+    float Epsilon;
+    int MaxIter;
+    float Hematocrit;
+    int ModelType;
+    bool UseBounds;
+
+    long long NextCurve;
+    SimpleFastMutexLock NextCurveLock;
+  };
+
+  static const long long PkSolverBatchChunkSize = 64;
+
+  static ITK_THREAD_RETURN_TYPE pk_solver_batch_callback(void* arg)
+  {
+    MultiThreader::ThreadInfoStruct* info = static_cast<MultiThreader::ThreadInfoStruct *>(arg);
+    PkSolverBatchStruct* batch = static_cast<PkSolverBatchStruct *>(info->UserData);
+
+    LevenbergMarquardtOptimizer::Pointer optimizer = LevenbergMarquardtOptimizer::New();
+    LMCostFunction::Pointer costFunction = LMCostFunction::New();
+    const unsigned int numberOfParameters =
+      (batch->ModelType == LMCostFunction::TOFTS_3_PARAMETER) ? 3 : 2;
+    const int signalSize = batch->SignalSize;
+    std::vector<float> curve(signalSize), fittedCurve(signalSize);
+    LMCostFunction::ParametersType position(numberOfParameters);
+
+    for (;;)
+    {
+      batch->NextCurveLock.Lock();
+      const long long first = batch->NextCurve;
+      batch->NextCurve += PkSolverBatchChunkSize;
+      batch->NextCurveLock.Unlock();
+      if (first >= batch->NumberOfCurves)
+      {
+        break;
+      }
+      const long long last = std::min(first + PkSolverBatchChunkSize, batch->NumberOfCurves);
+
+      for (long long i = first; i < last; ++i)
+      {
+        const float* source = batch->Curves + i * batch->CurveStride;
+        for (int t = 0; t < signalSize; ++t)
+        {
+          curve[t] = source[t * batch->FrameStride];
+        }
+
+        float Ktrans = 0.0f, Ve = 0.0f, Fpv = 0.0f;
+        const unsigned code = fit_curve(signalSize, batch->TimeAxis, &curve[0], batch->BloodConcentrationCurve,
+          Ktrans, Ve, Fpv, batch->FTol, batch->GTol, batch->XTol, batch->Epsilon, batch->MaxIter,
+          batch->Hematocrit, optimizer, costFunction, batch->ModelType, 0, batch->UseBounds, 0, 0);
+
+        float* parameters = batch->Parameters + i * numberOfParameters;
+        parameters[0] = Ktrans;
+        parameters[1] = Ve;
+        if (numberOfParameters == 3)
+        {
+          parameters[2] = Fpv;
+        }
+        batch->Diagnostics[i] = code;
+
+        if (batch->RSquared || batch->FittedCurves)
+        {
+          for (unsigned int p = 0; p < numberOfParameters; ++p)
+          {
+            position[p] = parameters[p];
+          }
+          const LMCostFunction::MeasureType fitted = costFunction->GetFittedFunction(position);
+          for (int t = 0; t < signalSize; ++t)
+          {
+            fittedCurve[t] = fitted[t];
+          }
+          if (batch->RSquared)
+          {
+            // as the R-squared map of ConcentrationToQuantitativeImageFilter
+            batch->RSquared[i] = compute_rsquared(signalSize, &fittedCurve[0],
+              optimizer->GetOptimizer()->get_end_error());
+          }
+          if (batch->FittedCurves)
+          {
+            std::copy(fittedCurve.begin(), fittedCurve.end(), batch->FittedCurves + i * signalSize);
+          }
+        }
+      }
+    }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void pk_solver_batch(int signalSize, const float* timeAxis,
+    const float* BloodConcentrationCurve,
+    long long numberOfCurves, const float* PixelConcentrationCurves,
+    long long curveStride, long long frameStride,
+    float* parameters, unsigned* diagnostics,
+    float* rSquared, float* fittedCurves,
+    float fTol, float gTol, float xTol,
+    float epsilon, int maxIter, float hematocrit,
+    int modelType, bool useBounds,
+    unsigned int numberOfThreads)
+  {
+    if (numberOfCurves <= 0)
+    {
+      return;
+    }
+
+    PkSolverBatchStruct batch;
+    batch.SignalSize = signalSize;
+    batch.TimeAxis = timeAxis;
+    batch.BloodConcentrationCurve = BloodConcentrationCurve;
+    batch.NumberOfCurves = numberOfCurves;
+    batch.Curves = PixelConcentrationCurves;
+    batch.CurveStride = curveStride;
+    batch.FrameStride = frameStride;
+    batch.Parameters = parameters;
+    batch.Diagnostics = diagnostics;
+    batch.RSquared = rSquared;
+    batch.FittedCurves = fittedCurves;
+    batch.FTol = fTol;
+    batch.GTol = gTol;
+    batch.XTol = xTol;
+    batch.Epsilon = epsilon;
+    batch.MaxIter = maxIter;
+    batch.Hematocrit = hematocrit;
+    batch.ModelType = modelType;
+    batch.UseBounds = useBounds;
+    batch.NextCurve = 0;
+
+    // no more threads than chunks
+    const long long numberOfChunks = (numberOfCurves + PkSolverBatchChunkSize - 1) / PkSolverBatchChunkSize;
+    MultiThreader::Pointer threader = MultiThreader::New();
+    ThreadIdType threads = numberOfThreads ? numberOfThreads : threader->GetNumberOfThreads();
+    if (static_cast<long long>(threads) > numberOfChunks)
+    {
+      threads = static_cast<ThreadIdType>(numberOfChunks);
+    }
+    threader->SetNumberOfThreads(threads);
+    threader->SetSingleMethod(pk_solver_batch_callback, &batch);
+    threader->SingleMethodExecute();
+  }
+
   void pk_report()
   {
     probe.Report();
@@ -352,6 +575,24 @@ namespace itk
     return true;
   }
 
+  double compute_rsquared(int signalSize, const float* fittedCurve, double rms)
+  {
+    const double SSerr = rms*rms*signalSize;
+    double sumSquared = 0.0;
+    double sum = 0.0;
+    for (int i = 0; i < signalSize; ++i)
+    {
+      sum += fittedCurve[i];
+      sumSquared += (fittedCurve[i] * fittedCurve[i]);
+    }
+    const double SStot = sumSquared - sum*sum / (double)signalSize;
+    if (SStot <= 0.0)
+    {
+      return 0.0;
+    }
+    return 1.0 - (SSerr / SStot);
+  }
+
   float area_under_curve(int signalSize,
     const float* timeAxis,
     const float* concentration,
@@ -700,4 +941,246 @@ namespace itk
 
   }
 
+  // Calculate a population AIF.
+  //
+  // See "Experimentally-Derived Functional Form for a Population-Averaged High-
+  // Temporal-Resolution Arterial Input Function for Dynamic Contrast-Enhanced
+  // MRI" - Parker, Robers, Macdonald, Buonaccorsi, Cheung, Buckley, Jackson,
+  // Watson, Davies, Jayson.  Magnetic Resonance in Medicine 56:993-1000 (2006)
+  std::vector<float> compute_population_aif(const std::vector<float>& signalTime, float bolusArrivalTimeFraction)
+  {
+
+    // Inputs
+    // ------
+    // signalTime : sequence time, presumed in units of seconds.
+    // bolusArrivalTimeFraction : fractional point between 0 and 1 when the bolus is
+    //     desired to arrive.  Choose 0.0 to have it at the very beginning,
+    //     1.0 to have it at the end.
+    //
+    // Outputs
+    // -------
+    // AIF : arterial input function as a function of time
+    std::vector<float> AIF;
+
+    // Make a high resolution timing vector as input to the AIF construction.
+    std::vector<float> aif_time(signalTime.size() * 10);
+    float final_time_point = signalTime[signalTime.size() - 1];
+    float resolution = final_time_point / (aif_time.size() - 1);
+    for (size_t j = 0; j < aif_time.size(); ++j)
+    {
+      aif_time[j] = resolution * j;
+    }
+
+    size_t bolus_arrival_time_idx = (float)aif_time.size() * bolusArrivalTimeFraction;
+
+    size_t n = aif_time.size();
+    AIF.resize(n);
+
+    size_t numTimePoints = n - bolus_arrival_time_idx;
+    std::vector<float> timeSinceBolus(numTimePoints);
+
+
+    // t=FR*[0:numTimePoints-1]/60;
+    // These time points "start" when the bolus arrives.
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      //timeSinceBolus[j] = FR * j / 60.0;
+      timeSinceBolus[j] = aif_time[bolus_arrival_time_idx + j] - aif_time[bolus_arrival_time_idx];
+    }
+
+    // Parker
+    // defining parameters
+    double a1(0.809);
+    double a2(0.330);
+    double T1(0.17406);
+    double T2(0.365);
+    double sigma1(0.0563);
+    double sigma2(0.132);
+    double alpha(1.050);
+    double beta(0.1685);
+    double s(38.078);
+    double tau(0.483);
+
+
+    // term0=alpha*exp(-beta*t)./(1+exp(-s*(t-tau)));
+    // Here the assumption is that time is in minutes, so must scale accordingly.
+    // see Parker.
+    std::vector<double> term0(numTimePoints);
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      term0[j] = alpha * exp(-beta*timeSinceBolus[j] / 60.0)
+        / (1 + exp(-s * (timeSinceBolus[j] / 60.0 - tau)));
+    }
+
+
+    // term1=[];
+    // term2=[];
+    double A1 = a1 / (sigma1 * pow((2 * PI), 0.5));
+
+    // B1=exp(-(t-T1).^2./(2.*sigma1^2));
+    double numerator, denominator;
+    std::vector<double> B1(numTimePoints);
+    denominator = 2.0 * pow(sigma1, 2.0);
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      numerator = -1 * pow(-(timeSinceBolus[j] / 60.0 - T1), 2.0);
+      B1[j] = exp(numerator / denominator);
+    }
+
+    // term1=A1.*B1;
+    std::vector<double> term1(numTimePoints);
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      term1[j] = A1 * B1[j];
+    }
+
+
+    // A2=a2/(sigma2*((2*pi)^0.5));
+    double A2 = a2 / (sigma2 * pow(2 * PI, 0.5));
+
+    //B2=exp(-(t-T2).^2./(2.*sigma2^2));
+    std::vector<double> B2(numTimePoints);
+    denominator = 2.0 * pow(sigma2, 2.0);
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      numerator = -1 * pow(-(timeSinceBolus[j] / 60.0 - T2), 2.0);
+      B2[j] = exp(numerator / denominator);
+    }
+
+    // term2=A2.*B2;
+    std::vector<double> term2(numTimePoints);
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      term2[j] = A2 * B2[j];
+    }
+
+    // aifPost=term0+term1+term2;
+    std::vector<double> aifPost(numTimePoints);
+    for (size_t j = 0; j < numTimePoints; ++j)
+    {
+      aifPost[j] = term0[j] + term1[j] + term2[j];
+    }
+
+    // Initialize values before bolus arrival.
+    for (size_t j = 0; j < bolus_arrival_time_idx; ++j)
+    {
+      AIF[j] = 0;
+    }
+
+    // Shift the data to take into account the bolus arrival time.
+    // sp=timeOfBolus+1;
+    // AIF(sp:end)=aifPost;
+    for (size_t j = bolus_arrival_time_idx; j < AIF.size(); ++j)
+    {
+      AIF[j] = aifPost[j - bolus_arrival_time_idx];
+    }
+
+    // Resample back to signal (sequence) time.
+    std::vector<float> rAIF = resample_curve(aif_time, AIF, signalTime);
+
+    return rAIF;
+
+  }
+
+  // Least recently used cache of the population AIFs of the last
+  // PopulationAIFCacheSize timings, most recent first
+  struct PopulationAIFCacheEntry
+  {
+    std::vector<float> SignalTime;
+    float BolusArrivalTimeFraction;
+    std::vector<float> AIF;
+  };
+  static const size_t PopulationAIFCacheSize = 16;
+  static std::vector<PopulationAIFCacheEntry> populationAIFCache;
+  static SimpleFastMutexLock populationAIFCacheLock;
+
+  std::vector<float> get_population_aif(const std::vector<float>& signalTime, float bolusArrivalTimeFraction)
+  {
+    populationAIFCacheLock.Lock();
+    for (size_t i = 0; i < populationAIFCache.size(); ++i)
+    {
+      if (populationAIFCache[i].BolusArrivalTimeFraction == bolusArrivalTimeFraction
+        && populationAIFCache[i].SignalTime == signalTime)
+      {
+        PopulationAIFCacheEntry entry = populationAIFCache[i];
+        populationAIFCache.erase(populationAIFCache.begin() + i);
+        populationAIFCache.insert(populationAIFCache.begin(), entry);
+        populationAIFCacheLock.Unlock();
+        return entry.AIF;
+      }
+    }
+    populationAIFCacheLock.Unlock();
+
+    PopulationAIFCacheEntry entry;
+    entry.SignalTime = signalTime;
+    entry.BolusArrivalTimeFraction = bolusArrivalTimeFraction;
+    entry.AIF = compute_population_aif(signalTime, bolusArrivalTimeFraction);
+
+    populationAIFCacheLock.Lock();
+    populationAIFCache.insert(populationAIFCache.begin(), entry);
+    if (populationAIFCache.size() > PopulationAIFCacheSize)
+    {
+      populationAIFCache.pop_back();
+    }
+    populationAIFCacheLock.Unlock();
+    return entry.AIF;
+  }
+
+  // Linearly interpolate the curve (t1, y1) at the times t2, extrapolating
+  // from the first or last two samples outside the range of t1
+  std::vector<float> resample_curve(const std::vector<float>& t1, const std::vector<float>& y1, const std::vector<float>& t2)
+  {
+    // Resample time1, y1 to time2
+    size_t timeSize = t2.size();
+    std::vector<float> y2(timeSize);
+
+    std::vector<float>::iterator y2it = y2.begin();
+    std::vector<float>::const_iterator t2it = t2.begin();
+
+    std::vector<float>::const_iterator y1it = y1.begin();
+    std::vector<float>::const_iterator t1it = t1.begin();
+
+    std::vector<float>::const_iterator y1itnext = y1it;
+    y1itnext++;
+    std::vector<float>::const_iterator t1itnext = t1it;
+    t1itnext++;
+
+    for (; t2it != t2.end(); ++t2it, ++y2it)
+    {
+      // Three cases
+      // (1) extrapolate the aif on the low end of the range of prescribed timings
+      // (2) interpolate the aif
+      // (3) extrapolate the aif on the high end of the range of prescribed timings
+      //
+      // Case (1) is handled implictly by the initialization and conditionals.
+      if (*t1it <= *t2it)
+      {
+        // Case (2) from above)
+        // find the prescribed times that straddle the current time to interpolate
+        while (*t1itnext < *t2it && t1itnext != t1.end())
+        {
+          ++t1it;
+          ++t1itnext;
+          ++y1it;
+          ++y1itnext;
+        }
+      }
+      if (t1itnext == t1.end())
+      {
+        // we'll need to extrapolate (Case (3) from above)
+        t1itnext = t1it;
+        --t1it;
+        y1itnext = y1it;
+        --y1it;
+      }
+
+      // interpolate aif;
+      float a;
+      a = *y1it + ((*t2it - *t1it) / (*t1itnext - *t1it)) * (*y1itnext - *y1it);
+      *y2it = a;
+    }
+
+    return y2;
+  }
+
 }; // end of namespace
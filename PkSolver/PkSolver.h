@@ -19,7 +19,9 @@
 #include <math.h>
 #include <vnl/algo/vnl_convolve.h>
 #include "itkArray.h"
+#include <algorithm>
 #include <string>
+#include <vector>
 
 // work around compile error on Win
 #define M_PI 3.1415926535897932384626433832795
@@ -43,7 +45,13 @@ enum OptimizerDiagnosticCodes
   KTRANS_CLAMPED = 0x10, // = 16 Ktrans was clamped to [0..5]
   VE_CLAMPED = 0x20, // = 32 Ve was clamped to [0..1]
   BAT_DETECTION_FAILED = 0x30, // = 48 BAT detection procedure failed
-  BAT_BEFORE_AIF_BAT = 0x40 // = 64 BAT at the voxel was before AIF BAT
+  BAT_BEFORE_AIF_BAT = 0x40, // = 64 BAT at the voxel was before AIF BAT
+  FPV_CLAMPED = 0x80, // = 128 Fpv was at a bound of [0..1] (bounded fitting only)
+  PYRAMID_BACKGROUND = 0x100, // = 256 skipped, the coarse voxel containing it is background
+  // bits of their own, the codes above use all the bits below 0x100
+  PRESCREEN_LOW_ENHANCEMENT = 0x200, // = 512 peak enhancement below the pre-screen threshold
+  PRESCREEN_LOW_SLOPE = 0x400, // = 1024 max slope below the pre-screen threshold
+  PRESCREEN_LOW_SNR = 0x800 // = 2048 enhancement to baseline noise ratio below the pre-screen threshold
 };
 
 const std::string OptimizerDiagnosticStrings[] =
@@ -92,6 +100,82 @@ namespace itk
 
     LMCostFunction()
     {
+      m_UseBounds = false;
+      m_LowerBound[0] = 0.0;    // Ktrans
+      m_LowerBound[1] = 1.0e-4; // Ve, the model is singular at 0
+      m_LowerBound[2] = 0.0;    // Fpv
+      m_UpperBound[0] = 5.0;
+      m_UpperBound[1] = 1.0;
+      m_UpperBound[2] = 1.0;
+    }
+
+    // Box constraints on the parameters. When enabled, the optimizer
+    // works on unbounded variables that a scaled logistic function maps
+    // into the box before the model is evaluated, so the residual stays
+    // smooth and its finite difference Jacobian nonzero, and every
+    // iterate is feasible. GetValue() takes the variables of the
+    // optimizer, GetFittedFunction() the model parameters.
+    void SetUseBounds(bool useBounds)
+    {
+      m_UseBounds = useBounds;
+    }
+
+    bool GetUseBounds() const
+    {
+      return m_UseBounds;
+    }
+
+    ValueType GetLowerBound(unsigned int i) const
+    {
+      return m_LowerBound[i];
+    }
+
+    ValueType GetUpperBound(unsigned int i) const
+    {
+      return m_UpperBound[i];
+    }
+
+    // Model parameters at the variables of the optimizer
+    ParametersType GetModelParameters(const ParametersType & optimizerParameters) const
+    {
+      ParametersType parameters(optimizerParameters);
+      if (m_UseBounds)
+      {
+        for (unsigned int i = 0; i < parameters.size() && i < 3; ++i)
+        {
+          parameters[i] = m_LowerBound[i]
+            + (m_UpperBound[i] - m_LowerBound[i]) / (1.0 + exp(-optimizerParameters[i]));
+        }
+      }
+      return parameters;
+    }
+
+    // Variables of the optimizer at model parameters. The logistic never
+    // reaches the bounds, so parameters on or outside the box are moved
+    // just inside it.
+    ParametersType GetOptimizerParameters(const ParametersType & parameters) const
+    {
+      ParametersType optimizerParameters(parameters);
+      if (m_UseBounds)
+      {
+        for (unsigned int i = 0; i < parameters.size() && i < 3; ++i)
+        {
+          ValueType fraction = (parameters[i] - m_LowerBound[i]) / (m_UpperBound[i] - m_LowerBound[i]);
+          fraction = std::min(std::max(fraction, 1.0e-6), 1.0 - 1.0e-6);
+          optimizerParameters[i] = log(fraction / (1.0 - fraction));
+        }
+      }
+      return optimizerParameters;
+    }
+
+    // Whether a model parameter is within 0.1% of its range from one of
+    // its bounds, where the logistic is flat and the bound is in effect
+    // active
+    bool IsAtBound(const ParametersType & parameters, unsigned int i) const
+    {
+      const ValueType tolerance = 1.0e-3;
+      const ValueType fraction = (parameters[i] - m_LowerBound[i]) / (m_UpperBound[i] - m_LowerBound[i]);
+      return fraction <= tolerance || fraction >= 1.0 - tolerance;
     }
 
     void SetHematocrit(float hematocrit)
@@ -134,10 +218,12 @@ namespace itk
       //std::cout << "Time: " << Time << std::endl;
     }
 
-    MeasureType GetValue(const ParametersType & parameters) const
+    MeasureType GetValue(const ParametersType & optimizerParameters) const
     {
       MeasureType measure(RangeDimension);
 
+      const ParametersType parameters = GetModelParameters(optimizerParameters);
+
       ValueType Ktrans = parameters[0];
       ValueType Ve = parameters[1];
 
@@ -211,6 +297,10 @@ namespace itk
 
     ArrayType Cv, Cb, Time;
 
+    bool m_UseBounds;
+    ValueType m_LowerBound[3];
+    ValueType m_UpperBound[3];
+
     ArrayType Convolution(ArrayType X, ArrayType Y) const
     {
       ArrayType Z;
@@ -302,6 +392,15 @@ namespace itk
   // returns diagnostic error code from the VNL optimizer,
   //  as defined by OptimizerDiagnosticCodes, and masked to indicate
   //  wheather Ktrans or Ve were clamped.
+  //  initialParameters, if given, holds the starting Ktrans, Ve (and
+  //  Fpv for the 3 parameter model) instead of the default start.
+  //  With useBounds, the parameters are constrained to the cost
+  //  function's box during the optimization and the returned code
+  //  flags the bounds that are active at the solution.
+  //  numberOfIterations and numberOfEvaluations, if given, receive the
+  //  optimizer's iteration and cost function evaluation counts. vnl's
+  //  lmdif reports its evaluations of the residuals as its iterations,
+  //  so the two counts are the same.
   unsigned pk_solver(int signalSize, const float* timeAxis,
     const float* PixelConcentrationCurve, const float* BloodConcentrationCurve,
     float& Ktrans, float& Ve, float& Fpv,
@@ -311,7 +410,34 @@ namespace itk
     LMCostFunction* costFunction,
     int modelType = itk::LMCostFunction::TOFTS_2_PARAMETER,
     int constantBAT = 0,
-    const std::string BATCalculationMode = "PeakGradient");
+    const std::string BATCalculationMode = "PeakGradient",
+    const float* initialParameters = 0,
+    bool useBounds = false,
+    unsigned* numberOfIterations = 0,
+    unsigned* numberOfEvaluations = 0);
+
+  // Fit many curves that share the AIF (BloodConcentrationCurve) and
+  //  the time axis (in minutes), as pk_solver does one. Sample t of
+  //  curve i is PixelConcentrationCurves[i * curveStride + t * frameStride].
+  //  For each curve, parameters receives Ktrans, Ve (and Fpv for the 3
+  //  parameter model) at parameters[i * numberOfParameters] and
+  //  diagnostics the code pk_solver would return. rSquared, if given,
+  //  receives the R-squared of each fit (see compute_rsquared(), as the
+  //  R-squared map of the module) and fittedCurves, if given, the
+  //  fitted curve at fittedCurves[i * signalSize]. The curves are fitted
+  //  by numberOfThreads threads (0 for the MultiThreader default), each
+  //  reusing one optimizer and cost function for all its curves.
+  void pk_solver_batch(int signalSize, const float* timeAxis,
+    const float* BloodConcentrationCurve,
+    long long numberOfCurves, const float* PixelConcentrationCurves,
+    long long curveStride, long long frameStride,
+    float* parameters, unsigned* diagnostics,
+    float* rSquared = 0, float* fittedCurves = 0,
+    float fTol = 1e-4f, float gTol = 1e-4f, float xTol = 1e-5f,
+    float epsilon = 1e-9f, int maxIter = 200, float hematocrit = 0.4f,
+    int modelType = itk::LMCostFunction::TOFTS_2_PARAMETER,
+    bool useBounds = false,
+    unsigned int numberOfThreads = 0);
 
   void pk_report();
   void pk_clear();
@@ -326,6 +452,11 @@ namespace itk
 
   float area_under_curve(int signalSize, const float* timeAxis, const float* concentration, int BATIndex, float aucTimeInterval);
 
+  // R-squared of a fit, 1 - SSerr / SStot, with SSerr from the rms
+  // residual reported by the optimizer and SStot from the fitted curve.
+  // A flat fitted curve, for which SStot is 0, gives 0.
+  double compute_rsquared(int signalSize, const float* fittedCurve, double rms);
+
   float intergrate(float* yValues, float * xValues, int size);
 
   void compute_derivative(int signalSize, const float* SingnalY, float* YDeriv);
@@ -350,6 +481,18 @@ namespace itk
 
   float compute_s0_individual_curve(int signalSize, const float* SignalY, float S0GradThresh, std::string BATCalculationMode, int constantBAT);
 
+  // Population averaged AIF of Parker et al. sampled at signalTime (in
+  // seconds), with the bolus arriving at the given fraction (0 to 1) of
+  // the acquisition
+  std::vector<float> compute_population_aif(const std::vector<float>& signalTime, float bolusArrivalTimeFraction);
+
+  // compute_population_aif through a process wide cache of the latest
+  // timings, for processes that quantify many studies. Thread safe.
+  std::vector<float> get_population_aif(const std::vector<float>& signalTime, float bolusArrivalTimeFraction);
+
+  // Linear interpolation of the curve (t1, y1) at the times t2
+  std::vector<float> resample_curve(const std::vector<float>& t1, const std::vector<float>& y1, const std::vector<float>& t2);
+
 };
 
 #endif
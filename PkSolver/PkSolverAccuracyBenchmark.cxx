@@ -0,0 +1,503 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Accuracy against speed of the fitting settings, by Monte Carlo.
+//
+// Tofts curves with known Ktrans, Ve and fpv (over a grid of values) are
+// turned into SPGR signals, noise is added at each SNR and the noisy
+// signals are converted back to concentrations, for each temporal
+// resolution. Every noisy curve is then fit by each engine (the
+// unconstrained Levenberg-Marquardt fit, the fit constrained to the
+// parameter bounds, and the clustered fit of the quantifier, which fits
+// the mean curve of each cluster of the curves of a set) with each
+// tolerance setting (fTol, gTol, xTol, maxIter). For each combination
+// the fits per second, and the bias and RMSE of Ktrans and Ve
+// (relative to the true values) and of fpv (absolute), with the
+// fractions of fits that were clamped or ran out of iterations and the
+// mean number of optimizer iterations per fit, are printed as a CSV
+// table. The lm and bounded rows of a setting compare the iterations
+// spent with and without the parameter bounds (--boundedFitting).
+//
+// Usage: PkSolverAccuracyBenchmark [options], see --help
+
+#include "PkSolver.h"
+#include "PkTimingReport.h"
+#include "itkConcentrationToQuantitativeImageFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkLevenbergMarquardtOptimizer.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  const float T1Pre = 1597.0f;       // ms
+  const float TR = 5.0f;             // ms
+  const float FA = 15.0f;            // degrees
+  const float Relaxivity = 0.0039f;  // 1/(mM ms)
+  const float Hematocrit = 0.4f;
+  const float S0 = 1000.0f;
+
+  struct ToleranceSetting
+  {
+    float FTolerance;
+    float GTolerance;
+    float XTolerance;
+    int MaxIter;
+  };
+
+  struct Engine
+  {
+    std::string Name;
+    bool UseBounds;
+    bool Clustered;
+  };
+
+  typedef itk::VectorImage<float, 3> ConcentrationVolumeType;
+  typedef itk::Image<short, 3> MaskVolumeType;
+  typedef itk::Image<float, 3> ParameterVolumeType;
+  typedef itk::ConcentrationToQuantitativeImageFilter<ConcentrationVolumeType, MaskVolumeType, ParameterVolumeType>
+    QuantifierType;
+
+  // Noisy concentration curves of one temporal resolution and SNR,
+  // with their true parameters
+  struct CurveSet
+  {
+    std::vector<float> TimeMinutes;
+    std::vector<float> AIF;
+    std::vector< std::vector<float> > Concentrations;
+    std::vector<float> Ktrans;
+    std::vector<float> Ve;
+    std::vector<float> Fpv;
+  };
+
+  // Error statistics of one parameter
+  struct ErrorStatistics
+  {
+    double Sum;
+    double SumOfSquares;
+    unsigned long Count;
+
+    ErrorStatistics() : Sum(0.0), SumOfSquares(0.0), Count(0) {}
+    void Add(double error)
+    {
+      Sum += error;
+      SumOfSquares += error * error;
+      ++Count;
+    }
+    double Bias() const { return Count ? Sum / Count : 0.0; }
+    double RMSE() const { return Count ? sqrt(SumOfSquares / Count) : 0.0; }
+  };
+
+  void Usage(const char* program)
+  {
+    std::cerr << "Usage: " << program << " [options]" << std::endl;
+    std::cerr << "Options (lists are comma separated):" << std::endl;
+    std::cerr << "  --ktrans list          true Ktrans values, 1/min (default 0.05,0.1,0.25,0.5)" << std::endl;
+    std::cerr << "  --ve list              true Ve values (default 0.1,0.3,0.5)" << std::endl;
+    std::cerr << "  --fpv list             true fpv values, any above 0 selects the 3 parameter model (default 0)" << std::endl;
+    std::cerr << "  --snr list             S0 over the noise standard deviation (default 20,50,100)" << std::endl;
+    std::cerr << "  --frameSeconds list    temporal resolutions (default 2.5,5,10)" << std::endl;
+    std::cerr << "  --duration s           length of the series (default 300)" << std::endl;
+    std::cerr << "  --realizations n       noisy curves per parameter combination (default 20)" << std::endl;
+    std::cerr << "  --engines list         lm, bounded and/or clusters (default lm,bounded,clusters)" << std::endl;
+    std::cerr << "  --clusters n           number of clusters of the clusters engine (default 16)" << std::endl;
+    std::cerr << "  --settings list        fTol/gTol/xTol/maxIter settings separated by ';'" << std::endl;
+    std::cerr << "                         (default 1e-4,1e-4,1e-5,200;1e-3,1e-3,1e-4,200;1e-2,1e-2,1e-3,200;1e-4,1e-4,1e-5,30)" << std::endl;
+    std::cerr << "  --seed n               random seed (default 1)" << std::endl;
+  }
+
+  std::vector<std::string> Split(const std::string& list, char separator)
+  {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, separator))
+    {
+      if (!item.empty())
+      {
+        items.push_back(item);
+      }
+    }
+    return items;
+  }
+
+  std::vector<float> ParseList(const std::string& list)
+  {
+    std::vector<std::string> items = Split(list, ',');
+    std::vector<float> values;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+      values.push_back(atof(items[i].c_str()));
+    }
+    return values;
+  }
+
+  // SPGR signal of a concentration; convert_signal_to_concentration
+  // inverts it for the same S0
+  float Signal(float concentration)
+  {
+    const double alpha = FA * 3.14159265358979 / 180.0;
+    const double cosAlpha = cos(alpha);
+    const double E0 = exp(-TR / T1Pre);
+    const double E = exp(-TR * (1.0 / T1Pre + Relaxivity * concentration));
+    return S0 * ((1.0 - E) / (1.0 - cosAlpha * E)) * ((1.0 - cosAlpha * E0) / (1.0 - E0));
+  }
+
+  void MakeCurves(float frameSeconds, float duration, float snr, unsigned int realizations,
+    const std::vector<float>& ktransValues, const std::vector<float>& veValues,
+    const std::vector<float>& fpvValues, int modelType,
+    itk::Statistics::MersenneTwisterRandomVariateGenerator* random, CurveSet& curves)
+  {
+    const unsigned int timePoints = static_cast<unsigned int>(duration / frameSeconds) + 1;
+    std::vector<float> timeSeconds(timePoints);
+    curves.TimeMinutes.resize(timePoints);
+    for (unsigned int t = 0; t < timePoints; ++t)
+    {
+      timeSeconds[t] = t * frameSeconds;
+      curves.TimeMinutes[t] = timeSeconds[t] / 60.0f;
+    }
+    curves.AIF = itk::compute_population_aif(timeSeconds, 0.1f);
+
+    itk::LMCostFunction::Pointer costFunction = itk::LMCostFunction::New();
+    costFunction->SetNumberOfValues(timePoints);
+    costFunction->SetCb(&curves.AIF[0], timePoints);
+    costFunction->SetTime(&curves.TimeMinutes[0], timePoints);
+    costFunction->SetHematocrit(Hematocrit);
+    costFunction->SetModelType(modelType);
+    itk::LMCostFunction::ParametersType parameters(costFunction->GetNumberOfParameters());
+
+    std::vector<float> signal(timePoints);
+    std::vector<float> concentration(timePoints);
+    const double sigma = S0 / snr;
+    for (size_t k = 0; k < ktransValues.size(); ++k)
+    {
+      for (size_t v = 0; v < veValues.size(); ++v)
+      {
+        for (size_t f = 0; f < fpvValues.size(); ++f)
+        {
+          parameters[0] = ktransValues[k];
+          parameters[1] = veValues[v];
+          if (modelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+          {
+            parameters[2] = fpvValues[f];
+          }
+          itk::LMCostFunction::MeasureType truth = costFunction->GetFittedFunction(parameters);
+          for (unsigned int r = 0; r < realizations; ++r)
+          {
+            for (unsigned int t = 0; t < timePoints; ++t)
+            {
+              signal[t] = Signal(truth[t]) + sigma * random->GetNormalVariate();
+            }
+            itk::convert_signal_to_concentration(timePoints, &signal[0], T1Pre, TR, FA,
+              &concentration[0], Relaxivity, S0);
+            curves.Concentrations.push_back(concentration);
+            curves.Ktrans.push_back(ktransValues[k]);
+            curves.Ve.push_back(veValues[v]);
+            curves.Fpv.push_back(modelType == itk::LMCostFunction::TOFTS_3_PARAMETER ? fpvValues[f] : 0.0f);
+          }
+        }
+      }
+    }
+  }
+
+  // Fit all the curves of a set with the clustered fitting of the
+  // quantifier, as the voxels of an N x 1 x 1 volume with the AIF of the
+  // set prescribed
+  void FitClustered(const CurveSet& curves, const ToleranceSetting& setting, int modelType,
+    unsigned int numberOfClusters, std::vector<float>& ktrans, std::vector<float>& ve,
+    std::vector<float>& fpv, std::vector<unsigned>& codes, unsigned long& iterations)
+  {
+    const unsigned int timePoints = curves.TimeMinutes.size();
+    std::vector<float> timeSeconds(timePoints);
+    for (unsigned int t = 0; t < timePoints; ++t)
+    {
+      timeSeconds[t] = curves.TimeMinutes[t] * 60.0f;
+    }
+
+    ConcentrationVolumeType::SizeType size;
+    size[0] = curves.Concentrations.size();
+    size[1] = 1;
+    size[2] = 1;
+    ConcentrationVolumeType::Pointer volume = ConcentrationVolumeType::New();
+    volume->SetRegions(ConcentrationVolumeType::RegionType(size));
+    volume->SetNumberOfComponentsPerPixel(timePoints);
+    volume->Allocate();
+    ConcentrationVolumeType::PixelType pixel(timePoints);
+    size_t i = 0;
+    for (itk::ImageRegionIterator<ConcentrationVolumeType> it(volume, volume->GetLargestPossibleRegion());
+      !it.IsAtEnd(); ++it, ++i)
+    {
+      for (unsigned int t = 0; t < timePoints; ++t)
+      {
+        pixel[t] = curves.Concentrations[i][t];
+      }
+      it.Set(pixel);
+    }
+
+    QuantifierType::Pointer quantifier = QuantifierType::New();
+    quantifier->SetInput(volume);
+    quantifier->SetTiming(timeSeconds);
+    quantifier->SetPrescribedAIF(timeSeconds, curves.AIF);
+    quantifier->UsePrescribedAIFOn();
+    quantifier->SetfTol(setting.FTolerance);
+    quantifier->SetgTol(setting.GTolerance);
+    quantifier->SetxTol(setting.XTolerance);
+    quantifier->Setepsilon(1e-9f);
+    quantifier->SetmaxIter(setting.MaxIter);
+    quantifier->Sethematocrit(Hematocrit);
+    quantifier->SetModelType(modelType);
+    quantifier->SetBATCalculationMode("PeakGradient");
+    quantifier->SetMaskByRSquared(false);
+    quantifier->SetNumberOfClusters(numberOfClusters);
+    quantifier->Update();
+    iterations = quantifier->GetNumberOfIterations();
+
+    ktrans.clear();
+    ve.clear();
+    fpv.clear();
+    codes.clear();
+    const ParameterVolumeType::RegionType region = volume->GetLargestPossibleRegion();
+    itk::ImageRegionConstIterator<ParameterVolumeType> ktransIt(quantifier->GetKTransOutput(), region);
+    itk::ImageRegionConstIterator<ParameterVolumeType> veIt(quantifier->GetVEOutput(), region);
+    itk::ImageRegionConstIterator<ParameterVolumeType> diagnosticsIt(quantifier->GetOptimizerDiagnosticsOutput(), region);
+    for (; !ktransIt.IsAtEnd(); ++ktransIt, ++veIt, ++diagnosticsIt)
+    {
+      ktrans.push_back(ktransIt.Get());
+      ve.push_back(veIt.Get());
+      codes.push_back(static_cast<unsigned>(diagnosticsIt.Get()));
+    }
+    if (modelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+    {
+      for (itk::ImageRegionConstIterator<ParameterVolumeType> fpvIt(quantifier->GetFPVOutput(), region);
+        !fpvIt.IsAtEnd(); ++fpvIt)
+      {
+        fpv.push_back(fpvIt.Get());
+      }
+    }
+    else
+    {
+      fpv.assign(ktrans.size(), 0.0f);
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  std::vector<float> ktransValues = ParseList("0.05,0.1,0.25,0.5");
+  std::vector<float> veValues = ParseList("0.1,0.3,0.5");
+  std::vector<float> fpvValues = ParseList("0");
+  std::vector<float> snrValues = ParseList("20,50,100");
+  std::vector<float> frameSeconds = ParseList("2.5,5,10");
+  std::vector<std::string> engineNames = Split("lm,bounded,clusters", ',');
+  std::string settingsList = "1e-4,1e-4,1e-5,200;1e-3,1e-3,1e-4,200;1e-2,1e-2,1e-3,200;1e-4,1e-4,1e-5,30";
+  float duration = 300.0f;
+  unsigned int realizations = 20;
+  unsigned int seed = 1;
+  unsigned int numberOfClusters = 16;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--ktrans" && i + 1 < argc)
+    {
+      ktransValues = ParseList(argv[++i]);
+    }
+    else if (arg == "--ve" && i + 1 < argc)
+    {
+      veValues = ParseList(argv[++i]);
+    }
+    else if (arg == "--fpv" && i + 1 < argc)
+    {
+      fpvValues = ParseList(argv[++i]);
+    }
+    else if (arg == "--snr" && i + 1 < argc)
+    {
+      snrValues = ParseList(argv[++i]);
+    }
+    else if (arg == "--frameSeconds" && i + 1 < argc)
+    {
+      frameSeconds = ParseList(argv[++i]);
+    }
+    else if (arg == "--duration" && i + 1 < argc)
+    {
+      duration = atof(argv[++i]);
+    }
+    else if (arg == "--realizations" && i + 1 < argc)
+    {
+      realizations = atoi(argv[++i]);
+    }
+    else if (arg == "--engines" && i + 1 < argc)
+    {
+      engineNames = Split(argv[++i], ',');
+    }
+    else if (arg == "--settings" && i + 1 < argc)
+    {
+      settingsList = argv[++i];
+    }
+    else if (arg == "--seed" && i + 1 < argc)
+    {
+      seed = atoi(argv[++i]);
+    }
+    else if (arg == "--clusters" && i + 1 < argc)
+    {
+      numberOfClusters = atoi(argv[++i]);
+    }
+    else
+    {
+      Usage(argv[0]);
+      return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  std::vector<Engine> engines;
+  for (size_t i = 0; i < engineNames.size(); ++i)
+  {
+    if (engineNames[i] != "lm" && engineNames[i] != "bounded" && engineNames[i] != "clusters")
+    {
+      std::cerr << "Unknown engine " << engineNames[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+    Engine engine;
+    engine.Name = engineNames[i];
+    engine.UseBounds = engineNames[i] == "bounded";
+    engine.Clustered = engineNames[i] == "clusters";
+    engines.push_back(engine);
+  }
+
+  std::vector<ToleranceSetting> settings;
+  std::vector<std::string> settingItems = Split(settingsList, ';');
+  for (size_t i = 0; i < settingItems.size(); ++i)
+  {
+    ToleranceSetting setting;
+    if (sscanf(settingItems[i].c_str(), "%f,%f,%f,%d", &setting.FTolerance, &setting.GTolerance,
+      &setting.XTolerance, &setting.MaxIter) != 4)
+    {
+      std::cerr << "Bad setting " << settingItems[i] << ", expected fTol,gTol,xTol,maxIter" << std::endl;
+      return EXIT_FAILURE;
+    }
+    settings.push_back(setting);
+  }
+
+  if (ktransValues.empty() || veValues.empty() || fpvValues.empty() || snrValues.empty()
+    || frameSeconds.empty() || engines.empty() || settings.empty() || realizations == 0
+    || numberOfClusters == 0)
+  {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int modelType = itk::LMCostFunction::TOFTS_2_PARAMETER;
+  for (size_t i = 0; i < fpvValues.size(); ++i)
+  {
+    if (fpvValues[i] > 0.0f)
+    {
+      modelType = itk::LMCostFunction::TOFTS_3_PARAMETER;
+    }
+  }
+
+  itk::Statistics::MersenneTwisterRandomVariateGenerator::Pointer random =
+    itk::Statistics::MersenneTwisterRandomVariateGenerator::CreateInstance();
+  random->Initialize(seed);
+
+  itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
+  itk::LMCostFunction::Pointer costFunction = itk::LMCostFunction::New();
+
+  std::cout << "engine,fTol,gTol,xTol,maxIter,frameSeconds,snr,fits,fitsPerSecond,"
+    << "ktransBias,ktransRMSE,veBias,veRMSE,fpvBias,fpvRMSE,clampedFraction,maxIterFraction,meanIterations" << std::endl;
+
+  for (size_t r = 0; r < frameSeconds.size(); ++r)
+  {
+    for (size_t s = 0; s < snrValues.size(); ++s)
+    {
+      CurveSet curves;
+      MakeCurves(frameSeconds[r], duration, snrValues[s], realizations,
+        ktransValues, veValues, fpvValues, modelType, random, curves);
+      const int timePoints = curves.TimeMinutes.size();
+
+      for (size_t e = 0; e < engines.size(); ++e)
+      {
+        for (size_t c = 0; c < settings.size(); ++c)
+        {
+          const ToleranceSetting& setting = settings[c];
+          ErrorStatistics ktransError, veError, fpvError;
+          unsigned long clamped = 0;
+          unsigned long exhausted = 0;
+          unsigned long iterations = 0;
+
+          // the clustered engine fits the whole set at once, the time
+          // includes the clustering
+          std::vector<float> clusteredKtrans, clusteredVe, clusteredFpv;
+          std::vector<unsigned> clusteredCodes;
+          const double start = itk::PkTimingReport::GetTime();
+          if (engines[e].Clustered)
+          {
+            FitClustered(curves, setting, modelType, numberOfClusters,
+              clusteredKtrans, clusteredVe, clusteredFpv, clusteredCodes, iterations);
+          }
+          for (size_t i = 0; i < curves.Concentrations.size(); ++i)
+          {
+            float Ktrans = 0.0f, Ve = 0.0f, Fpv = 0.0f;
+            unsigned code = 0;
+            if (engines[e].Clustered)
+            {
+              Ktrans = clusteredKtrans[i];
+              Ve = clusteredVe[i];
+              Fpv = clusteredFpv[i];
+              code = clusteredCodes[i];
+            }
+            else
+            {
+              unsigned fitIterations = 0;
+              code = itk::pk_solver(timePoints, &curves.TimeMinutes[0],
+                &curves.Concentrations[i][0], &curves.AIF[0], Ktrans, Ve, Fpv,
+                setting.FTolerance, setting.GTolerance, setting.XTolerance, 1e-9f,
+                setting.MaxIter, Hematocrit, optimizer, costFunction, modelType,
+                0, "PeakGradient", 0, engines[e].UseBounds, &fitIterations);
+              iterations += fitIterations;
+            }
+
+            ktransError.Add((Ktrans - curves.Ktrans[i]) / curves.Ktrans[i]);
+            veError.Add((Ve - curves.Ve[i]) / curves.Ve[i]);
+            fpvError.Add(Fpv - curves.Fpv[i]);
+            if (code & (KTRANS_CLAMPED | VE_CLAMPED))
+            {
+              ++clamped;
+            }
+            if ((code & 0xf) == TOO_MANY_ITERATIONS)
+            {
+              ++exhausted;
+            }
+          }
+          const double seconds = itk::PkTimingReport::GetTime() - start;
+          const unsigned long fits = curves.Concentrations.size();
+
+          std::cout << engines[e].Name << "," << setting.FTolerance << "," << setting.GTolerance << ","
+            << setting.XTolerance << "," << setting.MaxIter << "," << frameSeconds[r] << ","
+            << snrValues[s] << "," << fits << "," << (seconds > 0 ? fits / seconds : 0.0) << ","
+            << ktransError.Bias() << "," << ktransError.RMSE() << ","
+            << veError.Bias() << "," << veError.RMSE() << ","
+            << fpvError.Bias() << "," << fpvError.RMSE() << ","
+            << double(clamped) / fits << "," << double(exhausted) / fits << ","
+            << double(iterations) / fits << std::endl;
+        }
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// pk_solver_batch must give each curve the parameters, diagnostics,
+// fitted curve and R-squared of a pk_solver fit of that curve alone,
+// for one and for several threads. The curves are synthetic Tofts
+// curves, laid out frame major to exercise the strides, and a flat
+// curve whose R-squared must be finite.
+//
+// Usage: PkSolverBatchTest
+
+#include "PkSolver.h"
+#include "itkLevenbergMarquardtOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+  const int NumberOfFrames = 40;
+  const float FrameSeconds = 5.0f;
+  const float Hematocrit = 0.4f;
+  const float Tolerance = 1e-5f;
+
+  // Ktrans, Ve, Fpv of the synthetic curves
+  const float TrueParameters[][3] =
+  {
+    { 0.05f, 0.2f, 0.01f },
+    { 0.25f, 0.4f, 0.05f },
+    { 0.8f, 0.6f, 0.02f },
+    { 1.5f, 0.3f, 0.1f },
+    { 0.0f, 0.0f, 0.0f }  // flat
+  };
+  const long long NumberOfCurves = sizeof(TrueParameters) / sizeof(TrueParameters[0]);
+
+  bool Close(float a, float b)
+  {
+    return fabs(a - b) <= Tolerance * std::max(1.0f, static_cast<float>(fabs(b)));
+  }
+
+  bool TestModel(int modelType, const std::vector<float>& timeMinutes, const std::vector<float>& aif)
+  {
+    const unsigned int numberOfParameters = modelType == itk::LMCostFunction::TOFTS_3_PARAMETER ? 3 : 2;
+
+    // frame t of curve i at curves[t * NumberOfCurves + i]
+    itk::LMCostFunction::Pointer model = itk::LMCostFunction::New();
+    model->SetNumberOfValues(NumberOfFrames);
+    model->SetCb(&aif[0], NumberOfFrames);
+    model->SetTime(&timeMinutes[0], NumberOfFrames);
+    model->SetHematocrit(Hematocrit);
+    model->SetModelType(itk::LMCostFunction::TOFTS_3_PARAMETER);
+    std::vector<float> curves(NumberOfFrames * NumberOfCurves);
+    for (long long i = 0; i < NumberOfCurves; ++i)
+    {
+      itk::LMCostFunction::ParametersType parameters(3);
+      for (unsigned int p = 0; p < 3; ++p)
+      {
+        parameters[p] = TrueParameters[i][p];
+      }
+      const itk::LMCostFunction::MeasureType curve = model->GetFittedFunction(parameters);
+      for (int t = 0; t < NumberOfFrames; ++t)
+      {
+        curves[t * NumberOfCurves + i] = TrueParameters[i][0] > 0.0f ? curve[t] : 0.0f;
+      }
+    }
+
+    // each curve fitted alone
+    std::vector<float> expectedParameters(NumberOfCurves * numberOfParameters);
+    std::vector<unsigned> expectedDiagnostics(NumberOfCurves);
+    std::vector<float> expectedRSquared(NumberOfCurves);
+    std::vector<float> expectedFitted(NumberOfCurves * NumberOfFrames);
+    for (long long i = 0; i < NumberOfCurves; ++i)
+    {
+      std::vector<float> curve(NumberOfFrames);
+      for (int t = 0; t < NumberOfFrames; ++t)
+      {
+        curve[t] = curves[t * NumberOfCurves + i];
+      }
+      itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
+      itk::LMCostFunction::Pointer costFunction = itk::LMCostFunction::New();
+      float Ktrans = 0.0f, Ve = 0.0f, Fpv = 0.0f;
+      expectedDiagnostics[i] = itk::pk_solver(NumberOfFrames, &timeMinutes[0], &curve[0], &aif[0],
+        Ktrans, Ve, Fpv, 1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, Hematocrit, optimizer, costFunction, modelType);
+      float* parameters = &expectedParameters[i * numberOfParameters];
+      parameters[0] = Ktrans;
+      parameters[1] = Ve;
+      if (numberOfParameters == 3)
+      {
+        parameters[2] = Fpv;
+      }
+
+      itk::LMCostFunction::ParametersType position(numberOfParameters);
+      for (unsigned int p = 0; p < numberOfParameters; ++p)
+      {
+        position[p] = parameters[p];
+      }
+      const itk::LMCostFunction::MeasureType fitted = costFunction->GetFittedFunction(position);
+      for (int t = 0; t < NumberOfFrames; ++t)
+      {
+        expectedFitted[i * NumberOfFrames + t] = fitted[t];
+      }
+      expectedRSquared[i] = itk::compute_rsquared(NumberOfFrames, &expectedFitted[i * NumberOfFrames],
+        optimizer->GetOptimizer()->get_end_error());
+    }
+
+    bool ok = true;
+    const unsigned int threads[] = { 1, 4 };
+    for (unsigned int n = 0; n < sizeof(threads) / sizeof(threads[0]); ++n)
+    {
+      std::vector<float> parameters(NumberOfCurves * numberOfParameters);
+      std::vector<unsigned> diagnostics(NumberOfCurves);
+      std::vector<float> rSquared(NumberOfCurves);
+      std::vector<float> fitted(NumberOfCurves * NumberOfFrames);
+      itk::pk_solver_batch(NumberOfFrames, &timeMinutes[0], &aif[0],
+        NumberOfCurves, &curves[0], 1, NumberOfCurves,
+        &parameters[0], &diagnostics[0], &rSquared[0], &fitted[0],
+        1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, Hematocrit, modelType, false, threads[n]);
+
+      for (long long i = 0; i < NumberOfCurves; ++i)
+      {
+        bool same = diagnostics[i] == expectedDiagnostics[i] && Close(rSquared[i], expectedRSquared[i]);
+        for (unsigned int p = 0; p < numberOfParameters; ++p)
+        {
+          same = same && Close(parameters[i * numberOfParameters + p], expectedParameters[i * numberOfParameters + p]);
+        }
+        for (int t = 0; t < NumberOfFrames; ++t)
+        {
+          same = same && Close(fitted[i * NumberOfFrames + t], expectedFitted[i * NumberOfFrames + t]);
+        }
+        if (!same)
+        {
+          std::cerr << "Model " << numberOfParameters << ", " << threads[n] << " threads, curve " << i
+            << ": Ktrans " << parameters[i * numberOfParameters] << " Ve " << parameters[i * numberOfParameters + 1]
+            << " R2 " << rSquared[i] << " diagnostics " << diagnostics[i]
+            << " instead of Ktrans " << expectedParameters[i * numberOfParameters]
+            << " Ve " << expectedParameters[i * numberOfParameters + 1]
+            << " R2 " << expectedRSquared[i] << " diagnostics " << expectedDiagnostics[i] << std::endl;
+          ok = false;
+        }
+        if (!(rSquared[i] == rSquared[i]) || fabs(rSquared[i]) > 1e30f)
+        {
+          std::cerr << "Model " << numberOfParameters << ", curve " << i << ": R2 is not finite" << std::endl;
+          ok = false;
+        }
+      }
+    }
+    return ok;
+  }
+}
+
+int main(int, char * [])
+{
+  std::vector<float> timeSeconds(NumberOfFrames), timeMinutes(NumberOfFrames);
+  for (int t = 0; t < NumberOfFrames; ++t)
+  {
+    timeSeconds[t] = t * FrameSeconds;
+    timeMinutes[t] = timeSeconds[t] / 60.0f;
+  }
+  const std::vector<float> aif = itk::compute_population_aif(timeSeconds, 0.1f);
+
+  bool ok = true;
+  ok = TestModel(itk::LMCostFunction::TOFTS_2_PARAMETER, timeMinutes, aif) && ok;
+  ok = TestModel(itk::LMCostFunction::TOFTS_3_PARAMETER, timeMinutes, aif) && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
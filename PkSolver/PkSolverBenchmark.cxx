@@ -0,0 +1,381 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Microbenchmarks of the PkSolver kernels.
+//
+// Each kernel runs on synthetic curves (Parker population AIF, Tofts
+// tissue curves and the matching SPGR signal) of several lengths, and is
+// repeated until it has run for a minimum time. The time per call is
+// printed as CSV (default) or JSON; for pk_solver_batch it is the time
+// per curve.
+//
+// Usage: PkSolverBenchmark [--json] [--minTime seconds] [timePoints ...]
+
+#include "PkSolver.h"
+#include "PkTimingReport.h"
+#include "itkLevenbergMarquardtOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  const float FrameSeconds = 5.0f;     // temporal resolution of the synthetic series
+  const float T1Pre = 1600.0f;         // ms
+  const float TR = 5.0f;               // ms
+  const float FA = 15.0f;              // degrees
+  const float Relaxivity = 4.9E-3f;    // 1/(mM ms)
+  const float Hematocrit = 0.4f;
+  const float S0 = 1000.0f;
+
+  // Synthetic curves of one length
+  struct Curves
+  {
+    std::vector<float> TimeSeconds;
+    std::vector<float> TimeMinutes;
+    std::vector<float> AIF;
+    std::vector<float> Tissue;         // Tofts curve with a little noise
+    std::vector<float> Signal;         // SPGR signal of the tissue curve
+  };
+
+  Curves MakeCurves(unsigned int timePoints)
+  {
+    Curves curves;
+    curves.TimeSeconds.resize(timePoints);
+    curves.TimeMinutes.resize(timePoints);
+    for (unsigned int i = 0; i < timePoints; ++i)
+    {
+      curves.TimeSeconds[i] = i * FrameSeconds;
+      curves.TimeMinutes[i] = curves.TimeSeconds[i] / 60.0f;
+    }
+    curves.AIF = itk::compute_population_aif(curves.TimeSeconds, 0.1f);
+
+    itk::LMCostFunction::Pointer costFunction = itk::LMCostFunction::New();
+    costFunction->SetNumberOfValues(timePoints);
+    costFunction->SetCb(&curves.AIF[0], timePoints);
+    costFunction->SetTime(&curves.TimeMinutes[0], timePoints);
+    costFunction->SetHematocrit(Hematocrit);
+    costFunction->SetModelType(itk::LMCostFunction::TOFTS_3_PARAMETER);
+    itk::LMCostFunction::ParametersType parameters(3);
+    parameters[0] = 0.25;
+    parameters[1] = 0.4;
+    parameters[2] = 0.05;
+    itk::LMCostFunction::MeasureType fitted = costFunction->GetFittedFunction(parameters);
+
+    // deterministic noise, so every run benchmarks the same curves
+    unsigned long seed = 12345;
+    const double alpha = FA * 3.14159265358979 / 180.0;
+    curves.Tissue.resize(timePoints);
+    curves.Signal.resize(timePoints);
+    for (unsigned int i = 0; i < timePoints; ++i)
+    {
+      seed = (seed * 1103515245UL + 12345UL) & 0x7fffffffUL;
+      const double noise = 0.01 * ((double)seed / 0x7fffffffUL - 0.5);
+      curves.Tissue[i] = std::max(0.0, fitted[i] + noise);
+
+      const double E1 = exp(-TR * (1.0 / T1Pre + Relaxivity * curves.Tissue[i]));
+      curves.Signal[i] = S0 * (1.0 - E1) / (1.0 - cos(alpha) * E1) * (1.0 - cos(alpha) * exp(-TR / T1Pre)) / (1.0 - exp(-TR / T1Pre));
+    }
+    return curves;
+  }
+
+  struct Result
+  {
+    std::string Kernel;
+    std::string Model;
+    unsigned int TimePoints;
+    unsigned long Calls;
+    double NanosecondsPerCall;
+  };
+
+  // Run a kernel (a functor with operator()) until minTime has elapsed,
+  // doubling the number of calls between clock reads
+  template <class TKernel>
+  Result Run(const std::string& kernelName, const std::string& model, unsigned int timePoints,
+    TKernel& kernel, double minTime)
+  {
+    kernel(); // warm up
+
+    unsigned long calls = 0;
+    unsigned long batch = 1;
+    const double start = itk::PkTimingReport::GetTime();
+    double elapsed = 0.0;
+    while (elapsed < minTime)
+    {
+      for (unsigned long i = 0; i < batch; ++i)
+      {
+        kernel();
+      }
+      calls += batch;
+      batch *= 2;
+      elapsed = itk::PkTimingReport::GetTime() - start;
+    }
+
+    Result result;
+    result.Kernel = kernelName;
+    result.Model = model;
+    result.TimePoints = timePoints;
+    result.Calls = calls;
+    result.NanosecondsPerCall = elapsed * 1e9 / calls;
+    return result;
+  }
+
+  const char* ModelName(int modelType)
+  {
+    return modelType == itk::LMCostFunction::TOFTS_3_PARAMETER ? "Tofts3Parameter" : "Tofts2Parameter";
+  }
+
+  // Kernels
+
+  struct PkSolverKernel
+  {
+    const Curves* Data;
+    int ModelType;
+    void operator()()
+    {
+      float Ktrans = 0.0f, Ve = 0.0f, Fpv = 0.0f;
+      itk::pk_solver(Data->Tissue.size(), &Data->TimeMinutes[0], &Data->Tissue[0], &Data->AIF[0],
+        Ktrans, Ve, Fpv, 1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, Hematocrit, ModelType);
+    }
+  };
+
+  struct PkSolverReuseKernel
+  {
+    const Curves* Data;
+    int ModelType;
+    itk::LevenbergMarquardtOptimizer::Pointer Optimizer;
+    itk::LMCostFunction::Pointer CostFunction;
+    void operator()()
+    {
+      float Ktrans = 0.0f, Ve = 0.0f, Fpv = 0.0f;
+      itk::pk_solver(Data->Tissue.size(), &Data->TimeMinutes[0], &Data->Tissue[0], &Data->AIF[0],
+        Ktrans, Ve, Fpv, 1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, Hematocrit,
+        Optimizer, CostFunction, ModelType);
+    }
+  };
+
+  // BatchSize fits of the tissue curve (a curve stride of 0) by one
+  // thread, to compare the per curve cost with pk_solver_reuse
+  struct PkSolverBatchKernel
+  {
+    enum { BatchSize = 64 };
+    const Curves* Data;
+    int ModelType;
+    std::vector<float> Parameters;
+    std::vector<unsigned> Diagnostics;
+    void operator()()
+    {
+      itk::pk_solver_batch(Data->Tissue.size(), &Data->TimeMinutes[0], &Data->AIF[0],
+        BatchSize, &Data->Tissue[0], 0, 1, &Parameters[0], &Diagnostics[0], 0, 0,
+        1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, Hematocrit, ModelType, false, 1);
+    }
+  };
+
+  struct GetValueKernel
+  {
+    itk::LMCostFunction::Pointer CostFunction;
+    itk::LMCostFunction::ParametersType Parameters;
+    double Sink;
+    void operator()()
+    {
+      Sink += CostFunction->GetValue(Parameters)[0];
+    }
+  };
+
+  struct ConcentrationKernel
+  {
+    const Curves* Data;
+    std::vector<float> Concentration;
+    void operator()()
+    {
+      itk::convert_signal_to_concentration(Data->Signal.size(), &Data->Signal[0],
+        T1Pre, TR, FA, &Concentration[0], Relaxivity);
+    }
+  };
+
+  struct BATKernel
+  {
+    const Curves* Data;
+    int Sink;
+    void operator()()
+    {
+      int arrival = 0, firstPeak = 0;
+      float maxSlope = 0.0f;
+      itk::compute_bolus_arrival_time(Data->Tissue.size(), &Data->Tissue[0], arrival, firstPeak, maxSlope);
+      Sink += arrival;
+    }
+  };
+
+  struct S0Kernel
+  {
+    const Curves* Data;
+    float Sink;
+    void operator()()
+    {
+      Sink += itk::compute_s0_individual_curve(Data->Signal.size(), &Data->Signal[0], 15.0f, "PeakGradient", 0);
+    }
+  };
+
+  struct AUCKernel
+  {
+    const Curves* Data;
+    float Sink;
+    void operator()()
+    {
+      Sink += itk::area_under_curve(Data->Tissue.size(), &Data->TimeSeconds[0], &Data->Tissue[0],
+        3, Data->TimeSeconds.back());
+    }
+  };
+
+  void WriteCSV(std::ostream& os, const std::vector<Result>& results)
+  {
+    os << "kernel,model,timePoints,calls,nsPerCall" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      os << results[i].Kernel << "," << results[i].Model << "," << results[i].TimePoints << ","
+        << results[i].Calls << "," << results[i].NanosecondsPerCall << std::endl;
+    }
+  }
+
+  void WriteJSON(std::ostream& os, const std::vector<Result>& results)
+  {
+    os << "[" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      os << "  {\"kernel\": \"" << results[i].Kernel << "\", \"model\": \"" << results[i].Model
+        << "\", \"timePoints\": " << results[i].TimePoints << ", \"calls\": " << results[i].Calls
+        << ", \"nsPerCall\": " << results[i].NanosecondsPerCall << "}"
+        << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    os << "]" << std::endl;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  bool json = false;
+  double minTime = 0.5;
+  std::vector<unsigned int> lengths;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--json"))
+    {
+      json = true;
+    }
+    else if (!strcmp(argv[i], "--minTime") && i + 1 < argc)
+    {
+      minTime = atof(argv[++i]);
+    }
+    else if (atoi(argv[i]) > 0)
+    {
+      lengths.push_back(atoi(argv[i]));
+    }
+    else
+    {
+      std::cerr << "Usage: " << argv[0] << " [--json] [--minTime seconds] [timePoints ...]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (lengths.empty())
+  {
+    const unsigned int defaultLengths[] = { 20, 40, 80, 160, 320 };
+    lengths.assign(defaultLengths, defaultLengths + sizeof(defaultLengths) / sizeof(defaultLengths[0]));
+  }
+
+  // the first pk_solver overload reports its stop condition on stdout,
+  // keep it out of the results
+  std::ostringstream discarded;
+  std::streambuf* coutBuffer = std::cout.rdbuf();
+
+  std::vector<Result> results;
+  const int models[2] = { itk::LMCostFunction::TOFTS_2_PARAMETER, itk::LMCostFunction::TOFTS_3_PARAMETER };
+  for (size_t l = 0; l < lengths.size(); ++l)
+  {
+    const unsigned int timePoints = lengths[l];
+    Curves curves = MakeCurves(timePoints);
+
+    for (unsigned int m = 0; m < 2; ++m)
+    {
+      PkSolverKernel solver;
+      solver.Data = &curves;
+      solver.ModelType = models[m];
+      std::cout.rdbuf(discarded.rdbuf());
+      Result result = Run("pk_solver", ModelName(models[m]), timePoints, solver, minTime);
+      std::cout.rdbuf(coutBuffer);
+      discarded.str("");
+      results.push_back(result);
+
+      PkSolverReuseKernel reuse;
+      reuse.Data = &curves;
+      reuse.ModelType = models[m];
+      reuse.Optimizer = itk::LevenbergMarquardtOptimizer::New();
+      reuse.CostFunction = itk::LMCostFunction::New();
+      results.push_back(Run("pk_solver_reuse", ModelName(models[m]), timePoints, reuse, minTime));
+
+      PkSolverBatchKernel batch;
+      batch.Data = &curves;
+      batch.ModelType = models[m];
+      batch.Parameters.resize(PkSolverBatchKernel::BatchSize * 3);
+      batch.Diagnostics.resize(PkSolverBatchKernel::BatchSize);
+      Result batchResult = Run("pk_solver_batch", ModelName(models[m]), timePoints, batch, minTime);
+      batchResult.NanosecondsPerCall /= PkSolverBatchKernel::BatchSize; // per curve
+      results.push_back(batchResult);
+
+      GetValueKernel getValue;
+      getValue.CostFunction = itk::LMCostFunction::New();
+      getValue.CostFunction->SetNumberOfValues(timePoints);
+      getValue.CostFunction->SetCb(&curves.AIF[0], timePoints);
+      getValue.CostFunction->SetCv(&curves.Tissue[0], timePoints);
+      getValue.CostFunction->SetTime(&curves.TimeMinutes[0], timePoints);
+      getValue.CostFunction->SetHematocrit(Hematocrit);
+      getValue.CostFunction->SetModelType(models[m]);
+      getValue.Parameters = itk::LMCostFunction::ParametersType(getValue.CostFunction->GetNumberOfParameters());
+      getValue.Parameters.Fill(0.1);
+      getValue.Sink = 0.0;
+      results.push_back(Run("LMCostFunction::GetValue", ModelName(models[m]), timePoints, getValue, minTime));
+    }
+
+    ConcentrationKernel concentration;
+    concentration.Data = &curves;
+    concentration.Concentration.resize(timePoints);
+    results.push_back(Run("convert_signal_to_concentration", "", timePoints, concentration, minTime));
+
+    BATKernel bat;
+    bat.Data = &curves;
+    bat.Sink = 0;
+    results.push_back(Run("compute_bolus_arrival_time", "", timePoints, bat, minTime));
+
+    S0Kernel s0;
+    s0.Data = &curves;
+    s0.Sink = 0.0f;
+    results.push_back(Run("compute_s0_individual_curve", "", timePoints, s0, minTime));
+
+    AUCKernel auc;
+    auc.Data = &curves;
+    auc.Sink = 0.0f;
+    results.push_back(Run("area_under_curve", "", timePoints, auc, minTime));
+  }
+
+  if (json)
+  {
+    WriteJSON(std::cout, results);
+  }
+  else
+  {
+    WriteCSV(std::cout, results);
+  }
+  return EXIT_SUCCESS;
+}
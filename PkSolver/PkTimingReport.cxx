@@ -0,0 +1,239 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#include "PkTimingReport.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+  // Quote a string for JSON. Names are plain identifiers or file
+  // roles, so only quotes and backslashes need escaping.
+  std::string Quote(const std::string& s)
+  {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+      if (s[i] == '"' || s[i] == '\\')
+      {
+        quoted += '\\';
+      }
+      quoted += s[i];
+    }
+    return quoted + "\"";
+  }
+}
+
+namespace itk
+{
+  PkTimingReport::PkTimingReport()
+  {
+    this->Initialize();
+  }
+
+  const char* PkTimingReport::GetStageName(unsigned int stage)
+  {
+    static const char* names[NumberOfStages] =
+    {
+      "read", "header", "s0", "concentration", "aif", "bat", "fit", "rsquared", "auc", "write"
+    };
+    if (stage >= NumberOfStages)
+    {
+      return "";
+    }
+    return names[stage];
+  }
+
+  double PkTimingReport::GetTime()
+  {
+    return itksys::SystemTools::GetTime();
+  }
+
+  double PkTimingReport::GetPeakResidentSetSize()
+  {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+      return static_cast<double>(counters.PeakWorkingSetSize);
+    }
+    return 0.0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+      return 0.0;
+    }
+#if defined(__APPLE__)
+    return static_cast<double>(usage.ru_maxrss);          // bytes
+#else
+    return static_cast<double>(usage.ru_maxrss) * 1024.0; // kilobytes
+#endif
+#endif
+  }
+
+  void PkTimingReport::Initialize()
+  {
+    m_StartTime = GetTime();
+    m_StageSeconds.clear();
+    m_StageCounts.clear();
+    m_Steps.clear();
+    m_Sections.clear();
+    m_Counters.clear();
+    this->SetNumberOfThreads(1);
+    this->Modified();
+  }
+
+  void PkTimingReport::SetNumberOfThreads(unsigned int numberOfThreads)
+  {
+    if (numberOfThreads > m_StageSeconds.size())
+    {
+      m_StageSeconds.resize(numberOfThreads, std::vector<double>(NumberOfStages, 0.0));
+      m_StageCounts.resize(numberOfThreads, std::vector<SizeValueType>(NumberOfStages, 0));
+    }
+  }
+
+  void PkTimingReport::AddStageTime(unsigned int thread, StageType stage, double seconds, SizeValueType count)
+  {
+    m_StageSeconds[thread][stage] += seconds;
+    m_StageCounts[thread][stage] += count;
+  }
+
+  void PkTimingReport::AddStep(StageType stage, const std::string& name, double seconds)
+  {
+    Step step;
+    step.Stage = stage;
+    step.Name = name;
+    step.Seconds = seconds;
+    m_Steps.push_back(step);
+
+    if (m_TraceRecorder)
+    {
+      m_TraceRecorder->AddEvent(0, GetStageName(stage), m_TraceRecorder->GetTime() - seconds);
+    }
+
+    // serial steps also count towards their stage, on the main thread
+    this->AddStageTime(0, stage, seconds);
+  }
+
+  void PkTimingReport::AddSection(const std::string& name, double wallSeconds,
+    const std::vector<double>& threadBusySeconds, SizeValueType numberOfVoxels)
+  {
+    Section section;
+    section.Name = name;
+    section.WallSeconds = wallSeconds;
+    section.ThreadBusySeconds = threadBusySeconds;
+    section.NumberOfVoxels = numberOfVoxels;
+    m_Sections.push_back(section);
+  }
+
+  void PkTimingReport::SetCounter(const std::string& name, double value)
+  {
+    for (size_t i = 0; i < m_Counters.size(); ++i)
+    {
+      if (m_Counters[i].first == name)
+      {
+        m_Counters[i].second = value;
+        return;
+      }
+    }
+    m_Counters.push_back(std::make_pair(name, value));
+  }
+
+  void PkTimingReport::WriteJSON(std::ostream& os) const
+  {
+    const unsigned int numberOfThreads = m_StageSeconds.size();
+
+    os << "{\n";
+    os << "  \"wallSeconds\": " << GetTime() - m_StartTime << ",\n";
+    os << "  \"peakRSSBytes\": " << GetPeakResidentSetSize() << ",\n";
+    os << "  \"numberOfThreads\": " << numberOfThreads << ",\n";
+
+    os << "  \"counters\": {";
+    for (size_t i = 0; i < m_Counters.size(); ++i)
+    {
+      os << (i ? ", " : "") << Quote(m_Counters[i].first) << ": " << m_Counters[i].second;
+    }
+    os << "},\n";
+
+    os << "  \"stages\": [\n";
+    for (unsigned int stage = 0; stage < NumberOfStages; ++stage)
+    {
+      double seconds = 0.0;
+      SizeValueType count = 0;
+      for (unsigned int t = 0; t < numberOfThreads; ++t)
+      {
+        seconds += m_StageSeconds[t][stage];
+        count += m_StageCounts[t][stage];
+      }
+      os << "    {\"name\": " << Quote(GetStageName(stage))
+        << ", \"seconds\": " << seconds
+        << ", \"count\": " << count
+        << ", \"threadSeconds\": [";
+      for (unsigned int t = 0; t < numberOfThreads; ++t)
+      {
+        os << (t ? ", " : "") << m_StageSeconds[t][stage];
+      }
+      os << "]}" << (stage + 1 < NumberOfStages ? "," : "") << "\n";
+    }
+    os << "  ],\n";
+
+    os << "  \"steps\": [\n";
+    for (size_t i = 0; i < m_Steps.size(); ++i)
+    {
+      os << "    {\"stage\": " << Quote(GetStageName(m_Steps[i].Stage))
+        << ", \"name\": " << Quote(m_Steps[i].Name)
+        << ", \"seconds\": " << m_Steps[i].Seconds
+        << "}" << (i + 1 < m_Steps.size() ? "," : "") << "\n";
+    }
+    os << "  ],\n";
+
+    os << "  \"sections\": [\n";
+    for (size_t i = 0; i < m_Sections.size(); ++i)
+    {
+      const Section& section = m_Sections[i];
+      double busy = 0.0;
+      for (size_t t = 0; t < section.ThreadBusySeconds.size(); ++t)
+      {
+        busy += section.ThreadBusySeconds[t];
+      }
+      const double capacity = section.WallSeconds * section.ThreadBusySeconds.size();
+      os << "    {\"name\": " << Quote(section.Name)
+        << ", \"wallSeconds\": " << section.WallSeconds
+        << ", \"voxels\": " << section.NumberOfVoxels
+        << ", \"voxelsPerSecond\": " << (section.WallSeconds > 0 ? section.NumberOfVoxels / section.WallSeconds : 0.0)
+        << ", \"threadUtilization\": " << (capacity > 0 ? busy / capacity : 0.0)
+        << ", \"threadBusySeconds\": [";
+      for (size_t t = 0; t < section.ThreadBusySeconds.size(); ++t)
+      {
+        os << (t ? ", " : "") << section.ThreadBusySeconds[t];
+      }
+      os << "]}" << (i + 1 < m_Sections.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}\n";
+  }
+
+  void PkTimingReport::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "NumberOfThreads: " << m_StageSeconds.size() << std::endl;
+    os << indent << "NumberOfSteps: " << m_Steps.size() << std::endl;
+    os << indent << "NumberOfSections: " << m_Sections.size() << std::endl;
+  }
+
+} // end namespace itk
@@ -0,0 +1,226 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef PkTimingReport_h_
+#define PkTimingReport_h_
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "PkTraceRecorder.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+  /** \class PkTimingReport
+   * \brief Wall time of the processing stages, per thread.
+   *
+   * Threaded code adds the time spent in each stage to the row of its
+   * thread, so no locking is needed as long as SetNumberOfThreads() was
+   * called (by the main thread) before the threads start. Parallel
+   * sections record their wall time and the busy time of each thread,
+   * from which the thread utilization is derived. Serial steps, like
+   * reading the input or writing one output, are recorded by name.
+   *
+   * The report is written as JSON along with the throughput of each
+   * section and the peak resident set size of the process.
+   */
+  class PkTimingReport : public Object
+  {
+  public:
+    typedef PkTimingReport           Self;
+    typedef Object                   Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(PkTimingReport, Object);
+
+    enum StageType
+    {
+      ReadStage = 0,
+      HeaderStage,
+      S0Stage,
+      ConcentrationStage,
+      AIFStage,
+      BATStage,
+      FitStage,
+      RSquaredStage,
+      AUCStage,
+      WriteStage,
+      NumberOfStages
+    };
+
+    static const char* GetStageName(unsigned int stage);
+
+    /** Wall clock, in seconds */
+    static double GetTime();
+
+    /** Peak resident set size of the process in bytes, 0 if unknown */
+    static double GetPeakResidentSetSize();
+
+    /** Clear the report and restart its clock */
+    void Initialize();
+
+    /** Make room for the rows of a number of threads. Only grows. */
+    void SetNumberOfThreads(unsigned int numberOfThreads);
+
+    /** Add time spent by a thread in a stage, for count items */
+    void AddStageTime(unsigned int thread, StageType stage, double seconds, SizeValueType count = 1);
+
+    /** Add a serial step of a stage, e.g. writing one output */
+    void AddStep(StageType stage, const std::string& name, double seconds);
+
+    /** Add a parallel section: its wall time, the time each thread was
+     * busy and the number of voxels it processed */
+    void AddSection(const std::string& name, double wallSeconds,
+      const std::vector<double>& threadBusySeconds, SizeValueType numberOfVoxels);
+
+    /** Record a named count, e.g. the number of fitted voxels */
+    void SetCounter(const std::string& name, double value);
+
+    /** Optional recorder to which the serial steps are also added, as
+     * events of the main thread named after their stage */
+    itkSetObjectMacro(TraceRecorder, PkTraceRecorder);
+    itkGetObjectMacro(TraceRecorder, PkTraceRecorder);
+
+    void WriteJSON(std::ostream& os) const;
+
+  protected:
+    PkTimingReport();
+    ~PkTimingReport()
+    {
+    }
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+  private:
+    PkTimingReport(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+
+    struct Step
+    {
+      int Stage;
+      std::string Name;
+      double Seconds;
+    };
+
+    struct Section
+    {
+      std::string Name;
+      double WallSeconds;
+      std::vector<double> ThreadBusySeconds;
+      SizeValueType NumberOfVoxels;
+    };
+
+    double m_StartTime;
+    PkTraceRecorder::Pointer m_TraceRecorder;
+    std::vector< std::vector<double> > m_StageSeconds;          // [thread][stage]
+    std::vector< std::vector<SizeValueType> > m_StageCounts;    // [thread][stage]
+    std::vector<Step> m_Steps;
+    std::vector<Section> m_Sections;
+    std::vector< std::pair<std::string, double> > m_Counters;
+  };
+
+  /** \class PkScopedTiming
+   * \brief Adds the lifetime of the object as a step of a timing report.
+   * Does nothing when the report is null.
+   */
+  class PkScopedTiming
+  {
+  public:
+    PkScopedTiming(PkTimingReport* report, PkTimingReport::StageType stage, const std::string& name)
+      : m_Report(report), m_Stage(stage), m_Name(name), m_Start(report ? PkTimingReport::GetTime() : 0.0)
+    {
+    }
+    ~PkScopedTiming()
+    {
+      if (m_Report)
+      {
+        m_Report->AddStep(m_Stage, m_Name, PkTimingReport::GetTime() - m_Start);
+      }
+    }
+
+  private:
+    PkScopedTiming(const PkScopedTiming &); // purposely not implemented
+    void operator=(const PkScopedTiming &); // purposely not implemented
+
+    PkTimingReport* m_Report;
+    PkTimingReport::StageType m_Stage;
+    std::string m_Name;
+    double m_Start;
+  };
+
+  /** \class PkStageTimer
+   * \brief Accumulates the stage times of one thread and adds them to a
+   * timing report when destroyed.
+   *
+   * Stop() charges the time since the last Start() or Stop() to a
+   * stage, so consecutive stages are timed with one clock read each.
+   * Does nothing when the report is null.
+   */
+  class PkStageTimer
+  {
+  public:
+    PkStageTimer(PkTimingReport* report, unsigned int thread)
+      : m_Report(report), m_Thread(thread), m_Start(0.0)
+    {
+      for (unsigned int i = 0; i < PkTimingReport::NumberOfStages; ++i)
+      {
+        m_Seconds[i] = 0.0;
+        m_Counts[i] = 0;
+      }
+    }
+    ~PkStageTimer()
+    {
+      if (m_Report)
+      {
+        for (unsigned int i = 0; i < PkTimingReport::NumberOfStages; ++i)
+        {
+          if (m_Counts[i])
+          {
+            m_Report->AddStageTime(m_Thread, static_cast<PkTimingReport::StageType>(i), m_Seconds[i], m_Counts[i]);
+          }
+        }
+      }
+    }
+
+    void Start()
+    {
+      if (m_Report)
+      {
+        m_Start = PkTimingReport::GetTime();
+      }
+    }
+
+    void Stop(PkTimingReport::StageType stage)
+    {
+      if (m_Report)
+      {
+        const double now = PkTimingReport::GetTime();
+        m_Seconds[stage] += now - m_Start;
+        ++m_Counts[stage];
+        m_Start = now;
+      }
+    }
+
+  private:
+    PkStageTimer(const PkStageTimer &); // purposely not implemented
+    void operator=(const PkStageTimer &); // purposely not implemented
+
+    PkTimingReport* m_Report;
+    unsigned int m_Thread;
+    double m_Start;
+    double m_Seconds[PkTimingReport::NumberOfStages];
+    SizeValueType m_Counts[PkTimingReport::NumberOfStages];
+  };
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,101 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#include "PkTraceRecorder.h"
+#include "itksys/SystemTools.hxx"
+
+namespace itk
+{
+  PkTraceRecorder::PkTraceRecorder()
+  {
+    m_Capacity = 65536;
+    m_Origin = itksys::SystemTools::GetTime();
+    this->SetNumberOfThreads(1);
+  }
+
+  void PkTraceRecorder::SetNumberOfThreads(unsigned int numberOfThreads)
+  {
+    if (numberOfThreads > m_Buffers.size())
+    {
+      const size_t first = m_Buffers.size();
+      m_Buffers.resize(numberOfThreads);
+      for (size_t t = first; t < m_Buffers.size(); ++t)
+      {
+        m_Buffers[t].Events.resize(m_Capacity);
+        m_Buffers[t].NumberOfEvents = 0;
+      }
+    }
+  }
+
+  double PkTraceRecorder::GetTime() const
+  {
+    return itksys::SystemTools::GetTime() - m_Origin;
+  }
+
+  void PkTraceRecorder::AddEvent(unsigned int thread, const char* name, double start,
+    const char* argName, long value)
+  {
+    // a thread without a buffer (SetNumberOfThreads was not called for
+    // it) has nowhere to record without a lock, its events are dropped
+    if (thread >= m_Buffers.size())
+    {
+      return;
+    }
+    Buffer& buffer = m_Buffers[thread];
+    if (buffer.Events.empty())
+    {
+      return;
+    }
+    Event& event = buffer.Events[buffer.NumberOfEvents % buffer.Events.size()];
+    event.Name = name;
+    event.ArgName = argName;
+    event.Value = value;
+    event.Start = start;
+    event.Duration = this->GetTime() - start;
+    ++buffer.NumberOfEvents;
+  }
+
+  void PkTraceRecorder::WriteChromeTrace(std::ostream& os) const
+  {
+    os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (size_t t = 0; t < m_Buffers.size(); ++t)
+    {
+      // name the rows, thread 0 is also the main thread
+      os << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t
+        << ", \"args\": {\"name\": \"" << (t == 0 ? "main" : "worker") << " " << t << "\"}}";
+      first = false;
+
+      const Buffer& buffer = m_Buffers[t];
+      const unsigned long size = buffer.Events.size();
+      const unsigned long begin = buffer.NumberOfEvents > size ? buffer.NumberOfEvents - size : 0;
+      for (unsigned long i = begin; i < buffer.NumberOfEvents; ++i)
+      {
+        const Event& event = buffer.Events[i % size];
+        os << ",\n{\"name\": \"" << event.Name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << t
+          << ", \"ts\": " << static_cast<long long>(event.Start * 1e6)
+          << ", \"dur\": " << static_cast<long long>(event.Duration * 1e6);
+        if (event.ArgName)
+        {
+          os << ", \"args\": {\"" << event.ArgName << "\": " << event.Value << "}";
+        }
+        os << "}";
+      }
+    }
+    os << "\n]}\n";
+  }
+
+  void PkTraceRecorder::PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os, indent);
+    os << indent << "Capacity: " << m_Capacity << std::endl;
+    os << indent << "NumberOfThreads: " << m_Buffers.size() << std::endl;
+  }
+
+} // end namespace itk
@@ -0,0 +1,125 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+#ifndef PkTraceRecorder_h_
+#define PkTraceRecorder_h_
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include <ostream>
+#include <vector>
+
+namespace itk
+{
+  /** \class PkTraceRecorder
+   * \brief Records timed events per thread and writes them in the Chrome
+   * trace event format (viewable in chrome://tracing or Perfetto).
+   *
+   * Each thread writes to its own ring buffer, so recording takes no
+   * lock; when a buffer is full the oldest events of that thread are
+   * overwritten. Event names must be string literals (or otherwise
+   * outlive the recorder), only the pointer is stored.
+   * SetNumberOfThreads() must be called by the main thread before other
+   * threads record.
+   */
+  class PkTraceRecorder : public Object
+  {
+  public:
+    typedef PkTraceRecorder          Self;
+    typedef Object                   Superclass;
+    typedef SmartPointer<Self>       Pointer;
+    typedef SmartPointer<const Self> ConstPointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(PkTraceRecorder, Object);
+
+    /** Number of events kept per thread. Default is 65536. Applies to
+     * the buffers created after it is set. */
+    itkSetMacro(Capacity, unsigned int);
+    itkGetConstMacro(Capacity, unsigned int);
+
+    /** Make room for the buffers of a number of threads. Only grows. */
+    void SetNumberOfThreads(unsigned int numberOfThreads);
+
+    /** Seconds since the recorder was created */
+    double GetTime() const;
+
+    /** Record an event of a thread that started at start (from
+     * GetTime()) and ends now. argName, if given, labels value in the
+     * event's arguments. Events of threads beyond the number given to
+     * SetNumberOfThreads() are dropped. */
+    void AddEvent(unsigned int thread, const char* name, double start,
+      const char* argName = 0, long value = 0);
+
+    /** Write all the events in the Chrome trace JSON format */
+    void WriteChromeTrace(std::ostream& os) const;
+
+  protected:
+    PkTraceRecorder();
+    ~PkTraceRecorder()
+    {
+    }
+    void PrintSelf(std::ostream& os, Indent indent) const;
+
+  private:
+    PkTraceRecorder(const Self &); // purposely not implemented
+    void operator=(const Self &); // purposely not implemented
+
+    struct Event
+    {
+      const char* Name;
+      const char* ArgName;
+      long Value;
+      double Start;
+      double Duration;
+    };
+
+    struct Buffer
+    {
+      std::vector<Event> Events;
+      unsigned long NumberOfEvents;   // total recorded, including overwritten
+    };
+
+    unsigned int m_Capacity;
+    double m_Origin;
+    std::vector<Buffer> m_Buffers;
+  };
+
+  /** \class PkTraceScope
+   * \brief Records its lifetime as an event. Does nothing when the
+   * recorder is null.
+   */
+  class PkTraceScope
+  {
+  public:
+    PkTraceScope(PkTraceRecorder* recorder, unsigned int thread, const char* name)
+      : m_Recorder(recorder), m_Thread(thread), m_Name(name), m_Start(recorder ? recorder->GetTime() : 0.0)
+    {
+    }
+    ~PkTraceScope()
+    {
+      if (m_Recorder)
+      {
+        m_Recorder->AddEvent(m_Thread, m_Name, m_Start);
+      }
+    }
+
+  private:
+    PkTraceScope(const PkTraceScope &); // purposely not implemented
+    void operator=(const PkTraceScope &); // purposely not implemented
+
+    PkTraceRecorder* m_Recorder;
+    unsigned int m_Thread;
+    const char* m_Name;
+    double m_Start;
+  };
+
+} // end namespace itk
+
+#endif
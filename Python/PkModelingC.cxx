@@ -0,0 +1,480 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+#include "PkModelingC.h"
+
+#include "itkPkModelingEngine.h"
+#include "PkSolver.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef itk::PkModelingEngine<float, short> EngineType;
+
+#if defined(_MSC_VER)
+#define PKM_THREAD_LOCAL __declspec(thread)
+#else
+#define PKM_THREAD_LOCAL __thread
+#endif
+
+struct pkm_engine
+{
+  EngineType::Pointer Engine;
+  itk::PkModelingParameters Parameters;
+  // signal copied from a layout the engine cannot use in place
+  EngineType::SignalVolumeType::Pointer SignalCopy;
+  std::string LastError;
+};
+
+namespace
+{
+  // one message per thread, so that a caller reads the failure of its
+  // own call; a plain buffer, as thread local storage cannot hold a
+  // std::string
+  PKM_THREAD_LOCAL char lastError[1024];
+
+  int Fail(const std::string& message)
+  {
+    strncpy(lastError, message.c_str(), sizeof(lastError) - 1);
+    lastError[sizeof(lastError) - 1] = '\0';
+    return -1;
+  }
+
+  int Fail(pkm_engine* engine, const std::string& message)
+  {
+    engine->LastError = message;
+    return -1;
+  }
+
+  // Copy a result image, which covers the whole signal grid, into a
+  // caller's buffer
+  template <class TImage>
+  void CopyToBuffer(const TImage* image, float* buffer)
+  {
+    const size_t numberOfValues = image->GetBufferedRegion().GetNumberOfPixels()
+      * image->GetNumberOfComponentsPerPixel();
+    memcpy(buffer, image->GetBufferPointer(), numberOfValues * sizeof(float));
+  }
+
+  bool SetParameter(itk::PkModelingParameters& p, const std::string& name, double value)
+  {
+#define PKM_PARAMETER(field, type) \
+    if (name == #field) \
+    { \
+      p.field = static_cast<type>(value); \
+      return true; \
+    }
+#define PKM_BOOLEAN_PARAMETER(field) \
+    if (name == #field) \
+    { \
+      p.field = (value != 0.0); \
+      return true; \
+    }
+    PKM_PARAMETER(T1PreBlood, float)
+    PKM_PARAMETER(T1PreTissue, float)
+    PKM_PARAMETER(Relaxivity, float)
+    PKM_PARAMETER(S0GradThresh, float)
+    PKM_PARAMETER(FTolerance, float)
+    PKM_PARAMETER(GTolerance, float)
+    PKM_PARAMETER(XTolerance, float)
+    PKM_PARAMETER(Epsilon, float)
+    PKM_PARAMETER(MaxIter, float)
+    PKM_PARAMETER(Hematocrit, float)
+    PKM_PARAMETER(AUCTimeInterval, float)
+    PKM_BOOLEAN_PARAMETER(BoundedFitting)
+    PKM_BOOLEAN_PARAMETER(UseFitCache)
+    PKM_BOOLEAN_PARAMETER(ComputeFpv)
+    PKM_BOOLEAN_PARAMETER(UsePopulationAIF)
+    PKM_PARAMETER(ConstantBAT, int)
+    PKM_PARAMETER(PrescreenPeakEnhancement, float)
+    PKM_PARAMETER(PrescreenMaxSlope, float)
+    PKM_PARAMETER(PrescreenSNR, float)
+    PKM_BOOLEAN_PARAMETER(TieredFitting)
+    PKM_PARAMETER(TieredToleranceScale, float)
+    PKM_PARAMETER(TieredMaxIter, int)
+    PKM_PARAMETER(RefitRSquaredThreshold, float)
+    PKM_PARAMETER(NumberOfClusters, int)
+    PKM_PARAMETER(ClusterRefineIterations, int)
+    PKM_PARAMETER(PyramidFactor, int)
+    PKM_BOOLEAN_PARAMETER(MaskByRSquared)
+    PKM_BOOLEAN_PARAMETER(ComputeParametricMaps)
+    PKM_BOOLEAN_PARAMETER(ComputeFitCostMaps)
+    PKM_BOOLEAN_PARAMETER(Verbose)
+#undef PKM_PARAMETER
+#undef PKM_BOOLEAN_PARAMETER
+    return false;
+  }
+
+  // Gather a strided curve into contiguous storage
+  void GatherCurve(const float* data, long long curve, int numberOfFrames,
+    long long curveStride, long long frameStride, std::vector<float>& out)
+  {
+    out.resize(numberOfFrames);
+    const float* start = data + curve * curveStride;
+    for (int t = 0; t < numberOfFrames; ++t)
+    {
+      out[t] = start[t * frameStride];
+    }
+  }
+}
+
+const char* pkm_last_error(void)
+{
+  return lastError;
+}
+
+int pkm_population_aif(const float* timeSeconds, int numberOfFrames,
+  float bolusArrivalTimeFraction, float* aif)
+{
+  if (numberOfFrames < 2)
+  {
+    return Fail("At least two frames are needed");
+  }
+  const std::vector<float> timing(timeSeconds, timeSeconds + numberOfFrames);
+  const std::vector<float> populationAIF = itk::get_population_aif(timing, bolusArrivalTimeFraction);
+  std::copy(populationAIF.begin(), populationAIF.end(), aif);
+  return 0;
+}
+
+int pkm_signal_to_concentration(const float* signal, long long numberOfCurves,
+  int numberOfFrames, long long curveStride, long long frameStride,
+  float T1, float TR, float flipAngle, float relaxivity, float S0GradThresh,
+  const char* batMode, int constantBAT, float* concentration)
+{
+  if (numberOfFrames < 2)
+  {
+    return Fail("At least two frames are needed");
+  }
+  const std::string batCalculationMode(batMode ? batMode : "PeakGradient");
+  if (batCalculationMode != "PeakGradient" && batCalculationMode != "UseConstantBAT")
+  {
+    return Fail("Unknown BAT calculation mode " + batCalculationMode);
+  }
+  std::vector<float> curve, result(numberOfFrames);
+  for (long long i = 0; i < numberOfCurves; ++i)
+  {
+    GatherCurve(signal, i, numberOfFrames, curveStride, frameStride, curve);
+    // S0 of each curve computed here: convert_signal_to_concentration
+    // would otherwise take the BAT settings from the solver's shared
+    // state
+    const float s0 = itk::compute_s0_individual_curve(numberOfFrames, &curve[0], S0GradThresh,
+      batCalculationMode, constantBAT);
+    itk::convert_signal_to_concentration(numberOfFrames, &curve[0], T1, TR, flipAngle,
+      &result[0], relaxivity, s0, S0GradThresh);
+    float* out = concentration + i * curveStride;
+    for (int t = 0; t < numberOfFrames; ++t)
+    {
+      out[t * frameStride] = result[t];
+    }
+  }
+  return 0;
+}
+
+int pkm_fit_curves(const float* concentration, long long numberOfCurves,
+  int numberOfFrames, long long curveStride, long long frameStride,
+  const float* aif, const float* timeSeconds, int threeParameters, float hematocrit,
+  float fTol, float gTol, float xTol, float epsilon, int maxIter, int useBounds,
+  int numberOfThreads, float* ktrans, float* ve, float* fpv, unsigned int* diagnostics,
+  float* rsquared, float* fitted)
+{
+  if (numberOfFrames < 2)
+  {
+    return Fail("At least two frames are needed");
+  }
+  if (threeParameters && !fpv)
+  {
+    return Fail("The 3 parameter model needs an fpv output");
+  }
+  if (numberOfCurves <= 0)
+  {
+    return 0;
+  }
+
+  std::vector<float> timeMinute(numberOfFrames);
+  for (int t = 0; t < numberOfFrames; ++t)
+  {
+    timeMinute[t] = timeSeconds[t] / 60.0f;
+  }
+  const int modelType = threeParameters ? itk::LMCostFunction::TOFTS_3_PARAMETER : itk::LMCostFunction::TOFTS_2_PARAMETER;
+  const unsigned int numberOfParameters = threeParameters ? 3 : 2;
+
+  std::vector<float> parameters(numberOfCurves * numberOfParameters);
+  itk::pk_solver_batch(numberOfFrames, &timeMinute[0], aif,
+    numberOfCurves, concentration, curveStride, frameStride,
+    &parameters[0], diagnostics, rsquared, fitted,
+    fTol, gTol, xTol, epsilon, maxIter, hematocrit, modelType, useBounds != 0,
+    numberOfThreads > 0 ? numberOfThreads : 0);
+
+  for (long long i = 0; i < numberOfCurves; ++i)
+  {
+    ktrans[i] = parameters[i * numberOfParameters];
+    ve[i] = parameters[i * numberOfParameters + 1];
+    if (threeParameters)
+    {
+      fpv[i] = parameters[i * numberOfParameters + 2];
+    }
+  }
+  return 0;
+}
+
+pkm_engine* pkm_engine_new(void)
+{
+  pkm_engine* engine = new pkm_engine;
+  engine->Engine = EngineType::New();
+  return engine;
+}
+
+void pkm_engine_delete(pkm_engine* engine)
+{
+  delete engine;
+}
+
+const char* pkm_engine_last_error(pkm_engine* engine)
+{
+  return engine->LastError.c_str();
+}
+
+int pkm_engine_set_parameter(pkm_engine* engine, const char* name, double value)
+{
+  if (!SetParameter(engine->Parameters, name, value))
+  {
+    return Fail(engine, std::string("Unknown parameter ") + name);
+  }
+  return 0;
+}
+
+int pkm_engine_set_bat_mode(pkm_engine* engine, const char* mode)
+{
+  const std::string batMode(mode);
+  if (batMode != "PeakGradient" && batMode != "UseConstantBAT")
+  {
+    return Fail(engine, "Unknown BAT calculation mode " + batMode);
+  }
+  engine->Parameters.BATCalculationMode = batMode;
+  return 0;
+}
+
+int pkm_engine_set_signal(pkm_engine* engine, const float* signal,
+  const long long size[3], int numberOfFrames, const long long strides[4],
+  const double spacing[3], const double origin[3])
+{
+  if (numberOfFrames < 2)
+  {
+    return Fail(engine, "At least two frames are needed");
+  }
+  EngineType::SizeType imageSize;
+  EngineType::SpacingType imageSpacing;
+  EngineType::PointType imageOrigin;
+  for (unsigned int i = 0; i < 3; ++i)
+  {
+    imageSize[i] = size[i];
+    imageSpacing[i] = spacing[i];
+    imageOrigin[i] = origin[i];
+  }
+
+  const long long nt = numberOfFrames;
+  if (strides[3] == 1 && strides[0] == nt && strides[1] == nt * size[0]
+    && strides[2] == nt * size[0] * size[1])
+  {
+    // the layout of a VectorImage: wrap it, the engine does not write
+    // to its signal
+    engine->SignalCopy = 0;
+    engine->Engine->SetSignalBuffer(const_cast<float *>(signal), imageSize, numberOfFrames,
+      imageSpacing, imageOrigin);
+    return 0;
+  }
+
+  EngineType::SignalVolumeType::Pointer copy = EngineType::SignalVolumeType::New();
+  copy->SetRegions(EngineType::RegionType(imageSize));
+  copy->SetNumberOfComponentsPerPixel(numberOfFrames);
+  copy->SetSpacing(imageSpacing);
+  copy->SetOrigin(imageOrigin);
+  copy->Allocate();
+  float* out = copy->GetBufferPointer();
+  for (long long z = 0; z < size[2]; ++z)
+  {
+    for (long long y = 0; y < size[1]; ++y)
+    {
+      for (long long x = 0; x < size[0]; ++x)
+      {
+        const float* in = signal + x * strides[0] + y * strides[1] + z * strides[2];
+        for (long long t = 0; t < nt; ++t)
+        {
+          *out++ = in[t * strides[3]];
+        }
+      }
+    }
+  }
+  engine->SignalCopy = copy;
+  engine->Engine->SetSignal(copy);
+  return 0;
+}
+
+int pkm_engine_set_acquisition(pkm_engine* engine, const float* timeSeconds,
+  int numberOfFrames, float flipAngle, float repetitionTime)
+{
+  engine->Engine->SetTiming(std::vector<float>(timeSeconds, timeSeconds + numberOfFrames));
+  engine->Engine->SetFlipAngle(flipAngle);
+  engine->Engine->SetRepetitionTime(repetitionTime);
+  return 0;
+}
+
+int pkm_engine_set_mask(pkm_engine* engine, const char* name, const short* mask)
+{
+  try
+  {
+    // a null mask clears the one of an earlier study
+    EngineType::MaskVolumeType::Pointer image;
+    if (mask)
+    {
+      image = engine->Engine->ImportMask(const_cast<short *>(mask));
+    }
+    const std::string maskName(name);
+    if (maskName == "aif")
+    {
+      engine->Engine->SetAIFMask(image);
+    }
+    else if (maskName == "roi")
+    {
+      engine->Engine->SetROIMask(image);
+    }
+    else if (maskName == "t1")
+    {
+      engine->Engine->SetT1Map(image);
+    }
+    else if (maskName == "labels")
+    {
+      engine->Engine->SetRegionLabelMap(image);
+    }
+    else
+    {
+      return Fail(engine, "Unknown mask " + maskName);
+    }
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    return Fail(engine, excep.GetDescription());
+  }
+  return 0;
+}
+
+int pkm_engine_set_prescribed_aif(pkm_engine* engine, const float* timeSeconds,
+  const float* aif, int numberOfValues)
+{
+  engine->Engine->SetPrescribedAIF(std::vector<float>(timeSeconds, timeSeconds + numberOfValues),
+    std::vector<float>(aif, aif + numberOfValues));
+  return 0;
+}
+
+int pkm_engine_run(pkm_engine* engine)
+{
+  try
+  {
+    engine->Engine->SetParameters(engine->Parameters);
+    engine->Engine->Update();
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    return Fail(engine, excep.GetDescription());
+  }
+  return 0;
+}
+
+int pkm_engine_get_map(pkm_engine* engine, const char* name, float* map)
+{
+  const std::string mapName(name);
+  EngineType::OutputVolumeType::Pointer image;
+  try
+  {
+    if (mapName == "ktrans")
+    {
+      image = engine->Engine->GetKtrans();
+    }
+    else if (mapName == "ve")
+    {
+      image = engine->Engine->GetVe();
+    }
+    else if (mapName == "fpv")
+    {
+      image = engine->Engine->GetFpv();
+    }
+    else if (mapName == "maxslope")
+    {
+      image = engine->Engine->GetMaxSlope();
+    }
+    else if (mapName == "auc")
+    {
+      image = engine->Engine->GetAUC();
+    }
+    else if (mapName == "rsquared")
+    {
+      image = engine->Engine->GetRSquared();
+    }
+    else if (mapName == "bat")
+    {
+      image = engine->Engine->GetBAT();
+    }
+    else if (mapName == "diagnostics")
+    {
+      image = engine->Engine->GetOptimizerDiagnostics();
+    }
+    else if (mapName == "iterations")
+    {
+      image = engine->Engine->GetIterations();
+    }
+    else if (mapName == "evaluations")
+    {
+      image = engine->Engine->GetEvaluations();
+    }
+    else if (mapName == "fittime")
+    {
+      image = engine->Engine->GetFitTime();
+    }
+    else
+    {
+      return Fail(engine, "Unknown map " + mapName);
+    }
+    CopyToBuffer(image.GetPointer(), map);
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    return Fail(engine, excep.GetDescription());
+  }
+  return 0;
+}
+
+int pkm_engine_get_curves(pkm_engine* engine, const char* name, float* curves)
+{
+  const std::string curvesName(name);
+  EngineType::FloatVectorVolumeType::Pointer image;
+  try
+  {
+    if (curvesName == "concentrations")
+    {
+      image = engine->Engine->GetConcentrations();
+    }
+    else if (curvesName == "fitted")
+    {
+      image = engine->Engine->GetFittedData();
+    }
+    else
+    {
+      return Fail(engine, "Unknown curves " + curvesName);
+    }
+    CopyToBuffer(image.GetPointer(), curves);
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    return Fail(engine, excep.GetDescription());
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+#ifndef PkModelingC_h_
+#define PkModelingC_h_
+
+/*
+ * C interface of PkModeling, for languages that call C libraries (the
+ * pkmodeling Python module uses it through ctypes, which releases the
+ * GIL for the duration of each call).
+ *
+ * Arrays are passed as pointers with strides counted in elements, so
+ * that views of other arrays can be passed without copying. Volumes are
+ * indexed (x, y, z); a signal adds the frame as a fourth axis. Functions
+ * return 0 on success and -1 on failure, with the reason available from
+ * pkm_engine_last_error() for an engine and pkm_last_error() for the
+ * other functions.
+ */
+
+#if defined(_WIN32)
+#define PKMODELING_C_EXPORT __declspec(dllexport)
+#else
+#define PKMODELING_C_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Message of the last failure of a function without an engine on the
+ * calling thread */
+PKMODELING_C_EXPORT const char* pkm_last_error(void);
+
+/* Population averaged AIF of Parker et al. at the given times (in
+ * seconds), with the bolus arriving at the given fraction of the
+ * acquisition */
+PKMODELING_C_EXPORT int pkm_population_aif(const float* timeSeconds, int numberOfFrames,
+  float bolusArrivalTimeFraction, float* aif);
+
+/* Convert signal curves to concentration curves (SPGR, precontrast T1
+ * in milliseconds, TR in milliseconds, flip angle in degrees). Curve i
+ * frame t is at signal[i * curveStride + t * frameStride]; the output
+ * uses the same layout. The S0 of each curve is computed from its
+ * samples before the bolus arrival, found with batMode ("PeakGradient", or
+ * "UseConstantBAT" with the arrival at frame constantBAT). */
+PKMODELING_C_EXPORT int pkm_signal_to_concentration(const float* signal, long long numberOfCurves,
+  int numberOfFrames, long long curveStride, long long frameStride,
+  float T1, float TR, float flipAngle, float relaxivity, float S0GradThresh,
+  const char* batMode, int constantBAT, float* concentration);
+
+/* Fit the Tofts model (2 parameters, or 3 with fpv when
+ * threeParameters is nonzero) to concentration curves laid out as for
+ * pkm_signal_to_concentration, which must already be aligned to the
+ * bolus arrival of the AIF. ktrans, ve, fpv, diagnostics and rsquared
+ * receive one value per curve; fpv may be null for the 2 parameter
+ * model and rsquared may be null. fitted, if not null, receives the
+ * fitted curves, the frames of a curve contiguous. The curves are
+ * fitted by numberOfThreads threads (0 for the default). */
+PKMODELING_C_EXPORT int pkm_fit_curves(const float* concentration, long long numberOfCurves,
+  int numberOfFrames, long long curveStride, long long frameStride,
+  const float* aif, const float* timeSeconds, int threeParameters, float hematocrit,
+  float fTol, float gTol, float xTol, float epsilon, int maxIter, int useBounds,
+  int numberOfThreads, float* ktrans, float* ve, float* fpv, unsigned int* diagnostics,
+  float* rsquared, float* fitted);
+
+/*
+ * Engine quantifying a whole study (see itk::PkModelingEngine)
+ */
+typedef struct pkm_engine pkm_engine;
+
+PKMODELING_C_EXPORT pkm_engine* pkm_engine_new(void);
+PKMODELING_C_EXPORT void pkm_engine_delete(pkm_engine* engine);
+PKMODELING_C_EXPORT const char* pkm_engine_last_error(pkm_engine* engine);
+
+/* Set a setting of itk::PkModelingParameters by its name, e.g.
+ * "FTolerance" or "ComputeFpv" (booleans are nonzero values) */
+PKMODELING_C_EXPORT int pkm_engine_set_parameter(pkm_engine* engine, const char* name, double value);
+/* "PeakGradient" or "UseConstantBAT" */
+PKMODELING_C_EXPORT int pkm_engine_set_bat_mode(pkm_engine* engine, const char* mode);
+
+/* Signal at (x, y, z, t) is signal[x * strides[0] + y * strides[1] +
+ * z * strides[2] + t * strides[3]]. A voxel-major signal (strides
+ * nt, nt*nx, nt*nx*ny, 1) is used in place and must outlive the
+ * engine's use of it; any other layout is copied. */
+PKMODELING_C_EXPORT int pkm_engine_set_signal(pkm_engine* engine, const float* signal,
+  const long long size[3], int numberOfFrames, const long long strides[4],
+  const double spacing[3], const double origin[3]);
+
+/* Frame times in seconds, flip angle in degrees, TR in milliseconds */
+PKMODELING_C_EXPORT int pkm_engine_set_acquisition(pkm_engine* engine, const float* timeSeconds,
+  int numberOfFrames, float flipAngle, float repetitionTime);
+
+/* A mask on the grid of the signal, x fastest, used in place: "aif",
+ * "roi", "t1" (a T1 map) or "labels" (a region label map). The engine
+ * keeps the mask for later runs until it is replaced, or cleared with
+ * a null mask, so the buffer must outlive that use. */
+PKMODELING_C_EXPORT int pkm_engine_set_mask(pkm_engine* engine, const char* name, const short* mask);
+
+/* AIF given as concentrations at its own times, copied. No values
+ * clear it, the AIF is then measured from the "aif" mask. */
+PKMODELING_C_EXPORT int pkm_engine_set_prescribed_aif(pkm_engine* engine, const float* timeSeconds,
+  const float* aif, int numberOfValues);
+
+/* Convert and fit */
+PKMODELING_C_EXPORT int pkm_engine_run(pkm_engine* engine);
+
+/* Copy a map of the last run into an x fastest buffer the size of the
+ * signal: "ktrans", "ve", "fpv", "maxslope", "auc", "rsquared", "bat",
+ * "diagnostics", "iterations", "evaluations" or "fittime" */
+PKMODELING_C_EXPORT int pkm_engine_get_map(pkm_engine* engine, const char* name, float* map);
+
+/* Copy the "concentrations" or "fitted" curves of the last run, voxel
+ * major (frames of a voxel contiguous, x fastest) */
+PKMODELING_C_EXPORT int pkm_engine_get_curves(pkm_engine* engine, const char* name, float* curves);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
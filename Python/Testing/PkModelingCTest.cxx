@@ -0,0 +1,262 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Tests of the C interface. pkm_fit_curves must give each curve the
+// results of pk_solver. An engine that runs a study with an ROI, a T1
+// map and a prescribed AIF, whose buffers are then freed, must run a
+// smaller study with an AIF mask only as a fresh engine does.
+//
+// Usage: PkModelingCTest
+
+#include "PkModelingC.h"
+#include "PkSolver.h"
+#include "itkLevenbergMarquardtOptimizer.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  const int NumberOfFrames = 30;
+  const float FrameSeconds = 5.0f;
+
+  // A study in the voxel-major layout the engine uses in place
+  struct Study
+  {
+    long long Size[3];
+    std::vector<float> Signal;
+    std::vector<short> AIFMask;
+    std::vector<short> ROIMask;
+    std::vector<short> T1Map;
+
+    long long GetNumberOfVoxels() const
+    {
+      return Size[0] * Size[1] * Size[2];
+    }
+  };
+
+  // A baseline, then an enhancement that grows with x and y; the AIF is
+  // the column at x = y = 0 and the ROI leaves out a border of a voxel
+  Study MakeStudy(long long sx, long long sy, long long sz)
+  {
+    Study study;
+    study.Size[0] = sx;
+    study.Size[1] = sy;
+    study.Size[2] = sz;
+    const long long n = study.GetNumberOfVoxels();
+    study.Signal.resize(n * NumberOfFrames);
+    study.AIFMask.resize(n);
+    study.ROIMask.resize(n);
+    study.T1Map.resize(n);
+    long long voxel = 0;
+    for (long long z = 0; z < sz; ++z)
+    {
+      for (long long y = 0; y < sy; ++y)
+      {
+        for (long long x = 0; x < sx; ++x, ++voxel)
+        {
+          const float rate = 0.02f * (1 + x) + 0.01f * (1 + y);
+          for (int t = 0; t < NumberOfFrames; ++t)
+          {
+            const float enhancement = t < 5 ? 0.0f : 1.0f - exp(-rate * (t - 5));
+            study.Signal[voxel * NumberOfFrames + t] = 100.0f * (1.0f + enhancement);
+          }
+          study.AIFMask[voxel] = (x == 0 && y == 0) ? 1 : 0;
+          study.ROIMask[voxel] = (x > 0 && y > 0 && x + 1 < sx && y + 1 < sy) ? 1 : 0;
+          study.T1Map[voxel] = 1400;
+        }
+      }
+    }
+    return study;
+  }
+
+  std::vector<float> Timing()
+  {
+    std::vector<float> timing(NumberOfFrames);
+    for (int t = 0; t < NumberOfFrames; ++t)
+    {
+      timing[t] = t * FrameSeconds;
+    }
+    return timing;
+  }
+
+  bool Check(pkm_engine* engine, int status, const std::string& what)
+  {
+    if (status != 0)
+    {
+      std::cerr << what << ": " << pkm_engine_last_error(engine) << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool SetSignal(pkm_engine* engine, const Study& study)
+  {
+    const long long strides[4] =
+    {
+      NumberOfFrames, NumberOfFrames * study.Size[0], NumberOfFrames * study.Size[0] * study.Size[1], 1
+    };
+    const double spacing[3] = { 1.0, 1.0, 1.0 };
+    const double origin[3] = { 0.0, 0.0, 0.0 };
+    const std::vector<float> timing = Timing();
+    return Check(engine, pkm_engine_set_signal(engine, &study.Signal[0], study.Size, NumberOfFrames,
+        strides, spacing, origin), "set_signal")
+      && Check(engine, pkm_engine_set_acquisition(engine, &timing[0], NumberOfFrames, 15.0f, 5.0f),
+        "set_acquisition");
+  }
+
+  // The study with an AIF mask only, as the Python module passes it
+  // after an earlier run: every other input cleared
+  bool RunMeasuredAIF(pkm_engine* engine, const Study& study)
+  {
+    return SetSignal(engine, study)
+      && Check(engine, pkm_engine_set_mask(engine, "aif", &study.AIFMask[0]), "set_mask aif")
+      && Check(engine, pkm_engine_set_mask(engine, "roi", 0), "clear roi")
+      && Check(engine, pkm_engine_set_mask(engine, "t1", 0), "clear t1")
+      && Check(engine, pkm_engine_set_mask(engine, "labels", 0), "clear labels")
+      && Check(engine, pkm_engine_set_prescribed_aif(engine, 0, 0, 0), "clear prescribed_aif")
+      && Check(engine, pkm_engine_run(engine), "run");
+  }
+
+  bool CompareMap(pkm_engine* engine, pkm_engine* reference, const char* name, long long numberOfVoxels)
+  {
+    std::vector<float> map(numberOfVoxels), referenceMap(numberOfVoxels);
+    if (!Check(engine, pkm_engine_get_map(engine, name, &map[0]), name)
+      || !Check(reference, pkm_engine_get_map(reference, name, &referenceMap[0]), name))
+    {
+      return false;
+    }
+    for (long long i = 0; i < numberOfVoxels; ++i)
+    {
+      if (map[i] != referenceMap[i])
+      {
+        std::cerr << name << ": voxel " << i << " is " << map[i] << " instead of " << referenceMap[i] << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool TestFitCurves()
+  {
+    const std::vector<float> timing = Timing();
+    std::vector<float> timeMinutes(NumberOfFrames), aif(NumberOfFrames);
+    for (int t = 0; t < NumberOfFrames; ++t)
+    {
+      timeMinutes[t] = timing[t] / 60.0f;
+    }
+    pkm_population_aif(&timing[0], NumberOfFrames, 0.1f, &aif[0]);
+
+    // Tofts curves, the frames of a curve contiguous
+    const float trueParameters[][2] = { { 0.1f, 0.3f }, { 0.6f, 0.5f }, { 1.2f, 0.2f } };
+    const long long numberOfCurves = sizeof(trueParameters) / sizeof(trueParameters[0]);
+    itk::LMCostFunction::Pointer model = itk::LMCostFunction::New();
+    model->SetNumberOfValues(NumberOfFrames);
+    model->SetCb(&aif[0], NumberOfFrames);
+    model->SetTime(&timeMinutes[0], NumberOfFrames);
+    model->SetHematocrit(0.4f);
+    std::vector<float> curves(numberOfCurves * NumberOfFrames);
+    for (long long i = 0; i < numberOfCurves; ++i)
+    {
+      itk::LMCostFunction::ParametersType parameters(2);
+      parameters[0] = trueParameters[i][0];
+      parameters[1] = trueParameters[i][1];
+      const itk::LMCostFunction::MeasureType curve = model->GetFittedFunction(parameters);
+      for (int t = 0; t < NumberOfFrames; ++t)
+      {
+        curves[i * NumberOfFrames + t] = curve[t];
+      }
+    }
+
+    std::vector<float> ktrans(numberOfCurves), ve(numberOfCurves), rSquared(numberOfCurves);
+    std::vector<unsigned int> diagnostics(numberOfCurves);
+    if (pkm_fit_curves(&curves[0], numberOfCurves, NumberOfFrames, NumberOfFrames, 1,
+      &aif[0], &timing[0], 0, 0.4f, 1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, 0, 2,
+      &ktrans[0], &ve[0], 0, &diagnostics[0], &rSquared[0], 0) != 0)
+    {
+      std::cerr << "pkm_fit_curves: " << pkm_last_error() << std::endl;
+      return false;
+    }
+
+    bool ok = true;
+    for (long long i = 0; i < numberOfCurves; ++i)
+    {
+      itk::LevenbergMarquardtOptimizer::Pointer optimizer = itk::LevenbergMarquardtOptimizer::New();
+      itk::LMCostFunction::Pointer costFunction = itk::LMCostFunction::New();
+      float Ktrans = 0.0f, Ve = 0.0f, Fpv = 0.0f;
+      const unsigned code = itk::pk_solver(NumberOfFrames, &timeMinutes[0], &curves[i * NumberOfFrames], &aif[0],
+        Ktrans, Ve, Fpv, 1e-4f, 1e-4f, 1e-5f, 1e-9f, 200, 0.4f, optimizer, costFunction);
+      itk::LMCostFunction::ParametersType position(2);
+      position[0] = Ktrans;
+      position[1] = Ve;
+      const itk::LMCostFunction::MeasureType fitted = costFunction->GetFittedFunction(position);
+      std::vector<float> fittedCurve(fitted.begin(), fitted.end());
+      const float expectedRSquared = itk::compute_rsquared(NumberOfFrames, &fittedCurve[0],
+        optimizer->GetOptimizer()->get_end_error());
+      if (fabs(ktrans[i] - Ktrans) > 1e-5f || fabs(ve[i] - Ve) > 1e-5f || diagnostics[i] != code
+        || fabs(rSquared[i] - expectedRSquared) > 1e-5f)
+      {
+        std::cerr << "pkm_fit_curves curve " << i << ": Ktrans " << ktrans[i] << " Ve " << ve[i]
+          << " R2 " << rSquared[i] << " diagnostics " << diagnostics[i] << " instead of Ktrans " << Ktrans
+          << " Ve " << Ve << " R2 " << expectedRSquared << " diagnostics " << code << std::endl;
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+  bool TestEngineReuse()
+  {
+    pkm_engine* engine = pkm_engine_new();
+    bool ok = true;
+    {
+      // freed before the second run, as the arrays of an earlier
+      // Python run may be
+      const Study first = MakeStudy(10, 10, 3);
+      const std::vector<float> timing = Timing();
+      std::vector<float> aif(NumberOfFrames);
+      pkm_population_aif(&timing[0], NumberOfFrames, 0.1f, &aif[0]);
+      ok = SetSignal(engine, first)
+        && Check(engine, pkm_engine_set_mask(engine, "roi", &first.ROIMask[0]), "set_mask roi")
+        && Check(engine, pkm_engine_set_mask(engine, "t1", &first.T1Map[0]), "set_mask t1")
+        && Check(engine, pkm_engine_set_prescribed_aif(engine, &timing[0], &aif[0], NumberOfFrames),
+          "set_prescribed_aif")
+        && Check(engine, pkm_engine_run(engine), "run");
+    }
+
+    const Study second = MakeStudy(6, 8, 2);
+    ok = ok && RunMeasuredAIF(engine, second);
+    pkm_engine* reference = pkm_engine_new();
+    ok = ok && RunMeasuredAIF(reference, second);
+    const char* const maps[] = { "ktrans", "ve", "diagnostics" };
+    for (unsigned int m = 0; ok && m < sizeof(maps) / sizeof(maps[0]); ++m)
+    {
+      ok = CompareMap(engine, reference, maps[m], second.GetNumberOfVoxels());
+    }
+    pkm_engine_delete(reference);
+    pkm_engine_delete(engine);
+    if (!ok)
+    {
+      std::cerr << "A reused engine differs from a fresh one" << std::endl;
+    }
+    return ok;
+  }
+}
+
+int main(int, char * [])
+{
+  bool ok = true;
+  ok = TestFitCurves() && ok;
+  ok = TestEngineReuse() && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,263 @@
+"""NumPy interface of PkModeling.
+
+Calls the PkModelingC library through ctypes. Arrays are passed to the
+library as pointers with strides, so views are not copied when the
+library can use their layout; ctypes releases the GIL for the duration
+of each call, so calls from several Python threads run in parallel.
+
+Time is in seconds, the flip angle in degrees and TR and T1 in
+milliseconds, as in the PkModeling module.
+
+Example::
+
+    import pkmodeling
+    engine = pkmodeling.Engine(ComputeFpv=True, BoundedFitting=True)
+    maps = engine.run(signal, time_seconds, flip_angle=15.0,
+                      repetition_time=5.0, aif_mask=aif, roi_mask=roi)
+    ktrans = maps['ktrans']
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+__all__ = ['population_aif', 'signal_to_concentration', 'fit_curves', 'Engine']
+
+MAPS = ('ktrans', 've', 'fpv', 'maxslope', 'auc', 'rsquared', 'bat',
+        'diagnostics', 'iterations', 'evaluations', 'fittime')
+
+_float_p = ctypes.POINTER(ctypes.c_float)
+_short_p = ctypes.POINTER(ctypes.c_short)
+_uint_p = ctypes.POINTER(ctypes.c_uint)
+_longlong3 = ctypes.c_longlong * 3
+_longlong4 = ctypes.c_longlong * 4
+_double3 = ctypes.c_double * 3
+
+
+def _load_library():
+    path = os.environ.get('PKMODELING_LIBRARY')
+    if not path:
+        directory = os.path.dirname(os.path.abspath(__file__))
+        for name in ('libPkModelingC.so', 'libPkModelingC.dylib', 'PkModelingC.dll'):
+            path = os.path.join(directory, name)
+            if os.path.exists(path):
+                break
+    library = ctypes.CDLL(path)
+
+    library.pkm_last_error.restype = ctypes.c_char_p
+    library.pkm_engine_last_error.restype = ctypes.c_char_p
+    library.pkm_engine_new.restype = ctypes.c_void_p
+    library.pkm_engine_delete.argtypes = [ctypes.c_void_p]
+    library.pkm_engine_last_error.argtypes = [ctypes.c_void_p]
+    library.pkm_population_aif.argtypes = [_float_p, ctypes.c_int, ctypes.c_float, _float_p]
+    library.pkm_signal_to_concentration.argtypes = [
+        _float_p, ctypes.c_longlong, ctypes.c_int, ctypes.c_longlong, ctypes.c_longlong,
+        ctypes.c_float, ctypes.c_float, ctypes.c_float, ctypes.c_float, ctypes.c_float,
+        ctypes.c_char_p, ctypes.c_int, _float_p]
+    library.pkm_fit_curves.argtypes = [
+        _float_p, ctypes.c_longlong, ctypes.c_int, ctypes.c_longlong, ctypes.c_longlong,
+        _float_p, _float_p, ctypes.c_int, ctypes.c_float,
+        ctypes.c_float, ctypes.c_float, ctypes.c_float, ctypes.c_float, ctypes.c_int, ctypes.c_int,
+        ctypes.c_int, _float_p, _float_p, _float_p, _uint_p, _float_p, _float_p]
+    library.pkm_engine_set_parameter.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_double]
+    library.pkm_engine_set_bat_mode.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    library.pkm_engine_set_signal.argtypes = [
+        ctypes.c_void_p, _float_p, _longlong3, ctypes.c_int, _longlong4, _double3, _double3]
+    library.pkm_engine_set_acquisition.argtypes = [
+        ctypes.c_void_p, _float_p, ctypes.c_int, ctypes.c_float, ctypes.c_float]
+    library.pkm_engine_set_mask.argtypes = [ctypes.c_void_p, ctypes.c_char_p, _short_p]
+    library.pkm_engine_set_prescribed_aif.argtypes = [ctypes.c_void_p, _float_p, _float_p, ctypes.c_int]
+    library.pkm_engine_run.argtypes = [ctypes.c_void_p]
+    library.pkm_engine_get_map.argtypes = [ctypes.c_void_p, ctypes.c_char_p, _float_p]
+    library.pkm_engine_get_curves.argtypes = [ctypes.c_void_p, ctypes.c_char_p, _float_p]
+    return library
+
+
+_library = _load_library()
+
+
+def _pointer(array, pointer_type=_float_p):
+    return array.ctypes.data_as(pointer_type)
+
+
+def _check(status):
+    if status != 0:
+        raise RuntimeError(_library.pkm_last_error().decode())
+
+
+def _curves(array, axis):
+    """View of an array as (curves, frames), moving the frame axis last.
+    Only copies if the remaining axes cannot be merged."""
+    array = np.asarray(array, dtype=np.float32)
+    moved = np.moveaxis(array, axis, -1)
+    curves = moved.reshape(-1, moved.shape[-1])
+    return moved.shape, curves
+
+
+def _strides(array):
+    return [s // array.itemsize for s in array.strides]
+
+
+def population_aif(time_seconds, bolus_arrival_fraction=0.1):
+    """Population averaged AIF of Parker et al. at the given times"""
+    time_seconds = np.ascontiguousarray(time_seconds, dtype=np.float32)
+    aif = np.empty_like(time_seconds)
+    _check(_library.pkm_population_aif(_pointer(time_seconds), len(time_seconds),
+                                       bolus_arrival_fraction, _pointer(aif)))
+    return aif
+
+
+def signal_to_concentration(signal, T1, TR, flip_angle, relaxivity=0.0039,
+                            s0_grad_thresh=15.0, bat_mode='PeakGradient', constant_bat=1,
+                            axis=-1):
+    """Concentration curves of signal curves along the given axis. The S0
+    of each curve is computed from its samples before the bolus arrival,
+    detected with bat_mode ('PeakGradient', or 'UseConstantBAT' for the arrival at
+    frame constant_bat)."""
+    shape, curves = _curves(signal, axis)
+    concentration = np.empty(curves.shape, dtype=np.float32)
+    curve_stride, frame_stride = _strides(curves)
+    out_curve_stride, out_frame_stride = _strides(concentration)
+    if (curve_stride, frame_stride) != (out_curve_stride, out_frame_stride):
+        curves = np.ascontiguousarray(curves)
+        curve_stride, frame_stride = _strides(curves)
+    _check(_library.pkm_signal_to_concentration(
+        _pointer(curves), curves.shape[0], curves.shape[1], curve_stride, frame_stride,
+        T1, TR, flip_angle, relaxivity, s0_grad_thresh, bat_mode.encode('ascii'), constant_bat,
+        _pointer(concentration)))
+    return np.moveaxis(concentration.reshape(shape), -1, axis)
+
+
+def fit_curves(concentration, aif, time_seconds, three_parameters=False, hematocrit=0.4,
+               ftol=1e-4, gtol=1e-4, xtol=1e-5, epsilon=1e-9, max_iter=200,
+               bounded=False, fitted=False, threads=0, axis=-1):
+    """Fit the Tofts model to concentration curves along the given axis,
+    aligned to the bolus arrival of the AIF, on the given number of
+    threads (0 for the default). Returns a dict of arrays of the shape
+    of the other axes: ktrans, ve, fpv (3 parameter model only),
+    rsquared and diagnostics, and with fitted, the fitted curves in the
+    shape of concentration."""
+    shape, curves = _curves(concentration, axis)
+    aif = np.ascontiguousarray(aif, dtype=np.float32)
+    time_seconds = np.ascontiguousarray(time_seconds, dtype=np.float32)
+    count = curves.shape[0]
+    results = {'ktrans': np.empty(count, dtype=np.float32),
+               've': np.empty(count, dtype=np.float32),
+               'rsquared': np.empty(count, dtype=np.float32),
+               'diagnostics': np.empty(count, dtype=np.uint32)}
+    fpv = None
+    if three_parameters:
+        results['fpv'] = np.empty(count, dtype=np.float32)
+        fpv = _pointer(results['fpv'])
+    fitted_curves = None
+    if fitted:
+        fitted_curves = np.empty(curves.shape, dtype=np.float32)
+    curve_stride, frame_stride = _strides(curves)
+    _check(_library.pkm_fit_curves(
+        _pointer(curves), count, curves.shape[1], curve_stride, frame_stride,
+        _pointer(aif), _pointer(time_seconds), int(three_parameters), hematocrit,
+        ftol, gtol, xtol, epsilon, max_iter, int(bounded), threads,
+        _pointer(results['ktrans']), _pointer(results['ve']), fpv,
+        _pointer(results['diagnostics'], _uint_p), _pointer(results['rsquared']),
+        None if fitted_curves is None else _pointer(fitted_curves)))
+    results = dict((name, value.reshape(shape[:-1])) for name, value in results.items())
+    if fitted_curves is not None:
+        results['fitted'] = np.moveaxis(fitted_curves.reshape(shape), -1, axis)
+    return results
+
+
+class Engine(object):
+    """Quantification of a whole study, as the PkModeling module does.
+
+    Keyword arguments are the settings of itk::PkModelingParameters
+    (e.g. FTolerance, ComputeFpv, BoundedFitting, BATCalculationMode).
+    """
+
+    def __init__(self, **parameters):
+        self._engine = _library.pkm_engine_new()
+        # arrays the engine uses in place, by name, kept until the engine
+        # is given others
+        self._inputs = {}
+        for name, value in parameters.items():
+            self.set_parameter(name, value)
+
+    def __del__(self):
+        if getattr(self, '_engine', None):
+            _library.pkm_engine_delete(self._engine)
+            self._engine = None
+
+    def _check(self, status):
+        if status != 0:
+            raise RuntimeError(_library.pkm_engine_last_error(self._engine).decode())
+
+    def set_parameter(self, name, value):
+        if name == 'BATCalculationMode':
+            self._check(_library.pkm_engine_set_bat_mode(self._engine, value.encode()))
+        else:
+            self._check(_library.pkm_engine_set_parameter(self._engine, name.encode(), float(value)))
+
+    def run(self, signal, time_seconds, flip_angle, repetition_time, aif_mask=None,
+            roi_mask=None, t1_map=None, labels=None, prescribed_aif=None,
+            layout='tzyx', spacing=(1.0, 1.0, 1.0), origin=(0.0, 0.0, 0.0),
+            maps=('ktrans', 've', 'fpv', 'rsquared', 'diagnostics'), curves=()):
+        """Quantify a study.
+
+        signal is indexed (t, z, y, x) for layout 'tzyx' or (z, y, x, t)
+        for 'zyxt'; the latter is used without copying. Masks are (z, y,
+        x). prescribed_aif is a pair of arrays (times in seconds,
+        concentrations). spacing and origin are given in (x, y, z)
+        order. Returns a dict with the requested maps, shaped (z, y, x),
+        and curves ('concentrations', 'fitted'), shaped like the signal.
+        """
+        signal = np.asarray(signal, dtype=np.float32)
+        if layout == 'tzyx':
+            frames, nz, ny, nx = signal.shape
+            st, sz, sy, sx = _strides(signal)
+        elif layout == 'zyxt':
+            nz, ny, nx, frames = signal.shape
+            sz, sy, sx, st = _strides(signal)
+        else:
+            raise ValueError('layout must be tzyx or zyxt')
+
+        self._check(_library.pkm_engine_set_signal(
+            self._engine, _pointer(signal), _longlong3(nx, ny, nz), frames,
+            _longlong4(sx, sy, sz, st), _double3(*spacing), _double3(*origin)))
+        self._inputs['signal'] = signal
+
+        time_seconds = np.ascontiguousarray(time_seconds, dtype=np.float32)
+        self._check(_library.pkm_engine_set_acquisition(
+            self._engine, _pointer(time_seconds), len(time_seconds), flip_angle, repetition_time))
+
+        # the masks of an earlier run are cleared when not given again
+        for name, mask in (('aif', aif_mask), ('roi', roi_mask), ('t1', t1_map), ('labels', labels)):
+            if mask is None:
+                self._check(_library.pkm_engine_set_mask(self._engine, name.encode(), None))
+                self._inputs.pop(name, None)
+                continue
+            mask = np.ascontiguousarray(mask, dtype=np.int16)
+            if mask.shape != (nz, ny, nx):
+                raise ValueError('%s must be shaped like the signal volume' % name)
+            self._check(_library.pkm_engine_set_mask(self._engine, name.encode(), _pointer(mask, _short_p)))
+            self._inputs[name] = mask
+
+        if prescribed_aif is None:
+            self._check(_library.pkm_engine_set_prescribed_aif(self._engine, None, None, 0))
+        else:
+            aif_time = np.ascontiguousarray(prescribed_aif[0], dtype=np.float32)
+            aif = np.ascontiguousarray(prescribed_aif[1], dtype=np.float32)
+            self._check(_library.pkm_engine_set_prescribed_aif(
+                self._engine, _pointer(aif_time), _pointer(aif), len(aif)))
+
+        self._check(_library.pkm_engine_run(self._engine))
+
+        results = {}
+        for name in maps:
+            result = np.empty((nz, ny, nx), dtype=np.float32)
+            self._check(_library.pkm_engine_get_map(self._engine, name.encode(), _pointer(result)))
+            results[name] = result
+        for name in curves:
+            result = np.empty((nz, ny, nx, frames), dtype=np.float32)
+            self._check(_library.pkm_engine_get_curves(self._engine, name.encode(), _pointer(result)))
+            results[name] = result if layout == 'zyxt' else np.moveaxis(result, -1, 0)
+        return results
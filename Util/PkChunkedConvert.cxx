@@ -0,0 +1,151 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Convert multivolume images between NRRD (or any other format ITK
+// reads) and the PkModeling chunked container (.pkc). The pixel
+// component type and the image attributes are preserved.
+
+#include "itkImageIOFactory.h"
+#include "itkNrrdImageIOFactory.h"
+#include "itkPkChunkedImageIO.h"
+#include "itkPkChunkedImageIOFactory.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  void Usage(const char* program)
+  {
+    std::cerr << "Usage: " << program << " [options] input output" << std::endl;
+    std::cerr << "  Convert between NRRD and the PkModeling chunked format (.pkc)." << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --tileSize x y z   tile size in voxels when writing .pkc (default 16 16 4)" << std::endl;
+    std::cerr << "  --raw              store tiles uncompressed" << std::endl;
+    std::cerr << "  --threads n        number of threads used to encode/decode tiles" << std::endl;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  std::vector<std::string> fileNames;
+  unsigned int tileSize[3] = { 16, 16, 4 };
+  bool compress = true;
+  unsigned int numberOfThreads = 0;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--tileSize" && i + 3 < argc)
+    {
+      for (unsigned int j = 0; j < 3; ++j)
+      {
+        tileSize[j] = atoi(argv[++i]);
+      }
+    }
+    else if (arg == "--raw")
+    {
+      compress = false;
+    }
+    else if (arg == "--threads" && i + 1 < argc)
+    {
+      numberOfThreads = atoi(argv[++i]);
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else
+    {
+      fileNames.push_back(arg);
+    }
+  }
+
+  if (fileNames.size() != 2)
+  {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  itk::NrrdImageIOFactory::RegisterOneFactory();
+  itk::PkChunkedImageIOFactory::RegisterOneFactory();
+
+  try
+  {
+    itk::ImageIOBase::Pointer reader =
+      itk::ImageIOFactory::CreateImageIO(fileNames[0].c_str(), itk::ImageIOFactory::ReadMode);
+    if (!reader)
+    {
+      std::cerr << "Cannot read " << fileNames[0] << std::endl;
+      return EXIT_FAILURE;
+    }
+    reader->SetFileName(fileNames[0]);
+    reader->ReadImageInformation();
+
+    const unsigned int dimension = reader->GetNumberOfDimensions();
+    itk::ImageIORegion region(dimension);
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      region.SetIndex(i, 0);
+      region.SetSize(i, reader->GetDimensions(i));
+    }
+    reader->SetIORegion(region);
+
+    // read the raw buffer; no pixel conversion is done
+    std::vector<char> buffer(reader->GetImageSizeInBytes());
+    reader->Read(buffer.empty() ? 0 : &buffer[0]);
+
+    itk::ImageIOBase::Pointer writer =
+      itk::ImageIOFactory::CreateImageIO(fileNames[1].c_str(), itk::ImageIOFactory::WriteMode);
+    if (!writer)
+    {
+      std::cerr << "Cannot write " << fileNames[1] << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    itk::PkChunkedImageIO* chunkedWriter = dynamic_cast<itk::PkChunkedImageIO *>(writer.GetPointer());
+    if (chunkedWriter)
+    {
+      chunkedWriter->SetTileSize(tileSize[0], tileSize[1], tileSize[2]);
+      if (numberOfThreads > 0)
+      {
+        chunkedWriter->SetNumberOfThreads(numberOfThreads);
+      }
+    }
+
+    writer->SetFileName(fileNames[1]);
+    writer->SetNumberOfDimensions(dimension);
+    for (unsigned int i = 0; i < dimension; ++i)
+    {
+      writer->SetDimensions(i, reader->GetDimensions(i));
+      writer->SetSpacing(i, reader->GetSpacing(i));
+      writer->SetOrigin(i, reader->GetOrigin(i));
+      writer->SetDirection(i, reader->GetDirection(i));
+    }
+    writer->SetNumberOfComponents(reader->GetNumberOfComponents());
+    writer->SetComponentType(reader->GetComponentType());
+    writer->SetPixelType(reader->GetPixelType());
+    writer->SetMetaDataDictionary(reader->GetMetaDataDictionary());
+    writer->SetUseCompression(compress);
+    writer->SetIORegion(region);
+    writer->Write(buffer.empty() ? 0 : &buffer[0]);
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
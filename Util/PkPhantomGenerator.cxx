@@ -0,0 +1,521 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Synthesize a DCE-MRI multivolume of arbitrary size for testing
+// PkModeling without patient data.
+//
+// Tissue curves follow the Tofts model driven by the Parker population
+// AIF. Ktrans ramps along x, Ve along y and fpv along z between the
+// given limits, so every voxel has a known ground truth. Contrast
+// arrives in each voxel a number of frames after the AIF, drawn from a
+// normal distribution. The signal is the spoiled gradient echo signal
+// of the concentration, plus optional Gaussian noise. A column of
+// vessel voxels in the corner of every slice carries the AIF itself.
+//
+// The multivolume is written with the MultiVolume.* attributes the
+// PkModeling CLI reads (frame labels, flip angle and repetition time).
+
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMetaDataObject.h"
+#include "itkMultiThreader.h"
+#include "itkNrrdImageIOFactory.h"
+#include "itkPkChunkedImageIOFactory.h"
+#include "itkVectorImage.h"
+#include "PkSolver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  typedef itk::VectorImage<short, 3> MultiVolumeType;
+  typedef itk::Image<float, 3>       ParameterImageType;
+  typedef itk::Image<unsigned char, 3> MaskImageType;
+
+  struct PhantomParameters
+  {
+    unsigned int Size[3];
+    double Spacing[3];
+    unsigned int NumberOfFrames;
+    float FrameSeconds;
+    float KtransRange[2];
+    float VeRange[2];
+    float FpvRange[2];
+    float AIFArrivalFraction;
+    float BATDelayMean;       // frames after the AIF arrival
+    float BATDelaySigma;      // frames
+    float NoiseSigma;         // signal units
+    float S0;
+    float T1Tissue;           // ms
+    float T1Blood;            // ms
+    float TR;                 // ms
+    float FA;                 // degrees
+    float Relaxivity;         // 1/(mM ms)
+    float Hematocrit;
+    unsigned int VesselWidth; // voxels
+    unsigned int Seed;
+  };
+
+  void Usage(const char* program)
+  {
+    std::cerr << "Usage: " << program << " [options] output" << std::endl;
+    std::cerr << "  Write a synthetic DCE-MRI multivolume (.nrrd or .pkc)." << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --size x y z          volume size in voxels (default 64 64 16)" << std::endl;
+    std::cerr << "  --spacing x y z       voxel spacing in mm (default 1 1 1)" << std::endl;
+    std::cerr << "  --frames n            number of frames (default 40)" << std::endl;
+    std::cerr << "  --frameSeconds s      time between frames (default 5)" << std::endl;
+    std::cerr << "  --ktrans min max      Ktrans along x, 1/min (default 0.05 0.5)" << std::endl;
+    std::cerr << "  --ve min max          Ve along y (default 0.1 0.6)" << std::endl;
+    std::cerr << "  --fpv min max         fpv along z (default 0 0, the 2 parameter model)" << std::endl;
+    std::cerr << "  --aifArrival f        AIF arrival as a fraction of the series (default 0.1)" << std::endl;
+    std::cerr << "  --batDelay mean sd    tissue arrival after the AIF, frames (default 1 0.5)" << std::endl;
+    std::cerr << "  --noise sigma         Gaussian noise, signal units (default 0)" << std::endl;
+    std::cerr << "  --S0 value            baseline signal (default 1000)" << std::endl;
+    std::cerr << "  --T1Tissue ms         (default 1597)" << std::endl;
+    std::cerr << "  --T1Blood ms          (default 1600)" << std::endl;
+    std::cerr << "  --TR ms               repetition time (default 5)" << std::endl;
+    std::cerr << "  --FA degrees          flip angle (default 15)" << std::endl;
+    std::cerr << "  --relaxivity r        (default 0.0039)" << std::endl;
+    std::cerr << "  --hematocrit h        (default 0.4)" << std::endl;
+    std::cerr << "  --vesselWidth n       width of the AIF vessel column, 0 for none (default 2)" << std::endl;
+    std::cerr << "  --seed n              random seed (default 1)" << std::endl;
+    std::cerr << "  --aifMask file        write the vessel voxels as a mask" << std::endl;
+    std::cerr << "  --roiMask file        write the tissue voxels as a mask" << std::endl;
+    std::cerr << "  --groundTruth prefix  write prefix-ktrans.nrrd, -ve, -fpv and -bat" << std::endl;
+  }
+
+  // Spoiled gradient echo signal of a concentration; the inverse of
+  // convert_signal_to_concentration for the same S0
+  float Signal(float concentration, const PhantomParameters& p, float T1)
+  {
+    const double alpha = p.FA * 3.14159265358979 / 180.0;
+    const double cosAlpha = cos(alpha);
+    const double E0 = exp(-p.TR / T1);
+    const double E = exp(-p.TR * (1.0 / T1 + p.Relaxivity * concentration));
+    return p.S0 * ((1.0 - E) / (1.0 - cosAlpha * E)) * ((1.0 - cosAlpha * E0) / (1.0 - E0));
+  }
+
+  float Ramp(const float range[2], unsigned int i, unsigned int size)
+  {
+    if (size < 2)
+    {
+      return range[0];
+    }
+    return range[0] + (range[1] - range[0]) * i / (size - 1);
+  }
+
+  struct GeneratorThreadStruct
+  {
+    const PhantomParameters* Parameters;
+    MultiVolumeType* MultiVolume;
+    ParameterImageType* Ktrans;
+    ParameterImageType* Ve;
+    ParameterImageType* Fpv;
+    ParameterImageType* BAT;
+    MaskImageType* AIFMask;
+    std::vector<float> TimeMinutes;
+    // AIF delayed by 0, 1, ... frames
+    std::vector< std::vector<float> > DelayedAIF;
+    unsigned int AIFArrivalFrame;
+  };
+
+  ITK_THREAD_RETURN_TYPE GenerateThreaderCallback(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+    GeneratorThreadStruct* str = static_cast<GeneratorThreadStruct *>(info->UserData);
+    const PhantomParameters& p = *str->Parameters;
+    const unsigned int frames = p.NumberOfFrames;
+    const int modelType = p.FpvRange[1] > 0.0f ?
+      itk::LMCostFunction::TOFTS_3_PARAMETER : itk::LMCostFunction::TOFTS_2_PARAMETER;
+
+    itk::LMCostFunction::Pointer costFunction = itk::LMCostFunction::New();
+    costFunction->SetNumberOfValues(frames);
+    costFunction->SetTime(&str->TimeMinutes[0], frames);
+    costFunction->SetHematocrit(p.Hematocrit);
+    costFunction->SetModelType(modelType);
+    itk::LMCostFunction::ParametersType parameters(costFunction->GetNumberOfParameters());
+
+    std::vector<float> signal(frames);
+    MultiVolumeType::PixelType pixel(frames);
+    // New() would hand every thread the shared global generator
+    itk::Statistics::MersenneTwisterRandomVariateGenerator::Pointer random =
+      itk::Statistics::MersenneTwisterRandomVariateGenerator::CreateInstance();
+
+    // slices are interleaved across threads; each slice has its own
+    // random sequence so the phantom does not depend on the thread count
+    for (unsigned int z = info->ThreadID; z < p.Size[2]; z += info->NumberOfThreads)
+    {
+      random->Initialize(p.Seed + z);
+      for (unsigned int y = 0; y < p.Size[1]; ++y)
+      {
+        for (unsigned int x = 0; x < p.Size[0]; ++x)
+        {
+          MultiVolumeType::IndexType index;
+          index[0] = x;
+          index[1] = y;
+          index[2] = z;
+
+          const bool vessel = x < p.VesselWidth && y < p.VesselWidth;
+          if (vessel)
+          {
+            const std::vector<float>& aif = str->DelayedAIF[0];
+            for (unsigned int t = 0; t < frames; ++t)
+            {
+              signal[t] = Signal(aif[t], p, p.T1Blood);
+            }
+            str->Ktrans->SetPixel(index, 0.0f);
+            str->Ve->SetPixel(index, 0.0f);
+            str->Fpv->SetPixel(index, 0.0f);
+            str->BAT->SetPixel(index, str->AIFArrivalFrame);
+          }
+          else
+          {
+            parameters[0] = Ramp(p.KtransRange, x, p.Size[0]);
+            parameters[1] = Ramp(p.VeRange, y, p.Size[1]);
+            if (modelType == itk::LMCostFunction::TOFTS_3_PARAMETER)
+            {
+              parameters[2] = Ramp(p.FpvRange, z, p.Size[2]);
+            }
+
+            double delay = p.BATDelayMean + p.BATDelaySigma * random->GetNormalVariate();
+            delay = std::max(0.0, std::min(delay, double(str->DelayedAIF.size() - 1)));
+            const unsigned int delayFrames = static_cast<unsigned int>(delay + 0.5);
+
+            const std::vector<float>& aif = str->DelayedAIF[delayFrames];
+            costFunction->SetCb(&aif[0], frames);
+            itk::LMCostFunction::MeasureType concentration = costFunction->GetFittedFunction(parameters);
+            for (unsigned int t = 0; t < frames; ++t)
+            {
+              signal[t] = Signal(concentration[t], p, p.T1Tissue);
+            }
+            str->Ktrans->SetPixel(index, parameters[0]);
+            str->Ve->SetPixel(index, parameters[1]);
+            str->Fpv->SetPixel(index, modelType == itk::LMCostFunction::TOFTS_3_PARAMETER ? parameters[2] : 0.0);
+            str->BAT->SetPixel(index, str->AIFArrivalFrame + delayFrames);
+          }
+
+          if (p.NoiseSigma > 0.0f)
+          {
+            for (unsigned int t = 0; t < frames; ++t)
+            {
+              signal[t] += p.NoiseSigma * random->GetNormalVariate();
+            }
+          }
+          for (unsigned int t = 0; t < frames; ++t)
+          {
+            pixel[t] = static_cast<short>(std::max(0.0f, std::min(32767.0f, signal[t] + 0.5f)));
+          }
+          str->MultiVolume->SetPixel(index, pixel);
+          str->AIFMask->SetPixel(index, vessel ? 1 : 0);
+        }
+      }
+    }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  template <class TImage>
+  typename TImage::Pointer AllocateLike(const MultiVolumeType* reference)
+  {
+    typename TImage::Pointer image = TImage::New();
+    image->CopyInformation(reference);
+    image->SetRegions(reference->GetLargestPossibleRegion());
+    image->Allocate();
+    image->FillBuffer(0);
+    return image;
+  }
+
+  template <class TImage>
+  void WriteImage(const TImage* image, const std::string& fileName)
+  {
+    typedef itk::ImageFileWriter<TImage> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetFileName(fileName.c_str());
+    writer->SetUseCompression(1);
+    writer->Update();
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  PhantomParameters p;
+  p.Size[0] = 64;
+  p.Size[1] = 64;
+  p.Size[2] = 16;
+  p.Spacing[0] = p.Spacing[1] = p.Spacing[2] = 1.0;
+  p.NumberOfFrames = 40;
+  p.FrameSeconds = 5.0f;
+  p.KtransRange[0] = 0.05f;
+  p.KtransRange[1] = 0.5f;
+  p.VeRange[0] = 0.1f;
+  p.VeRange[1] = 0.6f;
+  p.FpvRange[0] = 0.0f;
+  p.FpvRange[1] = 0.0f;
+  p.AIFArrivalFraction = 0.1f;
+  p.BATDelayMean = 1.0f;
+  p.BATDelaySigma = 0.5f;
+  p.NoiseSigma = 0.0f;
+  p.S0 = 1000.0f;
+  p.T1Tissue = 1597.0f;
+  p.T1Blood = 1600.0f;
+  p.TR = 5.0f;
+  p.FA = 15.0f;
+  p.Relaxivity = 0.0039f;
+  p.Hematocrit = 0.4f;
+  p.VesselWidth = 2;
+  p.Seed = 1;
+
+  std::string outputFileName, aifMaskFileName, roiMaskFileName, groundTruthPrefix;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--size" && i + 3 < argc)
+    {
+      for (unsigned int j = 0; j < 3; ++j)
+      {
+        p.Size[j] = atoi(argv[++i]);
+      }
+    }
+    else if (arg == "--spacing" && i + 3 < argc)
+    {
+      for (unsigned int j = 0; j < 3; ++j)
+      {
+        p.Spacing[j] = atof(argv[++i]);
+      }
+    }
+    else if (arg == "--frames" && i + 1 < argc)
+    {
+      p.NumberOfFrames = atoi(argv[++i]);
+    }
+    else if (arg == "--frameSeconds" && i + 1 < argc)
+    {
+      p.FrameSeconds = atof(argv[++i]);
+    }
+    else if (arg == "--ktrans" && i + 2 < argc)
+    {
+      p.KtransRange[0] = atof(argv[++i]);
+      p.KtransRange[1] = atof(argv[++i]);
+    }
+    else if (arg == "--ve" && i + 2 < argc)
+    {
+      p.VeRange[0] = atof(argv[++i]);
+      p.VeRange[1] = atof(argv[++i]);
+    }
+    else if (arg == "--fpv" && i + 2 < argc)
+    {
+      p.FpvRange[0] = atof(argv[++i]);
+      p.FpvRange[1] = atof(argv[++i]);
+    }
+    else if (arg == "--aifArrival" && i + 1 < argc)
+    {
+      p.AIFArrivalFraction = atof(argv[++i]);
+    }
+    else if (arg == "--batDelay" && i + 2 < argc)
+    {
+      p.BATDelayMean = atof(argv[++i]);
+      p.BATDelaySigma = atof(argv[++i]);
+    }
+    else if (arg == "--noise" && i + 1 < argc)
+    {
+      p.NoiseSigma = atof(argv[++i]);
+    }
+    else if (arg == "--S0" && i + 1 < argc)
+    {
+      p.S0 = atof(argv[++i]);
+    }
+    else if (arg == "--T1Tissue" && i + 1 < argc)
+    {
+      p.T1Tissue = atof(argv[++i]);
+    }
+    else if (arg == "--T1Blood" && i + 1 < argc)
+    {
+      p.T1Blood = atof(argv[++i]);
+    }
+    else if (arg == "--TR" && i + 1 < argc)
+    {
+      p.TR = atof(argv[++i]);
+    }
+    else if (arg == "--FA" && i + 1 < argc)
+    {
+      p.FA = atof(argv[++i]);
+    }
+    else if (arg == "--relaxivity" && i + 1 < argc)
+    {
+      p.Relaxivity = atof(argv[++i]);
+    }
+    else if (arg == "--hematocrit" && i + 1 < argc)
+    {
+      p.Hematocrit = atof(argv[++i]);
+    }
+    else if (arg == "--vesselWidth" && i + 1 < argc)
+    {
+      p.VesselWidth = atoi(argv[++i]);
+    }
+    else if (arg == "--seed" && i + 1 < argc)
+    {
+      p.Seed = atoi(argv[++i]);
+    }
+    else if (arg == "--aifMask" && i + 1 < argc)
+    {
+      aifMaskFileName = argv[++i];
+    }
+    else if (arg == "--roiMask" && i + 1 < argc)
+    {
+      roiMaskFileName = argv[++i];
+    }
+    else if (arg == "--groundTruth" && i + 1 < argc)
+    {
+      groundTruthPrefix = argv[++i];
+    }
+    else if (arg == "--help" || arg == "-h")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (outputFileName.empty() && arg[0] != '-')
+    {
+      outputFileName = arg;
+    }
+    else
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (outputFileName.empty() || p.NumberOfFrames < 2
+    || p.AIFArrivalFraction < 0.0f || p.AIFArrivalFraction >= 1.0f
+    || p.Size[0] == 0 || p.Size[1] == 0 || p.Size[2] == 0)
+  {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  itk::NrrdImageIOFactory::RegisterOneFactory();
+  itk::PkChunkedImageIOFactory::RegisterOneFactory();
+
+  try
+  {
+    MultiVolumeType::Pointer multiVolume = MultiVolumeType::New();
+    MultiVolumeType::RegionType region;
+    MultiVolumeType::SpacingType spacing;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+      region.SetSize(i, p.Size[i]);
+      spacing[i] = p.Spacing[i];
+    }
+    multiVolume->SetRegions(region);
+    multiVolume->SetSpacing(spacing);
+    multiVolume->SetVectorLength(p.NumberOfFrames);
+    multiVolume->Allocate();
+
+    GeneratorThreadStruct str;
+    str.Parameters = &p;
+    str.MultiVolume = multiVolume;
+
+    ParameterImageType::Pointer ktrans = AllocateLike<ParameterImageType>(multiVolume);
+    ParameterImageType::Pointer ve = AllocateLike<ParameterImageType>(multiVolume);
+    ParameterImageType::Pointer fpv = AllocateLike<ParameterImageType>(multiVolume);
+    ParameterImageType::Pointer bat = AllocateLike<ParameterImageType>(multiVolume);
+    MaskImageType::Pointer aifMask = AllocateLike<MaskImageType>(multiVolume);
+    str.Ktrans = ktrans;
+    str.Ve = ve;
+    str.Fpv = fpv;
+    str.BAT = bat;
+    str.AIFMask = aifMask;
+
+    // frame times, and the AIF with its arrival shifted by whole frames
+    std::vector<float> timeSeconds(p.NumberOfFrames);
+    str.TimeMinutes.resize(p.NumberOfFrames);
+    for (unsigned int t = 0; t < p.NumberOfFrames; ++t)
+    {
+      timeSeconds[t] = t * p.FrameSeconds;
+      str.TimeMinutes[t] = timeSeconds[t] / 60.0f;
+    }
+    const float lastTime = timeSeconds.back();
+    str.AIFArrivalFrame = static_cast<unsigned int>(ceil(p.AIFArrivalFraction * lastTime / p.FrameSeconds));
+    const unsigned int maxDelay = p.NumberOfFrames / 2 > str.AIFArrivalFrame ?
+      p.NumberOfFrames / 2 - str.AIFArrivalFrame : 0;
+    for (unsigned int d = 0; d <= maxDelay; ++d)
+    {
+      const float fraction = p.AIFArrivalFraction + d * p.FrameSeconds / lastTime;
+      str.DelayedAIF.push_back(itk::compute_population_aif(timeSeconds, fraction));
+    }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(std::max<unsigned int>(1,
+      std::min<unsigned int>(threader->GetNumberOfThreads(), p.Size[2])));
+    threader->SetSingleMethod(GenerateThreaderCallback, &str);
+    threader->SingleMethodExecute();
+
+    // attributes read by the PkModeling CLI; frame labels are trigger
+    // times in ms
+    itk::MetaDataDictionary& dictionary = multiVolume->GetMetaDataDictionary();
+    std::ostringstream frameLabels;
+    for (unsigned int t = 0; t < p.NumberOfFrames; ++t)
+    {
+      frameLabels << (t ? "," : "") << timeSeconds[t] * 1000.0f;
+    }
+    std::ostringstream value;
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.FrameIdentifyingDICOMTagName", "TriggerTime");
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.FrameIdentifyingDICOMTagUnits", "ms");
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.FrameLabels", frameLabels.str());
+    value << p.NumberOfFrames;
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.NumberOfFrames", value.str());
+    value.str("");
+    value << p.FA;
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.DICOM.FlipAngle", value.str());
+    value.str("");
+    value << p.TR;
+    itk::EncapsulateMetaData<std::string>(dictionary, "MultiVolume.DICOM.RepetitionTime", value.str());
+
+    WriteImage<MultiVolumeType>(multiVolume, outputFileName);
+
+    if (!aifMaskFileName.empty())
+    {
+      WriteImage<MaskImageType>(aifMask, aifMaskFileName);
+    }
+    if (!roiMaskFileName.empty())
+    {
+      MaskImageType::Pointer roiMask = AllocateLike<MaskImageType>(multiVolume);
+      itk::ImageRegionIteratorWithIndex<MaskImageType> it(roiMask, region);
+      for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+        it.Set(aifMask->GetPixel(it.GetIndex()) ? 0 : 1);
+      }
+      WriteImage<MaskImageType>(roiMask, roiMaskFileName);
+    }
+    if (!groundTruthPrefix.empty())
+    {
+      WriteImage<ParameterImageType>(ktrans, groundTruthPrefix + "-ktrans.nrrd");
+      WriteImage<ParameterImageType>(ve, groundTruthPrefix + "-ve.nrrd");
+      WriteImage<ParameterImageType>(fpv, groundTruthPrefix + "-fpv.nrrd");
+      WriteImage<ParameterImageType>(bat, groundTruthPrefix + "-bat.nrrd");
+    }
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
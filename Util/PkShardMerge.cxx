@@ -0,0 +1,274 @@
+/*=========================================================================
+
+  Program:   PkModeling module
+  Language:  C++
+
+  Copyright (c) Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See License.txt or http://www.slicer.org/copyright/copyright.txt for details.
+  =========================================================================*/
+
+// Assemble an output of a study processed in shards (PkModeling --shard
+// i/N) from the outputs of the shards. The shards must all be present,
+// their slabs must tile the slices of the study and they must have used
+// the same AIF. Any map, or multivolume output, of the module can be
+// merged; the pixels are copied as they are.
+
+#include "itkImageIOFactory.h"
+#include "itkMetaDataObject.h"
+#include "itkNrrdImageIOFactory.h"
+#include "itkPkChunkedImageIOFactory.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  void Usage(const char* program)
+  {
+    std::cerr << "Usage: " << program << " output shardOutput [shardOutput ...]" << std::endl;
+    std::cerr << "  Merge the outputs of the shards of a study (PkModeling --shard i/N)." << std::endl;
+  }
+
+  // An output of one shard, from the attributes written by PkModeling
+  struct ShardOutput
+  {
+    std::string FileName;
+    itk::ImageIOBase::Pointer IO;
+    unsigned int Number;
+    unsigned int NumberOfShards;
+    unsigned long FirstSlice;
+    unsigned long EndSlice;
+    unsigned long StudySize[3];
+    std::string AIFChecksum;
+
+    bool operator<(const ShardOutput& other) const
+    {
+      return FirstSlice < other.FirstSlice;
+    }
+  };
+
+  bool GetAttribute(const itk::MetaDataDictionary& dictionary, const std::string& key, std::string& value)
+  {
+    return itk::ExposeMetaData<std::string>(dictionary, key, value);
+  }
+
+  bool ReadShardOutput(const std::string& fileName, ShardOutput& shard)
+  {
+    shard.FileName = fileName;
+    shard.IO = itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::ImageIOFactory::ReadMode);
+    if (!shard.IO)
+    {
+      std::cerr << "Cannot read " << fileName << std::endl;
+      return false;
+    }
+    shard.IO->SetFileName(fileName);
+    shard.IO->ReadImageInformation();
+
+    const itk::MetaDataDictionary& dictionary = shard.IO->GetMetaDataDictionary();
+    std::string number, slices, studySize;
+    if (!GetAttribute(dictionary, "Shard.Number", number)
+      || !GetAttribute(dictionary, "Shard.Slices", slices)
+      || !GetAttribute(dictionary, "Shard.StudySize", studySize)
+      || !GetAttribute(dictionary, "Shard.AIFChecksum", shard.AIFChecksum))
+    {
+      std::cerr << fileName << " is not the output of a shard" << std::endl;
+      return false;
+    }
+    if (sscanf(number.c_str(), "%u/%u", &shard.Number, &shard.NumberOfShards) != 2
+      || sscanf(slices.c_str(), "%lu %lu", &shard.FirstSlice, &shard.EndSlice) != 2
+      || sscanf(studySize.c_str(), "%lu %lu %lu", &shard.StudySize[0], &shard.StudySize[1], &shard.StudySize[2]) != 3)
+    {
+      std::cerr << fileName << " has malformed shard attributes" << std::endl;
+      return false;
+    }
+
+    // a slab spans the study in x and y
+    if (shard.IO->GetNumberOfDimensions() != 3
+      || shard.IO->GetDimensions(0) != shard.StudySize[0]
+      || shard.IO->GetDimensions(1) != shard.StudySize[1]
+      || shard.IO->GetDimensions(2) != shard.EndSlice - shard.FirstSlice)
+    {
+      std::cerr << fileName << " does not match the size of its slab" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // The shards must be those of one study and output, and complete
+  bool CheckShards(std::vector<ShardOutput>& shards)
+  {
+    const ShardOutput& first = shards[0];
+    bool ok = true;
+    std::vector<std::string> seen(first.NumberOfShards + 1);
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+      const ShardOutput& shard = shards[i];
+      if (shard.NumberOfShards != first.NumberOfShards
+        || shard.StudySize[0] != first.StudySize[0]
+        || shard.StudySize[1] != first.StudySize[1]
+        || shard.StudySize[2] != first.StudySize[2]
+        || shard.IO->GetNumberOfComponents() != first.IO->GetNumberOfComponents()
+        || shard.IO->GetComponentType() != first.IO->GetComponentType())
+      {
+        std::cerr << shard.FileName << " is not a shard of the same study and output as " << first.FileName << std::endl;
+        ok = false;
+      }
+      else if (shard.AIFChecksum != first.AIFChecksum)
+      {
+        std::cerr << shard.FileName << " used a different AIF than " << first.FileName << std::endl;
+        ok = false;
+      }
+      else if (shard.Number < 1 || shard.Number > shard.NumberOfShards)
+      {
+        std::cerr << shard.FileName << " has an invalid shard number" << std::endl;
+        ok = false;
+      }
+      else if (!seen[shard.Number].empty())
+      {
+        std::cerr << shard.FileName << " and " << seen[shard.Number] << " are both shard " << shard.Number << std::endl;
+        ok = false;
+      }
+      else
+      {
+        seen[shard.Number] = shard.FileName;
+      }
+    }
+    if (!ok)
+    {
+      return false;
+    }
+
+    for (unsigned int n = 1; n <= first.NumberOfShards; ++n)
+    {
+      if (seen[n].empty())
+      {
+        std::cerr << "Shard " << n << "/" << first.NumberOfShards << " is missing" << std::endl;
+        ok = false;
+      }
+    }
+    if (!ok)
+    {
+      return false;
+    }
+
+    std::sort(shards.begin(), shards.end());
+    unsigned long nextSlice = 0;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+      if (shards[i].FirstSlice != nextSlice)
+      {
+        std::cerr << "The slabs of the shards do not tile the study at slice " << nextSlice << std::endl;
+        return false;
+      }
+      nextSlice = shards[i].EndSlice;
+    }
+    if (nextSlice != first.StudySize[2])
+    {
+      std::cerr << "The slabs of the shards end at slice " << nextSlice << " of " << first.StudySize[2] << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 3 || std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h")
+  {
+    Usage(argv[0]);
+    return argc < 3 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  const std::string outputFileName = argv[1];
+
+  itk::NrrdImageIOFactory::RegisterOneFactory();
+  itk::PkChunkedImageIOFactory::RegisterOneFactory();
+
+  try
+  {
+    std::vector<ShardOutput> shards(argc - 2);
+    for (int i = 2; i < argc; ++i)
+    {
+      if (!ReadShardOutput(argv[i], shards[i - 2]))
+      {
+        return EXIT_FAILURE;
+      }
+    }
+    if (!CheckShards(shards))
+    {
+      return EXIT_FAILURE;
+    }
+
+    // the slabs are consecutive slices, so each is a contiguous part of
+    // the merged buffer
+    const ShardOutput& first = shards[0];
+    const itk::SizeValueType sliceBytes = first.IO->GetImageSizeInBytes() / first.IO->GetDimensions(2);
+    std::vector<char> buffer(sliceBytes * first.StudySize[2]);
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+      ShardOutput& shard = shards[i];
+      itk::ImageIORegion region(3);
+      for (unsigned int d = 0; d < 3; ++d)
+      {
+        region.SetIndex(d, 0);
+        region.SetSize(d, shard.IO->GetDimensions(d));
+      }
+      shard.IO->SetIORegion(region);
+      shard.IO->Read(&buffer[sliceBytes * shard.FirstSlice]);
+    }
+
+    // the geometry of the study is that of the first slab, and its
+    // attributes those of the shards without the shard
+    itk::MetaDataDictionary dictionary = first.IO->GetMetaDataDictionary();
+    itk::MetaDataDictionary merged;
+    const std::vector<std::string> keys = dictionary.GetKeys();
+    for (size_t k = 0; k < keys.size(); ++k)
+    {
+      if (keys[k].compare(0, 6, "Shard.") != 0)
+      {
+        merged[keys[k]] = dictionary[keys[k]];
+      }
+    }
+
+    itk::ImageIOBase::Pointer writer =
+      itk::ImageIOFactory::CreateImageIO(outputFileName.c_str(), itk::ImageIOFactory::WriteMode);
+    if (!writer)
+    {
+      std::cerr << "Cannot write " << outputFileName << std::endl;
+      return EXIT_FAILURE;
+    }
+    itk::ImageIORegion region(3);
+    writer->SetFileName(outputFileName);
+    writer->SetNumberOfDimensions(3);
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+      writer->SetDimensions(d, first.StudySize[d]);
+      writer->SetSpacing(d, first.IO->GetSpacing(d));
+      writer->SetOrigin(d, first.IO->GetOrigin(d));
+      writer->SetDirection(d, first.IO->GetDirection(d));
+      region.SetIndex(d, 0);
+      region.SetSize(d, first.StudySize[d]);
+    }
+    writer->SetNumberOfComponents(first.IO->GetNumberOfComponents());
+    writer->SetComponentType(first.IO->GetComponentType());
+    writer->SetPixelType(first.IO->GetPixelType());
+    writer->SetMetaDataDictionary(merged);
+    writer->SetUseCompression(true);
+    writer->SetIORegion(region);
+    writer->Write(&buffer[0]);
+
+    std::cout << "Merged " << shards.size() << " shards into " << outputFileName << std::endl;
+  }
+  catch (itk::ExceptionObject & excep)
+  {
+    std::cerr << argv[0] << ": exception caught !" << std::endl;
+    std::cerr << excep << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}